@@ -0,0 +1,182 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Client for the cache server of "jigdo-file cache-server"
+
+*/
+
+#include <config.h>
+
+#include <cacheclient.hh>
+#if HAVE_CACHESERVER
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd-jigdo.h>
+
+#include <cachefile.hh>
+#include <debug.hh>
+#include <log.hh>
+#include <string.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("cacheclient")
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+
+  DbError serverError(const string& socketName) {
+    int e = errno;
+    return DbError(e, subst(_("Cache server `%L1': %L2"), socketName,
+                            strerror(e)));
+  }
+
+}
+//______________________________________________________________________
+
+CacheClient::CacheClient(const string& socketName)
+    : name(socketName), fd(-1), pending(), reply(), replyPos(0) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (name.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    throw serverError(name);
+  }
+  memcpy(addr.sun_path, name.data(), name.size());
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) throw serverError(name);
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) != 0) {
+    DbError e = serverError(name);
+    ::close(fd);
+    throw e;
+  }
+  debug("Connected to %1", name);
+}
+
+CacheClient::~CacheClient() {
+  try {
+    sync();
+  } catch (DbError e) {
+    debug("~CacheClient: %1", e.message);
+  }
+  ::close(fd);
+}
+//______________________________________________________________________
+
+void CacheClient::beginMessage(vector<Ubyte>& msg, uint32 type) {
+  size_t start = msg.size();
+  msg.resize(start + HEADER);
+  serialize4(type, &msg[start]);
+  serialize4(0, &msg[start + 4]);
+}
+
+void CacheClient::endMessage(vector<Ubyte>& msg, size_t start) {
+  serialize4(msg.size() - start - HEADER, &msg[start + 4]);
+}
+
+void CacheClient::appendItem(vector<Ubyte>& msg, const char* data,
+                             size_t size) {
+  size_t pos = msg.size();
+  msg.resize(pos + 4 + size);
+  serialize4(size, &msg[pos]);
+  memcpy(&msg[pos + 4], data, size);
+}
+//______________________________________________________________________
+
+void CacheClient::send(const vector<Ubyte>& msg) {
+  size_t done = 0;
+  while (done < msg.size()) {
+    // Fail with EPIPE instead of getting killed if the server has quit
+    ssize_t n = ::send(fd, &msg[done], msg.size() - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw serverError(name);
+    done += n;
+  }
+}
+
+void CacheClient::readAll(Ubyte* buf, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, buf, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) errno = ECONNRESET;
+    if (n <= 0) throw serverError(name);
+    buf += n;
+    size -= n;
+  }
+}
+
+void CacheClient::receive(uint32 expectedType) {
+  Ubyte header[HEADER];
+  readAll(header, HEADER);
+  uint32 type, size;
+  unserialize4(type, header);
+  unserialize4(size, header + 4);
+  if (type != expectedType || size > MAX_MESSAGE) {
+    errno = EPROTO;
+    throw serverError(name);
+  }
+  reply.resize(size);
+  replyPos = 0;
+  if (size > 0) readAll(&reply[0], size);
+}
+//______________________________________________________________________
+
+void CacheClient::lookup(const vector<string>& keys, size_t begin,
+                         size_t end) {
+  if (begin == end) { // An empty LOOKUP would return all entries
+    reply.clear();
+    replyPos = 0;
+    return;
+  }
+  sendLookup(keys, begin, end);
+}
+
+void CacheClient::lookupAll() {
+  vector<string> none;
+  sendLookup(none, 0, 0);
+}
+
+void CacheClient::sendLookup(const vector<string>& keys, size_t begin,
+                             size_t end) {
+  sync(); // The server must know our own entries
+  vector<Ubyte> msg;
+  beginMessage(msg, MSG_LOOKUP);
+  for (size_t i = begin; i < end; ++i)
+    appendItem(msg, keys[i].data(), keys[i].size());
+  endMessage(msg, 0);
+  send(msg);
+  receive(MSG_ENTRIES);
+  debug("Lookup of %1 keys, answer has %2 bytes", end - begin,
+        reply.size());
+}
+//________________________________________
+
+void CacheClient::insert(const string& key, const Ubyte* entry,
+                         size_t entrySize) {
+  if (pending.empty()) beginMessage(pending, MSG_INSERT);
+  appendItem(pending, key.data(), key.size());
+  appendItem(pending, reinterpret_cast<const char*>(entry), entrySize);
+  if (pending.size() >= WRITE_BUFFER) sync();
+}
+
+void CacheClient::sync() {
+  if (pending.empty()) return;
+  endMessage(pending, 0);
+  vector<Ubyte> msg;
+  msg.swap(pending);
+  send(msg);
+}
+
+#endif /* HAVE_CACHESERVER */
@@ -0,0 +1,123 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Client for the cache server of "jigdo-file cache-server"
+
+  The server (see cacheserver.hh) keeps the entries of a cache file in
+  memory and answers requests of any number of jigdo-file processes
+  over a Unix domain socket. Selected with jigdo-file
+  --cache-server=SOCKET, which makes CacheFile use a CacheClient.
+
+  Messages in both directions consist of a header with 4 bytes type
+  and 4 bytes length of the following payload, all numbers
+  little-endian. The payload is a sequence of items:<pre>
+  Type     Direction Items
+  LOOKUP   to server 4 bytes keySize, key
+  INSERT   to server 4 bytes keySize, key, 4 bytes entrySize, entry
+  ENTRIES  to client 4 bytes keySize, key, 4 bytes entrySize, entry</pre>
+  The server answers each LOOKUP with ENTRIES, which contains the
+  entries for those of the keys it knows. A LOOKUP without any keys
+  returns all entries. INSERT is not answered. The keys and entries
+  are the same as those of CacheFile's libdb database.
+
+*/
+
+#ifndef CACHECLIENT_HH
+#define CACHECLIENT_HH
+
+#include <config.h>
+
+/** The server and client need Unix domain sockets */
+#if UNIX
+#  define HAVE_CACHESERVER 1
+#else
+#  define HAVE_CACHESERVER 0
+#endif
+
+#if HAVE_CACHESERVER
+
+#include <string>
+#include <vector>
+
+#include <nocopy.hh>
+#include <serialize.hh>
+//______________________________________________________________________
+
+/** Connection to a cache server. The methods throw DbError if
+    communication with the server fails. */
+class CacheClient : NoCopy {
+public:
+  /** Connect to server listening on the socket */
+  explicit CacheClient(const string& socketName);
+  ~CacheClient();
+
+  /** Ask the server for the entries of keys[begin] to keys[end-1].
+      Afterwards, call nextEntry() to get them. */
+  void lookup(const vector<string>& keys, size_t begin, size_t end);
+  /** Ask the server for all its entries */
+  void lookupAll();
+  /** Return next entry of the answer to the last lookup(), or false
+      if there are no more. entry is only valid until the next
+      call to lookup(). */
+  inline bool nextEntry(string& key, const Ubyte*& entry, size_t& size);
+
+  /** Send entry to the server. It is only sent by the next call to
+      sync(), or when many entries have been added. */
+  void insert(const string& key, const Ubyte* entry, size_t entrySize);
+  void sync();
+
+  // Message types, "JCL?" after serialize4()
+  static const uint32 MSG_LOOKUP = 0x4c4c434aU;
+  static const uint32 MSG_INSERT = 0x494c434aU;
+  static const uint32 MSG_ENTRIES = 0x454c434aU;
+  static const size_t HEADER = 8;
+  // Larger messages are rejected by both sides
+  static const size_t MAX_MESSAGE = 256 * 1024 * 1024;
+  // Keys per LOOKUP sent by CacheFile::findAll()
+  static const size_t LOOKUP_BATCH = 4096;
+
+  // Helpers shared with CacheServer
+  static void appendItem(vector<Ubyte>& msg, const char* data, size_t size);
+  static void beginMessage(vector<Ubyte>& msg, uint32 type);
+  static void endMessage(vector<Ubyte>& msg, size_t start);
+
+private:
+  static const size_t WRITE_BUFFER = 1024 * 1024;
+
+  void sendLookup(const vector<string>& keys, size_t begin, size_t end);
+  void send(const vector<Ubyte>& msg);
+  void readAll(Ubyte* buf, size_t size);
+  void receive(uint32 expectedType);
+
+  string name;
+  int fd;
+  vector<Ubyte> pending; // INSERT message not yet sent
+  vector<Ubyte> reply; // Payload of last ENTRIES message
+  size_t replyPos; // Offset of next item to return in reply
+};
+//______________________________________________________________________
+
+bool CacheClient::nextEntry(string& key, const Ubyte*& entry,
+                            size_t& size) {
+  // A truncated item ends the answer
+  if (reply.size() - replyPos < 4) return false;
+  uint32 keySize, entrySize;
+  unserialize4(keySize, &reply[replyPos]);
+  if (reply.size() - replyPos - 4 < keySize + (size_t)4) return false;
+  key.assign(reinterpret_cast<const char*>(&reply[replyPos + 4]), keySize);
+  replyPos += 4 + keySize;
+  unserialize4(entrySize, &reply[replyPos]);
+  if (reply.size() - replyPos - 4 < entrySize) return false;
+  entry = &reply[replyPos + 4];
+  size = entrySize;
+  replyPos += 4 + entrySize;
+  return true;
+}
+
+#endif /* HAVE_CACHESERVER */
+#endif
@@ -18,8 +18,9 @@
 
 #include <cachefile.hh>
 #include <compat.hh>
-#if HAVE_LIBDB
+#if HAVE_CACHEFILE
 
+#include <algorithm>
 #if DEBUG
 #  include <iostream>
 #endif
@@ -33,14 +34,48 @@
 
 DEBUG_UNIT("cachefile")
 
-CacheFile::CacheFile(const char* dbName) {
+CacheFile::CacheFile(const char* dbName, size_t cacheMemory,
+                     Format format) {
+# if HAVE_LIBDB
+  db = 0;
   memset(&data, 0, sizeof(DBT));
+# endif
+# if HAVE_CACHELOG
+  log = 0;
+# endif
+# if HAVE_CACHESERVER
+  client = 0;
+  if (format == FORMAT_SERVER) {
+    client = new CacheClient(dbName);
+    return;
+  }
+# endif
+# if HAVE_CACHELOG
+  if (format == FORMAT_LOG) {
+    log = new CacheLog(dbName);
+    return;
+  }
+# endif
+# if HAVE_LIBDB
+  if (format == FORMAT_DB) {
+    openDb(dbName, cacheMemory);
+    return;
+  }
+# endif
+  (void)cacheMemory;
+  throw DbError(0, _("This format of cache file is not supported by this "
+                     "version of jigdo-file"));
+}
 
+#if HAVE_LIBDB
+void CacheFile::openDb(const char* dbName, size_t cacheMemory) {
   int e = db_create(&db, 0, 0); // No env/flags
   if (e != 0) throw DbError(e);
 
-  // Cache of 0GB+4MB, one contiguous chunk
-  db->set_cachesize(db, 0, 4*1024*1024, 1);
+  // Cache of the given size, one contiguous chunk
+  const uint64 gigabyte = 1024*1024*1024;
+  db->set_cachesize(db, (u_int32_t)(cacheMemory / gigabyte),
+                    (u_int32_t)(cacheMemory % gigabyte), 1);
 
   // Use a btree, create database file if not yet present
   e = compat_dbOpen(db, dbName, "jigdo filecache v1", DB_BTREE, DB_CREATE,
@@ -48,20 +83,28 @@ CacheFile::CacheFile(const char* dbName) {
   if (e != 0) {
     // Re-close, in case it is necessary
     db->close(db, 0);
+    db = 0;
     if (e != DB_OLD_VERSION && e != DB_RUNRECOVERY)
       throw DbError(e);
     /* If the DB file is old or corrupted, just regenerate it from
        scratch, otherwise throw error. */
     debug("Cache file corrupt, recreating it");
+    e = db_create(&db, 0, 0);
+    if (e != 0) throw DbError(e);
     if (compat_dbOpen(db, dbName, "jigdo filecache v1", DB_BTREE,
-                      DB_CREATE | DB_TRUNCATE, 0666) != 0)
+                      DB_CREATE | DB_TRUNCATE, 0666) != 0) {
+      db->close(db, 0);
+      db = 0;
       throw DbError(e);
+    }
   }
 
   data.flags |= DB_DBT_REALLOC;
 }
+#endif
 //______________________________________________________________________
 
+#if HAVE_LIBDB
 namespace {
 
   /** Local struct: Wrapper which calls close() for any DBC cursor at end of
@@ -88,10 +131,45 @@ namespace {
   };
 
 }
+#endif
 //________________________________________
 
 Status CacheFile::find(const Ubyte*& resultData, size_t& resultSize,
                        const string& fileName, uint64 fileSize, time_t mtime) {
+# if HAVE_CACHELOG
+  if (log != 0) {
+    size_t size;
+    Ubyte* d = log->find(fileName, size);
+    if (d == 0 || size < USER_DATA) return FAILED;
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    if (cacheMtime != mtime || cacheFileSize != fileSize) return FAILED;
+    CacheLog::touch(d + ACCESS, time(0));
+    resultData = d + USER_DATA;
+    resultSize = size - USER_DATA;
+    return OK;
+  }
+# endif
+# if HAVE_CACHESERVER
+  if (client != 0) {
+    // The server updates the access time
+    const Ubyte* d;
+    size_t size;
+    if (!clientFind(fileName, d, size)) return FAILED;
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    if (cacheMtime != mtime || cacheFileSize != fileSize) return FAILED;
+    resultData = d + USER_DATA;
+    resultSize = size - USER_DATA;
+    return OK;
+  }
+# endif
+
+# if HAVE_LIBDB
   DBT key; memset(&key, 0, sizeof(DBT));
   key.data = const_cast<char*>(fileName.c_str());
   key.size = (u_int32_t)fileName.size(); // filename size is safely
@@ -131,12 +209,50 @@ Status CacheFile::find(const Ubyte*& resultData, size_t& resultSize,
   resultData = d + USER_DATA;
   resultSize = data.size - USER_DATA;
   return OK;
+# else
+  return FAILED;
+# endif
 }
 //________________________________________
 
 Status CacheFile::findName(const Ubyte*& resultData, size_t& resultSize,
     const string& fileName, off_t& resultFileSize,
     time_t& resultMtime) {
+# if HAVE_CACHELOG
+  if (log != 0) {
+    size_t size;
+    Ubyte* d = log->find(fileName, size);
+    if (d == 0 || size < USER_DATA) return FAILED;
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    resultMtime = cacheMtime;
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    resultFileSize = cacheFileSize;
+    CacheLog::touch(d + ACCESS, time(0));
+    resultData = d + USER_DATA;
+    resultSize = size - USER_DATA;
+    return OK;
+  }
+# endif
+# if HAVE_CACHESERVER
+  if (client != 0) {
+    const Ubyte* d;
+    size_t size;
+    if (!clientFind(fileName, d, size)) return FAILED;
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    resultMtime = cacheMtime;
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    resultFileSize = cacheFileSize;
+    resultData = d + USER_DATA;
+    resultSize = size - USER_DATA;
+    return OK;
+  }
+# endif
+
+# if HAVE_LIBDB
   DBT key; memset(&key, 0, sizeof(DBT));
   key.data = const_cast<char*>(fileName.c_str());
   key.size = (u_int32_t)fileName.size(); // filename size is safely
@@ -176,10 +292,137 @@ Status CacheFile::findName(const Ubyte*& resultData, size_t& resultSize,
   resultData = d + USER_DATA;
   resultSize = data.size - USER_DATA;
   return OK;
+# else
+  return FAILED;
+# endif
+}
+//______________________________________________________________________
+
+#if HAVE_CACHELOG
+/* Passes the entries of the log to a Lookup, updates the access time
+   of those it used */
+struct CacheFile::LogLookup {
+  LogLookup(Lookup& l) : lookup(l), now(time(0)) { }
+  void operator()(const string& fileName, Ubyte* d, size_t size) {
+    if (size < USER_DATA) return;
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    if (lookup(fileName, cacheFileSize, cacheMtime, d + USER_DATA,
+               size - USER_DATA))
+      CacheLog::touch(d + ACCESS, now);
+  }
+  Lookup& lookup;
+  time_t now;
+};
+#endif
+
+#if HAVE_CACHESERVER
+bool CacheFile::clientFind(const string& fileName, const Ubyte*& d,
+                           size_t& size) {
+  vector<string> key(1, fileName);
+  client->lookup(key, 0, 1);
+  string name;
+  return client->nextEntry(name, d, size) && size >= USER_DATA;
+}
+
+void CacheFile::clientLookup(Lookup& lookup) {
+  string fileName;
+  const Ubyte* d;
+  size_t size;
+  while (client->nextEntry(fileName, d, size)) {
+    if (size < USER_DATA) continue;
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    lookup(fileName, cacheFileSize, cacheMtime, d + USER_DATA,
+           size - USER_DATA);
+  }
+}
+#endif
+
+void CacheFile::findAll(Lookup& lookup, const vector<string>* fileNames) {
+# if HAVE_CACHELOG
+  if (log != 0) {
+    LogLookup logLookup(lookup);
+    log->forEach(logLookup);
+    return;
+  }
+# endif
+# if HAVE_CACHESERVER
+  /* Only fetch the wanted entries, in batches to limit the size of
+     each answer. Unlike with the other formats, they are not passed
+     in the order of their names. */
+  if (client != 0) {
+    if (fileNames == 0) {
+      client->lookupAll();
+      clientLookup(lookup);
+      return;
+    }
+    for (size_t i = 0; i < fileNames->size();
+         i += CacheClient::LOOKUP_BATCH) {
+      client->lookup(*fileNames, i, min(fileNames->size(),
+                                        i + CacheClient::LOOKUP_BATCH));
+      clientLookup(lookup);
+    }
+    return;
+  }
+# endif
+  (void)fileNames;
+
+# if HAVE_LIBDB
+  DBT key; memset(&key, 0, sizeof(DBT));
+  AutoCursor cursor;
+  // Cursor with no transaction id, no flags
+  if (db->cursor(db, 0, &cursor.c, 0) != 0) return;
+
+  int status;
+  time_t now = time(0);
+  Paranoid(now != static_cast<time_t>(-1));
+  while ((status = cursor.get(&key, &data, DB_NEXT)) == 0) {
+    if (data.data == 0 || data.size < USER_DATA) continue;
+    Ubyte* d = static_cast<Ubyte*>(data.data);
+    time_t cacheMtime;
+    unserialize4(cacheMtime, d + MTIME);
+    uint64 cacheFileSize;
+    unserialize6(cacheFileSize, d + SIZE);
+    string fileName(static_cast<char*>(key.data), key.size);
+    if (!lookup(fileName, cacheFileSize, cacheMtime, d + USER_DATA,
+                data.size - USER_DATA))
+      continue;
+
+    // Entry was used - update access time, like find()
+    serialize4(now, d + ACCESS);
+    DBT partial; memset(&partial, 0, sizeof(DBT));
+    partial.data = d + ACCESS;
+    partial.size = 4;
+    partial.flags |= DB_DBT_PARTIAL;
+    partial.doff = ACCESS;
+    partial.dlen = 4;
+    cursor.put(&key, &partial, DB_CURRENT);
+  }
+  if (status != DB_NOTFOUND)
+    throw DbError(status);
+# endif
 }
 //______________________________________________________________________
 
 void CacheFile::expire(time_t t) {
+# if HAVE_CACHELOG
+  /* Compaction replaces the walk over all entries: It rewrites the
+     whole log, so it is only done if it is due. */
+  if (log != 0) {
+    if (log->compactionDue()) log->compact(t);
+    return;
+  }
+# endif
+# if HAVE_CACHESERVER
+  if (client != 0) return;
+# endif
+
+# if HAVE_LIBDB
   DBT key; memset(&key, 0, sizeof(DBT));
   DBT data; memset(&data, 0, sizeof(DBT));
   AutoCursor cursor;
@@ -201,18 +444,49 @@ void CacheFile::expire(time_t t) {
   }
   if (status != DB_NOTFOUND)
     throw DbError(status);
+# endif
+}
+//______________________________________________________________________
+
+void CacheFile::sync() {
+# if HAVE_CACHELOG
+  if (log != 0) {
+    log->sync();
+    return;
+  }
+# endif
+# if HAVE_CACHESERVER
+  if (client != 0) {
+    client->sync();
+    return;
+  }
+# endif
+# if HAVE_LIBDB
+  int e = db->sync(db, 0);
+  if (e != 0) throw DbError(e);
+# endif
 }
 //______________________________________________________________________
 
 /* Prepare for an insertion of data, by allocating a sufficient amount
    of memory and returning a pointer to it. */
 Ubyte* CacheFile::insert_prepare(size_t inSize) {
+# if HAVE_CACHELOG || HAVE_CACHESERVER
+  if (usesEntry()) {
+    entry.resize(USER_DATA + inSize);
+    return &entry[USER_DATA];
+  }
+# endif
+# if HAVE_LIBDB
   // Allocate enough memory for the new entry
   void* tmp = realloc(data.data, USER_DATA + inSize);
   if (tmp == 0) throw bad_alloc();
   data.data = tmp;
   data.size = (u_int32_t)(USER_DATA + inSize);
   return static_cast<Ubyte*>(tmp) + USER_DATA;
+# else
+  return 0;
+# endif
 }
 
 /* ASSUMES THAT insert_prepare() HAS JUST BEEN CALLED and that the
@@ -220,6 +494,23 @@ Ubyte* CacheFile::insert_prepare(size_t inSize) {
    function commits the data to the db. */
 void CacheFile::insert_perform(const string& fileName, time_t mtime,
                                uint64 fileSize) {
+# if HAVE_CACHELOG || HAVE_CACHESERVER
+  if (usesEntry()) {
+    Ubyte* buf = &entry[0];
+    serialize4(time(0), buf + ACCESS);
+    serialize4(mtime, buf + MTIME);
+    serialize6(fileSize, buf + SIZE);
+#   if HAVE_CACHELOG
+    if (log != 0) log->insert(fileName, buf, entry.size());
+#   endif
+#   if HAVE_CACHESERVER
+    if (client != 0) client->insert(fileName, buf, entry.size());
+#   endif
+    return;
+  }
+# endif
+
+# if HAVE_LIBDB
   Ubyte* buf = static_cast<Ubyte*>(data.data);
 
   // Write our data members
@@ -239,7 +530,8 @@ void CacheFile::insert_perform(const string& fileName, time_t mtime,
 //   for (size_t i = USER_DATA; i < data.get_size(); ++i)
 //     cerr << ' '<< hex << (int)(buf[i]);
 //   cerr << endl;
+# endif
 }
 //______________________________________________________________________
 
-#endif /* HAVE_LIBDB */
+#endif /* HAVE_CACHEFILE */
@@ -16,6 +16,11 @@
 
   Cache with checksums of file contents - used by JigdoCache in scan.hh
 
+  The cache file is either a libdb database (FORMAT_DB), or a log of
+  records with the same contents (FORMAT_LOG, see cachelog.hh). With
+  FORMAT_SERVER, the entries are kept by "jigdo-file cache-server"
+  instead (see cacheclient.hh).
+
   The created libdb3 database contains one table with a mapping from
   filenames (without trailing zero byte) to a binary structure. The
   filename key is the second part of the complete filename, i.e. the
@@ -32,14 +37,17 @@
   bytes to scan.hh classes:<pre>
    4   blockLength (of rsync sum)
    4   csumBlockLength
-   4   blocks (number of valid checksum blocks in this entry)
+   4   blocks (number of valid checksum blocks in this entry), ORed with
+       0x10000000 if the entry contains no MD5 checksums and with
+       0x20000000 if it contains no SHA256 checksums
    8   rsyncSum of file start (only valid if blocks > 0)
   16   fileMD5Sum (only valid if
                    blocks == (fileSize+csumBlockLength-1)/csumBlockLength )
   32   fileSHA256Sum (only valid if
                       blocks == (fileSize+csumBlockLength-1)/csumBlockLength )
-  followed by n entries:
-  16   md5sum of block of size csumBlockLength</pre>
+  followed by n entries, unless there are no MD5 checksums:
+  16   md5sum of block of size csumBlockLength
+  followed by n entries, unless there are no SHA256 checksums:
   32   sha256sum of block of size csumBlockLength</pre>
 
   Why is mtime and size not part of the key? Because we only want to
@@ -56,18 +64,29 @@
 #include <string>
 #include <time.h> /* for time_t */
 
+#include <cacheclient.hh>
+#include <cachelog.hh>
+
+/** Is a cache file supported at all? */
+#define HAVE_CACHEFILE (HAVE_LIBDB || HAVE_CACHELOG || HAVE_CACHESERVER)
+
+#if HAVE_CACHEFILE
 #if HAVE_LIBDB
-#include <db.h>
+#  include <db.h>
+#endif
 #include <stdlib.h> /* free() */
 #include <string.h> /* memcpy(), memset() */
+#include <vector>
 
 #include <debug.hh>
 #include <status.hh>
 //______________________________________________________________________
 
-/** libdb errors */
+/** libdb errors, and errors accessing the cache log */
 struct DbError : public Error {
+# if HAVE_LIBDB
   explicit DbError(int c) : Error(db_strerror(c)), code(c) { }
+# endif
   DbError(int c, const string& m) : Error(m), code(c) { }
   DbError(int c, const char* m) : Error(m), code(c) { }
   int code;
@@ -77,10 +96,23 @@ struct DbError : public Error {
 /** Cache with checksums of file contents */
 class CacheFile {
 public:
-  /** Create new database or open existing database */
-  CacheFile(const char* dbName);
+  /** FORMAT_DB is only available if HAVE_LIBDB, FORMAT_LOG only if
+      HAVE_CACHELOG, FORMAT_SERVER only if HAVE_CACHESERVER */
+  enum Format { FORMAT_DB, FORMAT_LOG, FORMAT_SERVER };
+
+  /** Create new database or open existing database
+      @param dbName Name of file, or of the server's socket with
+      FORMAT_SERVER
+      @param cacheMemory Size of libdb's in-memory cache of database
+      pages, ignored with other formats */
+  explicit CacheFile(const char* dbName,
+                     size_t cacheMemory = DEFAULT_CACHE_MEMORY,
+                     Format format = DEFAULT_FORMAT);
   inline ~CacheFile();
 
+  static const size_t DEFAULT_CACHE_MEMORY = 4*1024*1024;
+  static const Format DEFAULT_FORMAT = (HAVE_LIBDB ? FORMAT_DB : FORMAT_LOG);
+
   /** Look for an entry in the database which matches the specified filename
       (which must be absolute), file modification time and file size. If no
       entry is found, return FAILED. Otherwise, return OK and overwrite
@@ -102,6 +134,24 @@ public:
                   const string& fileName,
                   off_t& resultFileSize, time_t& resultMtime);
 
+  /** Callback for findAll() */
+  class Lookup {
+  public:
+    virtual ~Lookup() { }
+    /** Called for each entry in the database. data/size are like the
+        result of find(). Return true if the entry was used; this
+        updates its access time. */
+    virtual bool operator()(const string& fileName, uint64 fileSize,
+                            time_t mtime, const Ubyte* data,
+                            size_t size) = 0;
+  };
+  /** Pass all entries of the database to lookup, in the order of their
+      filenames. This reads the database sequentially, which is much
+      faster than one find() per file if there are many files. If
+      fileNames is not null, lookup is only interested in the entries
+      for these names; with FORMAT_SERVER, only those are fetched. */
+  void findAll(Lookup& lookup, const vector<string>* fileNames = 0);
+
   /** Insert/overwrite entry for the given file (name must be
       absolute, file must have the supplied mtime and size). The data
       for the entry is supplied in inData. */
@@ -115,35 +165,88 @@ public:
                      time_t mtime, uint64 fileSize);
 
   /** Remove all entries from the database that have a "last access"
-      time that is older than the given time. */
+      time that is older than the given time. With FORMAT_LOG, this
+      only happens when CacheLog::compactionDue() says so. With
+      FORMAT_SERVER, the server takes care of expiry. */
   void expire(time_t t);
 
-private:
-  // Don't copy
-  explicit inline CacheFile(const CacheFile&);
-  inline CacheFile& operator=(const CacheFile&);
-  Ubyte* insert_prepare(size_t inSize);
-  void insert_perform(const string& fileName, time_t mtime, uint64 fileSize);
+  /** Write all changes to disc. Inserting many entries is fastest if
+      they are inserted in the order of their filenames, followed by
+      one call to sync(). With FORMAT_LOG and FORMAT_SERVER, entries
+      are only written by sync(). */
+  void sync();
 
   /* Byte offsets of first members of a cache entry (see start of this
      file). Defining a struct with byte members would be more
      convenient, but would also be a recipe for disaster because of
      alignment problems. (E.g., a RISC machine might pad to the next
-     multiple of 4 bytes after every byte member.) */
+     multiple of 4 bytes after every byte member.) CacheServer keeps
+     whole entries, so these are public. */
   enum { ACCESS = 0, MTIME = 4, SIZE = 8, USER_DATA = 14 };
 
-  DB* db; // Database object
+private:
+  // Don't copy
+  explicit inline CacheFile(const CacheFile&);
+  inline CacheFile& operator=(const CacheFile&);
+# if HAVE_LIBDB
+  void openDb(const char* dbName, size_t cacheMemory);
+# endif
+  Ubyte* insert_prepare(size_t inSize);
+  void insert_perform(const string& fileName, time_t mtime, uint64 fileSize);
+  struct LogLookup;
+# if HAVE_CACHESERVER
+  bool clientFind(const string& fileName, const Ubyte*& d, size_t& size);
+  // Pass entries received from the server to a Lookup
+  void clientLookup(Lookup& lookup);
+# endif
+# if HAVE_CACHELOG || HAVE_CACHESERVER
+  // Is an entry assembled in "entry" by insert_prepare()?
+  inline bool usesEntry() const;
+# endif
+
+# if HAVE_LIBDB
+  DB* db; // Database object, null with other formats
   DBT data; // Object for result data
+# endif
+# if HAVE_CACHELOG
+  CacheLog* log; // Null with other formats
+# endif
+# if HAVE_CACHELOG || HAVE_CACHESERVER
+  vector<Ubyte> entry; // For insert_prepare() and find()
+# endif
+# if HAVE_CACHESERVER
+  CacheClient* client; // Null with other formats
+# endif
 };
 //______________________________________________________________________
 
 CacheFile::~CacheFile() {
+# if HAVE_CACHELOG
+  delete log;
+# endif
+# if HAVE_CACHESERVER
+  delete client;
+# endif
+# if HAVE_LIBDB
   free(data.data);
-  Paranoid(db != 0);
-  db->close(db, 0); // no flags, ignore any errors
+  if (db != 0) db->close(db, 0); // no flags, ignore any errors
+# endif
 }
 //______________________________________________________________________
 
+#if HAVE_CACHELOG || HAVE_CACHESERVER
+bool CacheFile::usesEntry() const {
+  bool r = false;
+# if HAVE_CACHELOG
+  r = r || log != 0;
+# endif
+# if HAVE_CACHESERVER
+  r = r || client != 0;
+# endif
+  return r;
+}
+#endif
+
 void CacheFile::insert(const Ubyte* inData, size_t inSize,
     const string& fileName, time_t mtime, uint64 fileSize) {
   memcpy(insert_prepare(inSize), inData, inSize);
@@ -161,12 +264,15 @@ void CacheFile::insert(Functor f, size_t inSize, const string& fileName,
 
 #else
 
-// !HAVE_LIBDB - provide a dummy implementation which does nothing
+// !HAVE_CACHEFILE - provide a dummy implementation which does nothing
 
 class CacheFile {
 public:
-  CacheFile(const char*) { }
+  enum Format { FORMAT_DB, FORMAT_LOG, FORMAT_SERVER };
+  explicit CacheFile(const char*, size_t = 0, Format = FORMAT_DB) { }
   ~CacheFile() { }
+  static const size_t DEFAULT_CACHE_MEMORY = 4*1024*1024;
+  static const Format DEFAULT_FORMAT = FORMAT_DB;
   bool find(const Ubyte*&, size_t&, const string&, time_t, uint64) {
     return false;
   }
@@ -178,6 +284,7 @@ public:
   void insert(Functor, size_t, const string&, time_t, uint64) { }
   void insert(const Ubyte*, size_t, const string&, time_t, uint64) { }
   void expire(time_t) { }
+  void sync() { }
 };
 
 #endif
@@ -0,0 +1,133 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Append-only cache log. Two CacheLog objects for the same file stand in
+  for two processes which use the cache at the same time.
+
+  #test-deps cachelog.o
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd-jigdo.h>
+#include <vector>
+
+#include <cachefile.hh>
+#include <cachelog.hh>
+#include <debug.hh>
+#include <log.hh>
+#include <serialize.hh>
+#include <string.hh>
+//______________________________________________________________________
+
+#if HAVE_CACHELOG
+
+namespace {
+
+  const char* const fileName = "cachelog-test.tmp";
+
+  // Entry: access time, then x repeated n times
+  void insert(CacheLog& log, const string& key, time_t access, Ubyte x,
+              size_t n) {
+    vector<Ubyte> entry(4 + n, x);
+    serialize4(access, &entry[0]);
+    log.insert(key, &entry[0], entry.size());
+  }
+
+  void check(CacheLog& log, const string& key, Ubyte x, size_t n) {
+    size_t size = 0;
+    Ubyte* entry = log.find(key, size);
+    Assert(entry != 0);
+    Assert(size == 4 + n);
+    for (size_t i = 4; i < size; ++i) Assert(entry[i] == x);
+  }
+
+  void checkMissing(CacheLog& log, const string& key) {
+    size_t size;
+    Assert(log.find(key, size) == 0);
+  }
+
+  struct Count {
+    Count() : n(0) { }
+    void operator()(const string&, Ubyte*, size_t) { ++n; }
+    size_t n;
+  };
+
+  void removeFiles() {
+    remove(fileName);
+    remove((string(fileName) + ".idx").c_str());
+  }
+
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+  removeFiles();
+  time_t now = time(0);
+  string key;
+
+  {
+    CacheLog a(fileName), b(fileName);
+    insert(a, "one", now, 1, 10);
+    insert(a, "two", now, 2, 20);
+    checkMissing(b, "one"); // Not written before sync()
+    a.sync();
+    check(b, "one", 1, 10);
+    check(b, "two", 2, 20);
+
+    // Newer record supersedes the old one
+    insert(b, "one", now, 3, 30);
+    b.sync();
+    check(a, "one", 3, 30);
+
+    // Enough records to make the index grow
+    for (unsigned i = 0; i < 50000; ++i) {
+      append(key = "key", i);
+      insert(i % 2 ? a : b, key, i < 1000 ? now - 1000 : now,
+             static_cast<Ubyte>(i), i % 7);
+    }
+    a.sync();
+    b.sync();
+    for (unsigned i = 0; i < 50000; i += 99) {
+      append(key = "key", i);
+      check(a, key, static_cast<Ubyte>(i), i % 7);
+      check(b, key, static_cast<Ubyte>(i), i % 7);
+    }
+    Count c;
+    a.forEach(c);
+    Assert(c.n == 50002);
+
+    // Drop the 1000 old entries. b notices that the log was replaced.
+    a.compact(now - 500);
+    checkMissing(b, "key0");
+    check(b, "key1000", static_cast<Ubyte>(1000), 1000 % 7);
+    check(b, "one", 3, 30);
+    Count d;
+    b.forEach(d);
+    Assert(d.n == 49002);
+  }
+
+  // Index is rebuilt from the log
+  remove((string(fileName) + ".idx").c_str());
+  {
+    CacheLog a(fileName);
+    check(a, "two", 2, 20);
+    check(a, "key49999", static_cast<Ubyte>(49999), 49999 % 7);
+  }
+
+  removeFiles();
+  return 0;
+}
+
+#else
+
+int main() { return 0; }
+
+#endif
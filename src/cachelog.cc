@@ -0,0 +1,680 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Append-only cache log - alternative to the libdb database of CacheFile
+
+*/
+
+#include <config.h>
+
+#include <cachelog.hh>
+#if HAVE_CACHELOG
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd-jigdo.h>
+#include <unordered_set>
+
+#include <cachefile.hh>
+#include <debug.hh>
+#include <log.hh>
+#include <string.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("cachelog")
+
+/* Native byte order, all members accessed with atomic operations,
+   because other processes use the same index at the same time */
+struct CacheLog::IndexHeader {
+  char magic[8];
+  uint64 byteOrder; // To detect an index from a machine of other endianness
+  uint64 logId; // Index belongs to the log with this logId
+  uint64 indexedUpTo; // All records before this log offset are indexed
+  uint64 slotCount; // Power of 2
+  uint64 usedSlots;
+  uint64 deadBytes; // Approximate size of superseded records in the log
+  uint32 retired; // Nonzero once replaced by another index
+  uint32 claimed; // Time when a process started to replace the index
+};
+
+namespace {
+
+  const char LOG_MAGIC_TEXT[] = "jigdo cache log\n";
+  const char INDEX_MAGIC[8] = { 'j', 'c', 'i', 'n', 'd', 'e', 'x', '1' };
+  const uint64 BYTE_ORDER_MARK = 0x0102030405060708ULL;
+  const uint32 RECORD_MAGIC = 0x314c434aU; // "JCL1" after serialize4()
+
+  template <class T> inline T load(T& x) {
+    return __atomic_load_n(&x, __ATOMIC_ACQUIRE);
+  }
+  template <class T> inline void store(T& x, T value) {
+    __atomic_store_n(&x, value, __ATOMIC_RELEASE);
+  }
+  template <class T> inline bool compareAndSwap(T& x, T& expected,
+                                                T desired) {
+    return __atomic_compare_exchange_n(&x, &expected, desired, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+
+  DbError fileError(const string& fileName) {
+    int e = errno;
+    return DbError(e, subst(_("Cache file `%L1': %L2"), fileName,
+                            strerror(e)));
+  }
+
+}
+//______________________________________________________________________
+
+CacheLog::CacheLog(const string& n)
+    : name(n), fd(-1), logMap(0), logMapSize(0), knownSize(0), logId(0),
+      index(), pending(), pendingOffsets() {
+  try {
+    open();
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+CacheLog::~CacheLog() {
+  try {
+    sync();
+  } catch (DbError e) {
+    debug("~CacheLog: %1", e.message);
+  }
+  close();
+}
+//______________________________________________________________________
+
+void CacheLog::open() {
+  int attempts = 0;
+  while (true) {
+    openLog();
+    if (openIndex()) break;
+    /* The index belongs to another log. Probably, another process is
+       just replacing both - try again, then rebuild the index. */
+    close();
+    if (++attempts > 3) {
+      openLog();
+      buildIndex(slotsFor(knownSize), true);
+      break;
+    }
+    usleep(100000);
+  }
+  catchUp();
+}
+
+void CacheLog::close() {
+  unmapIndex(index);
+  if (logMap != 0) munmap(logMap, (size_t)logMapSize);
+  logMap = 0;
+  logMapSize = 0;
+  knownSize = 0;
+  if (fd != -1) ::close(fd);
+  fd = -1;
+}
+
+void CacheLog::checkCurrent() {
+  if (logMap != 0 && index.header != 0
+      && load(*reinterpret_cast<uint32*>(logMap + LOG_RETIRED)) == 0
+      && load(index.header->retired) == 0) return;
+  debug("Reopening `%1'", name);
+  close();
+  open();
+}
+//______________________________________________________________________
+
+void CacheLog::openLog() {
+  fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0666);
+  if (fd == -1) throw fileError(name);
+
+  /* Only one process may write the header of a new log. This is the
+     only time the log is locked. */
+  flock(fd, LOCK_EX);
+  struct stat fileInfo;
+  if (fstat(fd, &fileInfo) != 0) throw fileError(name);
+  if (fileInfo.st_size == 0) {
+    vector<Ubyte> header(LOG_HEADER, 0);
+    memcpy(&header[LOG_MAGIC], LOG_MAGIC_TEXT, 16);
+    serialize8(newLogId(), &header[LOG_ID]);
+    serialize4(time(0), &header[LOG_COMPACTED]);
+    writeAll(fd, header, name);
+    fileInfo.st_size = LOG_HEADER;
+  }
+  flock(fd, LOCK_UN);
+
+  if (fileInfo.st_size < LOG_HEADER)
+    throw DbError(0, subst(_("`%L1' is not a jigdo cache log file"), name));
+  knownSize = fileInfo.st_size;
+  mapLog(knownSize);
+  if (memcmp(logMap + LOG_MAGIC, LOG_MAGIC_TEXT, 16) != 0)
+    throw DbError(0, subst(_("`%L1' is not a jigdo cache log file"), name));
+  unserialize8(logId, logMap + LOG_ID);
+}
+
+uint64 CacheLog::refreshSize() {
+  struct stat fileInfo;
+  if (fstat(fd, &fileInfo) != 0) throw fileError(name);
+  knownSize = fileInfo.st_size;
+  mapLog(knownSize);
+  return knownSize;
+}
+
+/* The mapping is made larger than the file, so it needs to be renewed
+   only rarely while the log grows. Only the part up to knownSize is
+   ever accessed. */
+void CacheLog::mapLog(uint64 size) {
+  if (size <= logMapSize) return;
+  uint64 newSize = 2 * size;
+  if (newSize < WRITE_BUFFER) newSize = WRITE_BUFFER;
+  if ((uint64)(size_t)newSize != newSize) {
+    errno = EFBIG;
+    throw fileError(name);
+  }
+  void* m = mmap(0, (size_t)newSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  if (m == MAP_FAILED) throw fileError(name);
+  if (logMap != 0) munmap(logMap, (size_t)logMapSize);
+  logMap = static_cast<Ubyte*>(m);
+  logMapSize = newSize;
+}
+
+uint64 CacheLog::newLogId() {
+  struct timeval now;
+  gettimeofday(&now, 0);
+  uint64 x[3] = { (uint64)now.tv_sec, (uint64)now.tv_usec,
+                  (uint64)getpid() };
+  return hash(reinterpret_cast<const char*>(x), sizeof(x));
+}
+//______________________________________________________________________
+
+bool CacheLog::readRecord(uint64 pos, uint64 end, Record& r) {
+  if (end - pos < REC_HEADER + MIN_ENTRY) return false;
+  const Ubyte* p = logMap + pos;
+  uint32 magic, size, keySize, recCheck;
+  unserialize4(magic, p + REC_MAGIC);
+  if (magic != RECORD_MAGIC) return false;
+  unserialize4(size, p + REC_SIZE);
+  unserialize4(keySize, p + REC_KEYSIZE);
+  if (size > end - pos || size < REC_HEADER + MIN_ENTRY
+      || keySize > size - REC_HEADER - MIN_ENTRY) return false;
+  r.size = size;
+  r.keySize = keySize;
+  r.entrySize = size - REC_HEADER - keySize;
+  unserialize4(recCheck, p + REC_CHECK);
+  return recCheck == check(recordKey(pos), r.keySize, recordEntry(pos, r),
+                           r.entrySize);
+}
+
+/* A crash or a full disc can leave a partly written batch of records
+   in the log, and another process may be writing one at the end of the
+   log right now. Skip such data by looking for the next valid
+   record. */
+uint64 CacheLog::scan(uint64 pos, uint64 end, Record& r) {
+  while (pos < end && !readRecord(pos, end, r)) ++pos;
+  return pos < end ? pos : end;
+}
+
+// FNV-1a, with the final mixing step of MurmurHash3
+uint64 CacheLog::hash(const char* data, size_t size) {
+  uint64 h = 0xcbf29ce484222325ULL;
+  for (const char* end = data + size; data < end; ++data) {
+    h ^= static_cast<Ubyte>(*data);
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint32 CacheLog::check(const char* key, size_t keySize, const Ubyte* entry,
+                       size_t entrySize) {
+  // The access time is left out, it is modified in place by touch()
+  Paranoid(ENTRY_ACCESS == 0);
+  uint64 h = hash(key, keySize)
+    ^ hash(reinterpret_cast<const char*>(entry) + MIN_ENTRY,
+           entrySize - MIN_ENTRY);
+  return (uint32)(h ^ (h >> 32));
+}
+
+void CacheLog::writeAll(int fd, const vector<Ubyte>& data,
+                        const string& fileName) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = write(fd, &data[done], data.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw fileError(fileName);
+    done += n;
+  }
+}
+
+/* Create a file in the same directory as the log, so it can be
+   renamed to replace it, with the same permissions as the log */
+int CacheLog::createTemp(const string& prefix, string& tmpName) {
+  tmpName = prefix;
+  tmpName += ".XXXXXX";
+  int tmpFd = mkstemp(&tmpName[0]);
+  if (tmpFd == -1) throw fileError(tmpName);
+  struct stat fileInfo;
+  if (fstat(fd, &fileInfo) == 0) fchmod(tmpFd, fileInfo.st_mode & 0777);
+  return tmpFd;
+}
+//______________________________________________________________________
+
+Ubyte* CacheLog::find(const string& key, size_t& entrySize) {
+  checkCurrent();
+  uint64 off = lookup(index, key);
+  if (off == 0) return 0;
+  // lookup() has checked the record header and key
+  uint32 size;
+  unserialize4(size, logMap + off + REC_SIZE);
+  if (!inLog(off, size) || size < REC_HEADER + key.size() + MIN_ENTRY)
+    return 0;
+  entrySize = size - REC_HEADER - key.size();
+  return logMap + off + REC_HEADER + key.size();
+}
+//________________________________________
+
+void CacheLog::insert(const string& key, const Ubyte* entry,
+                      size_t entrySize) {
+  Paranoid(entrySize >= MIN_ENTRY);
+  size_t pos = pending.size();
+  uint32 size = (uint32)(REC_HEADER + key.size() + entrySize);
+  pendingOffsets.push_back(pos);
+  pending.resize(pos + size);
+  Ubyte* p = &pending[pos];
+  serialize4(RECORD_MAGIC, p + REC_MAGIC);
+  serialize4(size, p + REC_SIZE);
+  serialize4(key.size(), p + REC_KEYSIZE);
+  serialize4(check(key.data(), key.size(), entry, entrySize), p + REC_CHECK);
+  memcpy(p + REC_HEADER, key.data(), key.size());
+  memcpy(p + REC_HEADER + key.size(), entry, entrySize);
+  if (pending.size() >= WRITE_BUFFER) sync();
+}
+
+/* Thanks to O_APPEND, one write() puts all records at the end of the
+   log, even if other processes append to it at the same time. */
+void CacheLog::sync() {
+  if (pending.empty()) return;
+  checkCurrent();
+  ssize_t n;
+  do {
+    n = write(fd, &pending[0], pending.size());
+  } while (n < 0 && errno == EINTR);
+  if (n != (ssize_t)pending.size()) {
+    // Any partly written records are skipped by scan()
+    if (n >= 0) errno = ENOSPC;
+    pending.clear();
+    pendingOffsets.clear();
+    throw fileError(name);
+  }
+  // Our file position is now at the end of the data we wrote
+  uint64 start = lseek(fd, 0, SEEK_CUR) - pending.size();
+  debug("Appended %1 records at %2", pendingOffsets.size(), start);
+  for (vector<size_t>::iterator i = pendingOffsets.begin(),
+         e = pendingOffsets.end(); i != e; ++i) {
+    uint32 keySize;
+    unserialize4(keySize, &pending[*i + REC_KEYSIZE]);
+    string key(reinterpret_cast<const char*>(&pending[*i + REC_HEADER]),
+               keySize);
+    indexInsert(index, key, start + *i, false);
+  }
+  // If we are the first to append since the last catchUp(), no need to scan
+  uint64 expected = start;
+  compareAndSwap(index.header->indexedUpTo, expected,
+                 start + pending.size());
+  pending.clear();
+  pendingOffsets.clear();
+  if (2 * load(index.header->usedSlots) > index.header->slotCount) grow();
+}
+//______________________________________________________________________
+
+bool CacheLog::compactionDue() {
+  checkCurrent();
+  uint64 size = refreshSize();
+  uint32 compacted;
+  unserialize4(compacted, logMap + LOG_COMPACTED);
+  return 2 * load(index.header->deadBytes) > size
+    || static_cast<signed>((uint32)time(0) - compacted) > COMPACT_INTERVAL;
+}
+
+void CacheLog::compact(time_t expired) {
+  sync();
+  checkCurrent();
+  if (!claim(index)) return;
+  debug("Compacting `%1'", name);
+
+  string logTmp, indexTmp;
+  int logFd = -1;
+  Index n;
+  uint64 end = 0;
+  try {
+    logFd = createTemp(name, logTmp);
+    uint64 id = newLogId();
+    vector<Ubyte> out(LOG_HEADER, 0);
+    memcpy(&out[LOG_MAGIC], LOG_MAGIC_TEXT, 16);
+    serialize8(id, &out[LOG_ID]);
+    serialize4(time(0), &out[LOG_COMPACTED]);
+
+    size_t slotCount = slotsFor(0);
+    while (slotCount < 2 * load(index.header->usedSlots)) slotCount *= 2;
+    int indexFd = createTemp(indexName(), indexTmp);
+    size_t indexSize = sizeof(IndexHeader) + slotCount * sizeof(uint64);
+    if (ftruncate(indexFd, indexSize) != 0) {
+      ::close(indexFd);
+      throw fileError(indexTmp);
+    }
+    mapIndex(n, indexFd, indexSize, indexTmp);
+    initIndex(n, id, slotCount);
+
+    /* Copy the current records which have not expired. If another
+       process supersedes a record we have already copied, keep the
+       copy - the key must only be in the new index once. */
+    uint64 written = 0;
+    unordered_set<string> copied;
+    end = refreshSize();
+    Record r;
+    for (uint64 pos = scan(LOG_HEADER, end, r); pos < end;
+         pos = scan(pos + r.size, end, r)) {
+      string key(recordKey(pos), r.keySize);
+      if (lookup(index, key) != pos) continue; // Superseded
+      if (!copied.insert(key).second) continue;
+      uint32 access;
+      unserialize4(access, recordEntry(pos, r) + ENTRY_ACCESS);
+      // Same as 'if (access < expired)', but deals with wraparound
+      if (static_cast<signed>(access - (uint32)expired) < 0) {
+        debug("Cache: expiring %1", key);
+        continue;
+      }
+      indexInsert(n, key, written + out.size(), true);
+      out.insert(out.end(), logMap + pos, logMap + pos + r.size);
+      if (out.size() >= WRITE_BUFFER) {
+        writeAll(logFd, out, logTmp);
+        written += out.size();
+        out.clear();
+      }
+    }
+    writeAll(logFd, out, logTmp);
+    n.header->indexedUpTo = written + out.size();
+    if (fsync(logFd) != 0) throw fileError(logTmp);
+    ::close(logFd);
+    logFd = -1;
+
+    if (rename(logTmp.c_str(), name.c_str()) != 0) throw fileError(name);
+    logTmp.clear();
+    if (rename(indexTmp.c_str(), indexName().c_str()) != 0)
+      throw fileError(indexName());
+  } catch (...) {
+    if (logFd != -1) ::close(logFd);
+    if (!logTmp.empty()) unlink(logTmp.c_str());
+    if (!indexTmp.empty()) unlink(indexTmp.c_str());
+    unmapIndex(n);
+    release(index);
+    throw;
+  }
+  unmapIndex(n);
+
+  // Make the other processes switch to the new files
+  store(*reinterpret_cast<uint32*>(logMap + LOG_RETIRED), (uint32)1);
+  store(index.header->retired, (uint32)1);
+
+  /* Copy the records which were appended while we were busy. Until
+     the other processes notice the new log, there may be more. */
+  uint64 newEnd = refreshSize();
+  Record r;
+  vector<string> keys;
+  vector<Ubyte> entries;
+  vector<size_t> entryOffsets;
+  for (uint64 pos = scan(end, newEnd, r); pos < newEnd;
+       pos = scan(pos + r.size, newEnd, r)) {
+    string key(recordKey(pos), r.keySize);
+    if (lookup(index, key) != pos) continue;
+    keys.push_back(key);
+    entryOffsets.push_back(entries.size());
+    Ubyte* entry = recordEntry(pos, r);
+    entries.insert(entries.end(), entry, entry + r.entrySize);
+  }
+  entryOffsets.push_back(entries.size());
+  close();
+  open();
+  for (size_t i = 0; i < keys.size(); ++i)
+    insert(keys[i], &entries[entryOffsets[i]],
+           entryOffsets[i + 1] - entryOffsets[i]);
+  sync();
+}
+//______________________________________________________________________
+
+size_t CacheLog::slotsFor(uint64 logBytes) {
+  size_t slotCount = INITIAL_SLOTS;
+  while (slotCount < logBytes / 256) slotCount *= 2;
+  return slotCount;
+}
+
+bool CacheLog::openIndex() {
+  string indexFile = indexName();
+  int indexFd = ::open(indexFile.c_str(), O_RDWR);
+  if (indexFd == -1) {
+    if (errno != ENOENT) throw fileError(indexFile);
+    // No index yet - create one, or use another process's new one
+    if (buildIndex(slotsFor(knownSize), false)) return true;
+    return openIndex();
+  }
+
+  struct stat fileInfo;
+  bool ok = fstat(indexFd, &fileInfo) == 0
+    && (uint64)fileInfo.st_size >= sizeof(IndexHeader)
+    && (uint64)(size_t)fileInfo.st_size == (uint64)fileInfo.st_size;
+  if (ok) {
+    try {
+      mapIndex(index, indexFd, (size_t)fileInfo.st_size, indexFile);
+    } catch (...) {
+      ::close(indexFd);
+      throw;
+    }
+  }
+  ::close(indexFd);
+  if (ok) {
+    const IndexHeader* h = index.header;
+    uint64 slotCount = h->slotCount;
+    ok = memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0
+      && h->byteOrder == BYTE_ORDER_MARK
+      && slotCount > 0 && (slotCount & (slotCount - 1)) == 0
+      && (index.mapSize - sizeof(IndexHeader)) / sizeof(uint64) >= slotCount;
+  }
+  if (!ok) {
+    debug("Index of `%1' damaged, recreating it", name);
+    unmapIndex(index);
+    buildIndex(slotsFor(knownSize), true);
+    return true;
+  }
+  if (index.header->logId != logId) {
+    unmapIndex(index);
+    return false;
+  }
+  return true;
+}
+
+void CacheLog::mapIndex(Index& i, int indexFd, size_t size,
+                        const string& fileName) {
+  void* m = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+  if (m == MAP_FAILED) throw fileError(fileName);
+  i.header = static_cast<IndexHeader*>(m);
+  i.slots = reinterpret_cast<uint64*>(i.header + 1);
+  i.mapSize = size;
+}
+
+void CacheLog::initIndex(Index& i, uint64 id, size_t slotCount) {
+  IndexHeader* h = i.header;
+  memcpy(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  h->byteOrder = BYTE_ORDER_MARK;
+  h->logId = id;
+  h->indexedUpTo = LOG_HEADER;
+  h->slotCount = slotCount;
+}
+
+void CacheLog::unmapIndex(Index& i) {
+  if (i.header != 0) munmap(i.header, i.mapSize);
+  i = Index();
+}
+//________________________________________
+
+bool CacheLog::sameKey(uint64 off, const string& key) {
+  if (!inLog(off, REC_HEADER + key.size())) return false;
+  uint32 keySize;
+  unserialize4(keySize, logMap + off + REC_KEYSIZE);
+  return keySize == key.size()
+    && memcmp(recordKey(off), key.data(), key.size()) == 0;
+}
+
+uint64 CacheLog::lookup(const Index& i, const string& key) {
+  uint64 h = hash(key.data(), key.size());
+  uint64 tag = h >> (64 - TAG_BITS);
+  uint64 mask = i.header->slotCount - 1;
+  for (uint64 n = 0, s = h & mask; n <= mask; ++n, s = (s + 1) & mask) {
+    uint64 v = load(i.slots[s]);
+    if (v == 0) return 0;
+    if ((v & TAG_MASK) == tag && sameKey(v >> TAG_BITS, key))
+      return v >> TAG_BITS;
+  }
+  return 0;
+}
+
+/* A key is always stored in the first slot that was empty when it was
+   inserted, and slots are never emptied again. So if two processes
+   insert the same key at the same time, one of them sees the key in
+   the slot which the other one has just filled. */
+void CacheLog::indexInsert(Index& i, const string& key, uint64 off,
+                           bool unique) {
+  uint64 h = hash(key.data(), key.size());
+  uint64 tag = h >> (64 - TAG_BITS);
+  uint64 mask = i.header->slotCount - 1;
+  uint64 slot = (off << TAG_BITS) | tag;
+  uint64 n = 0, s = h & mask;
+  while (n <= mask) {
+    uint64 v = load(i.slots[s]);
+    if (v == 0) {
+      if (compareAndSwap(i.slots[s], v, slot)) {
+        __atomic_fetch_add(&i.header->usedSlots, 1, __ATOMIC_RELAXED);
+        return;
+      }
+      continue; // Another process was faster, look at the slot again
+    }
+    if (!unique && (v & TAG_MASK) == tag && sameKey(v >> TAG_BITS, key)) {
+      uint64 old = v >> TAG_BITS;
+      if (old >= off) return; // Already indexed, or a newer record
+      uint32 oldSize;
+      unserialize4(oldSize, logMap + old + REC_SIZE);
+      if (compareAndSwap(i.slots[s], v, slot)) {
+        __atomic_fetch_add(&i.header->deadBytes, oldSize, __ATOMIC_RELAXED);
+        return;
+      }
+      continue;
+    }
+    ++n;
+    s = (s + 1) & mask;
+  }
+  // Table is full - the record gets indexed when the index is rebuilt
+  debug("Index of `%1' full", name);
+}
+//________________________________________
+
+void CacheLog::catchUp() {
+  uint64 pos = load(index.header->indexedUpTo);
+  uint64 end = refreshSize();
+  if (pos < LOG_HEADER) pos = LOG_HEADER;
+  if (pos >= end) return;
+  debug("Indexing `%1' from %2 to %3", name, pos, end);
+  Record r;
+  for (pos = scan(pos, end, r); pos < end; pos = scan(pos + r.size, end, r))
+    indexInsert(index, string(recordKey(pos), r.keySize), pos, false);
+  advanceIndexed(index, end);
+  if (2 * load(index.header->usedSlots) > index.header->slotCount) grow();
+}
+
+void CacheLog::advanceIndexed(Index& i, uint64 end) {
+  uint64 x = load(i.header->indexedUpTo);
+  while (x < end && !compareAndSwap(i.header->indexedUpTo, x, end)) { }
+}
+
+bool CacheLog::claim(Index& i) {
+  uint32 now = (uint32)time(0);
+  uint32 c = load(i.header->claimed);
+  if (c != 0 && static_cast<signed>(now - c) < STALE_CLAIM) return false;
+  return compareAndSwap(i.header->claimed, c, now);
+}
+
+void CacheLog::release(Index& i) {
+  store(i.header->claimed, (uint32)0);
+}
+//________________________________________
+
+bool CacheLog::buildIndex(size_t slotCount, bool replace) {
+  string indexFile = indexName(), indexTmp;
+  debug("Building index of `%1' with %2 slots", name, slotCount);
+  int indexFd = createTemp(indexFile, indexTmp);
+  size_t size = sizeof(IndexHeader) + slotCount * sizeof(uint64);
+  Index n;
+  try {
+    if (ftruncate(indexFd, size) != 0) throw fileError(indexTmp);
+    mapIndex(n, indexFd, size, indexTmp);
+    ::close(indexFd);
+    indexFd = -1;
+    initIndex(n, logId, slotCount);
+
+    uint64 end = refreshSize();
+    Record r;
+    for (uint64 pos = scan(LOG_HEADER, end, r); pos < end;
+         pos = scan(pos + r.size, end, r))
+      indexInsert(n, string(recordKey(pos), r.keySize), pos, false);
+    n.header->indexedUpTo = end;
+
+    if (replace) {
+      if (rename(indexTmp.c_str(), indexFile.c_str()) != 0)
+        throw fileError(indexFile);
+    } else {
+      // Unlike rename(), link() fails if the index exists by now
+      int status = link(indexTmp.c_str(), indexFile.c_str());
+      if (status != 0 && errno != EEXIST) throw fileError(indexFile);
+      unlink(indexTmp.c_str());
+      if (status != 0) {
+        unmapIndex(n);
+        return false;
+      }
+    }
+  } catch (...) {
+    if (indexFd != -1) ::close(indexFd);
+    unlink(indexTmp.c_str());
+    unmapIndex(n);
+    throw;
+  }
+  if (index.header != 0) {
+    store(index.header->retired, (uint32)1);
+    unmapIndex(index);
+  }
+  index = n;
+  return true;
+}
+
+/* Records which other processes add to the old index after we have
+   read the log are indexed by the next catchUp(). */
+void CacheLog::grow() {
+  if (!claim(index)) return;
+  try {
+    buildIndex(2 * index.header->slotCount, true);
+  } catch (...) {
+    release(index);
+    throw;
+  }
+}
+
+#endif /* HAVE_CACHELOG */
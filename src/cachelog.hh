@@ -0,0 +1,239 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Append-only cache log - alternative to the libdb database of CacheFile
+
+  Selected with jigdo-file --cache-format=log. Several jigdo-file
+  processes can read and write the same log at the same time without
+  taking a lock: New entries are only ever appended to the log file,
+  with one write() of a whole batch of records to the file opened with
+  O_APPEND. A hash table in a second file, the log's name plus ".idx",
+  maps each key to the offset of its newest record in the log. Both
+  files are memory-mapped; the slots of the table are updated with
+  atomic compare-and-swap operations. The table can always be rebuilt
+  from the log.
+
+  Log file, all numbers little-endian:<pre>
+  Size Meaning
+  16   "jigdo cache log\n"
+   8   logId - random, changed when the log is compacted
+   4   retired - nonzero once compact() has replaced this file
+   4   time of last compaction
+  32   reserved</pre>
+  followed by records:<pre>
+   4   "JCL1"
+   4   size of whole record
+   4   keySize
+   4   check - hash of key and entry, except for the access time
+  keySize bytes key
+  entry, starting with 4 bytes access time</pre>
+
+  The entry is the same as in CacheFile's libdb database, i.e. last
+  access time, file mtime and size, followed by the data described in
+  cachefile.hh. A record which is superseded by a newer one for the
+  same key stays in the log until compact() removes it.
+
+  The index file is in native byte order - it contains a header with
+  the logId of the log it belongs to, then 64-bit slots, each with the
+  offset of a record in the log and some bits of its key's hash.
+
+*/
+
+#ifndef CACHELOG_HH
+#define CACHELOG_HH
+
+#include <config.h>
+
+/** The log needs mmap() and GCC's atomic builtins, on memory shared
+    between processes */
+#if UNIX && HAVE_MMAP && defined(__GNUC__)
+#  define HAVE_CACHELOG 1
+#else
+#  define HAVE_CACHELOG 0
+#endif
+
+#if HAVE_CACHELOG
+
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include <nocopy.hh>
+#include <serialize.hh>
+//______________________________________________________________________
+
+/** Cache log and its index. The methods throw DbError if an operation
+    on the files fails. */
+class CacheLog : NoCopy {
+public:
+  /** Open log, create it if not yet present */
+  explicit CacheLog(const string& name);
+  ~CacheLog();
+
+  /** Look up the newest entry for key. Returns null if there is none.
+      The entry can be modified in place with touch(). The pointer is
+      only valid until the next call to a method other than touch(). */
+  Ubyte* find(const string& key, size_t& entrySize);
+
+  /** Set the access time of an entry returned by find() or passed to
+      forEach() to now. To avoid writing to every page of the log after
+      each run, it is only updated if it is older than TOUCH_INTERVAL. */
+  static inline void touch(Ubyte* entry, time_t now);
+
+  /** Add a record for key. It is only written by the next call to
+      sync(), or when many records have been added. */
+  void insert(const string& key, const Ubyte* entry, size_t entrySize);
+
+  /** Append the records added by insert() to the log. Other processes
+      can find them afterwards. */
+  void sync();
+
+  /** Call f(key, entry, entrySize) for each current entry of the log,
+      in the order in which they appear in the log. f may touch() the
+      entry. Reading the whole log like this is much faster than
+      find() for many keys. */
+  template <class Function>
+  inline void forEach(Function& f);
+
+  /** Return true if compact() would make the log a lot smaller, or if
+      it was last compacted more than COMPACT_INTERVAL ago. */
+  bool compactionDue();
+
+  /** Replace the log with a copy which only contains the current
+      entries which were accessed at or after expired, and their
+      index. Does nothing if another process is compacting the log at
+      the same time. Records which other processes append during the
+      compaction are copied to the new log, but a record written by a
+      process which has not yet noticed the new log may get lost. */
+  void compact(time_t expired);
+
+  static const time_t TOUCH_INTERVAL = 60 * 60;
+  static const time_t COMPACT_INTERVAL = 24 * 60 * 60;
+
+private:
+  struct IndexHeader;
+  struct Index {
+    Index() : header(0), slots(0), mapSize(0) { }
+    IndexHeader* header;
+    uint64* slots;
+    size_t mapSize;
+  };
+  // Sizes of a record at some offset in the log
+  struct Record {
+    uint64 size;
+    size_t keySize;
+    size_t entrySize;
+  };
+
+  // Offsets in the log header and in each record, see above
+  enum {
+    LOG_MAGIC = 0, LOG_ID = 16, LOG_RETIRED = 24, LOG_COMPACTED = 28,
+    LOG_HEADER = 64
+  };
+  enum { REC_MAGIC = 0, REC_SIZE = 4, REC_KEYSIZE = 8, REC_CHECK = 12,
+         REC_HEADER = 16, ENTRY_ACCESS = 0, MIN_ENTRY = 4 };
+  static const size_t INITIAL_SLOTS = 1 << 16;
+  // A slot holds the offset of a record, shifted left by TAG_BITS
+  static const unsigned TAG_BITS = 20;
+  static const uint64 TAG_MASK = (1 << TAG_BITS) - 1;
+  // Claims of an index by a dead process are ignored after this time
+  static const time_t STALE_CLAIM = 10 * 60;
+  static const size_t WRITE_BUFFER = 1024 * 1024;
+
+  void open();
+  void close();
+  void openLog();
+  bool openIndex();
+  // Reopen if another process has replaced the log or its index
+  void checkCurrent();
+  // Update knownSize, map that much of the log, return it
+  uint64 refreshSize();
+  void mapLog(uint64 size);
+  // Is the area inside the log? Calls refreshSize() if necessary.
+  inline bool inLog(uint64 off, uint64 len);
+  const char* recordKey(uint64 pos) const {
+    return reinterpret_cast<const char*>(logMap + pos + REC_HEADER);
+  }
+  Ubyte* recordEntry(uint64 pos, const Record& r) const {
+    return logMap + pos + REC_HEADER + r.keySize;
+  }
+  uint64 newLogId();
+
+  /* Return offset of first valid record in the log between pos and
+     end and set r to it, or end if there is none */
+  uint64 scan(uint64 pos, uint64 end, Record& r);
+  bool readRecord(uint64 pos, uint64 end, Record& r);
+  static uint64 hash(const char* data, size_t size);
+  static uint32 check(const char* key, size_t keySize, const Ubyte* entry,
+                      size_t entrySize);
+  static void writeAll(int fd, const vector<Ubyte>& data,
+                       const string& fileName);
+  int createTemp(const string& prefix, string& tmpName);
+
+  // Operations on an index
+  static size_t slotsFor(uint64 logBytes);
+  void mapIndex(Index& i, int fd, size_t size, const string& fileName);
+  static void initIndex(Index& i, uint64 id, size_t slotCount);
+  static void unmapIndex(Index& i);
+  bool sameKey(uint64 off, const string& key);
+  // Offset of key's record, or 0 if not present
+  uint64 lookup(const Index& i, const string& key);
+  /* Point the key's slot in i to the record at off. Keys are compared
+     with the records in this log unless unique is true. */
+  void indexInsert(Index& i, const string& key, uint64 off, bool unique);
+  // Index records which were appended since the last call by any process
+  void catchUp();
+  static void advanceIndexed(Index& i, uint64 end);
+  static bool claim(Index& i);
+  static void release(Index& i);
+  /* Create a new index with the given number of slots for the log.
+     If replace is false, fail if another process created one first. */
+  bool buildIndex(size_t slotCount, bool replace);
+  void grow();
+  string indexName() const { return name + ".idx"; }
+
+  string name;
+  int fd; // Log file, opened with O_APPEND
+  Ubyte* logMap; // Mapping of log, may extend beyond the end of the file
+  uint64 logMapSize;
+  uint64 knownSize; // Bytes in log file when we last looked
+  uint64 logId;
+  Index index;
+  vector<Ubyte> pending; // Records not yet written by sync()
+  vector<size_t> pendingOffsets; // Offset of each record in pending
+};
+//______________________________________________________________________
+
+void CacheLog::touch(Ubyte* entry, time_t now) {
+  uint32 access;
+  unserialize4(access, entry + ENTRY_ACCESS);
+  // Same as 'if (now - access < TOUCH_INTERVAL)', but deals with wraparound
+  if (static_cast<signed>((uint32)now - access) < TOUCH_INTERVAL) return;
+  serialize4(now, entry + ENTRY_ACCESS);
+}
+
+bool CacheLog::inLog(uint64 off, uint64 len) {
+  if (off + len <= knownSize) return true;
+  return off + len <= refreshSize();
+}
+
+template <class Function>
+void CacheLog::forEach(Function& f) {
+  checkCurrent();
+  uint64 end = refreshSize();
+  Record r;
+  for (uint64 pos = scan(LOG_HEADER, end, r); pos < end;
+       pos = scan(pos + r.size, end, r)) {
+    string key(recordKey(pos), r.keySize);
+    if (lookup(index, key) != pos) continue; // Superseded
+    f(key, recordEntry(pos, r), r.entrySize);
+  }
+}
+
+#endif /* HAVE_CACHELOG */
+#endif
@@ -0,0 +1,461 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Cache server of "jigdo-file cache-server"
+
+*/
+
+#include <config.h>
+
+#include <cacheserver.hh>
+#if HAVE_CACHESERVER
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd-jigdo.h>
+
+#include <debug.hh>
+#include <log.hh>
+#include <serialize.hh>
+#include <string.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("cacheserver")
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+
+  volatile sig_atomic_t stopRequested = 0;
+  extern "C" void requestStop(int) { stopRequested = 1; }
+
+  DbError socketError(const string& socketName) {
+    int e = errno;
+    return DbError(e, subst(_("Cache server `%L1': %L2"), socketName,
+                            strerror(e)));
+  }
+
+  // Same as 'if (t1 < t2)' for access times, but deals with wraparound
+  inline bool before(uint32 t1, uint32 t2) {
+    return static_cast<signed>(t1 - t2) < 0;
+  }
+
+  /* Rewrite an entry's access time in the cache file only if it is
+     older than this, to avoid writing each used entry every time */
+  const time_t TOUCH_INTERVAL = 24 * 60 * 60;
+
+  /* The key of a file is the part of its path after "//", or the path
+     without a leading "/", like with JigdoCache::addFile() */
+  string fileKey(const string& path) {
+    string::size_type split = path.rfind(SPLITSEP);
+    if (split != string::npos)
+      return string(path, split + sizeof(SPLITSEP) - 1);
+    if (!path.empty() && path[0] == DIRSEP)
+      return string(path, 1);
+    return path;
+  }
+
+}
+//______________________________________________________________________
+
+struct CacheServer::Client {
+  Client(int f) : fd(f), in(), out(), outPos(0) { }
+  int fd;
+  vector<Ubyte> in; // Start of incomplete message
+  vector<Ubyte> out; // Answers not yet sent, from outPos onwards
+  size_t outPos;
+};
+
+// Copy the entries of the cache file into memory
+struct CacheServer::LoadAll : CacheFile::Lookup {
+  LoadAll(Entries& e) : entries(e), now(time(0)) { }
+  bool operator()(const string& fileName, uint64 fileSize, time_t mtime,
+                  const Ubyte* data, size_t size) {
+    vector<Ubyte>& entry = entries[fileName];
+    entry.resize(CacheFile::USER_DATA + size);
+    serialize4(now, &entry[CacheFile::ACCESS]);
+    serialize4(mtime, &entry[CacheFile::MTIME]);
+    serialize6(fileSize, &entry[CacheFile::SIZE]);
+    memcpy(&entry[CacheFile::USER_DATA], data, size);
+    return false; // Access time is only updated when the entry is used
+  }
+  Entries& entries;
+  time_t now;
+};
+
+#if HAVE_DIRWATCHER
+// Drop the entries of files which change
+struct CacheServer::WatchHandler : DirWatcher::Handler {
+  WatchHandler(CacheServer& s) : server(s) { }
+  void fileChanged(const string& path) { server.drop(fileKey(path)); }
+  void fileRemoved(const string& path) { server.drop(fileKey(path)); }
+  void dirAdded(const string& path) { dirRemoved(path); }
+  void dirRemoved(const string& path) {
+    server.dropDir(fileKey(path) + DIRSEP);
+  }
+  void overflow() {
+    // Not fatal, clients check the mtime and size of each entry
+    server.reporter.info(_("Too many changes, some cache entries of "
+                           "changed files are kept"));
+  }
+  CacheServer& server;
+};
+#endif
+//______________________________________________________________________
+
+CacheServer::CacheServer(const string& socketName, CacheFile* c,
+                         time_t expiry, JigdoCache::ProgressReporter& pr)
+    : name(socketName), listenFd(-1), cacheFile(c), cacheExpiry(expiry),
+      reporter(pr), entries(), dirty(), clients(), lastFlush(time(0)),
+      lastExpiry(time(0)) {
+  if (cacheFile != 0) {
+    LoadAll load(entries);
+    cacheFile->findAll(load);
+    debug("Loaded %1 entries", entries.size());
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (name.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    throw socketError(name);
+  }
+  memcpy(addr.sun_path, name.data(), name.size());
+
+  /* A socket left behind by a server which is no longer running is
+     removed, but do not take over the socket of a running server. */
+  try {
+    CacheClient running(name);
+    errno = EADDRINUSE;
+    throw socketError(name);
+  } catch (DbError e) {
+    if (e.code != ECONNREFUSED && e.code != ENOENT) throw;
+  }
+  struct stat fileInfo;
+  if (lstat(name.c_str(), &fileInfo) == 0 && S_ISSOCK(fileInfo.st_mode))
+    unlink(name.c_str());
+
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd == -1) throw socketError(name);
+  if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+    DbError e = socketError(name);
+    ::close(listenFd);
+    throw e;
+  }
+  fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+}
+
+CacheServer::~CacheServer() {
+  try {
+    flush();
+  } catch (DbError e) {
+    reporter.error(e.message);
+  }
+  for (vector<Client*>::iterator i = clients.begin(), e = clients.end();
+       i != e; ++i) {
+    ::close((*i)->fd);
+    delete *i;
+  }
+  ::close(listenFd);
+  unlink(name.c_str());
+}
+//______________________________________________________________________
+
+void CacheServer::run() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = requestStop; // No SA_RESTART, poll() is interrupted
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+
+  vector<struct pollfd> fds;
+  while (stopRequested == 0) {
+    fds.clear();
+    struct pollfd p;
+    p.fd = listenFd; p.events = POLLIN; p.revents = 0;
+    fds.push_back(p);
+    p.fd = -1; // Ignored by poll()
+#   if HAVE_DIRWATCHER
+    if (watcher.get() != 0) p.fd = watcher->fd();
+#   endif
+    fds.push_back(p);
+    for (vector<Client*>::iterator i = clients.begin(), e = clients.end();
+         i != e; ++i) {
+      p.fd = (*i)->fd;
+      // Only read the next request once the last answer was sent
+      p.events = ((*i)->out.empty() ? POLLIN : POLLOUT);
+      fds.push_back(p);
+    }
+
+    int n = poll(&fds[0], fds.size(), FLUSH_INTERVAL * 1000);
+    if (n < 0 && errno != EINTR) throw socketError(name);
+
+    if (n > 0) {
+      /* Go through the clients first, accept() appends to the
+         vector, watch() may take a while */
+      size_t alive = 0;
+      for (size_t i = 0; i < clients.size(); ++i) {
+        Client* c = clients[i];
+        short revents = fds[i + 2].revents;
+        bool ok = true;
+        if (revents & POLLOUT) ok = send(*c);
+        else if (revents & (POLLIN | POLLHUP | POLLERR)) ok = receive(*c);
+        if (ok) {
+          clients[alive++] = c;
+        } else {
+          debug("Client %1 gone", c->fd);
+          ::close(c->fd);
+          delete c;
+        }
+      }
+      clients.resize(alive);
+      if (fds[0].revents & POLLIN) accept();
+#     if HAVE_DIRWATCHER
+      if (fds[1].revents & POLLIN) {
+        WatchHandler h(*this);
+        try {
+          watcher->readEvents(h);
+        } catch (DirWatchError e) {
+          reporter.error(e.message);
+        }
+      }
+#     endif
+    }
+
+    time_t now = time(0);
+    if (!dirty.empty() && now - lastFlush >= FLUSH_INTERVAL) {
+      try { flush(); } catch (DbError e) { reporter.error(e.message); }
+    }
+    if (cacheExpiry > 0 && now - lastExpiry >= EXPIRY_INTERVAL) expire();
+  }
+  debug("Stopping");
+}
+//______________________________________________________________________
+
+void CacheServer::accept() {
+  while (true) {
+    int fd = ::accept(listenFd, 0, 0);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        reporter.error(socketError(name).message);
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    debug("Client %1 connected", fd);
+    clients.push_back(new Client(fd));
+  }
+}
+
+bool CacheServer::receive(Client& c) {
+  size_t old = c.in.size();
+  c.in.resize(old + READ_SIZE);
+  ssize_t n = read(c.fd, &c.in[old], READ_SIZE);
+  if (n <= 0) {
+    c.in.resize(old);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+                     || errno == EINTR);
+  }
+  c.in.resize(old + n);
+
+  // Process all complete messages
+  size_t pos = 0;
+  while (c.in.size() - pos >= CacheClient::HEADER) {
+    uint32 type, size;
+    unserialize4(type, &c.in[pos]);
+    unserialize4(size, &c.in[pos + 4]);
+    if (size > CacheClient::MAX_MESSAGE) return false;
+    if (c.in.size() - pos - CacheClient::HEADER < size) break;
+    if (!process(c, type, &c.in[pos + CacheClient::HEADER], size))
+      return false;
+    pos += CacheClient::HEADER + size;
+  }
+  c.in.erase(c.in.begin(), c.in.begin() + pos);
+  return c.out.empty() || send(c);
+}
+
+bool CacheServer::send(Client& c) {
+  while (c.outPos < c.out.size()) {
+    ssize_t n = ::send(c.fd, &c.out[c.outPos], c.out.size() - c.outPos,
+                       MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (n <= 0) return false;
+    c.outPos += n;
+  }
+  c.out.clear();
+  c.outPos = 0;
+  return true;
+}
+
+bool CacheServer::process(Client& c, uint32 type, const Ubyte* payload,
+                          size_t size) {
+  switch (type) {
+  case CacheClient::MSG_LOOKUP: lookup(c, payload, size); return true;
+  case CacheClient::MSG_INSERT: insert(payload, size); return true;
+  default: return false;
+  }
+}
+//______________________________________________________________________
+
+void CacheServer::lookup(Client& c, const Ubyte* payload, size_t size) {
+  size_t start = c.out.size();
+  CacheClient::beginMessage(c.out, CacheClient::MSG_ENTRIES);
+  uint32 now = (uint32)time(0);
+  if (size == 0) {
+    for (Entries::iterator i = entries.begin(), e = entries.end();
+         i != e; ++i) {
+      CacheClient::appendItem(c.out, i->first.data(), i->first.size());
+      CacheClient::appendItem(c.out,
+          reinterpret_cast<const char*>(&i->second[0]), i->second.size());
+    }
+  }
+  string key;
+  const Ubyte* end = payload + size;
+  while (end - payload >= 4) {
+    uint32 keySize;
+    unserialize4(keySize, payload);
+    payload += 4;
+    if ((size_t)(end - payload) < keySize) break;
+    key.assign(reinterpret_cast<const char*>(payload), keySize);
+    payload += keySize;
+    Entries::iterator i = entries.find(key);
+    if (i == entries.end()) continue;
+    Ubyte* entry = &i->second[0];
+    uint32 access;
+    unserialize4(access, entry + CacheFile::ACCESS);
+    if (before(access, now - (uint32)TOUCH_INTERVAL) && cacheFile != 0)
+      dirty.push_back(key);
+    serialize4(now, entry + CacheFile::ACCESS);
+    CacheClient::appendItem(c.out, key.data(), key.size());
+    CacheClient::appendItem(c.out, reinterpret_cast<const char*>(entry),
+                            i->second.size());
+  }
+  CacheClient::endMessage(c.out, start);
+  if (c.out.size() - start > CacheClient::MAX_MESSAGE) {
+    // The client would reject this, so only return the header
+    c.out.resize(start + CacheClient::HEADER);
+    CacheClient::endMessage(c.out, start);
+  }
+}
+
+void CacheServer::insert(const Ubyte* payload, size_t size) {
+  string key;
+  const Ubyte* end = payload + size;
+  uint32 now = (uint32)time(0);
+  while (end - payload >= 4) {
+    uint32 keySize, entrySize;
+    unserialize4(keySize, payload);
+    payload += 4;
+    if ((size_t)(end - payload) < keySize + (size_t)4) break;
+    key.assign(reinterpret_cast<const char*>(payload), keySize);
+    payload += keySize;
+    unserialize4(entrySize, payload);
+    payload += 4;
+    if ((size_t)(end - payload) < entrySize) break;
+    if (entrySize >= CacheFile::USER_DATA) {
+      vector<Ubyte>& entry = entries[key];
+      entry.assign(payload, payload + entrySize);
+      serialize4(now, &entry[CacheFile::ACCESS]);
+      if (cacheFile != 0) dirty.push_back(key);
+    }
+    payload += entrySize;
+  }
+}
+//________________________________________
+
+namespace {
+  // Sort keys and remove duplicates
+  void sortUnique(vector<string>& v) {
+    sort(v.begin(), v.end());
+    v.erase(unique(v.begin(), v.end()), v.end());
+  }
+}
+
+void CacheServer::flush() {
+  lastFlush = time(0);
+  if (dirty.empty() || cacheFile == 0) return;
+  sortUnique(dirty); // libdb is fastest if inserts are sorted by key
+  debug("Writing %1 entries", dirty.size());
+  for (vector<string>::iterator i = dirty.begin(), e = dirty.end();
+       i != e; ++i) {
+    Entries::iterator entry = entries.find(*i);
+    if (entry == entries.end()) continue; // Dropped meanwhile
+    const Ubyte* d = &entry->second[0];
+    time_t mtime;
+    unserialize4(mtime, d + CacheFile::MTIME);
+    uint64 fileSize;
+    unserialize6(fileSize, d + CacheFile::SIZE);
+    cacheFile->insert(d + CacheFile::USER_DATA,
+                      entry->second.size() - CacheFile::USER_DATA, *i,
+                      mtime, fileSize);
+  }
+  dirty.clear();
+  cacheFile->sync();
+}
+
+void CacheServer::expire() {
+  lastExpiry = time(0);
+  time_t expired = lastExpiry - cacheExpiry;
+  for (Entries::iterator i = entries.begin(); i != entries.end(); ) {
+    uint32 access;
+    unserialize4(access, &i->second[CacheFile::ACCESS]);
+    if (before(access, (uint32)expired)) {
+      debug("Expiring %1", i->first);
+      i = entries.erase(i);
+    } else {
+      ++i;
+    }
+  }
+  if (cacheFile == 0) return;
+  try {
+    flush();
+    cacheFile->expire(expired);
+  } catch (DbError e) {
+    reporter.error(e.message);
+  }
+}
+
+void CacheServer::drop(const string& key) {
+  if (entries.erase(key) > 0) debug("Dropped %1", key);
+}
+//______________________________________________________________________
+
+void CacheServer::dropDir(const string& keyPrefix) {
+  for (Entries::iterator i = entries.begin(); i != entries.end(); ) {
+    if (i->first.compare(0, keyPrefix.size(), keyPrefix) == 0)
+      i = entries.erase(i);
+    else
+      ++i;
+  }
+}
+
+#if HAVE_DIRWATCHER
+void CacheServer::watch(const string& dir) {
+  try {
+    if (watcher.get() == 0) watcher.reset(new DirWatcher());
+    watcher->watch(dir);
+  } catch (DirWatchError e) {
+    reporter.error(e.message);
+  }
+}
+#else
+void CacheServer::watch(const string&) { }
+#endif
+
+#endif /* HAVE_CACHESERVER */
@@ -0,0 +1,105 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Cache server of "jigdo-file cache-server"
+
+  Keeps all cache entries in memory and answers the requests of
+  CacheClient objects in other jigdo-file processes, see cacheclient.hh
+  for the protocol. If a cache file is given, its entries are loaded
+  at startup, and new entries are written to it.
+
+  The server can watch directories (e.g. a mirror's pool) with a
+  DirWatcher. If a file below them is modified, replaced or deleted, its
+  entry is dropped. This only saves memory and network traffic:
+  Clients compare each entry's mtime and file size with the file's,
+  like for a cache file. For a file below "/srv/mirror//debian", the
+  key of the entry is the part after "//", like in JigdoCache.
+
+*/
+
+#ifndef CACHESERVER_HH
+#define CACHESERVER_HH
+
+#include <config.h>
+
+#include <cacheclient.hh>
+#if HAVE_CACHESERVER
+
+#include <memory>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+#include <cachefile.hh>
+#include <dirwatcher.hh>
+#include <nocopy.hh>
+#include <scan.hh>
+//______________________________________________________________________
+
+/** Server for a cache which several jigdo-file processes use at the
+    same time. The methods throw DbError on errors. */
+class CacheServer : NoCopy {
+public:
+  /** Listen on the socket. If cacheFile is not null, it is read now
+      and new entries are written to it. Entries not accessed for
+      expiry seconds are removed, unless expiry is 0. */
+  CacheServer(const string& socketName, CacheFile* cacheFile,
+              time_t expiry, JigdoCache::ProgressReporter& pr);
+  /** Write any new entries to the cache file, remove the socket */
+  ~CacheServer();
+
+  /** Drop entries of files below dir if they change. Subdirectories
+      are watched, too. Does nothing without inotify support. */
+  void watch(const string& dir);
+
+  /** Answer requests until SIGINT or SIGTERM is received */
+  void run();
+
+  /** Number of entries in memory */
+  size_t size() const { return entries.size(); }
+
+private:
+  struct Client;
+  struct LoadAll;
+  struct WatchHandler;
+  typedef unordered_map<string, vector<Ubyte> > Entries;
+
+  void accept();
+  // Read from client, process complete messages. False if it is gone.
+  bool receive(Client& c);
+  bool send(Client& c);
+  bool process(Client& c, uint32 type, const Ubyte* payload, size_t size);
+  void lookup(Client& c, const Ubyte* payload, size_t size);
+  void insert(const Ubyte* payload, size_t size);
+  void flush(); // Write new entries to the cache file
+  void expire();
+  void drop(const string& key);
+  void dropDir(const string& keyPrefix);
+
+  static const size_t READ_SIZE = 64 * 1024;
+  static const time_t FLUSH_INTERVAL = 10;
+  static const time_t EXPIRY_INTERVAL = 60 * 60;
+
+  string name;
+  int listenFd;
+  CacheFile* cacheFile;
+  time_t cacheExpiry;
+  JigdoCache::ProgressReporter& reporter;
+  Entries entries;
+  vector<string> dirty; // Keys of entries which flush() must write
+  vector<Client*> clients;
+  time_t lastFlush, lastExpiry;
+# if HAVE_DIRWATCHER
+  unique_ptr<DirWatcher> watcher; // Null until watch() is first called
+# endif
+};
+//______________________________________________________________________
+
+#endif /* HAVE_CACHESERVER */
+#endif
@@ -81,6 +81,97 @@ int compat_rename(const char* src, const char* dst) {
 #endif
 //====================================================================
 
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE
+#include <algorithm>
+#include <fcntl.h>
+#if HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
+#if HAVE_LINUX_FS_H
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif
+#ifndef O_LARGEFILE
+#  define O_LARGEFILE 0
+#endif
+
+namespace {
+
+  // Don't ask the kernel for more than this at a time
+  const uint64 MAX_COPY = 1U << 30;
+
+# ifdef FICLONERANGE
+  /* Share the data blocks of src with dest. The destination offset must
+     be block-aligned, and so must the length unless the range extends to
+     the end of src. Returns nr of bytes cloned, i.e. either 0 or len,
+     possibly rounded down to a multiple of the block size. */
+  uint64 cloneRange(int in, int out, uint64 destOff, uint64 len) {
+    struct stat inInfo, outInfo;
+    if (fstat(in, &inInfo) != 0 || fstat(out, &outInfo) != 0
+        || inInfo.st_dev != outInfo.st_dev || outInfo.st_blksize <= 0)
+      return 0;
+    uint64 blockSize = outInfo.st_blksize;
+    if (destOff % blockSize != 0) return 0;
+    struct file_clone_range r;
+    r.src_fd = in;
+    r.src_offset = 0;
+    r.dest_offset = destOff;
+    /* If the range ends in the middle of a block, this only works at the
+       end of both files - else try again with the whole blocks. */
+    r.src_length = len;
+    if ((uint64)inInfo.st_size == len && ioctl(out, FICLONERANGE, &r) == 0)
+      return len;
+    r.src_length = len - len % blockSize;
+    if (r.src_length > 0 && ioctl(out, FICLONERANGE, &r) == 0)
+      return r.src_length;
+    return 0;
+  }
+# endif
+
+}
+
+uint64 compat_copyFile(const char* src, const char* dest, uint64 destOff,
+                       uint64 len) {
+  int in = open(src, O_RDONLY | O_LARGEFILE);
+  if (in == -1) return 0;
+  int out = open(dest, O_WRONLY | O_LARGEFILE);
+  if (out == -1) { close(in); return 0; }
+  uint64 done = 0;
+
+# ifdef FICLONERANGE
+  done = cloneRange(in, out, destOff, len);
+# endif
+
+# if HAVE_COPY_FILE_RANGE
+  while (done < len) {
+    loff_t inOff = done, outOff = destOff + done;
+    ssize_t n = copy_file_range(in, &inOff, out, &outOff,
+                                (size_t)min(len - done, MAX_COPY), 0);
+    if (n <= 0) break; // Error, or src shorter than len
+    done += n;
+  }
+# endif
+
+# if HAVE_SENDFILE
+  // sendfile() writes at the file position of out
+  if (done < len && lseek(out, destOff + done, SEEK_SET) != (off_t)-1) {
+    while (done < len) {
+      off_t inOff = done;
+      ssize_t n = sendfile(out, in, &inOff,
+                           (size_t)min(len - done, MAX_COPY));
+      if (n <= 0) break;
+      done += n;
+    }
+  }
+# endif
+
+  close(in);
+  if (close(out) != 0) return 0; // Can't be sure anything was written
+  return done;
+}
+#endif
+//====================================================================
+
 #if !WINDOWS && !HAVE_SETENV
 namespace {
   struct CmpTilEq {
@@ -146,6 +146,23 @@ int compat_compare(const string& s1, string::size_type pos1,
 #endif
 //______________________________________________________________________
 
+/** Copy len bytes from the start of file src to offset destOff of the
+    existing file dest, without passing the data through user space: The
+    data blocks are shared (reflinked) if the filesystem supports it,
+    otherwise the kernel copies them with copy_file_range() or
+    sendfile(). Returns the number of bytes copied. This is less than len
+    if src is too short, after an error or if none of the functions is
+    available - the caller should then copy the rest itself. */
+#if HAVE_COPY_FILE_RANGE || HAVE_SENDFILE
+uint64 compat_copyFile(const char* src, const char* dest, uint64 destOff,
+                       uint64 len);
+#else
+inline uint64 compat_copyFile(const char*, const char*, uint64, uint64) {
+  return 0;
+}
+#endif
+//______________________________________________________________________
+
 #if HAVE_LIBDB
 #  include <db.h>
 // v3, v4.0:
@@ -0,0 +1,82 @@
+# Test jigdo-file fetch with file: URIs, which libcurl reads directly:
+# Rejection of corrupt parts, resuming a .tmp file, fetching from scratch
+set -e
+rm -rf fetch-testdir
+mkdir fetch-testdir
+cd fetch-testdir
+
+jf="../jigdo-file"
+if test "$1" = "all"; then
+    args="--report=noprogress"
+else
+    args="--report=quiet --debug=~general"
+fi
+if $jf fetch $args 2>&1 | grep -q "without libcurl"; then
+    echo "fetch-test.sh: jigdo-file compiled without libcurl, skipped"
+    cd ..; rm -rf fetch-testdir; exit 0
+fi
+
+random() {
+    ../util/random "$@"
+}
+
+# Files f1 to f6 (f6 occurs twice in the image), good and bad mirror
+mkdir -p pool/a good bad/a
+i=0
+for s in 3k 70k 131k 300k 1k 40k; do
+    i=`expr $i + 1`
+    random $s >pool/a/f$i
+done
+random 777 >image
+cat pool/a/f1 pool/a/f2 pool/a/f6 >>image
+random 5k >>image
+cat pool/a/f3 pool/a/f4 pool/a/f6 pool/a/f5 >>image
+random 100 >>image
+cp -r pool/a good/
+cp pool/a/f1 bad/a/f1
+# f2: one byte changed, f3: too long, f4: too short, f5/f6 missing
+cp pool/a/f2 bad/a/f2
+printf X | dd of=bad/a/f2 bs=1 seek=100 conv=notrunc 2>/dev/null
+cp pool/a/f3 bad/a/f3; random 10 >>bad/a/f3
+dd if=pool/a/f4 of=bad/a/f4 bs=1k count=1 2>/dev/null
+dir=`pwd`
+
+$jf make-template $args --image=image --jigdo=image.jigdo \
+    --template=image.template --label Pool=pool \
+    --uri Pool=file:$dir/bad/ pool//
+
+# Only the bad mirror: Soft failure, the .tmp file contains f1
+if $jf fetch $args --image=out --jigdo=image.jigdo \
+    --template=image.template 2>log; then
+    echo "FAILED: fetch from bad mirror succeeded"; exit 1
+else
+    test $? = 1
+fi
+grep -q "does not match checksum" log
+grep -q "file is too long" log
+grep -q "file is too short" log
+test -f out.tmp -a ! -f out
+test `$jf ls --template=out.tmp 2>/dev/null | grep -c "^have-file"` = 1
+
+# Good mirror added, 2 transfers at a time: Resumes the .tmp file
+$jf fetch $args --max-transfers=2 --image=out --jigdo=image.jigdo \
+    --template=image.template --uri Pool=file:$dir/good/ 2>log
+cmp image out
+test ! -f out.tmp
+rm -f out
+
+# From scratch
+$jf fetch $args --image=out --jigdo=image.jigdo \
+    --template=image.template --uri Pool=file:$dir/good/ 2>log
+cmp image out
+test ! -f out.tmp
+rm -f out
+
+# Layout in 1k steps, so only 256k of downloaded data may be buffered
+$jf fetch $args --readbuffer=1k --image=out --jigdo=image.jigdo \
+    --template=image.template --uri Pool=file:$dir/good/ 2>log
+cmp image out
+test ! -f out.tmp
+
+cd ..
+rm -rf fetch-testdir
@@ -0,0 +1,381 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Download the missing parts of an image straight into its .tmp file
+
+*/
+
+#include <config.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <fetch.hh>
+//______________________________________________________________________
+
+void FetchParts::ProgressReporter::fetching(uint64, uint64, size_t) { }
+//______________________________________________________________________
+
+#if HAVE_LIBCURL
+
+#include <unistd-jigdo.h>
+
+#include <curl/curl.h>
+
+#include <debug.hh>
+#include <log.hh>
+#include <mimestream.hh>
+#include <string.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("fetch")
+
+/* The URIs of a MakeImage::Part. If the same file occurs several times
+   in the image, it is only downloaded once; MakeImage writes it to all
+   its offsets. */
+struct FetchParts::Part {
+  explicit Part(size_t n) : index(n), uris(), nextUri(0) { }
+  size_t index; // Nr of the part in image
+  vector<string> uris; // In order of preference
+  size_t nextUri; // Index of URI for the next attempt
+};
+
+// One running download of a Part
+struct FetchParts::Transfer {
+  Transfer(FetchParts* f, Part* p)
+    : self(f), part(p), curl(0), uri(0), tooLong(false), paused(false) {
+    curlError[0] = '\0';
+  }
+  FetchParts* self;
+  Part* part;
+  CURL* curl;
+  const string* uri;
+  bool tooLong; // Server sent more than the part's size
+  bool paused; // writeData() refused data because the image buffer is full
+  char curlError[CURL_ERROR_SIZE];
+};
+//______________________________________________________________________
+
+namespace {
+
+  string userAgent;
+
+  /* libcurl only understands "file://" with an absolute path, not the
+     "file:/x/y" or relative "file:y" which jigdo-file uses */
+  string curlUri(const string& uri) {
+    if (uri.compare(0, 5, "file:") != 0 || uri.compare(0, 7, "file://") == 0)
+      return uri;
+    string result = "file://";
+    if (uri.length() == 5 || uri[5] != '/') {
+      char cwd[4096];
+      if (getcwd(cwd, sizeof(cwd)) != 0) { result += cwd; result += '/'; }
+    }
+    result.append(uri, 5, string::npos);
+    return result;
+  }
+
+}
+//______________________________________________________________________
+
+FetchParts::FetchParts(JigdoConfig& jc, ProgressReporter& pr,
+                       unsigned maxT)
+  : config(jc), reporter(pr), maxTransfers(maxT > 0 ? maxT : 1),
+    maxPerHost(0), http2(false), multi(0), share(0), idle(), image(),
+    parts(), queue(), transfers(), failed(0), unsaved(0),
+    writeError(), bytesDone(0), bytesTotal(0), nextReport(0) {
+  image.setReporter(&pr);
+  curl_global_init(CURL_GLOBAL_ALL);
+  if (userAgent.empty()) {
+    userAgent = "jigdo-file/" JIGDO_VERSION " ";
+    const char* p = curl_version();
+    while (*p != ' ' && *p != '\0') userAgent += *p++;
+  }
+}
+
+FetchParts::~FetchParts() {
+  for (vector<Transfer*>::iterator i = transfers.begin(),
+         e = transfers.end(); i != e; ++i) {
+    curl_multi_remove_handle(static_cast<CURLM*>(multi), (*i)->curl);
+    curl_easy_cleanup((*i)->curl);
+    delete *i;
+  }
+  for (vector<void*>::iterator i = idle.begin(), e = idle.end(); i != e; ++i)
+    curl_easy_cleanup(static_cast<CURL*>(*i));
+  for (vector<Part*>::iterator i = parts.begin(), e = parts.end();
+       i != e; ++i)
+    delete *i;
+  if (multi != 0) curl_multi_cleanup(static_cast<CURLM*>(multi));
+  if (share != 0) curl_share_cleanup(static_cast<CURLSH*>(share));
+  curl_global_cleanup();
+}
+//______________________________________________________________________
+
+/* Look up a query (e.g. "MyServer:foo/path/bar") in the JigdoConfig
+   mapping, add all resulting URIs to part which it does not have yet.
+   Without a mapping for its label, the query itself is the result -
+   ignore that if mappedOnly. */
+void FetchParts::addUris(Part* part, const string& query, bool mappedOnly) {
+  JigdoConfig::Lookup l(config, query);
+  string uri;
+  while (l.next(uri)) {
+    if (mappedOnly && uri == query) continue;
+    uri = curlUri(uri);
+    if (find(part->uris.begin(), part->uris.end(), uri) == part->uris.end())
+      part->uris.push_back(uri);
+  }
+}
+
+// Collect all URIs for the file with the given checksum, like pma
+void FetchParts::partUris(Part* part, const string& sum, const char* label) {
+  vector<string> words;
+  size_t off;
+  for (ConfigFile::Find f(&config.configFile(), "Parts", sum, &off);
+       !f.finished(); off = f.next()) {
+    words.clear();
+    ConfigFile::split(words, *f.label(), off);
+    addUris(part, words[0], false);
+  }
+  // Last resort: "MD5Sum:<md5sum>" label line
+  addUris(part, label + sum, true);
+}
+//________________________________________
+
+int FetchParts::findParts() {
+  int noUris = 0;
+  for (size_t n = 0; n < image.partCount(); ++n) {
+    const MakeImage::Part& ip = image.part(n);
+    Base64String b64;
+    if (ip.sha)
+      b64.write(ip.sha256.sum, 32).flush();
+    else
+      b64.write(ip.md5.sum, 16).flush();
+
+    Part* p = new Part(n);
+    parts.push_back(p);
+    partUris(p, b64.result(), ip.sha ? "SHA256Sum:" : "MD5Sum:");
+    debug("Part %1: %2 bytes, %3 URIs", b64.result(), ip.size,
+          p->uris.size());
+    if (p->uris.empty()) {
+      reporter.error(subst(_("No URI known for the file with checksum "
+                             "%1"), b64.result()));
+      ++noUris;
+    } else {
+      queue.push_back(p);
+      bytesTotal += ip.size;
+    }
+  }
+  return noUris;
+}
+//______________________________________________________________________
+
+bool FetchParts::startTransfer() {
+  if (queue.empty()) return false;
+  Part* p = queue.front();
+  queue.pop_front();
+  Paranoid(p->nextUri < p->uris.size());
+
+  Transfer* t = new Transfer(this, p);
+  t->uri = &p->uris[p->nextUri++];
+  if (idle.empty()) {
+    t->curl = curl_easy_init();
+  } else {
+    t->curl = static_cast<CURL*>(idle.back());
+    idle.pop_back();
+  }
+  if (t->curl == 0) {
+    delete t;
+    throw Error(_("Could not initialize libcurl"));
+  }
+  debug("Start %1", *t->uri);
+  CURL* c = t->curl;
+  curl_easy_setopt(c, CURLOPT_URL, t->uri->c_str());
+  curl_easy_setopt(c, CURLOPT_ERRORBUFFER, t->curlError);
+  curl_easy_setopt(c, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(c, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(c, CURLOPT_AUTOREFERER, 1L);
+  curl_easy_setopt(c, CURLOPT_USERAGENT, userAgent.c_str());
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, writeData);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, t);
+  curl_easy_setopt(c, CURLOPT_PRIVATE, t);
+  if (share != 0) curl_easy_setopt(c, CURLOPT_SHARE, share);
+# if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+  if (http2) {
+    curl_easy_setopt(c, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    // Wait for a connection being set up, it can probably be multiplexed
+    curl_easy_setopt(c, CURLOPT_PIPEWAIT, 1L);
+  }
+# endif
+  transfers.push_back(t);
+  curl_multi_add_handle(static_cast<CURLM*>(multi), c);
+  return true;
+}
+//________________________________________
+
+/* libcurl callback: Pass data to the image, which checksums it.
+   Returning less than size*nmemb aborts the transfer. */
+size_t FetchParts::writeData(char* data, size_t size, size_t nmemb,
+                             void* transfer) {
+  Transfer* t = static_cast<Transfer*>(transfer);
+  FetchParts* self = t->self;
+  size_t index = t->part->index;
+  const MakeImage::Part& p = self->image.part(index);
+  size_t n = size * nmemb;
+  if (n > p.size - p.received) { t->tooLong = true; return 0; }
+
+# if LIBCURL_VERSION_NUM >= 0x071200 /* 7.18.0 */
+  /* The image buffers too much data which is not laid out yet: Leave
+     this data with libcurl, which stops receiving until run() has
+     written the buffers and unpaused the transfer. libcurl passes the
+     same data again then. libcurl cannot pause file: URIs, their data
+     is always accepted. */
+  if (self->image.bufferFull() && t->uri->compare(0, 5, "file:") != 0) {
+    debug("Pause %1", *t->uri);
+    t->paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+# endif
+  try {
+    // Returns false once the buffer is full, the next call pauses
+    self->image.partData(index, reinterpret_cast<const Ubyte*>(data), n);
+  } catch (Error e) {
+    self->writeError = e.message;
+    return 0;
+  }
+  self->bytesDone += n;
+  return n;
+}
+//________________________________________
+
+void FetchParts::transferDone(Transfer* t, int code) {
+  CURLM* m = static_cast<CURLM*>(multi);
+  curl_multi_remove_handle(m, t->curl);
+  // Keeps the handle's connection, see startTransfer()
+  curl_easy_reset(t->curl);
+  idle.push_back(t->curl);
+  for (vector<Transfer*>::iterator i = transfers.begin(),
+         e = transfers.end(); i != e; ++i)
+    if (*i == t) { transfers.erase(i); break; }
+  unique_ptr<Transfer> tDel(t);
+  if (!writeError.empty()) return;
+  Part* p = t->part;
+  uint64 got = image.part(p->index).received;
+
+  string err; // Empty => success
+  if (t->tooLong) {
+    err = _("file is too long");
+  } else if (code != CURLE_OK) {
+    err = (t->curlError[0] != '\0' ? t->curlError
+           : curl_easy_strerror(static_cast<CURLcode>(code)));
+  }
+  if (!err.empty()) {
+    image.partFailed(p->index);
+  } else {
+    // Checks length and checksums, marks the part as written if OK
+    const char* wrong = image.partFinished(p->index);
+    if (wrong != 0) err = wrong;
+  }
+  if (err.empty()) {
+    debug("Done %1", *t->uri);
+    ++unsaved;
+    return;
+  }
+
+  // Failed; the part's data was discarded, try next URI
+  reporter.error(subst(_("Download of `%1' failed (%2)"), *t->uri, err));
+  bytesDone -= got;
+  if (p->nextUri < p->uris.size())
+    queue.push_back(p);
+  else
+    ++failed;
+}
+//______________________________________________________________________
+
+int FetchParts::run(const string& imageFile, const string& imageTmpFile,
+                    const string& templFile, bool force) {
+  image.open(imageTmpFile, templFile, force);
+  failed = findParts();
+  reporter.info(subst(_("Fetching %1 files (%2 bytes), up to %3 at a time"),
+                      queue.size(), bytesTotal, maxTransfers));
+  //____________________
+
+  CURLM* m = curl_multi_init();
+  multi = m;
+  if (m == 0) throw Error(_("Could not initialize libcurl"));
+# if LIBCURL_VERSION_NUM >= 0x071e00 /* 7.30.0 */
+  curl_multi_setopt(m, CURLMOPT_MAX_HOST_CONNECTIONS, (long)maxPerHost);
+# endif
+# if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+  curl_multi_setopt(m, CURLMOPT_PIPELINING,
+                    http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+# endif
+  CURLSH* sh = curl_share_init();
+  share = sh;
+  if (sh != 0) {
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+  while (writeError.empty()) {
+    while (transfers.size() < maxTransfers && startTransfer()) { }
+    /* Downloads run while a new .tmp file is laid out. If they are
+       faster than the disc, stop receiving until the buffered data has
+       been written. */
+    bool layout = image.work();
+    while (image.bufferFull() && image.work()) { }
+# if LIBCURL_VERSION_NUM >= 0x071200 /* 7.18.0 */
+    for (size_t i = 0; i < transfers.size() && !image.bufferFull(); ++i) {
+      Transfer* t = transfers[i];
+      if (!t->paused) continue;
+      // Can call writeData() immediately, which may pause it again
+      t->paused = false;
+      curl_easy_pause(t->curl, CURLPAUSE_CONT);
+    }
+# endif
+    if (transfers.empty()) {
+      if (layout) continue;
+      break;
+    }
+
+    int running;
+    curl_multi_perform(m, &running);
+    CURLMsg* msg;
+    int msgsLeft;
+    while (writeError.empty()
+           && (msg = curl_multi_info_read(m, &msgsLeft)) != 0) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      Transfer* t;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &t);
+      transferDone(t, msg->data.result);
+    }
+
+    if (bytesDone >= nextReport) { // Keep user entertained
+      reporter.fetching(bytesDone, bytesTotal, queue.size()
+                        + transfers.size());
+      nextReport = bytesDone + REPORT_INTERVAL;
+    }
+    if (unsaved >= SAVE_INTERVAL && image.laidOut()) {
+      image.save();
+      unsaved = 0;
+    }
+    if (!transfers.empty()) curl_multi_wait(m, 0, 0, layout ? 0 : 1000, 0);
+  }
+  //____________________
+
+  if (!writeError.empty()) {
+    reporter.error(writeError);
+    image.save(); // The parts written so far are OK
+    return 3;
+  }
+  if (!image.finish(imageFile)) {
+    reporter.info(subst(_("%1 files could not be fetched - repeat command "
+                          "to try again"), failed));
+    return 1;
+  }
+  return 0;
+}
+
+#endif /* HAVE_LIBCURL */
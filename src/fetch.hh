@@ -0,0 +1,127 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Download the missing parts of an image straight into its .tmp file
+
+  The parts which the DESC section of the .tmp file lists as not yet
+  written are downloaded with libcurl, several at a time, and passed to
+  MakeImage as the data arrives. If the .tmp file does not exist yet,
+  MakeImage creates it while the first downloads are already running.
+  Only available if HAVE_LIBCURL.
+
+*/
+
+#ifndef FETCH_HH
+#define FETCH_HH
+
+#include <config.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <jigdoconfig.hh>
+#include <makeimage.hh>
+#include <nocopy.hh>
+//______________________________________________________________________
+
+/** Downloads the parts that a .tmp image file is still missing */
+class FetchParts : NoCopy {
+public:
+  class ProgressReporter;
+
+  /** @param jc Config from the .jigdo file, to look up URIs for parts
+      @param pr Receives progress reports and error messages
+      @param maxTransfers Maximum number of simultaneous downloads */
+  FetchParts(JigdoConfig& jc, ProgressReporter& pr, unsigned maxTransfers);
+  ~FetchParts();
+
+  /** Limit the nr of connections to the same host, 0 means no limit. If
+      all of a host's connections are busy, libcurl delays further
+      transfers from it. Call before run(). */
+  inline void setMaxPerHost(unsigned n);
+  /** Use HTTP/2 where possible, and multiplex transfers from the same
+      host over one connection. Call before run(). */
+  inline void setHttp2(bool h2);
+  /** See MakeImage::setLimits(). Transfers are paused while more than
+      bufferLimit bytes wait for the image to be laid out. Call before
+      run(). */
+  inline void setLimits(size_t readAmount, size_t bufferLimit);
+
+  /** Fetch all parts missing from imageTmpFile, creating it from the
+      template first if necessary. If the image is complete afterwards,
+      truncate it and rename it to imageFile. Throws Error if the .tmp
+      file cannot be used, see MakeImage::open().
+      @return 0 if image complete, 1 if some parts could not be
+      downloaded, 3 for errors which leave the .tmp file unusable */
+  int run(const string& imageFile, const string& imageTmpFile,
+          const string& templFile, bool force);
+
+  /** DESC section is rewritten after this many parts were fetched, so
+      little is lost if the program is interrupted */
+  static const unsigned SAVE_INTERVAL = 30;
+
+private:
+  struct Part;
+  struct Transfer;
+  static size_t writeData(char* data, size_t size, size_t nmemb,
+                          void* transfer);
+
+  /* Fill parts with the entries of files that are not yet written,
+     return nr of parts without any URI */
+  int findParts();
+  void partUris(Part* part, const string& sum, const char* label);
+  void addUris(Part* part, const string& query, bool mappedOnly);
+  // Start the next transfer if possible, return false if none left
+  bool startTransfer();
+  // Transfer has ended with status code, check the data
+  void transferDone(Transfer* t, int code);
+
+  JigdoConfig& config;
+  ProgressReporter& reporter;
+  unsigned maxTransfers;
+  unsigned maxPerHost;
+  bool http2;
+  void* multi; // CURLM*
+  void* share; // CURLSH*, DNS and TLS session cache for all transfers
+  /* CURL* handles of finished transfers. Reusing them saves setting up
+     new handles, and they keep their connection open for the next
+     transfer from the same server. */
+  vector<void*> idle;
+
+  MakeImage image;
+  vector<Part*> parts; // Same order as parts of image
+  deque<Part*> queue; // Parts waiting for their next download attempt
+  vector<Transfer*> transfers; // Currently running
+  unsigned failed; // Nr of parts whose URIs have all failed
+  unsigned unsaved; // Nr of parts fetched since last image.save()
+  string writeError; // Error writing to the image, give up
+  uint64 bytesDone, bytesTotal, nextReport;
+};
+//______________________________________________________________________
+
+/** Class allowing FetchParts to convey information back to the
+    caller. The default versions of the methods print errors to cerr
+    and do nothing for progress reports. */
+class FetchParts::ProgressReporter : public MakeImage::ProgressReporter {
+public:
+  /** Called regularly while data arrives.
+      @param done Nr of bytes fetched so far, excluding failed attempts
+      @param total Total nr of bytes of missing parts
+      @param partsLeft Nr of parts not fetched yet */
+  virtual void fetching(uint64 done, uint64 total, size_t partsLeft);
+};
+//______________________________________________________________________
+
+void FetchParts::setMaxPerHost(unsigned n) { maxPerHost = n; }
+void FetchParts::setHttp2(bool h2) { http2 = h2; }
+void FetchParts::setLimits(size_t readAmount, size_t bufferLimit) {
+  image.setLimits(readAmount, bufferLimit);
+}
+
+#endif
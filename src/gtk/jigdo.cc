@@ -15,6 +15,7 @@
 #  include <unistd-jigdo.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <iostream>
 #include <string>
@@ -26,6 +27,7 @@
 #include <glibwww.hh>
 #include <gui.hh>
 #include <jobline.hh>
+#include <makeimagedl.hh>
 #include <proxyguess.hh>
 #include <string-utf.hh>
 #include <support.hh>
@@ -59,7 +61,8 @@ void tryHelp() {
 }
 
 enum {
-  LONGOPT_DEBUG = 0x100, LONGOPT_NODEBUG
+  LONGOPT_DEBUG = 0x100, LONGOPT_NODEBUG, LONGOPT_RANGES, LONGOPT_MAXPERHOST,
+  LONGOPT_HTTP2
 };
 
 inline void cmdOptions(int argc, char* argv[]) {
@@ -72,8 +75,11 @@ inline void cmdOptions(int argc, char* argv[]) {
     static const struct option longopts[] = {
       { "debug",              optional_argument, 0, LONGOPT_DEBUG },
       { "help",               no_argument,       0, 'h' },
+      { "http2",              no_argument,       0, LONGOPT_HTTP2 },
+      { "max-per-host",       required_argument, 0, LONGOPT_MAXPERHOST },
       { "no-debug",           no_argument,       0, LONGOPT_NODEBUG },
       { "proxy",              required_argument, 0, 'Y' },
+      { "ranges",             required_argument, 0, LONGOPT_RANGES },
       { "version",            no_argument,       0, 'v' },
       { 0, 0, 0, 0 }
     };
@@ -93,6 +99,29 @@ inline void cmdOptions(int argc, char* argv[]) {
       if (optarg) optDebug = optarg; else optDebug = "all";
       break;
     case LONGOPT_NODEBUG: optDebug.erase(); break;
+    case LONGOPT_RANGES: {
+      char* end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || n > 16) {
+        cerr << subst(_("%L1: Please specify a number between 0 and 16 "
+                        "after --ranges"), binaryName) << endl;
+        error = true;
+      }
+      Job::MakeImageDl::maxRanges = static_cast<unsigned>(n);
+      break;
+    }
+    case LONGOPT_MAXPERHOST: {
+      char* end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || n > 1024) {
+        cerr << subst(_("%L1: Please specify a number between 0 and 1024 "
+                        "after --max-per-host"), binaryName) << endl;
+        error = true;
+      }
+      Download::maxPerHost = static_cast<unsigned>(n);
+      break;
+    }
+    case LONGOPT_HTTP2: Download::http2 = true; break;
     case '?': error = true;
     case ':': break;
     default:
@@ -107,10 +136,17 @@ inline void cmdOptions(int argc, char* argv[]) {
     "Usage: %L1 [OPTIONS] [URL]\n"
     "Options:\n"
     "  -h  --help       Output help\n"
+    "  --http2          Use HTTP/2 if possible, and download several files\n"
+    "                   from the same server over one connection\n"
+    "  --max-per-host=NUMBER\n"
+    "                   Open at most NUMBER connections to the same\n"
+    "                   server, 0 for no limit [0]\n"
     "  -Y  --proxy=on/off/guess [guess]\n"
     "                   Turn proxy on (i.e. use env vars http_proxy,\n"
     "                   ftp_proxy, all_proxy) or off, or guess (from\n"
     "                   Mozilla/KDE/wget/lynx settings)\n"
+    "  --ranges=NUMBER  Fetch large files in up to NUMBER pieces at once,\n"
+    "                   from different servers if possible [1]\n"
     "  -v  --version    Output version info\n"
     "  --debug[=all|=UNIT1,UNIT2...|=help]\n"
     "                   Print debugging information for all units, or for\n"
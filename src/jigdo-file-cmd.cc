@@ -16,21 +16,33 @@
 
 #include <config.h>
 
+#include <algorithm>
 #include <fstream>
+#include <map>
 #include <memory>
+#include <poll.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd-jigdo.h>
 #include <errno.h>
 
+#include <cacheserver.hh>
 #include <compat.hh>
 #include <debug.hh>
+#include <dirwatcher.hh>
 #include <jigdo-file-cmd.hh>
+#include <mappedfile.hh>
 #include <mimestream.hh>
+#include <multidigest.hh>
 #include <recursedir.hh>
 #include <string.hh>
+#include <threadpool.hh>
 //______________________________________________________________________
 
+DEBUG_UNIT("jigdo-file-cmd")
+
 namespace {
 
 #if !HAVE_WORKING_FSTREAM /* ie istream and bistream are not the same */
@@ -74,6 +86,43 @@ istream* openForInput(istream*& dest, const string& name) {
   return dest;
 }
 
+/* copyAndDigest() callback for checksumImage() */
+class ReportReading {
+public:
+  ReportReading(MD5Sum::ProgressReporter& r, uint64 s)
+    : reporter(r), size(s), done(0), nextReport(REPORT_INTERVAL) { }
+  void operator()(size_t n) {
+    done += n;
+    if (done < nextReport) return;
+    reporter.readingChecksum(done, size);
+    nextReport += REPORT_INTERVAL;
+  }
+private:
+  MD5Sum::ProgressReporter& reporter;
+  uint64 size, done, nextReport;
+};
+
+/* Feed the first size bytes of the image to all checksums in digests,
+   reading them from imageMap if it is open, otherwise from image.
+   Returns true if the image is exactly size bytes long. */
+template <class Digests>
+bool checksumImage(Digests& digests, bistream& image,
+                   const MappedFile& imageMap, uint64 size,
+                   size_t readAmount, MD5Sum::ProgressReporter& pr) {
+  ReportReading report(pr, size);
+  if (imageMap.is_open()) {
+    // Small slices: All checksums work on data which is still in cache
+    digestMemory(imageMap.data(), min(size, imageMap.size()), readAmount,
+                 digests, report);
+    return imageMap.size() == size;
+  }
+  vector<Ubyte> buf(readAmount);
+  copyAndDigest(image, 0, size, &buf[0], readAmount, digests, report);
+  if (!image) return false;
+  image.get();
+  return image.eof();
+}
+
 /* Ensure that an output file is not already present. Should use this
    for all files before openForOutput() */
 int willOutputTo(const string& name, bool optForce,
@@ -121,6 +170,12 @@ ostream* openForOutput(ostream*& dest, const string& name) {
   }
 }
 
+// Digest family needed for MkTemplate::CHECK_MD5 or CHECK_SHA256
+unsigned checksumDigests(int checksumChoice) {
+  return (checksumChoice == MkTemplate::CHECK_SHA256 ?
+          FilePart::SHA256_DIGEST : FilePart::MD5_DIGEST);
+}
+
 } // local namespace
 //______________________________________________________________________
 
@@ -222,6 +277,8 @@ int JigdoFileCmd::makeTemplate() {
   // Open files
   bistream* image;
   unique_ptr<bistream> imageDel(openForInput(image, imageFile));
+  MappedFile imageMap; // If possible, scan the mapped file directly
+  imageMap.open(imageFile);
 
   unique_ptr<ConfigFile> cfDel(new ConfigFile());
   ConfigFile* cf = cfDel.get();
@@ -243,9 +300,14 @@ int JigdoFileCmd::makeTemplate() {
   unique_ptr<bostream> templDel(openForOutput(templ, templFile));
   //____________________
 
-  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
+  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter,
+                   optCacheMemory, optCacheFormat);
   cache.setParams(blockLength, csumBlockLength);
+  cache.setThreads(optThreads);
   cache.setCheckFiles(optCheckFiles);
+  // The --match-exec command is also passed the other checksum
+  if (optMatchExec.empty())
+    cache.setDigests(checksumDigests(optChecksumChoice));
   if (addLabels(cache)) return 3;
   while (true) {
     try { cache.readFilenames(fileNames); } // Recurse through directories
@@ -253,12 +315,20 @@ int JigdoFileCmd::makeTemplate() {
     break;
   }
   // Create and run MkTemplate operation
+  int zipQuality = optZipQuality;
+  /* -1 to -9 select zstd levels 1 to 9 (and -0 level 1). Higher levels
+     compress much more slowly for a small gain, use --zstd=N for them. */
+  if (optCompression == MkTemplate::COMPRESS_ZSTD)
+    zipQuality = (optZstdLevel != 0 ? optZstdLevel : max(optZipQuality, 1));
   unique_ptr<MkTemplate>
     op(new MkTemplate(&cache, image, &jc, templ, *optReporter,
-                      optZipQuality, readAmount, optAddImage, optAddServers,
-                      optBzip2, optChecksumChoice));
+                      zipQuality, readAmount, optAddImage, optAddServers,
+                      optCompression,
+                      (optChecksumChoice != 0 ? optChecksumChoice
+                                              : MkTemplate::CHECK_MD5)));
   op->setMatchExec(optMatchExec);
   op->setGreedyMatching(optGreedyMatching);
+  if (imageMap.is_open()) op->setImageMap(&imageMap);
   size_t lastDirSep = imageFile.rfind(DIRSEP);
   if (lastDirSep == string::npos) lastDirSep = 0; else ++lastDirSep;
   string imageFileLeaf(imageFile, lastDirSep);
@@ -291,8 +361,16 @@ int JigdoFileCmd::makeImage() {
   }
 
   if (imageFile != "-" && willOutputTo(imageFile, optForce) > 0) return 3;
-  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
+  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter,
+                   optCacheMemory, optCacheFormat);
   cache.setParams(blockLength, csumBlockLength);
+  // Only calculate the checksum type used by the template
+  cache.setDigests(0);
+  // Unless told otherwise, inflate template data on all CPUs
+  if (optThreads == 0 && imageFile != "-")
+    cache.setThreads(ThreadPool::cpus());
+  else
+    cache.setThreads(optThreads);
   while (true) {
     try { cache.readFilenames(fileNames); } // Recurse through directories
     catch (RecurseError e) { optReporter->error(e.message); continue; }
@@ -319,6 +397,80 @@ int JigdoFileCmd::makeImage() {
 }
 //______________________________________________________________________
 
+/* Like make-image, but always create the .tmp file, then download the
+   files that are still missing into it. */
+int JigdoFileCmd::fetchImage() {
+  if (imageFile.empty() || jigdoFile.empty() || templFile.empty()
+      || imageFile == "-") {
+    cerr << subst(_(
+      "%1 fetch: Not all of --image, --jigdo, --template specified.\n"
+      "(Attempt to deduce missing names failed.)\n"), binaryName);
+    exit_tryHelp();
+  }
+  if (templFile == "-") {
+    cerr << subst(_("%1 fetch: Sorry, cannot read template from standard "
+                    "input.\n"), binaryName);
+    exit_tryHelp();
+  }
+# if !HAVE_LIBCURL
+  optReporter->error(subst(_("%1 fetch: Not available, %1 was compiled "
+                             "without libcurl"), binaryName));
+  return 3;
+# else
+  if (willOutputTo(imageFile, optForce) > 0) return 3;
+
+  // Read .jigdo file
+  istream* jigdo;
+  unique_ptr<istream> jigdoDel(openForInput(jigdo, jigdoFile));
+  unique_ptr<ConfigFile> cfDel(new ConfigFile());
+  *jigdo >> *cfDel;
+  JigdoConfig jc(jigdoFile, cfDel.release(), *optReporter);
+  // Add any mappings specified on command line
+  if (!optUris.empty()) {
+    addUris(jc.configFile());
+    jc.rescan();
+  }
+
+  string imageTmpFile = imageFile;
+  imageTmpFile += EXTSEPS"tmp";
+
+  try {
+    /* Copy any files given on the command line to the image first.
+       Otherwise, FetchParts creates the .tmp file while downloading. */
+    if (!fileNames.empty()) {
+      JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter,
+                       optCacheMemory, optCacheFormat);
+      cache.setParams(blockLength, csumBlockLength);
+      cache.setDigests(0);
+      cache.setThreads(optThreads == 0 ? ThreadPool::cpus() : optThreads);
+      while (true) {
+        try { cache.readFilenames(fileNames); } // Recurse through dirs
+        catch (RecurseError e) { optReporter->error(e.message); continue; }
+        break;
+      }
+      bistream* templ;
+      unique_ptr<bistream> templDel(openForInput(templ, templFile));
+      int result = JigdoDesc::makeImage(&cache, imageFile, imageTmpFile,
+          templFile, templ, optForce, *optReporter, readAmount,
+          optMkImageCheck, true);
+      if (result == 0 || result >= 3) return result;
+    }
+    FetchParts fetch(jc, *optReporter, optMaxTransfers);
+    fetch.setMaxPerHost(optMaxPerHost);
+    fetch.setHttp2(optHttp2);
+    // Same ratio as MakeImage's defaults, 32MB for the default 128k
+    fetch.setLimits(readAmount, readAmount * (MakeImage::BUFFER_LIMIT
+                                              / MakeImage::READ_AMOUNT));
+    return fetch.run(imageFile, imageTmpFile, templFile, optForce);
+  } catch (Error e) {
+    string err = binaryName; err += " fetch: "; err += e.message;
+    optReporter->error(err);
+    return 3;
+  }
+# endif
+}
+//______________________________________________________________________
+
 int JigdoFileCmd::listTemplate() {
   if (templFile.empty()) {
     cerr << subst(_("%1 list-template: --template not specified.\n"),
@@ -371,6 +523,8 @@ int JigdoFileCmd::verifyImage() {
 
   bistream* image;
   unique_ptr<bistream> imageDel(openForInput(image, imageFile));
+  MappedFile imageMap; // If possible, checksum the mapped file directly
+  imageMap.open(imageFile);
 
   JigdoDescVec contents;
   JigdoDesc::ImageInfoMD5* info_md5 = 0;
@@ -391,46 +545,46 @@ int JigdoFileCmd::verifyImage() {
       return 3;
     }
 
-    // Attempt verification via SHA256 first if that's possible
+    // Find the image checksums; SHA256 is preferred if both are present
     for (JigdoDescVec::iterator i = contents.begin(); i != contents.end(); ++i) {
-      info_sha256 = dynamic_cast<JigdoDesc::ImageInfoSHA256*>(*i);
-      if (info_sha256) {
-        SHA256Sum md; // SHA256Sum of image
-        md.updateFromStream(*image, info_sha256->size(), readAmount, *optReporter);
-	md.finish();
-	if (*image) {
-          image->get();
-	  if (image->eof()) {
-            optReporter->info(subst("SHA256 from template: %1", info_sha256->sha256().toString()));
-            optReporter->info(subst("SHA256 from image:    %1", md.toString()));
-	    if (md == info_sha256->sha256()) {
-              optReporter->info(_("OK: SHA256 Checksums match, image is good!"));
-	    return 0;
-	    }
-	  }
-	}
-      }
+      if (info_sha256 == 0)
+        info_sha256 = dynamic_cast<JigdoDesc::ImageInfoSHA256*>(*i);
+      if (info_md5 == 0)
+        info_md5 = dynamic_cast<JigdoDesc::ImageInfoMD5*>(*i);
     }
-
-    for (JigdoDescVec::iterator i = contents.begin(); i != contents.end(); ++i) {
-      info_md5 = dynamic_cast<JigdoDesc::ImageInfoMD5*>(*i);
-      if (info_md5) {
-        MD5Sum md; // MD5Sum of image
-	md.updateFromStream(*image, info_md5->size(), readAmount, *optReporter);
-	md.finish();
-	if (*image) {
-          image->get();
-	  if (image->eof()) {
-            optReporter->info(subst("MD5 from template: %1", info_md5->md5().toString()));
-            optReporter->info(subst("MD5 from image:    %1", md.toString()));
-            if (md == info_md5->md5()) {
-              optReporter->info(_("OK: MD5 Checksums match, image is good!"));
-	      optReporter->info(_("WARNING: MD5 is not considered a secure hash!"));
-	      optReporter->info(_("WARNING: It is recommended to verify your image in other ways too!"));
-	      return 0;
-	    }
-	  }
-	}
+    if (info_sha256 != 0 && info_md5 != 0
+        && info_md5->size() != info_sha256->size())
+      info_md5 = 0; // Can't check both in one pass, shouldn't happen anyway
+
+    // Calculate all of them in a single pass over the image
+    SHA256Sum sd; // SHA256Sum of image
+    MD5Sum md; // MD5Sum of image
+    MultiDigest<SHA256Sum, MD5Sum> digests(info_sha256 != 0 ? &sd : 0,
+                                           info_md5 != 0 ? &md : 0);
+    if ((info_sha256 != 0 || info_md5 != 0)
+        && checksumImage(digests, *image, imageMap,
+                         (info_sha256 != 0 ? info_sha256->size()
+                                           : info_md5->size()),
+                         readAmount, *optReporter)) {
+      if (info_sha256 != 0) {
+        sd.finish();
+        optReporter->info(subst("SHA256 from template: %1", info_sha256->sha256().toString()));
+        optReporter->info(subst("SHA256 from image:    %1", sd.toString()));
+        if (sd == info_sha256->sha256()) {
+          optReporter->info(_("OK: SHA256 Checksums match, image is good!"));
+          return 0;
+        }
+      }
+      if (info_md5 != 0) {
+        md.finish();
+        optReporter->info(subst("MD5 from template: %1", info_md5->md5().toString()));
+        optReporter->info(subst("MD5 from image:    %1", md.toString()));
+        if (md == info_md5->md5()) {
+          optReporter->info(_("OK: MD5 Checksums match, image is good!"));
+          optReporter->info(_("WARNING: MD5 is not considered a secure hash!"));
+          optReporter->info(_("WARNING: It is recommended to verify your image in other ways too!"));
+          return 0;
+        }
       }
     }
     if (info_sha256 == 0 && info_md5 == 0) {
@@ -510,13 +664,27 @@ int JigdoFileCmd::printMissing(Command command) {
     jc.rescan();
   }
 
+  /* If files were given on the command line, do not list parts which
+     are present among them */
+  unique_ptr<JigdoCache> cache;
+  if (!fileNames.empty()) {
+    cache.reset(new JigdoCache(cacheFile, optCacheExpiry, readAmount,
+                               *optReporter, optCacheMemory,
+                               optCacheFormat));
+    cache->setParams(blockLength, csumBlockLength);
+    cache->setDigests(0);
+    while (true) {
+      try { cache->readFilenames(fileNames); } // Recurse through directories
+      catch (RecurseError e) { optReporter->error(e.message); continue; }
+      break;
+    }
+  }
+
   set<MD5> MD5sums;
   set<SHA256> SHA256sums;
   try {
-    JigdoDesc::listMissingMD5(MD5sums, imageTmpFile, templFile, templ,
-                              *optReporter);
-    JigdoDesc::listMissingSHA256(SHA256sums, imageTmpFile, templFile, templ,
-                                 *optReporter);
+    JigdoDesc::listMissing(MD5sums, SHA256sums, imageTmpFile, templFile,
+                           templ, *optReporter, cache.get());
   } catch (Error e) {
     string err = subst(_("%1 print-missing: %2"), binaryName, e.message);
     optReporter->error(err);
@@ -642,6 +810,106 @@ int JigdoFileCmd::printMissing(Command command) {
 }
 //______________________________________________________________________
 
+#if HAVE_DIRWATCHER
+namespace {
+
+  volatile sig_atomic_t stopRequested = 0;
+  extern "C" void stopWatching(int) { stopRequested = 1; }
+
+  /* Files and directories to scan again for "scan --watch", with the
+     time of the last change to each */
+  struct ScanPending : DirWatcher::Handler {
+    ScanPending() : paths(), overflowed(false) { }
+    void fileChanged(const string& path) { paths[path] = time(0); }
+    void fileRemoved(const string& path) { paths.erase(path); }
+    void dirAdded(const string& path) { paths[path] = time(0); }
+    void dirRemoved(const string& path) {
+      paths.erase(path);
+      string prefix = path;
+      prefix += DIRSEP;
+      map<string, time_t>::iterator i = paths.lower_bound(prefix);
+      while (i != paths.end()
+             && i->first.compare(0, prefix.size(), prefix) == 0)
+        paths.erase(i++);
+    }
+    void overflow() { overflowed = true; }
+    map<string, time_t> paths;
+    bool overflowed;
+  };
+
+  /* Only scan a file once no change was seen for this long, so a file
+     which is being written is not read over and over again */
+  const time_t SETTLE_TIME = 2;
+
+  /* Wait until some of the pending paths have not changed for
+     SETTLE_TIME, move them to ready. Returns false once SIGINT or
+     SIGTERM was received. */
+  bool waitForChanges(DirWatcher& watcher, ScanPending& pending,
+                      const vector<string>& watchDirs,
+                      JigdoCache::ProgressReporter& reporter,
+                      vector<string>& ready) {
+    ready.clear();
+    while (stopRequested == 0) {
+      struct pollfd p;
+      p.fd = watcher.fd(); p.events = POLLIN; p.revents = 0;
+      int n = poll(&p, 1, 1000);
+      if (n < 0 && errno != EINTR) {
+        reporter.error(subst(_("Cannot watch files: %L1"), strerror(errno)));
+        return false;
+      }
+      if (n > 0) {
+        try {
+          watcher.readEvents(pending);
+        } catch (DirWatchError e) {
+          reporter.error(e.message);
+        }
+      }
+      if (pending.overflowed) {
+        // Changes were lost, check everything against the cache
+        reporter.info(_("Too many changes, scanning all files again"));
+        pending.overflowed = false;
+        pending.paths.clear();
+        for (vector<string>::const_iterator i = watchDirs.begin(),
+               e = watchDirs.end(); i != e; ++i)
+          pending.paths[*i] = 0;
+      }
+
+      time_t settled = time(0) - SETTLE_TIME;
+      map<string, time_t>::iterator i = pending.paths.begin();
+      while (i != pending.paths.end()) {
+        if (i->second > settled) { ++i; continue; }
+        struct stat fileInfo;
+        if (lstat(i->first.c_str(), &fileInfo) == 0) // Not gone again
+          ready.push_back(i->first);
+        pending.paths.erase(i++);
+      }
+      if (!ready.empty()) return true;
+    }
+    return false;
+  }
+
+}
+#endif
+//______________________________________________________________________
+
+/* Read all files in names (and below the directories in it), so their
+   checksums end up in the cache */
+void JigdoFileCmd::scanCache(JigdoCache& cache, RecurseDir& names) {
+  // By default, prepare the cache for both checksum types
+  if (optChecksumChoice != 0)
+    cache.setDigests(checksumDigests(optChecksumChoice));
+  while (true) {
+    try { cache.readFilenames(names); } // Recurse through directories
+    catch (RecurseError e) { optReporter->error(e.message); continue; }
+    break;
+  }
+  /* Cause entire file to be read, or only the first checksum block
+     if not scanning the whole file. This happens in parallel if
+     --threads was given, and the loop only needs to wait for it. */
+  JigdoCache::ReadAhead files(&cache, optScanWholeFile);
+  while (files.next() != 0) { }
+}
+
 // Enter all file arguments into the cache
 int JigdoFileCmd::scanFiles() {
   if (cacheFile.empty()) {
@@ -650,32 +918,71 @@ int JigdoFileCmd::scanFiles() {
     exit_tryHelp();
   }
 
-  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
-  cache.setParams(blockLength, csumBlockLength);
-  if (addLabels(cache)) return 3;
-  while (true) {
-    try { cache.readFilenames(fileNames); } // Recurse through directories
-    catch (RecurseError e) { optReporter->error(e.message); continue; }
-    break;
-  }
-  JigdoCache::iterator ci = cache.begin(), ce = cache.end();
-  if (optScanWholeFile) {
-    // Cause entire file to be read
-    while (ci != ce) {
-      ci->getMD5Sum(&cache);
-      ci->getSHA256Sum(&cache);
-      ++ci;
-    }
-  } else {
-    // Only cause first checksum block to be read; not scanning the whole file
-    while (ci != ce) {
-      ci->getMD5Sums(&cache, 0);
-      ci->getSHA256Sums(&cache, 0);
-      ++ci;
+# if HAVE_DIRWATCHER
+  /* With --watch, start watching before the first scan, so changes
+     made while it runs are not missed */
+  unique_ptr<DirWatcher> watcher;
+  if (optWatch) {
+    try {
+      watcher.reset(new DirWatcher());
+      for (vector<string>::iterator i = watchDirs.begin(),
+             e = watchDirs.end(); i != e; ++i) {
+        struct stat fileInfo;
+        if (stat(i->c_str(), &fileInfo) == 0 && S_ISDIR(fileInfo.st_mode))
+          watcher->watch(*i);
+      }
+    } catch (DirWatchError e) {
+      optReporter->error(e.message);
+      return 3;
     }
   }
+# else
+  if (optWatch) {
+    optReporter->error(_("Sorry, this version of jigdo-file was compiled "
+                         "without support for --watch"));
+    return 3;
+  }
+# endif
+
+  {
+    JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter,
+                     optCacheMemory, optCacheFormat);
+    cache.setParams(blockLength, csumBlockLength);
+    cache.setThreads(optThreads);
+    if (addLabels(cache)) return 3;
+    scanCache(cache, fileNames);
+    // Cache data is written out when the JigdoCache is destroyed
+  }
+  if (!optWatch) return 0;
+
+# if HAVE_DIRWATCHER
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stopWatching; // No SA_RESTART, poll() is interrupted
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+
+  optReporter->info(subst(_("Watching %1 directories for changes"),
+                          watcher->size()));
+  ScanPending pending;
+  vector<string> changed;
+  while (waitForChanges(*watcher, pending, watchDirs, *optReporter,
+                        changed)) {
+    debug("Scanning %1 changed files/directories", changed.size());
+    RecurseDir names;
+    for (vector<string>::iterator i = changed.begin(), e = changed.end();
+         i != e; ++i)
+      names.addFile(*i);
+    // Entries are only expired by the first scan
+    JigdoCache cache(cacheFile, 0, readAmount, *optReporter,
+                     optCacheMemory, optCacheFormat);
+    cache.setParams(blockLength, csumBlockLength);
+    cache.setThreads(optThreads);
+    scanCache(cache, names);
+  }
+# endif
   return 0;
-  // Cache data is written out when the JigdoCache is destroyed
 }
 //______________________________________________________________________
 
@@ -685,9 +992,12 @@ int JigdoFileCmd::scanFiles() {
    print out the part of any filename following any "//". This is
    actually very similar to scanFiles() above. */
 int JigdoFileCmd::md5sumFiles() {
-  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
+  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter,
+                   optCacheMemory, optCacheFormat);
   cache.setParams(blockLength, csumBlockLength);
+  cache.setThreads(optThreads);
   cache.setCheckFiles(optCheckFiles);
+  cache.setDigests(FilePart::MD5_DIGEST);
   while (true) {
     try { cache.readFilenames(fileNames); } // Recurse through directories
     catch (RecurseError e) { optReporter->error(e.message); continue; }
@@ -696,21 +1006,20 @@ int JigdoFileCmd::md5sumFiles() {
 
   if (JigdoFileCmd::optHex) Base64String::hex = true;
 
-  JigdoCache::iterator ci = cache.begin(), ce = cache.end();
-  while (ci != ce) {
+  // Causes whole file to be read, maybe by several threads in parallel
+  JigdoCache::ReadAhead files(&cache, true);
+  while (FilePart* file = files.next()) {
     Base64String m;
-    // Causes whole file to be read
-    const MD5Sum* md = ci->getMD5Sum(&cache);
+    const MD5Sum* md = file->getMD5Sum(&cache);
     if (md != 0) {
       m.write(md->digest(), 16).flush();
       string& s(m.result());
       s += "  ";
-      if (ci->getPath() == "/") s += '/';
-      s += ci->leafName();
+      if (file->getPath() == "/") s += '/';
+      s += file->leafName();
       // Output checksum line
       optReporter->coutInfo(s);
     }
-    ++ci;
   }
   return 0;
   // Cache data is written out when the JigdoCache is destroyed
@@ -723,9 +1032,12 @@ int JigdoFileCmd::md5sumFiles() {
    print out the part of any filename following any "//". This is
    actually very similar to scanFiles() above. */
 int JigdoFileCmd::sha256sumFiles() {
-  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
+  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter,
+                   optCacheMemory, optCacheFormat);
   cache.setParams(blockLength, csumBlockLength);
+  cache.setThreads(optThreads);
   cache.setCheckFiles(optCheckFiles);
+  cache.setDigests(FilePart::SHA256_DIGEST);
   while (true) {
     try { cache.readFilenames(fileNames); } // Recurse through directories
     catch (RecurseError e) { optReporter->error(e.message); continue; }
@@ -734,22 +1046,52 @@ int JigdoFileCmd::sha256sumFiles() {
 
   if (JigdoFileCmd::optHex) Base64String::hex = true;
 
-  JigdoCache::iterator ci = cache.begin(), ce = cache.end();
-  while (ci != ce) {
+  // Causes whole file to be read, maybe by several threads in parallel
+  JigdoCache::ReadAhead files(&cache, true);
+  while (FilePart* file = files.next()) {
     Base64String m;
-    // Causes whole file to be read
-    const SHA256Sum* md = ci->getSHA256Sum(&cache);
+    const SHA256Sum* md = file->getSHA256Sum(&cache);
     if (md != 0) {
       m.write(md->digest(), 32).flush();
       string& s(m.result());
       s += "  ";
-      if (ci->getPath() == "/") s += '/';
-      s += ci->leafName();
+      if (file->getPath() == "/") s += '/';
+      s += file->leafName();
       // Output checksum line
       optReporter->coutInfo(s);
     }
-    ++ci;
   }
   return 0;
   // Cache data is written out when the JigdoCache is destroyed
 }
+//______________________________________________________________________
+
+/* Keep the cache in memory for other jigdo-file processes which use
+   --cache-server, until killed. */
+int JigdoFileCmd::cacheServer() {
+# if HAVE_CACHESERVER
+  if (optCacheServer.empty()) {
+    cerr << subst(_("%1 cache-server: Please specify a --cache-server "
+                    "socket.\n"), binaryName);
+    exit_tryHelp();
+  }
+
+  unique_ptr<CacheFile> file;
+  if (!cacheFile.empty())
+    file.reset(new CacheFile(cacheFile.c_str(), optCacheMemory,
+                             optCacheFormat));
+  CacheServer server(optCacheServer, file.get(), optCacheExpiry,
+                     *optReporter);
+  for (vector<string>::iterator i = watchDirs.begin(), e = watchDirs.end();
+       i != e; ++i)
+    server.watch(*i);
+  optReporter->info(subst(_("Listening on `%L1', %2 cache entries"),
+                          optCacheServer, server.size()));
+  server.run();
+  return 0;
+# else
+  optReporter->error(_("Sorry, this version of jigdo-file was compiled "
+                       "without support for cache-server"));
+  return 3;
+# endif
+}
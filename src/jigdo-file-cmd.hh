@@ -22,6 +22,7 @@
 #include <iosfwd>
 #include <string>
 
+#include <fetch.hh>
 #include <jigdoconfig.hh>
 #include <scan.hh>
 #include <md5sum.hh>
@@ -37,7 +38,8 @@ struct AnyReporter : public MkTemplate::ProgressReporter,
                      public JigdoDesc::ProgressReporter,
                      public MD5Sum::ProgressReporter,
                      public SHA256Sum::ProgressReporter,
-                     public JigdoConfig::ProgressReporter {
+                     public JigdoConfig::ProgressReporter,
+                     public FetchParts::ProgressReporter {
   virtual void error(const string& message) {
     MD5Sum::ProgressReporter::error(message);
   }
@@ -56,9 +58,9 @@ class JigdoFileCmd {
   //________________________________________
 
   enum Command {
-    MAKE_TEMPLATE, MAKE_IMAGE,
+    MAKE_TEMPLATE, MAKE_IMAGE, FETCH,
     PRINT_MISSING, PRINT_MISSING_ALL,
-    SCAN, VERIFY, LIST_TEMPLATE, MD5SUM, SHA256SUM
+    SCAN, VERIFY, LIST_TEMPLATE, MD5SUM, SHA256SUM, CACHE_SERVER
   };
   //________________________________________
 
@@ -78,18 +80,29 @@ class JigdoFileCmd {
   static string jigdoMergeFile;
   static string cacheFile;
   static size_t optCacheExpiry; // Expiry time for cache in seconds
+  static size_t optCacheMemory; // Size of libdb's page cache
+  static CacheFile::Format optCacheFormat;
+  static string optCacheServer; // Socket of cache-server
+  // Directories given to cache-server or scan --watch
+  static vector<string> watchDirs;
   static vector<string> optLabels; // Strings of the form "Label=/some/path"
   static vector<string> optUris;   // "Label=http://some.server/"
   static size_t blockLength; // of rsync algorithm, is also minimum file size
   static size_t csumBlockLength;
   static size_t readAmount;
+  static unsigned optThreads; // Nr of threads, 0 if not specified
+  static unsigned optMaxTransfers; // Nr of simultaneous downloads for fetch
+  static unsigned optMaxPerHost; // fetch: connections per server, 0 = any
   static int optZipQuality;
-  static bool optBzip2;
-  static int optChecksumChoice;
+  static int optCompression; // MkTemplate::COMPRESS_*
+  static int optZstdLevel; // 1..22, 0 => derive from optZipQuality
+  static int optChecksumChoice; // MkTemplate::CHECK_*, 0 if not specified
   static bool optForce; // true => Silently delete existent output
+  static bool optHttp2; // fetch: multiplex transfers over HTTP/2
   static bool optMkImageCheck; // true => check checksums
   static bool optCheckFiles; // true => check if files exist
   static bool optScanWholeFile; // false => read only first block
+  static bool optWatch; // true => scan watchDirs again if files change
   // true => skip smaller matches if a larger match could be possible
   static bool optGreedyMatching;
   static bool optAddImage; // true => Add [Image] section to output .jigdo
@@ -114,12 +127,14 @@ class JigdoFileCmd {
   //@{
   static int makeTemplate();
   static int makeImage();
+  static int fetchImage();
   static int printMissing(Command command = PRINT_MISSING);
   static int scanFiles();
   static int verifyImage();
   static int listTemplate();
   static int md5sumFiles();
   static int sha256sumFiles();
+  static int cacheServer();
   //@}
 
   /** @name
@@ -127,6 +142,8 @@ class JigdoFileCmd {
       jigdo-file-cmd.cc */
   //@{
   static int addLabels(JigdoCache& cache);
+  static void scanCache(JigdoCache& cache, RecurseDir& names);
+  static int scanWatch();
   static void addUris(ConfigFile& config);
   static bool printMissing_lookup(JigdoConfig& jc, const string& query,
                                   bool printAll);
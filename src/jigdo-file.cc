@@ -37,6 +37,7 @@
 #include <recursedir.hh>
 #include <scan.hh>
 #include <string.hh>
+#include <threadpool.hh>
 //______________________________________________________________________
 
 RecurseDir JigdoFileCmd::fileNames;
@@ -46,18 +47,28 @@ string JigdoFileCmd::templFile;
 string JigdoFileCmd::jigdoMergeFile;
 string JigdoFileCmd::cacheFile;
 size_t JigdoFileCmd::optCacheExpiry = 60*60*24*30; // default: 30 days
+size_t JigdoFileCmd::optCacheMemory = CacheFile::DEFAULT_CACHE_MEMORY;
+CacheFile::Format JigdoFileCmd::optCacheFormat = CacheFile::DEFAULT_FORMAT;
+string JigdoFileCmd::optCacheServer;
+vector<string> JigdoFileCmd::watchDirs;
 vector<string> JigdoFileCmd::optLabels;
 vector<string> JigdoFileCmd::optUris;
 size_t JigdoFileCmd::blockLength    =   1*1024U;
 size_t JigdoFileCmd::csumBlockLength = 128*1024U - 55;
 size_t JigdoFileCmd::readAmount     = 128*1024U;
+unsigned JigdoFileCmd::optThreads = 0; // 0 = no --threads, i.e. default
+unsigned JigdoFileCmd::optMaxTransfers = 4;
+unsigned JigdoFileCmd::optMaxPerHost = 0;
 int JigdoFileCmd::optZipQuality = Z_BEST_COMPRESSION;
-bool JigdoFileCmd::optBzip2 = false;
-int JigdoFileCmd::optChecksumChoice = MkTemplate::CHECK_MD5;
+int JigdoFileCmd::optCompression = MkTemplate::COMPRESS_GZIP;
+int JigdoFileCmd::optZstdLevel = 0; // 0 = derive from -0 to -9
+int JigdoFileCmd::optChecksumChoice = 0;
 bool JigdoFileCmd::optForce = false;
+bool JigdoFileCmd::optHttp2 = false;
 bool JigdoFileCmd::optMkImageCheck = true;
 bool JigdoFileCmd::optCheckFiles = true;
 bool JigdoFileCmd::optScanWholeFile = false;
+bool JigdoFileCmd::optWatch = false;
 bool JigdoFileCmd::optGreedyMatching = true;
 bool JigdoFileCmd::optAddImage = true;
 bool JigdoFileCmd::optAddServers = true;
@@ -169,6 +180,21 @@ public:
     m += _("writing image");
     print(m, false);
   }
+  virtual void fetching(uint64 done, uint64 total, size_t partsLeft) {
+    if (!printProgress) return;
+    string m;
+    append(m, (total == 0 ? 100 : 100 * done / total), 3); // 3
+    m += '%'; // 1 char
+    append(m, done / 1024, 8); // >= 8 chars
+    m += "k/"; // 2 chars
+    append(m, total / 1024); // want >= 8 chars
+    m += 'k'; // 1 char
+    if (m.size() < 3+1+8+2+8+1)
+      m += "          " + 10 - (3+1+8+2+8+1 - m.size());
+    Paranoid(m.length() == PROGRESS_WIDTH);
+    m += subst(_("fetching, %1 files left"), partsLeft);
+    print(m, false);
+  }
   virtual void abortingScan() {
     string m(_("Error scanning image - abort"));
     print(m);
@@ -301,13 +327,17 @@ inline void printUsage(bool detailed, size_t blockLength,
     "  make-template mt Create template and jigdo from image and files\n"
     "  make-image mi    Recreate image from template and files (can merge\n"
     "                   files in >1 steps, uses `IMG%2tmp' for --image=IMG)\n"
+    "  fetch fe         Like make-image, then download the missing files\n"
+    "                   from the URIs in the jigdo file into `IMG%2tmp'\n"
     "  print-missing pm After make-image, print files still missing for\n"
     "                   the image to be completely recreated\n"),
     binName(), EXTSEPS);
   if (detailed) cout << _(
     "  print-missing-all pma\n"
     "                   Print all URIs for each missing file\n"
-    "  scan sc          Update cache with information about supplied files\n");
+    "  scan sc          Update cache with information about supplied files\n"
+    "  cache-server cs  Keep cache in memory for other jigdo-file processes,\n"
+    "                   forget entries of files below FILES which change\n");
   cout << _(
     "  verify ver       Check whether image matches checksum from template\n"
     "  md5sum md5       Print MD5 checksums similar to md5sum(1)\n"
@@ -337,9 +367,12 @@ inline void printUsage(bool detailed, size_t blockLength,
     "      --uri Label=http://www.site.com\n"
     "                   [make-template] Add mapping from Label to given\n"
     "                   URI instead of default `file:' URI\n"
-    "                   [print-missing] Override mapping in input jigdo\n"
+    "                   [print-missing,fetch] Override mapping in input\n"
+    "                   jigdo\n"
     "  -0 to -9         Set amount of compression in output template\n"
     "      --bzip2      Use bzip2 compression instead of default --gzip\n"
+    "      --zstd[=N]   Use zstd compression [level 1 to 22, default\n"
+    "                   1 to 9 from -0 to -9]\n"
     "      --cache=FILE Store/reload information about any files scanned\n"),
     (WINDOWS ? "C:" : ""), DIRSEPS, SPLITSEP, EXTSEPS);
   if (detailed) {
@@ -348,6 +381,15 @@ inline void printUsage(bool detailed, size_t blockLength,
       "      --cache-expiry=SECONDS[h|d|w|m|y]\n"
       "                   Remove cache entries if last access was longer\n"
       "                   ago than given amount of time [default 30 days]\n"
+      "      --cache-memory=BYTES\n"
+      "                   Amount of memory for caching parts of the cache\n"
+      "                   file [default 4M]\n"
+      "      --cache-format=db|log\n"
+      "                   Type of cache file to create/use: libdb database,\n"
+      "                   or log which many processes can use at once\n"
+      "      --cache-server=SOCKET\n"
+      "                   [cache-server] Listen on SOCKET [other commands]\n"
+      "                   Use the server's cache instead of --cache\n"
       "  -h  --help       Output short help\n"
       "  -H  --help-all   Output this help\n");
   } else {
@@ -368,6 +410,7 @@ inline void printUsage(bool detailed, size_t blockLength,
     "                   [make_template] Choice of checksum algorithm to use\n"
     "                   in describing the image and matched files. Valid\n"
     "                   options are md5 and sha256\n"
+    "                   [scan] Only calculate this type of checksum\n"
     "  --checksum-block-size=BYTES [default %2]\n"
     "                   Uninteresting internal parameter -\n"
     "                   jigdo-file enforces: min-length < checksum-block-size\n"
@@ -375,6 +418,23 @@ inline void printUsage(bool detailed, size_t blockLength,
     "                   Alias for --checksum-block-size, deprecated.\n"
     "  --readbuffer=BYTES [default %3k]\n"
     "                   Amount of data to read at a time\n"
+    "  --threads=N [default 1, make-image: one per CPU]\n"
+    "                   [make-template,make-image,scan,md5sum,sha256sum]\n"
+    "                   Read and checksum up to N files in parallel, and\n"
+    "                   read N directories in parallel. 0 means one thread\n"
+    "                   per CPU. If N > 1, make-template\n"
+    "                   also reads the image ahead on a separate thread\n"
+    "                   and compresses template data on N threads, and\n"
+    "                   make-image decompresses template data on N threads\n"
+    "  --max-transfers=N [default 4]\n"
+    "                   [fetch] Download up to N files at the same time\n"
+    "  --max-per-host=N [default 0]\n"
+    "                   [fetch] Open at most N connections to the same\n"
+    "                   server, 0 means no limit\n"
+    "  --http2          [fetch] Use HTTP/2 if the server supports it, and\n"
+    "                   fetch several files over one connection\n"
+    "  --no-http2       [fetch] Fetch one file at a time per connection\n"
+    "                   [default]\n"
     "  --check-files [default]\n"
     "                   [make-template,md5sum,sha256sum] Check if files exist and\n"
     "                   get or verify checksums, date and size\n"
@@ -384,6 +444,8 @@ inline void printUsage(bool detailed, size_t blockLength,
     "                   [make-image] Do not verify checksums of files\n"
     "  --scan-whole-file [scan] Scan whole file instead of only first block\n"
     "  --no-scan-whole-file [scan] Scan only first block [default]\n"
+    "  --watch          [scan] Keep running, scan files below the directories\n"
+    "                   on the command line again when they change\n"
     "  --greedy-matching [make-template] Prefer immediate matches of small\n"
     "                   files now over possible (but uncertain) matches of \n"
     "                   larger files later [default]\n"
@@ -408,7 +470,7 @@ inline void printUsage(bool detailed, size_t blockLength,
     "  --no-hex [default]\n"
     "  --hex            [md5sum,sha256sum,list-template] Output checksums in\n"
     "                   hexadecimal, not Base64\n"
-    "  --gzip           [default] Use gzip compression, not --bzip2\n"),
+    "  --gzip           [default] Use gzip compression, not --bzip2/--zstd\n"),
     blockLength, csumBlockLength, readAmount / 1024) << endl;
   }
   return;
@@ -504,7 +566,10 @@ enum {
   LONGOPT_ADDIMAGE, LONGOPT_NOADDIMAGE, LONGOPT_NOCACHE, LONGOPT_CACHEEXPIRY,
   LONGOPT_MERGE, LONGOPT_HEX, LONGOPT_NOHEX, LONGOPT_DEBUG, LONGOPT_NODEBUG,
   LONGOPT_MATCHEXEC, LONGOPT_BZIP2, LONGOPT_GZIP, LONGOPT_SCANWHOLEFILE,
-  LONGOPT_NOSCANWHOLEFILE, LONGOPT_GREEDYMATCHING, LONGOPT_NOGREEDYMATCHING
+  LONGOPT_NOSCANWHOLEFILE, LONGOPT_GREEDYMATCHING, LONGOPT_NOGREEDYMATCHING,
+  LONGOPT_THREADS, LONGOPT_ZSTD, LONGOPT_CACHEMEMORY, LONGOPT_CACHEFORMAT,
+  LONGOPT_CACHESERVER, LONGOPT_WATCH, LONGOPT_MAXTRANSFERS,
+  LONGOPT_MAXPERHOST, LONGOPT_HTTP2, LONGOPT_NOHTTP2
 };
 
 // Deal with command line switches
@@ -520,6 +585,9 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { "bzip2",              no_argument,       0, LONGOPT_BZIP2 },
       { "cache",              required_argument, 0, 'c' },
       { "cache-expiry",       required_argument, 0, LONGOPT_CACHEEXPIRY },
+      { "cache-format",       required_argument, 0, LONGOPT_CACHEFORMAT },
+      { "cache-memory",       required_argument, 0, LONGOPT_CACHEMEMORY },
+      { "cache-server",       required_argument, 0, LONGOPT_CACHESERVER },
       { "check-files",        no_argument,       0, LONGOPT_MKIMAGECHECK },
       { "checksum-algorithm", required_argument, 0, 'C' },
       { "debug",              optional_argument, 0, LONGOPT_DEBUG },
@@ -530,11 +598,14 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { "help",               no_argument,       0, 'h' },
       { "help-all",           no_argument,       0, 'H' },
       { "hex",                no_argument,       0, LONGOPT_HEX },
+      { "http2",              no_argument,       0, LONGOPT_HTTP2 },
       { "image",              required_argument, 0, 'i' },
       { "image-section",      no_argument,       0, LONGOPT_ADDIMAGE },
       { "jigdo",              required_argument, 0, 'j' },
       { "label",              required_argument, 0, LONGOPT_LABEL },
       { "match-exec",         required_argument, 0, LONGOPT_MATCHEXEC },
+      { "max-per-host",       required_argument, 0, LONGOPT_MAXPERHOST },
+      { "max-transfers",      required_argument, 0, LONGOPT_MAXTRANSFERS },
       { "md5-block-size",     required_argument, 0, LONGOPT_CHECKSUMSIZE },
       { "checksum-block-size",required_argument, 0, LONGOPT_CHECKSUMSIZE },
       { "merge",              required_argument, 0, LONGOPT_MERGE },
@@ -545,6 +616,7 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { "no-force",           no_argument,       0, LONGOPT_NOFORCE },
       { "no-greedy-matching", no_argument,       0, LONGOPT_NOGREEDYMATCHING },
       { "no-hex",             no_argument,       0, LONGOPT_NOHEX },
+      { "no-http2",           no_argument,       0, LONGOPT_NOHTTP2 },
       { "no-image-section",   no_argument,       0, LONGOPT_NOADDIMAGE },
       { "no-scan-whole-file", no_argument,       0, LONGOPT_NOSCANWHOLEFILE },
       { "no-servers-section", no_argument,       0, LONGOPT_NOADDSERVERS },
@@ -553,8 +625,11 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { "scan-whole-file",    no_argument,       0, LONGOPT_SCANWHOLEFILE },
       { "servers-section",    no_argument,       0, LONGOPT_ADDSERVERS },
       { "template",           required_argument, 0, 't' },
+      { "threads",            required_argument, 0, LONGOPT_THREADS },
       { "uri",                required_argument, 0, LONGOPT_URI },
       { "version",            no_argument,       0, 'v' },
+      { "watch",              no_argument,       0, LONGOPT_WATCH },
+      { "zstd",               optional_argument, 0, LONGOPT_ZSTD },
       { 0, 0, 0, 0 }
     };
 
@@ -566,8 +641,28 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
     case '0': case '1': case '2': case '3': case '4':
     case '5': case '6': case '7': case '8': case '9':
       optZipQuality = c - '0'; break;
-    case LONGOPT_BZIP2: optBzip2 = true; break;
-    case LONGOPT_GZIP:  optBzip2 = false; break;
+    case LONGOPT_BZIP2: optCompression = MkTemplate::COMPRESS_BZIP2; break;
+    case LONGOPT_GZIP:  optCompression = MkTemplate::COMPRESS_GZIP; break;
+    case LONGOPT_ZSTD: {
+#     if HAVE_ZSTD
+      optCompression = MkTemplate::COMPRESS_ZSTD;
+      if (optarg == 0) { optZstdLevel = 0; break; }
+      char* end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg < '0' || *optarg > '9' || *end != '\0' || n < 1 || n > 22) {
+        cerr << subst(_("%1: Invalid argument to --zstd (allowed: 1 to 22)"),
+                      binName()) << '\n';
+        error = true;
+      } else {
+        optZstdLevel = static_cast<int>(n);
+      }
+#     else
+      cerr << subst(_("%1: --zstd is not supported, this version was "
+                      "compiled without libzstd"), binName()) << '\n';
+      error = true;
+#     endif
+      break;
+    }
     case 'h': case 'H': optHelp = c; break;
     case 'v': optVersion = true; break;
     case 'T': fileNames.addFilesFrom(
@@ -591,11 +686,63 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       break;
     case LONGOPT_NOCACHE: cacheFile.erase(); break;
     case LONGOPT_CACHEEXPIRY: optCacheExpiry = scanTimespan(optarg); break;
+    case LONGOPT_CACHEMEMORY: optCacheMemory = scanMemSize(optarg); break;
+    case LONGOPT_CACHEFORMAT:
+      if (strcmp(optarg, "db") == 0) {
+        optCacheFormat = CacheFile::FORMAT_DB;
+      } else if (strcmp(optarg, "log") == 0) {
+        optCacheFormat = CacheFile::FORMAT_LOG;
+      } else {
+        cerr << subst(_("%1: Invalid argument to --cache-format (allowed: "
+                        "db log)"), binName())
+             << '\n';
+        error = true;
+      }
+      break;
+    case LONGOPT_CACHESERVER: optCacheServer = optarg; break;
     case 'f': optForce = true; break;
     case LONGOPT_NOFORCE: optForce = false; break;
     case LONGOPT_MINSIZE:    blockLength = scanMemSize(optarg); break;
     case LONGOPT_CHECKSUMSIZE: csumBlockLength = scanMemSize(optarg); break;
     case LONGOPT_BUFSIZE:     readAmount = scanMemSize(optarg); break;
+    case LONGOPT_THREADS: {
+      char* end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg < '0' || *optarg > '9' || *end != '\0' || n > 1024) {
+        cerr << subst(_("%1: Invalid argument to --threads"), binName())
+             << '\n';
+        error = true;
+      } else {
+        optThreads = (n == 0 ? ThreadPool::cpus() : static_cast<unsigned>(n));
+      }
+      break;
+    }
+    case LONGOPT_MAXTRANSFERS: {
+      char* end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg < '1' || *optarg > '9' || *end != '\0' || n > 1024) {
+        cerr << subst(_("%1: Invalid argument to --max-transfers"),
+                      binName()) << '\n';
+        error = true;
+      } else {
+        optMaxTransfers = static_cast<unsigned>(n);
+      }
+      break;
+    }
+    case LONGOPT_MAXPERHOST: {
+      char* end;
+      unsigned long n = strtoul(optarg, &end, 10);
+      if (*optarg < '0' || *optarg > '9' || *end != '\0' || n > 1024) {
+        cerr << subst(_("%1: Invalid argument to --max-per-host"),
+                      binName()) << '\n';
+        error = true;
+      } else {
+        optMaxPerHost = static_cast<unsigned>(n);
+      }
+      break;
+    }
+    case LONGOPT_HTTP2: optHttp2 = true; break;
+    case LONGOPT_NOHTTP2: optHttp2 = false; break;
     case 'r':
       if (strcmp(optarg, "default") == 0) {
         optReporter = &reporterDefault;
@@ -620,6 +767,7 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
     case LONGOPT_NOGREEDYMATCHING: optGreedyMatching = false; break;
     case LONGOPT_SCANWHOLEFILE: optScanWholeFile = true; break;
     case LONGOPT_NOSCANWHOLEFILE: optScanWholeFile = false; break;
+    case LONGOPT_WATCH: optWatch = true; break;
     case LONGOPT_ADDSERVERS: optAddServers = true; break;
     case LONGOPT_NOADDSERVERS: optAddServers = false; break;
     case LONGOPT_ADDIMAGE: optAddImage = true; break;
@@ -683,6 +831,8 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { (char *)"mt",                MAKE_TEMPLATE },
       { (char *)"make-image",        MAKE_IMAGE },
       { (char *)"mi",                MAKE_IMAGE },
+      { (char *)"fetch",             FETCH },
+      { (char *)"fe",                FETCH },
       { (char *)"print-missing",     PRINT_MISSING },
       { (char *)"pm",                PRINT_MISSING },
       { (char *)"print-missing-all", PRINT_MISSING_ALL },
@@ -696,7 +846,9 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { (char *)"md5sum",            MD5SUM },
       { (char *)"md5",               MD5SUM },
       { (char *)"sha256sum",         SHA256SUM },
-      { (char *)"sha256",            SHA256SUM }
+      { (char *)"sha256",            SHA256SUM },
+      { (char *)"cache-server",      CACHE_SERVER },
+      { (char *)"cs",                CACHE_SERVER }
     };
 
     const CodesEntry *c = codes;
@@ -722,7 +874,18 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
   }
   //____________________
 
-  while (optind < argc) fileNames.addFile(argv[optind++]);
+  while (optind < argc) {
+    if (result == CACHE_SERVER || (result == SCAN && optWatch))
+      watchDirs.push_back(argv[optind]);
+    if (result != CACHE_SERVER) fileNames.addFile(argv[optind]);
+    ++optind;
+  }
+
+  // Other commands use the cache of the server instead of a cache file
+  if (!optCacheServer.empty() && result != CACHE_SERVER) {
+    cacheFile = optCacheServer;
+    optCacheFormat = CacheFile::FORMAT_SERVER;
+  }
 
 # if 0
   /* If no --files-from given and no files on command line, assume we
@@ -788,6 +951,8 @@ int main(int argc, char* argv[]) {
       returnValue = JigdoFileCmd::makeTemplate(); break;
     case JigdoFileCmd::MAKE_IMAGE:
       returnValue = JigdoFileCmd::makeImage();    break;
+    case JigdoFileCmd::FETCH:
+      returnValue = JigdoFileCmd::fetchImage();   break;
     case JigdoFileCmd::PRINT_MISSING:
     case JigdoFileCmd::PRINT_MISSING_ALL:
       returnValue = JigdoFileCmd::printMissing(command); break;
@@ -803,6 +968,8 @@ int main(int argc, char* argv[]) {
     case JigdoFileCmd::SHA256SUM:
       JigdoFileCmd::optCheckFiles = true; // Quick fix, possibly not 100% correct
       returnValue = JigdoFileCmd::sha256sumFiles();  break;
+    case JigdoFileCmd::CACHE_SERVER:
+      returnValue = JigdoFileCmd::cacheServer();  break;
     }
   }
   catch (bad_alloc &) { outOfMemory(); }
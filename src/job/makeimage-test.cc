@@ -0,0 +1,197 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Download & interpret .jigdo, download parts, assemble image
+
+  #test-deps job/makeimage.o mkimage.o zstream.o zstream-gz.o zstream-bz.o
+  #test-deps zstream-zstd.o compat.o scan.o cacheclient.o cachefile.o
+  #test-deps cachelog.o recursedir.o util/bstream.o util/configfile.o
+  #test-deps util/glibc-md5.o util/glibc-sha256.o util/mappedfile.o
+  #test-deps util/md5sum.o util/sha256sum.o util/rsyncsum.o
+  #test-deps util/stringpool.o util/threadpool.o
+  #test-ldflags $(LIBS)
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <bstream.hh>
+#include <debug.hh>
+#include <log.hh>
+#include <makeimage.hh>
+#include <mkimage.hh>
+#include <zstream-gz.hh>
+//______________________________________________________________________
+
+namespace {
+
+  const char* const templName = "makeimage-test.template";
+  const char* const tmpName = "makeimage-test.tmp";
+  const char* const imageName = "makeimage-test.iso";
+  const size_t BLOCK_LENGTH = 1024;
+
+  struct Quiet : MakeImage::ProgressReporter {
+    void error(const string&) { }
+    void info(const string&) { }
+  } quiet;
+
+  vector<Ubyte> image;
+  vector<vector<Ubyte> > files; // Contents of the parts
+
+  void random(vector<Ubyte>& v, size_t n) {
+    v.resize(n);
+    for (size_t i = 0; i < n; ++i) v[i] = static_cast<Ubyte>(rand() >> 8);
+  }
+
+  /* Image: unmatched data, file 0, unmatched, file 1, file 0 again,
+     unmatched, file 2, unmatched. Write its template. */
+  void makeTemplate() {
+    static const size_t sizes[] = { 200000, 300, 150000 };
+    files.resize(3);
+    for (int i = 0; i < 3; ++i) random(files[i], sizes[i]);
+    static const int layout[] = { -1, 0, -1, 1, 0, -1, 2, -1 };
+    static const size_t unmatchedSizes[] = { 1000, 5000, 70000, 10 };
+
+    bofstream templ(templName, ios::binary|ios::trunc);
+    string hdr = TEMPLATE_HDR;
+    hdr += "1.2 makeimage-test\r\nTest\r\n\r\n";
+    templ << hdr;
+    JigdoDescVec desc;
+    ZobstreamGz zip(templ, 64*1024);
+    vector<Ubyte> data;
+    int u = 0;
+    for (size_t i = 0; i < sizeof(layout) / sizeof(int); ++i) {
+      uint64 off = image.size();
+      if (layout[i] < 0) {
+        random(data, unmatchedSizes[u++]);
+        zip.write(&data[0], static_cast<unsigned>(data.size()));
+        desc.push_back(new JigdoDesc::UnmatchedData(off, data.size()));
+      } else {
+        data = files[layout[i]];
+        size_t r = (data.size() < BLOCK_LENGTH ? data.size() : BLOCK_LENGTH);
+        MD5Sum md;
+        md.update(&data[0], data.size()).finish();
+        desc.push_back(new JigdoDesc::MatchedFileMD5(off, data.size(),
+            RsyncSum64(&data[0], r), md));
+      }
+      image.insert(image.end(), data.begin(), data.end());
+    }
+    zip.close();
+    MD5Sum md;
+    md.update(&image[0], image.size()).finish();
+    desc.push_back(new JigdoDesc::ImageInfoMD5(image.size(), md,
+                                               BLOCK_LENGTH));
+    templ << desc;
+    templ.close();
+    Assert(templ);
+  }
+
+  void checkImage() {
+    vector<Ubyte> result(image.size() + 1);
+    FILE* f = fopen(imageName, "rb");
+    Assert(f != 0);
+    size_t n = fread(&result[0], 1, result.size(), f);
+    fclose(f);
+    Assert(n == image.size());
+    Assert(memcmp(&result[0], &image[0], n) == 0);
+  }
+
+  // Pass data of part n in chunks of random size
+  void feed(MakeImage& mi, size_t n, size_t len, bool interleave) {
+    const MakeImage::Part& p = mi.part(n);
+    // Map part to file via its size, they differ
+    const vector<Ubyte>* f = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+      if (files[i].size() == p.size) f = &files[i];
+    Assert(f != 0);
+    while (len > 0) {
+      size_t m = static_cast<size_t>(rand()) % 10000 + 1;
+      if (m > len) m = len;
+      bool more = mi.partData(n, &(*f)[p.received], m);
+      Assert(more == !mi.bufferFull());
+      len -= m;
+      if (interleave || !more) mi.work();
+    }
+  }
+
+}
+//______________________________________________________________________
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+  makeTemplate();
+  remove(tmpName);
+  remove(imageName);
+
+  // New .tmp file, part data arrives during layout, small buffer limit
+  {
+    MakeImage mi;
+    mi.setReporter(&quiet);
+    mi.setLimits(4096, 100000);
+    mi.open(tmpName, templName, false);
+    Assert(!mi.laidOut());
+    Assert(mi.partCount() == 3 && mi.partsLeft() == 3);
+    Assert(mi.part(0).offsets.size() == 2);
+    // Part 2 lies at the end, buffered until work() gets there
+    feed(mi, 2, mi.part(2).size, false);
+    Assert(mi.partFinished(2) == 0);
+    // Part 0 fails half way, then has wrong data
+    feed(mi, 0, 50000, true);
+    mi.partFailed(0);
+    Assert(mi.part(0).received == 0);
+    vector<Ubyte> junk(mi.part(1).size);
+    mi.partData(1, &junk[0], junk.size());
+    Assert(mi.partFinished(1) != 0);
+    Assert(mi.part(1).received == 0);
+    // Too short
+    feed(mi, 1, 100, true);
+    Assert(mi.partFinished(1) != 0);
+    feed(mi, 0, mi.part(0).size, true);
+    Assert(mi.partFinished(0) == 0);
+    while (mi.work()) { }
+    Assert(mi.laidOut() && mi.buffered() == 0);
+    Assert(mi.partsLeft() == 1);
+    Assert(!mi.finish(imageName));
+  }
+
+  // Continue the .tmp file, data is written directly
+  {
+    MakeImage mi;
+    mi.setReporter(&quiet);
+    mi.open(tmpName, templName, false);
+    Assert(mi.laidOut() && !mi.work());
+    Assert(mi.partCount() == 1);
+    feed(mi, 0, mi.part(0).size, false);
+    Assert(mi.buffered() == 0);
+    Assert(mi.partFinished(0) == 0);
+    Assert(mi.finish(imageName));
+  }
+  checkImage();
+  remove(imageName);
+
+  // All data arrives before the layout starts
+  {
+    MakeImage mi;
+    mi.setReporter(&quiet);
+    mi.open(tmpName, templName, false);
+    for (size_t n = 0; n < mi.partCount(); ++n) {
+      feed(mi, n, mi.part(n).size, false);
+      Assert(mi.partFinished(n) == 0);
+    }
+    while (mi.work()) { }
+    Assert(mi.finish(imageName));
+  }
+  checkImage();
+
+  remove(imageName);
+  remove(templName);
+  return 0;
+}
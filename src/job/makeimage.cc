@@ -13,9 +13,429 @@
 
 #include <config.h>
 
-#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <iostream>
+#include <map>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd-jigdo.h>
 
+#include <compat.hh>
+#include <log.hh>
 #include <makeimage.hh>
+#include <string.hh>
 //______________________________________________________________________
+
+DEBUG_UNIT("makeimage")
+
+void MakeImage::ProgressReporter::error(const string& message) {
+  cerr << message << endl;
+}
+void MakeImage::ProgressReporter::info(const string& message) {
+  cerr << message << endl;
+}
+
+namespace {
+  MakeImage::ProgressReporter noReport;
+}
+//______________________________________________________________________
+
+MakeImage::~MakeImage() {
+  for (vector<Part*>::iterator i = parts.begin(), e = parts.end();
+       i != e; ++i) {
+    for (deque<Ubyte*>::iterator b = (*i)->blocks.begin(),
+           be = (*i)->blocks.end(); b != be; ++b)
+      delete[] *b;
+    delete *i;
+  }
+  for (vector<Ubyte*>::iterator i = freeBlocks.begin(),
+         e = freeBlocks.end(); i != e; ++i)
+    delete[] *i;
+  if (data.get() != 0) {
+    try { data->close(); } catch (Error) { }
+  }
+  if (fd >= 0) close(fd);
+}
+//______________________________________________________________________
+
+void MakeImage::open(const string& imageTmpFile, const string& templFile,
+                     bool force) {
+  if (reporter == 0) reporter = &noReport;
+  Paranoid(fd < 0);
+  tmpName = imageTmpFile;
+  templ.reset(new bifstream(templFile.c_str(), ios::binary));
+  if (!*templ) {
+    string err = subst(_("Could not open `%1' for input: %2"),
+                       templFile, strerror(errno));
+    throw Error(err);
+  }
+  JigdoDesc::readTemplate(files, templFile, templ.get());
+
+  JigdoDesc::ImageInfoMD5* infoMD5 =
+      dynamic_cast<JigdoDesc::ImageInfoMD5*>(files.back());
+  JigdoDesc::ImageInfoSHA256* infoSHA256 =
+      dynamic_cast<JigdoDesc::ImageInfoSHA256*>(files.back());
+  if (infoMD5 != 0) {
+    blockLength = infoMD5->blockLength();
+    imageSizeVal = infoMD5->size();
+  } else if (infoSHA256 != 0) {
+    blockLength = infoSHA256->blockLength();
+    imageSizeVal = infoSHA256->size();
+  }
+  if (blockLength == 0 || imageSizeVal == 0)
+    throw Error(_("Unable to find a valid image info block"));
+
+  // Reuse the .tmp file if the DESC entries match, cf. makeImage()
+  bool reuse = false;
+  struct stat fileInfo;
+  if (stat(tmpName.c_str(), &fileInfo) == 0) {
+    const char* wontReuse;
+    JigdoDescVec filesTmp;
+    bifstream imageTmp(tmpName.c_str(), ios::binary);
+    if (!imageTmp)
+      wontReuse = strerror(errno);
+    else
+      wontReuse = JigdoDesc::readTmpFile(imageTmp, filesTmp, files);
+    if (wontReuse != 0) {
+      string msg = subst(_("Will not reuse existing temporary file `%1' - "
+                           "%2"), tmpName, wontReuse);
+      if (!force) {
+        reporter->error(msg);
+        throw Error(_("Delete/rename the file or use --force"));
+      }
+      reporter->info(msg);
+    } else {
+      files.swap(filesTmp);
+      reuse = true;
+    }
+  }
+
+  int flags = (reuse ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC);
+  fd = ::open(tmpName.c_str(), flags, 0666);
+  if (fd < 0) {
+    string err = subst(_("Could not open `%1' for output: %2"),
+                       tmpName, strerror(errno));
+    throw Error(err);
+  }
+  findParts();
+
+  if (reuse) {
+    debug("open: Continuing %1, %2 parts missing", tmpName, partsLeftVal);
+    templ.reset();
+    entry = files.size() - 1;
+    frontier = imageSizeVal;
+    return;
+  }
+  debug("open: Creating %1, %2 parts missing", tmpName, partsLeftVal);
+  JigdoDesc::isTemplate(*templ); // Seek to 1st DATA part
+  /* Additional 8k of zip buffer, cf. writeAll() in mkimage.cc */
+  data.reset(new Zibstream(*templ,
+                           static_cast<unsigned>(readAmount) + 8*1024));
+  buf.resize(readAmount);
+  entry = 0;
+  entryPos = 0;
+  frontier = 0;
+  while (entry < files.size() - 1 && files[entry]->size() == 0) ++entry;
+}
+//________________________________________
+
+void MakeImage::findParts() {
+  map<MD5, size_t> byMD5;
+  map<SHA256, size_t> bySHA256;
+  entryPart.assign(files.size(), 0);
+  for (size_t i = 0; i < files.size() - 1; ++i) {
+    size_t* known;
+    uint64 offset;
+    if (files[i]->type() == JigdoDesc::MATCHED_FILE_MD5) {
+      JigdoDesc::MatchedFileMD5* m =
+          dynamic_cast<JigdoDesc::MatchedFileMD5*>(files[i]);
+      map<MD5, size_t>::iterator k = byMD5.find(m->md5());
+      if (k == byMD5.end()) {
+        Part* p = new Part();
+        p->size = m->size(); p->md5 = m->md5(); p->rsync = m->rsync();
+        k = byMD5.insert(make_pair(m->md5(), parts.size())).first;
+        parts.push_back(p);
+      }
+      known = &k->second;
+      offset = m->offset();
+    } else if (files[i]->type() == JigdoDesc::MATCHED_FILE_SHA256) {
+      JigdoDesc::MatchedFileSHA256* m =
+          dynamic_cast<JigdoDesc::MatchedFileSHA256*>(files[i]);
+      map<SHA256, size_t>::iterator k = bySHA256.find(m->sha256());
+      if (k == bySHA256.end()) {
+        Part* p = new Part();
+        p->size = m->size(); p->sha256 = m->sha256(); p->rsync = m->rsync();
+        p->sha = true;
+        k = bySHA256.insert(make_pair(m->sha256(), parts.size())).first;
+        parts.push_back(p);
+      }
+      known = &k->second;
+      offset = m->offset();
+    } else {
+      continue;
+    }
+    // Same file at several offsets - only needs to be fetched once
+    entryPart[i] = *known;
+    parts[*known]->entries.push_back(i);
+    parts[*known]->offsets.push_back(offset);
+  }
+  partsLeftVal = parts.size();
+}
+//______________________________________________________________________
+
+void MakeImage::writeAt(const Ubyte* d, size_t len, uint64 off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, d, len, static_cast<off_t>(off));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      string err = subst(_("Error while writing to `%1' (%2)"),
+                         tmpName, strerror(errno));
+      throw Error(err);
+    }
+    d += n; len -= static_cast<size_t>(n);
+    off += static_cast<uint64>(n);
+  }
+}
+//________________________________________
+
+/* A block with data at part offset x is only needed until work() has
+   written that byte at the last (highest) offset of the part. */
+void MakeImage::releaseBuffer(Part* p) {
+  uint64 last = p->offsets.back();
+  uint64 done = (frontier > last ? frontier - last : 0);
+  while (!p->blocks.empty()) {
+    uint64 end = p->bufStart + BLOCK_SIZE;
+    if (p->blocks.size() == 1) end = p->received;
+    if (end > done) break;
+    freeBlocks.push_back(p->blocks.front());
+    p->blocks.pop_front();
+    p->bufStart = end;
+    bufferedVal -= BLOCK_SIZE;
+  }
+  if (p->blocks.empty()) p->bufStart = p->received;
+}
+//________________________________________
+
+bool MakeImage::work() {
+  if (laidOut()) return false;
+  JigdoDesc* d = files[entry];
+  uint64 left = d->size() - entryPos;
+  size_t n = (left < readAmount ? static_cast<size_t>(left) : readAmount);
+  Ubyte* b = &buf[0];
+  Part* p = 0;
+
+  switch (d->type()) {
+    case JigdoDesc::UNMATCHED_DATA:
+      if (*data) {
+        data->read(b, static_cast<unsigned>(n));
+        n = static_cast<size_t>(data->gcount());
+      } else {
+        n = 0;
+      }
+      if (n == 0) throw Error(_("Premature end of template data"));
+      break;
+    case JigdoDesc::MATCHED_FILE_MD5:
+    case JigdoDesc::MATCHED_FILE_SHA256:
+    case JigdoDesc::WRITTEN_FILE_MD5: // Finished by partFinished()
+    case JigdoDesc::WRITTEN_FILE_SHA256: {
+      /* Copy the part's data from its buffer, fill with zeroes where
+         nothing has been received yet */
+      p = parts[entryPart[entry]];
+      uint64 x = entryPos;
+      size_t i = 0;
+      while (i < n && x < p->received) {
+        Paranoid(x >= p->bufStart);
+        uint64 inBuf = x - p->bufStart;
+        const Ubyte* src = p->blocks[static_cast<size_t>(inBuf / BLOCK_SIZE)]
+                           + inBuf % BLOCK_SIZE;
+        size_t m = BLOCK_SIZE - static_cast<size_t>(inBuf % BLOCK_SIZE);
+        if (m > n - i) m = n - i;
+        if (m > p->received - x) m = static_cast<size_t>(p->received - x);
+        memcpy(b + i, src, m);
+        i += m; x += m;
+      }
+      memset(b + i, 0, n - i);
+      break;
+    }
+    default:
+      debug("work: invalid type %1", d->type());
+      throw Error(_("Error - template data's DESC section invalid"));
+  }
+
+  writeAt(b, n, frontier);
+  frontier += n;
+  entryPos += n;
+  if (p != 0) releaseBuffer(p);
+  while (entry < files.size() - 1 && entryPos == files[entry]->size()) {
+    ++entry;
+    entryPos = 0;
+  }
+  if (entry < files.size() - 1) return true;
+
+  // All data written, the .tmp file is usable now
+  Assert(frontier == imageSizeVal);
+  debug("work: Layout of %1 complete", tmpName);
+  data->close();
+  data.reset();
+  templ.reset();
+  vector<Ubyte>().swap(buf);
+  for (vector<Ubyte*>::iterator i = freeBlocks.begin(),
+         e = freeBlocks.end(); i != e; ++i)
+    delete[] *i;
+  vector<Ubyte*>().swap(freeBlocks);
+  save();
+  return false;
+}
+//______________________________________________________________________
+
+bool MakeImage::partData(size_t n, const Ubyte* d, size_t len) {
+  Part* p = parts[n];
+  Paranoid(!p->finished && len <= p->size - p->received);
+  uint64 pos = p->received;
+
+  if (pos < blockLength) {
+    uint64 rsyncLeft = blockLength - pos;
+    p->rsyncCheck.addBack(d, (len < rsyncLeft ? len
+                              : static_cast<size_t>(rsyncLeft)));
+  }
+  if (p->sha) p->sha256Check.update(d, len); else p->md5Check.update(d, len);
+
+  // Write the data where the image has been laid out already
+  for (vector<uint64>::const_iterator i = p->offsets.begin(),
+         e = p->offsets.end(); i != e; ++i) {
+    uint64 limit = (frontier > *i ? frontier - *i : 0);
+    if (pos >= limit) break; // Offsets are ascending
+    size_t m = (pos + len <= limit ? len : static_cast<size_t>(limit - pos));
+    writeAt(d, m, *i + pos);
+  }
+  p->received += len;
+
+  // Buffer the rest for work()
+  uint64 last = p->offsets.back();
+  uint64 done = (frontier > last ? frontier - last : 0);
+  if (p->blocks.empty()) {
+    if (pos < done) {
+      size_t skip = (pos + len <= done ? len
+                     : static_cast<size_t>(done - pos));
+      d += skip; len -= skip; pos += skip;
+    }
+    p->bufStart = pos;
+  }
+  while (len > 0) {
+    size_t used = BLOCK_SIZE; // Nr of bytes in last block
+    if (!p->blocks.empty())
+      used = static_cast<size_t>(pos - p->bufStart
+                                 - (p->blocks.size() - 1) * BLOCK_SIZE);
+    if (used == BLOCK_SIZE) {
+      if (freeBlocks.empty()) {
+        p->blocks.push_back(new Ubyte[BLOCK_SIZE]);
+      } else {
+        p->blocks.push_back(freeBlocks.back());
+        freeBlocks.pop_back();
+      }
+      bufferedVal += BLOCK_SIZE;
+      used = 0;
+    }
+    size_t m = BLOCK_SIZE - used;
+    if (m > len) m = len;
+    memcpy(p->blocks.back() + used, d, m);
+    d += m; len -= m; pos += m;
+  }
+  return !bufferFull();
+}
+//________________________________________
+
+const char* MakeImage::partFinished(size_t n) {
+  Part* p = parts[n];
+  Paranoid(!p->finished);
+  const char* err = 0;
+  if (p->received != p->size) {
+    err = _("file is too short");
+  } else if (p->sha ? p->sha256Check.finish() != p->sha256
+                    : p->md5Check.finish() != p->md5) {
+    err = _("does not match checksum in template data");
+  } else if (blockLength > 0 && p->rsyncCheck != p->rsync) {
+    err = _("does not match checksum in template data");
+  }
+  if (err != 0) {
+    partFailed(n);
+    return err;
+  }
+
+  /* Mark the file as written to the image at all its offsets. Any
+     buffered data is written by work() before the DESC section is. */
+  for (size_t i = 0; i < p->entries.size(); ++i) {
+    JigdoDesc*& e = files[p->entries[i]];
+    if (p->sha) {
+      JigdoDesc::MatchedFileSHA256* m =
+          dynamic_cast<JigdoDesc::MatchedFileSHA256*>(e);
+      e = new JigdoDesc::WrittenFileSHA256(m->offset(), m->size(),
+                                           m->rsync(), m->sha256());
+      delete m;
+    } else {
+      JigdoDesc::MatchedFileMD5* m =
+          dynamic_cast<JigdoDesc::MatchedFileMD5*>(e);
+      e = new JigdoDesc::WrittenFileMD5(m->offset(), m->size(),
+                                        m->rsync(), m->md5());
+      delete m;
+    }
+  }
+  p->finished = true;
+  --partsLeftVal;
+  return 0;
+}
+//________________________________________
+
+void MakeImage::partFailed(size_t n) {
+  Part* p = parts[n];
+  Paranoid(!p->finished);
+  while (!p->blocks.empty()) {
+    freeBlocks.push_back(p->blocks.back());
+    p->blocks.pop_back();
+    bufferedVal -= BLOCK_SIZE;
+  }
+  p->received = p->bufStart = 0;
+  p->rsyncCheck = RsyncSum64();
+  if (p->sha) p->sha256Check.reset(); else p->md5Check.reset();
+}
+//______________________________________________________________________
+
+void MakeImage::save() {
+  if (!laidOut()) return;
+  bfstream img(tmpName.c_str(), ios::binary|ios::in|ios::out);
+  img.seekp(imageSizeVal);
+  // No need to truncate here because DESC section never changes size
+  img << files;
+  img.close();
+  if (!img) {
+    string err = subst(_("Error while writing to `%1' (%2)"),
+                       tmpName, strerror(errno));
+    throw Error(err);
+  }
+}
+//________________________________________
+
+bool MakeImage::finish(const string& imageFile) {
+  Paranoid(laidOut());
+  if (partsLeftVal > 0) {
+    save();
+    return false;
+  }
+  close(fd); // Necessary on Windows before truncating is possible
+  fd = -1;
+  // Truncate to final image size, removing the DESC section
+  if (compat_truncate(tmpName.c_str(), imageSizeVal) != 0) {
+    string err = subst(_("Could not truncate `%1' (%2)"),
+                       tmpName, strerror(errno));
+    throw Error(err);
+  }
+  if (compat_rename(tmpName.c_str(), imageFile.c_str()) != 0) {
+    string err = subst(_("Could not move finished image from `%1' to `%2' "
+                         "(%3)"), tmpName, imageFile, strerror(errno));
+    throw Error(err);
+  }
+  reporter->info(subst(_("Successfully created `%1'"), imageFile));
+  return true;
+}
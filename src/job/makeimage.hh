@@ -19,9 +19,19 @@
 
 #include <config.h>
 
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bstream.hh>
 #include <debug.hh>
-#include <jigdoconfig.hh>
+#include <md5sum.hh>
+#include <mkimage.hh>
 #include <nocopy.hh>
+#include <rsyncsum.hh>
+#include <sha256sum.hh>
+#include <zstream.hh>
 //______________________________________________________________________
 
 /** Download & interpret .jigdo, download parts, assemble image. MakeImage is
@@ -35,14 +45,15 @@
     GtkMakeImage(GTK GUI)  CursesMakeImage(curses GUI)[0]
                    |        |
                    V        V
-                  MakeImageDl  "jigdo-file make-image"[1]
+                  MakeImageDl  "jigdo-file fetch"[1]
                            |     |
                            V     V
                           MakeImage
 
     [0] Curses GUI non-existent so far
-    [1] ATM, jigdo-file uses its own implementation of MakeImage's
-        functionality, TODO fix that.
+    [1] "jigdo-file make-image" still uses JigdoDesc::makeImage(), which
+        copies local files in one pass and can write to stdout. It shares
+        the code for reading template and .tmp file DESC sections.
     </pre>
 
     MakeImage: Everything for turning many data sources into one final image
@@ -113,33 +124,199 @@
 
     GtkMakeImage: Is notified by MakeImageDl when anything interesting
     happens, updates GTK+ widgets. Also pauses, continues etc. the
-    MakeImageDl. */
+    MakeImageDl.
+
+    The image is written to a .tmp file with the same format as that of
+    "jigdo-file make-image": After the image data, a DESC section lists
+    which parts have been written. When a new .tmp file is created, the
+    DESC section is only appended once all of the image has been laid out
+    by work(), so an interrupted layout is never mistaken for a usable .tmp
+    file. Everything that can go wrong with the .tmp file or the template
+    is reported by throwing an Error. */
 class MakeImage : NoCopy {
 public:
+  class ProgressReporter;
+  struct Part;
+
+  /** Default amount of image data that one call to work() writes */
+  static const size_t READ_AMOUNT = 128U * 1024;
+  /** Default limit for buffered part data, see partData() */
+  static const size_t BUFFER_LIMIT = 32U * 1024 * 1024;
+  /** Part data is buffered in blocks of this size, which are reused */
+  static const size_t BLOCK_SIZE = 64U * 1024;
 
-  /** jigdoFile argument is only used for displaying error messages when
-      scanning the .jigdo file contents.
-      TODO param destDir destination directory that the final image should be
-      written to. Initially, MakeImage will create a temporary dir (name
-      based on jigdoFile leafname) to store administrative data in. */
   inline explicit MakeImage();
-  inline ~MakeImage();
-
-  /** Set where to report JigdoConfig errors, overwriting any value passed as
-      jigdoErrors to the ctor. */
-//   inline void setReporter(JigdoConfig::ProgressReporter* jigdoErrors);
-
-  /** Public data member: Contents of .jigdo file. The component using this
-      MakeImage should retrieve the .jigdo data and add it here with
-      configFile().push_back(line) for each line of the file. Call
-      config.rescan() when done. */
-//   JigdoConfig config;
-//   ConfigFile& configFile() { return config.configFile(); }
+  ~MakeImage();
+
+  /** Set where to report errors and informational messages. By default,
+      they are printed to cerr. */
+  inline void setReporter(ProgressReporter* r);
+  /** Change the amount of data written by each work() call and the limit
+      for buffered data. Call before open(). */
+  inline void setLimits(size_t readAmount, size_t bufferLimit);
+
+  /** Read the DESC section of the template, then prepare the .tmp file:
+      If it exists and belongs to the same template, continue writing to
+      it. Otherwise, create it, and have work() write the image data to
+      it.
+      @param imageTmpFile Name of the .tmp file
+      @param templFile Name of the template, must remain readable until
+      laidOut() returns true
+      @param force If true, overwrite a .tmp file which cannot be reused,
+      otherwise throw an Error */
+  void open(const string& imageTmpFile, const string& templFile,
+            bool force);
+
+  /** Size of the final image */
+  inline uint64 imageSize() const;
+  /** Nr of bytes at the start of the .tmp file that work() has written */
+  inline uint64 laidOutBytes() const;
+  /** True once all of the image has been written at least once, i.e.
+      work() has nothing left to do */
+  inline bool laidOut() const;
+
+  /** Parts of the image which were missing at the time of open(). Each
+      part is a file which may occur several times in the image. The
+      parts are numbered in the order they first occur in the image. */
+  inline size_t partCount() const;
+  inline const Part& part(size_t n) const;
+  /** Nr of parts which have not been finished successfully yet */
+  inline size_t partsLeft() const;
+
+  /** Nr of bytes of part data which are buffered in memory */
+  inline size_t buffered() const;
+  /** True if more data is buffered than allowed with setLimits() */
+  inline bool bufferFull() const;
+
+  /** Do the next chunk of disc-intensive work, i.e. write the next
+      readAmount bytes of image data to the .tmp file: Either unmatched
+      data from the template, or for parts, data passed to partData()
+      earlier or zeroes. Throws Error in case of problems with the
+      template or the .tmp file.
+      @return true if there is more work to do */
+  bool work();
+
+  /** Pass downloaded data for part n to MakeImage. The data must be
+      passed in order, i.e. it starts at offset part(n).received of the
+      part, and must not extend beyond its end. The data is checksummed.
+      Where the image has already been laid out, it is written to all
+      offsets of the part immediately, the rest is buffered until work()
+      gets there.
+      @return false if more data is buffered than allowed - the caller
+      should pause downloading and call work() until bufferFull() returns
+      false. The data has been accepted in any case. */
+  bool partData(size_t n, const Ubyte* data, size_t len);
+  /** The download of part n is complete. If it has the right length and
+      checksums, mark the part as written to the image.
+      @return null on success, otherwise a message describing why the
+      data is wrong. In that case, partFailed(n) is called. */
+  const char* partFinished(size_t n);
+  /** Discard all data passed for part n, e.g. because its download was
+      interrupted. The next partData() must start at offset 0 again. */
+  void partFailed(size_t n);
+
+  /** Update the DESC section at the end of the .tmp file, if laidOut().
+      No need to call this before finish(). */
+  void save();
+  /** Once laidOut(), either rename the completed image to imageFile, or
+      if some parts are missing, just save().
+      @return true if the image is complete */
+  bool finish(const string& imageFile);
+
+private:
+  // Create the entry for each part
+  void findParts();
+  // Free those buffer blocks of p which work() does not need anymore
+  void releaseBuffer(Part* p);
+  // Write to the .tmp file, throw Error on failure
+  void writeAt(const Ubyte* data, size_t len, uint64 off);
+
+  ProgressReporter* reporter;
+  size_t readAmount, bufferLimit;
+
+  string tmpName;
+  int fd; // Of tmpName, -1 if not open
+  JigdoDescVec files; // Entries of template or .tmp file
+  uint64 imageSizeVal;
+  size_t blockLength; // Length of rsync sum at start of each part
+  vector<Part*> parts;
+  vector<size_t> entryPart; // For each entry of files, index in parts
+  size_t partsLeftVal;
+
+  // Layout of a new .tmp file by work()
+  unique_ptr<bifstream> templ;
+  unique_ptr<Zibstream> data; // Unmatched data from templ
+  vector<Ubyte> buf;
+  size_t entry; // Index in files of entry that work() is writing
+  uint64 entryPos; // Nr of bytes of that entry written
+  uint64 frontier; // Offset of first byte not laid out yet
+
+  vector<Ubyte*> freeBlocks; // Pool of unused buffer blocks
+  size_t bufferedVal; // Nr of bytes of used blocks
 };
 //______________________________________________________________________
 
-MakeImage::MakeImage() { }
+/** A part of the image which is missing. Only MakeImage modifies the
+    members. */
+struct MakeImage::Part {
+  Part() : size(0), sha(false), md5(), sha256(), rsync(), entries(),
+           offsets(), finished(false), received(0), md5Check(),
+           sha256Check(), rsyncCheck(), blocks(), bufStart(0) { }
+  uint64 size;
+  bool sha; // true => check sha256, else md5
+  MD5 md5;
+  SHA256 sha256;
+  RsyncSum64 rsync; // Of first blockLength bytes
+  vector<size_t> entries; // Indexes of its MatchedFile* entries
+  vector<uint64> offsets; // Their offsets in the image, ascending
+  bool finished; // Checksum OK, marked as written
+  uint64 received; // Nr of bytes passed to partData() so far
+
+  MD5Sum md5Check;
+  SHA256Sum sha256Check;
+  RsyncSum64 rsyncCheck;
+  /* Buffer for part data [bufStart, received). All blocks except the
+     last one are full. */
+  deque<Ubyte*> blocks;
+  uint64 bufStart;
+};
+//______________________________________________________________________
+
+/** Class allowing MakeImage to convey information back to the caller. The
+    default versions of the methods print errors and messages to cerr. */
+class MakeImage::ProgressReporter {
+public:
+  virtual ~ProgressReporter() { }
+  /** General-purpose error reporting. */
+  virtual void error(const string& message);
+  /** Like error(), but for purely informational messages. */
+  virtual void info(const string& message);
+};
+//______________________________________________________________________
+
+MakeImage::MakeImage()
+  : reporter(0), readAmount(READ_AMOUNT), bufferLimit(BUFFER_LIMIT),
+    tmpName(), fd(-1), files(), imageSizeVal(0), blockLength(0), parts(),
+    entryPart(), partsLeftVal(0), templ(), data(), buf(), entry(0),
+    entryPos(0), frontier(0), freeBlocks(), bufferedVal(0) { }
+
+void MakeImage::setReporter(ProgressReporter* r) { reporter = r; }
+
+void MakeImage::setLimits(size_t r, size_t b) {
+  readAmount = r; bufferLimit = b;
+}
+
+uint64 MakeImage::imageSize() const { return imageSizeVal; }
+uint64 MakeImage::laidOutBytes() const { return frontier; }
+bool MakeImage::laidOut() const {
+  return fd >= 0 && frontier == imageSizeVal && data.get() == 0;
+}
+
+size_t MakeImage::partCount() const { return parts.size(); }
+const MakeImage::Part& MakeImage::part(size_t n) const { return *parts[n]; }
+size_t MakeImage::partsLeft() const { return partsLeftVal; }
 
-MakeImage::~MakeImage() { }
+size_t MakeImage::buffered() const { return bufferedVal; }
+bool MakeImage::bufferFull() const { return bufferedVal > bufferLimit; }
 
 #endif
@@ -55,15 +55,27 @@ namespace {
      source .jigdo URL will be appended. */
   const char* const TMPDIR_PREFIX = "jigdo-";
 
+  // Seconds since the epoch, for UrlTransfer
+  double currentTime() {
+    GTimeVal now;
+    g_get_current_time(&now);
+    return now.tv_sec + now.tv_usec / 1000000.0;
+  }
+
 }
 
+unsigned MakeImageDl::maxRanges = 0;
+unsigned MakeImageDl::maxParts = 4;
+
 MakeImageDl::MakeImageDl(/*IO* ioPtr,*/ const string& jigdoUri,
                          const string& destination)
     : io(/*ioPtr*/), stateVal(DOWNLOADING_JIGDO),
       jigdoUrl(jigdoUri), jigdoIo(0), childrenVal(), dest(destination),
-      tmpDirVal(), mi(),
+      tmpDirVal(), mi(), nextPart(0), runningParts(0), failedParts(0),
+      unsavedParts(0),
       imageNameVal(), imageInfoVal(), imageShortInfoVal(), templateUrls(0),
-      templateMd5Val(0), callbackId(0) {
+      templateMd5Val(0), templateName(), callbackId(0), stallCheckId(0),
+      partFailedId(0) {
   // Remove all trailing '/' from dest dir, even if result empty
   unsigned destLen = dest.length();
   while (destLen > 0 && dest[destLen - 1] == DIRSEP) --destLen;
@@ -92,6 +104,8 @@ MakeImageDl::MakeImageDl(/*IO* ioPtr,*/ const string& jigdoUri,
 Job::MakeImageDl::~MakeImageDl() {
   debug("~MakeImageDl");
   if (callbackId != 0) g_source_remove(callbackId);
+  if (stallCheckId != 0) g_source_remove(stallCheckId);
+  if (partFailedId != 0) g_source_remove(partFailedId);
   killAllChildren();
   delete jigdoIo;
   delete templateMd5Val;
@@ -370,6 +384,78 @@ MakeImageDl::Child* MakeImageDl::childForSemiCompleted(
 }
 //______________________________________________________________________
 
+/* Ranges beyond the first are fetched from the next URLs in c->urls. They
+   are only peeked at; if the whole download fails, childFailed() still
+   tries them in turn. */
+void MakeImageDl::startTransfer(Child* c) {
+  SingleUrl* dl = dynamic_cast<SingleUrl*>(c->source());
+  if (dl == 0) return;
+  if (maxRanges > 1) {
+    vector<string> mirrors;
+    if (c->urls.get() != 0) c->urls->peek(&mirrors, maxRanges - 1);
+    dl->setRanges(maxRanges, mirrors);
+  }
+  if (c->urls.get() == 0) return;
+  c->transfer.start(*c->lastUrl, dl->progress()->currentSize(),
+                    currentTime());
+  if (stallCheckId == 0)
+    stallCheckId = g_timeout_add(STALL_CHECK_INTERVAL, &stallCheck_callback,
+                                 (gpointer)this);
+}
+
+/* Feed the progress of all measured downloads to their UrlTransfers, also
+   if no data arrives. Handles at most one stalled download per call. */
+gboolean MakeImageDl::stallCheck_callback(gpointer mi) {
+  MakeImageDl* self = static_cast<MakeImageDl*>(mi);
+  double now = currentTime();
+  bool running = false;
+  Child* stalled = 0;
+  for (ChildList::iterator i = self->childrenVal.begin(),
+         e = self->childrenVal.end(); i != e; ++i) {
+    Child* c = i->get();
+    if (!c->transfer.running()) continue;
+    running = true;
+    if (c->source()->paused()) {
+      c->transfer.wait(now);
+      continue;
+    }
+    c->transfer.progress(c->source()->progress()->currentSize(), now);
+    if (stalled == 0 && c->transfer.stalled(now)) stalled = c;
+  }
+  if (!running) {
+    self->stallCheckId = 0;
+    return FALSE; // startTransfer() registers us again
+  }
+  if (stalled != 0) self->childStalled(stalled);
+  return TRUE; // "Call me again"; if self was deleted, ignored by glib
+}
+
+/* Bandwidth-aware: If the download is likely to finish sooner at its
+   current speed than a new one at the typical speed, keep it. */
+void MakeImageDl::childStalled(Child* c) {
+  vector<string> next;
+  c->urls->peek(&next, 1);
+  if (next.empty()) return; // Nowhere else to go, keep waiting
+  SingleUrl* dl = dynamic_cast<SingleUrl*>(c->source());
+  Paranoid(dl != 0);
+  const Progress* p = dl->progress();
+  double speed = c->transfer.speed();
+  double typical = UrlTransfer::typicalSpeed();
+  if (speed > 0.0 && typical > 0.0
+      && p->dataSize() > p->currentSize()
+      && (p->dataSize() - p->currentSize()) / speed
+         < p->dataSize() / typical)
+    return;
+
+  debug("childStalled: %1 at %2 bytes/sec, typical %3",
+        dl->location(), speed, typical);
+  dl->stop();
+  string err = _("Download stalled, trying another server");
+  // Child::job_failed() calls childFailed(), which tries the next URL
+  IOSOURCE_SEND(DataSource::IO, dl->io, job_failed, (err));
+}
+//______________________________________________________________________
+
 /* Called by Child when the download has succeeded: Rename a '~' download to
    '-' to indicate that it is complete. */
 void MakeImageDl::singleUrlFinished(Child* c) {
@@ -411,6 +497,7 @@ void MakeImageDl::singleUrlFinished(Child* c) {
     generateError(err);
     return;
   }
+  if (stateVal == DOWNLOADING_TEMPLATE) templateName = destName;
 }
 //______________________________________________________________________
 
@@ -420,6 +507,15 @@ void MakeImageDl::childFailed(Child* c) {
 # endif
 
   IOSOURCE_SEND(IO, io, makeImageDl_finished, (c->source()));
+  // Lower the score of the server, before choosing the next one
+  c->transfer.finished(false, currentTime());
+  if (c->part != Child::NO_PART) {
+    // Must not delete c's SingleUrl from within its data callback
+    c->failed = true;
+    if (partFailedId == 0)
+      partFailedId = g_idle_add(&partFailed_callback, (gpointer)this);
+    return;
+  }
 
   // Delete partial output file if it is empty
   if (dynamic_cast<SingleUrl*>(c) != 0) {
@@ -433,7 +529,6 @@ void MakeImageDl::childFailed(Child* c) {
   if (c->urls.get() != 0) {
     while (true) {
       c->deleteSource();
-      // TODO: Punish servers in lastUrl for failure, by decreasing their score
       /* TODO: If old download was just interrupted, retry connecting a
          couple of further times and resume, but (really?) only do this after
          trying other download locations first. */
@@ -443,6 +538,7 @@ void MakeImageDl::childFailed(Child* c) {
       debug("childFailed: Trying next URL %1", url);
       if (childFor(url, (c->checkContent ? &c->md : 0), 0, c) != 0) {
         Paranoid(c->source() != 0);
+        startTransfer(c);
         c->source()->run();
         return;
       }
@@ -491,12 +587,23 @@ void MakeImageDl::Child::job_succeeded() {
 # if DEBUG
   childSuccFail = true;
 # endif
+  if (transfer.running()) {
+    double now = currentTime();
+    transfer.progress(source()->progress()->currentSize(), now);
+    transfer.finished(true, now);
+  }
   IOSOURCE_SEND(MakeImageDl::IO, master()->io,
                 makeImageDl_finished, (source()));
+  if (part != NO_PART) {
+    master()->partFinished(this); // Deletes this
+    return;
+  }
 
   // For SingleUrls, maybe rename cache entry
   if (dynamic_cast<SingleUrl*>(source()) != 0)
     master()->singleUrlFinished(this);
+  else if (master()->state() == DOWNLOADING_TEMPLATE)
+    master()->templateName = source()->location(); // CachedUrl filename
   // singleUrlSucceeded() calls this - also call it for other sources
   deleteSource();
 
@@ -518,6 +625,11 @@ void MakeImageDl::Child::dataSource_data(const Ubyte* data, unsigned size,
   // Desired checksum is in md; calculate actual checksum in mdCheck
   if (checkContent)
     mdCheck.update(data, size);
+  if (part != NO_PART)
+    master()->partData(this, data, size);
+  // For a split download, the progress includes data not yet passed to us
+  if (transfer.running())
+    transfer.progress(source()->progress()->currentSize(), currentTime());
 }
 
 //======================================================================
@@ -584,8 +696,211 @@ void MakeImageDl::templateFinished() {
   if (finalState()) return; // I.e. there was an error
   Paranoid(stateVal == DOWNLOADING_TEMPLATE);
 
-#warning "todo: mi.templateFinished();"
-  //mi.templateFinished();
+  stateVal = CREATING_IMAGE;
+
+  string imageTmp = dest;
+  imageTmp += DIRSEP;
+  imageTmp += imageName();
+  imageTmp += EXTSEPS"tmp";
+  try {
+    mi.open(imageTmp, templateName, false);
+  } catch (Error e) {
+    generateError(e.message);
+    return;
+  }
+  string info = _("Creating image");
+  IOSOURCE_SEND(IO, io, job_message, (info));
+  /* Write the image data in small chunks, so the GUI stays responsive
+     and the data of parts can be passed to mi in the meantime */
+  callbackId = g_idle_add(&makeImage_callback, (gpointer)this);
+  startParts();
+}
 
-//   stateVal = DOWNLOADING____;
+gboolean MakeImageDl::makeImage_callback(gpointer mi) {
+  MakeImageDl* self = static_cast<MakeImageDl*>(mi);
+  bool more;
+  try {
+    more = self->mi.work();
+  } catch (Error e) {
+    self->callbackId = 0;
+    self->generateError(e.message);
+    return FALSE;
+  }
+  if (!self->mi.bufferFull()) self->contParts();
+  if (more) return TRUE; // "Call me again"
+  debug("makeImage_callback: %1 laid out", self->imageName());
+  self->callbackId = 0;
+  self->imageFinished();
+  return FALSE;
+}
+//______________________________________________________________________
+
+void MakeImageDl::startParts() {
+  while (!finalState() && runningParts < maxParts
+         && nextPart < mi.partCount()) {
+    size_t n = nextPart++;
+    const MakeImage::Part& p = mi.part(n);
+    if (p.finished) continue; // Already in the .tmp file
+    // JigdoIO only knows about URLs of MD5 checksums
+    PartUrlMapping* urls = (p.sha ? 0 : urlMap[p.md5]);
+    if (urls == 0) {
+      Base64String b64;
+      if (p.sha)
+        b64.write(p.sha256.sum, 32).flush();
+      else
+        b64.write(p.md5.sum, 16).flush();
+      string err = subst(_("No URL known for the file with checksum %1"),
+                         b64.result());
+      IOSOURCE_SEND(IO, io, job_message, (err));
+      ++failedParts;
+      continue;
+    }
+    unique_ptr<vector<UrlMapping*> > lastUrl(new vector<UrlMapping*>);
+    string url = urls->enumerate(lastUrl.get());
+    Child* c = childForPart(url, n);
+    c->urls = urls;
+    c->lastUrl = lastUrl.release();
+    ++runningParts;
+    startTransfer(c);
+    c->source()->run();
+  }
+}
+
+/* There is no cache entry for parts: The data is checksummed by mi and
+   written straight to the .tmp file. */
+MakeImageDl::Child* MakeImageDl::childForPart(const string& url, size_t n,
+                                              Child* reuseChild) {
+  const MakeImage::Part& p = mi.part(n);
+  debug("childForPart: %1 for offset %2", url, p.offsets.front());
+  unique_ptr<SingleUrl> dl(new SingleUrl(url));
+  dl->setDestination(0, 0, p.size); // Fails if the server reports another size
+  Child* c;
+  if (reuseChild)
+    c = reuseChild->init(this, &childrenVal, dl.get(), 0);
+  else
+    c = new Child(this, &childrenVal, dl.get(), 0);
+  c->part = n;
+  string destDesc = subst(_("%1, offset %2"), imageName(), p.offsets.front());
+  IOSOURCE_SEND(IO, io, makeImageDl_new, (dl.get(), url, destDesc));
+  dl.release();
+  return c;
+}
+//________________________________________
+
+void MakeImageDl::partData(Child* c, const Ubyte* data, unsigned size) {
+  if (finalState()) return;
+  // Without a reported size, more data may arrive; checksums cover the rest
+  const MakeImage::Part& p = mi.part(c->part);
+  if (size > p.size - p.received)
+    size = static_cast<unsigned>(p.size - p.received);
+  if (size == 0) return;
+  try {
+    if (mi.partData(c->part, data, size) || c->waiting) return;
+  } catch (Error e) {
+    generateError(e.message);
+    return;
+  }
+  debug("partData: Buffer full, pausing %1", c->source()->location());
+  c->waiting = true;
+  c->source()->pause();
+}
+
+void MakeImageDl::contParts() {
+  for (ChildList::iterator i = childrenVal.begin(), e = childrenVal.end();
+       i != e; ++i) {
+    Child* c = i->get();
+    if (!c->waiting) continue;
+    c->waiting = false;
+    if (c->source() != 0 && c->source()->paused()) c->source()->cont();
+  }
+}
+//________________________________________
+
+void MakeImageDl::partFinished(Child* c) {
+  const char* wrong = mi.partFinished(c->part);
+  if (wrong != 0) {
+    // mi has discarded the data
+    string err = subst(_("Download of `%1' failed (%2)"),
+                       c->source()->location(), wrong);
+    IOSOURCE_SEND(IO, io, job_message, (err));
+    partFailed(c);
+    return;
+  }
+  debug("partFinished: %1", c->source()->location());
+  delete c;
+  --runningParts;
+  if (++unsavedParts >= SAVE_INTERVAL && mi.laidOut()) {
+    try {
+      mi.save();
+    } catch (Error e) {
+      generateError(e.message);
+      return;
+    }
+    unsavedParts = 0;
+  }
+  startParts();
+  imageFinished();
+}
+
+gboolean MakeImageDl::partFailed_callback(gpointer mi) {
+  MakeImageDl* self = static_cast<MakeImageDl*>(mi);
+  self->partFailedId = 0;
+  // partFailed() changes the list, start again after each call
+  bool found = true;
+  while (found) {
+    found = false;
+    for (ChildList::iterator i = self->childrenVal.begin(),
+           e = self->childrenVal.end(); i != e; ++i) {
+      Child* c = i->get();
+      if (!c->failed) continue;
+      self->partFailed(c);
+      found = true;
+      break;
+    }
+  }
+  return FALSE; // "Don't call me again"
+}
+
+void MakeImageDl::partFailed(Child* c) {
+  mi.partFailed(c->part);
+  string url;
+  if (!finalState() && c->urls.get() != 0)
+    url = c->urls->enumerate(c->lastUrl);
+  c->deleteSource();
+  if (!url.empty()) {
+    // Reuse this Child object for the next URL
+    debug("partFailed: Trying next URL %1", url);
+    childForPart(url, c->part, c);
+    startTransfer(c);
+    c->source()->run();
+    return;
+  }
+  delete c;
+  --runningParts;
+  ++failedParts;
+  startParts();
+  imageFinished();
+}
+//________________________________________
+
+void MakeImageDl::imageFinished() {
+  if (finalState() || !mi.laidOut() || runningParts > 0
+      || nextPart < mi.partCount())
+    return;
+  string imageFile = dest;
+  imageFile += DIRSEP;
+  imageFile += imageName();
+  try {
+    if (!mi.finish(imageFile)) {
+      string err = subst(_("%1 files could not be downloaded - start the "
+                           "download again to retry"), failedParts);
+      generateError(err);
+      return;
+    }
+  } catch (Error e) {
+    generateError(e.message);
+    return;
+  }
+  stateVal = COMPLETE;
+  IOSOURCE_SEND(IO, io, job_succeeded, ());
 }
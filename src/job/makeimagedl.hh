@@ -58,11 +58,15 @@
       immediately returns its data, or does an If-Modified-Since request; if
       partially downloaded, resumes.
 
-      <li>Starts further SingleURLs for download of individual parts.
+      <li>Starts further SingleURLs for download of individual parts. Their
+      data is not stored in the cache, but passed to MakeImage as it
+      arrives.
 
       <li>Automatic server selection: For servers which were rated equally
       acceptable by the user, measures their speed, then prefers the faster
-      ones (but does not completely stop using the slower ones).
+      ones (but does not completely stop using the slower ones). The
+      measurements are recorded with the UrlMappings of each download's URL,
+      see UrlTransfer. If a download stalls, it is moved to the next URL.
 
     </ul>
 
@@ -80,10 +84,22 @@ public:
       includes. Once exceeded, io->job_failed() is called. */
   static const int MAX_INCLUDES = 100;
 
+  /** Split downloads of large files (the .template, parts) into up to this
+      many ranges, see SingleUrl::setRanges(). The ranges are fetched from
+      the next servers that the file's PartUrlMapping lists. 0 or 1 (the
+      default) means no splitting. */
+  static unsigned maxRanges;
+
+  /** Nr of parts downloaded at the same time once the template is there,
+      default 4 */
+  static unsigned maxParts;
+
   enum State {
     DOWNLOADING_JIGDO,
     DOWNLOADING_TEMPLATE,
+    CREATING_IMAGE, // Laying out the .tmp file, downloading parts
     FINAL_STATE, // Value isn't actually used; all below are final states:
+    COMPLETE, // Image moved to its final name
     ERROR
   };
 
@@ -248,6 +264,24 @@ private: // To be called by Child only:
   // Called from Child::job_succeeded() when the template d/l has finished
   void templateFinished();
 
+  /* If c's source is a SingleUrl, set it up to split the download, and
+     measure it for server selection */
+  void startTransfer(Child* c);
+  /* The download of c has stalled, maybe give up and try the next URL.
+     Might delete c and this. */
+  void childStalled(Child* c);
+
+  // Pass data of a part download to mi, pause c if mi buffers too much
+  void partData(Child* c, const Ubyte* data, unsigned size);
+  // A part download has succeeded, check its data. Deletes c.
+  void partFinished(Child* c);
+  /* A part download has failed or its data was wrong: Try the next URL.
+     If none is left, go on without the part. Deletes c. */
+  void partFailed(Child* c);
+  /* Calls partFailed() for children marked as failed by childFailed(),
+     which can be called while the SingleUrl delivers data */
+  static gboolean partFailed_callback(gpointer);
+
 private: // Really private
 
   // Write a ReadMe.txt to the download dir; fails silently
@@ -283,6 +317,17 @@ private: // Really private
   Child* childForSemiCompleted(const struct stat& fileInfo,
     const string& filename, Child* reuseChild);
 
+  /* Start downloads of parts missing from the image, up to maxParts at a
+     time */
+  void startParts();
+  // Return child whose SingleUrl fetches part n of mi from url
+  Child* childForPart(const string& url, size_t n, Child* reuseChild = 0);
+  // Continue part downloads that partData() paused
+  void contParts();
+  /* If the image is laid out and all part downloads have ended, move it
+     to its final name. If some parts are missing, keep the .tmp file. */
+  void imageFinished();
+
   //static const char* destDescTemplateVal;
 
   State stateVal; // State, e.g. "downloading jigdo file", "error"
@@ -296,16 +341,31 @@ private: // Really private
 
   // Workhorse which actually generates the image from the data we feed it
   MakeImage mi;
+  size_t nextPart; // Index of next part of mi considered by startParts()
+  unsigned runningParts; // Nr of children which download parts
+  unsigned failedParts; // Nr of parts whose URLs have all failed
+  unsigned unsavedParts; // Nr of parts finished since last mi.save()
+  // mi's DESC section is rewritten after this many parts were finished
+  static const unsigned SAVE_INTERVAL = 30;
 
   // Info about first image section of this .jigdo, if any
   string imageNameVal;
   string imageInfoVal, imageShortInfoVal;
   SmartPtr<PartUrlMapping> templateUrls; // Can contain a list of altern. URLs
   MD5* templateMd5Val;
+  string templateName; // Cache entry with .template data, once downloaded
 
   static gboolean jigdoFinished_callback(gpointer);
   void jigdoFinished2();
+  /* Calls mi.work() whenever glib is idle, until the image is laid out.
+     Also continues paused part downloads once mi's buffer has room. */
+  static gboolean makeImage_callback(gpointer);
   int callbackId; // glib callback function ID
+  // Regularly checks whether child downloads have stalled
+  static gboolean stallCheck_callback(gpointer);
+  int stallCheckId;
+  int partFailedId;
+  static const int STALL_CHECK_INTERVAL = 5000;
 };
 //______________________________________________________________________
 
@@ -431,9 +491,12 @@ public:
   bool childSuccFail;
 # endif
 
+  // Value of part if the Child does not download a part of the image
+  static const size_t NO_PART = ~static_cast<size_t>(0);
+
 private:
 
-  // (Re)initialize data members, except for urls and lastUrl. Returns this
+  // (Re)initialize data members, except urls, lastUrl and part. Returns this
   inline Child* init(MakeImageDl* m, ChildList* list,
                      DataSource* src, const MD5* expectedContent);
 
@@ -452,6 +515,10 @@ private:
   MD5Sum mdCheck; // Only if contentMd==true, used to calculate actual checksum
   SmartPtr<PartUrlMapping> urls; // Null if only a single URL (.jigdo d/l)
   vector<UrlMapping*>* lastUrl; // To record last URL output by templateUrls
+  UrlTransfer transfer; // Only running if urls non-null and a SingleUrl
+  size_t part; // Index of the part in master's MakeImage, or NO_PART
+  bool waiting; // Paused by partData() until the MakeImage has room
+  bool failed; // Download of part failed, for partFailed_callback()
 };
 //======================================================================
 
@@ -495,6 +562,7 @@ Job::MakeImageDl::Child* Job::MakeImageDl::childFor(PartUrlMapping* urls,
   if (c != 0) {
     c->urls = urls;
     c->lastUrl = lastUrl.release();
+    startTransfer(c);
   }
   return c;
 }
@@ -512,6 +580,8 @@ Job::MakeImageDl::Child* Job::MakeImageDl::Child::init(MakeImageDl* m,
   sourceVal = src;
   checkContent = (expectedContent != 0);
   if (expectedContent != 0) md = *expectedContent; else md.clear();
+  mdCheck.reset(); // Forget data of earlier URL if reused by childFailed()
+  waiting = failed = false;
 # if DEBUG
   childSuccFail = false;
 # endif
@@ -523,7 +593,8 @@ Job::MakeImageDl::Child* Job::MakeImageDl::Child::init(MakeImageDl* m,
 Job::MakeImageDl::Child::Child(MakeImageDl* m, ChildList* list,
                                DataSource* src, const MD5* expectedContent)
   : ChildListBase(), Job::DataSource::IO(),
-    md(), mdCheck(), urls(), lastUrl(0) {
+    md(), mdCheck(), urls(), lastUrl(0), transfer(), part(NO_PART),
+    waiting(false), failed(false) {
   Paranoid(list != 0);
   init(m, list, src, expectedContent);
   // Add ourself to parent's list of children
@@ -0,0 +1,265 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Test for SingleUrl::setRanges(): Split downloads from a local HTTP
+  server which honours or ignores Range, drops connections or sends 404
+
+  #test-deps job/single-url.o job/datasource.o net/download.o
+  #test-deps util/bstream.o util/progress.o glibcurl/glibcurl.o
+  #test-ldflags $(CURLLIBS) $(LDFLAGS_WINSOCK)
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if !WINDOWS
+#  include <netinet/in.h>
+#  include <poll.h>
+#  include <signal.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+
+#include <glib.h>
+
+#include <debug.hh>
+#include <download.hh>
+#include <log.hh>
+#include <single-url.hh>
+//______________________________________________________________________
+
+using namespace Job;
+
+namespace {
+
+  const char* const fileName = "single-url-test.tmp";
+  const uint64 SIZE = 3 * SingleUrl::MIN_RANGE_SIZE + 12345;
+  vector<Ubyte> testData;
+
+  /* Receives the data of the SingleUrl, checks that it arrives in order
+     and that nothing arrives after the job succeeded or failed, which ends
+     the main loop. */
+  struct TestIo : DataSource::IO {
+    TestIo() : done(false), ok(false) { }
+    void job_deleted() { }
+    void job_succeeded() { Assert(!done); done = ok = true; }
+    void job_failed(const string& message) {
+      msg("job_failed: %1", message);
+      Assert(!done);
+      done = true;
+    }
+    void job_message(const string&) { }
+    void dataSource_dataSize(uint64) { Assert(!done); }
+    void dataSource_data(const Ubyte* d, unsigned size, uint64 current) {
+      Assert(!done);
+      Assert(current == received.size() + size);
+      received.insert(received.end(), d, d + size);
+    }
+    vector<Ubyte> received;
+    bool done, ok;
+  };
+
+# if !WINDOWS
+  int serverPort;
+  pid_t serverPid;
+
+  /* Offsets at which /d/ requests already dropped the connection. Shared
+     between the processes which handle the connections. */
+  struct Dropped { unsigned count; uint64 offset[64]; };
+  Dropped* dropped;
+
+  void sendAll(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+      ssize_t n = write(fd, p, len);
+      if (n <= 0) _exit(0); // Client closed the connection
+      p += n; len -= n;
+    }
+  }
+
+  /* Handle one request. The first char of the path selects the behaviour:
+     /r/ honours Range, /n/ ignores it, /d/ drops the connection after 1MB
+     the first time a piece larger than 2MB is requested from an offset,
+     /x/ always returns 404. */
+  void serve(int fd) {
+    string req;
+    char buf[1024];
+    while (req.find("\r\n\r\n") == string::npos) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0) return;
+      req.append(buf, n);
+    }
+    char mode = (req.size() > 5 ? req[5] : 'x'); // "GET /r/..."
+    if (mode == 'x') {
+      const char* notFound = "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+      sendAll(fd, notFound, strlen(notFound));
+      return;
+    }
+    uint64 start = 0, end = SIZE;
+    bool partial = false;
+    string::size_type r = req.find("Range: bytes=");
+    if (r != string::npos && mode != 'n') {
+      unsigned long long first, last;
+      int n = sscanf(req.c_str() + r + 13, "%llu-%llu", &first, &last);
+      Assert(n >= 1);
+      start = first;
+      if (n == 2) end = last + 1;
+      partial = true;
+    }
+    string head;
+    if (partial) {
+      head = subst("HTTP/1.1 206 Partial Content\r\n"
+                   "Content-Range: bytes %1-%2/%3\r\n", start, end - 1, SIZE);
+    } else {
+      head = "HTTP/1.1 200 OK\r\n";
+    }
+    head += subst("Content-Length: %1\r\nConnection: close\r\n\r\n",
+                  end - start);
+    sendAll(fd, head.data(), head.size());
+    uint64 len = end - start;
+    if (mode == 'd' && len > 2000000) {
+      bool seen = false;
+      for (unsigned i = 0; i < dropped->count; ++i)
+        if (dropped->offset[i] == start) seen = true;
+      if (!seen && dropped->count < 64) {
+        dropped->offset[dropped->count++] = start;
+        len = 1000000;
+      }
+    }
+    sendAll(fd, &testData[start], len);
+  }
+
+  // Fork a server process listening on a free port of 127.0.0.1
+  void startServer() {
+    void* mem = mmap(0, sizeof(Dropped), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    Assert(mem != MAP_FAILED);
+    dropped = static_cast<Dropped*>(mem);
+    dropped->count = 0;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    Assert(s >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    Assert(bind(s, reinterpret_cast<sockaddr*>(&addr), addrLen) == 0);
+    Assert(listen(s, 16) == 0);
+    Assert(getsockname(s, reinterpret_cast<sockaddr*>(&addr), &addrLen)
+           == 0);
+    serverPort = ntohs(addr.sin_port);
+    pid_t parent = getpid();
+    serverPid = fork();
+    Assert(serverPid >= 0);
+    if (serverPid > 0) { close(s); return; }
+    /* Server process, one child per connection. Exits once the test is
+       gone, also if it died because of a failed assertion. */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    while (getppid() == parent) {
+      struct pollfd p = { s, POLLIN, 0 };
+      if (poll(&p, 1, 1000) <= 0) continue;
+      int fd = accept(s, 0, 0);
+      if (fd < 0) continue;
+      if (fork() == 0) {
+        close(s);
+        serve(fd);
+        close(fd);
+        _exit(0);
+      }
+      close(fd);
+    }
+    _exit(0);
+  }
+
+  void stopServer() {
+    kill(serverPid, SIGTERM);
+  }
+
+  string url(char mode) {
+    return subst("http://127.0.0.1:%1/%2/data", serverPort, mode);
+  }
+
+  /* Download from url(mode) in up to n pieces, also using the given
+     mirrors. Returns true if the job succeeded; in that case, the data
+     was passed to the IO in order and is also in the output file. */
+  bool fetch(char mode, unsigned n, const char* mirrors,
+             uint64 expectedSize = 0, bool* split = 0) {
+    msg("fetch %1 ranges=%2 mirrors=%3", mode, n, mirrors);
+    vector<string> mirrorUrls;
+    for (const char* m = mirrors; *m != '\0'; ++m)
+      mirrorUrls.push_back(url(*m));
+    SmartPtr<BfstreamCounted> f(new BfstreamCounted(fileName,
+        ios::binary | ios::in | ios::out | ios::trunc));
+    TestIo io;
+    bool result;
+    {
+      SingleUrl s(url(mode));
+      s.io.addListener(io);
+      s.setRanges(n, mirrorUrls);
+      s.setDestination(f.get(), 0, expectedSize);
+      s.run();
+      while (!io.done) g_main_context_iteration(0, TRUE);
+      if (split != 0) *split = s.split();
+      result = io.ok;
+      if (result) Assert(s.succeeded());
+    }
+    if (!result) return false;
+    Assert(io.received == testData);
+    vector<Ubyte> written(testData.size() + 1);
+    f->clear();
+    f->seekg(0, ios::beg);
+    readBytes(*f, &written[0], written.size());
+    written.resize(f->gcount());
+    Assert(written == testData);
+    return true;
+  }
+# endif
+
+}
+//______________________________________________________________________
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+# if WINDOWS
+  msg("Skipped, needs fork()");
+# else
+  testData.resize(SIZE);
+  for (size_t i = 0; i < testData.size(); ++i)
+    testData[i] = static_cast<Ubyte>(rand() >> 8);
+  startServer();
+  alarm(300);
+  Download::init();
+  bool split;
+
+  // Server supports ranges: Split into pieces, data arrives in order
+  Assert(fetch('r', 3, "", 0, &split) && split);
+
+  // Server ignores Range: The first connection fetches everything
+  Assert(fetch('n', 3, ""));
+
+  // 404 from a mirror: Its pieces are moved to the next server
+  Assert(fetch('r', 3, "xr"));
+
+  // Pieces are interrupted once each: Resumed individually
+  Assert(fetch('d', 3, ""));
+
+  // Size does not match the expected one: Fails, nothing after job_failed
+  Assert(!fetch('r', 3, "", SIZE + 1, &split) && !split);
+
+  Download::cleanup();
+  stopServer();
+  remove(fileName);
+# endif
+  return 0;
+}
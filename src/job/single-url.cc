@@ -22,6 +22,7 @@
 #include <glib.h>
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 #include <autoptr.hh>
 #include <debug.hh>
@@ -34,17 +35,68 @@ using namespace Job;
 
 DEBUG_UNIT("single-url")
 
+/* One piece [begin;end) of a split download, fetched with its own
+   Download. The first done bytes of it have been written to destStream. */
+class SingleUrl::Range : private Download::Output {
+public:
+  Range(SingleUrl* m, size_t u, uint64 b, uint64 e)
+    : master(m), download(), uriNr(u), uriFailures(0), begin(b), end(e),
+      done(0), resumeLeft(0), tries(0), active(false), needRun(false),
+      finished(false), orphan(false), error() { }
+  // (Re)start download, resuming after the first done bytes
+  void run();
+  void stop();
+
+  SingleUrl* master;
+  unique_ptr<Download> download;
+  size_t uriNr; // Index into master->rangeUris
+  size_t uriFailures; // Nr of servers which failed permanently
+  uint64 begin, end, done;
+  unsigned resumeLeft; // >0: Nr of bytes of resume overlap left
+  int tries; // Nr of tries with the current server
+  bool active; // Download running, its data is used
+  bool needRun; // runRanges_callback() is to call run()
+  bool finished;
+  bool orphan; // All servers failed, left to master->download
+  string error; // If orphan, the last server's error message
+
+private:
+  // Virtual methods from Download::Output
+  virtual void download_dataSize(uint64 n);
+  virtual void download_data(const Ubyte* data, unsigned size,
+                             uint64 currentSize);
+  virtual void download_succeeded();
+  virtual void download_failed(string* message);
+  virtual void download_message(string* message);
+};
+//______________________________________________________________________
+
 SingleUrl::SingleUrl(/*IOPtr DataSource::IO* ioPtr, */const string& uri)
   : DataSource(/*ioPtr*/), download(uri, this), progressVal(),
     destStreamVal(0), destOff(0), destEndOff(0), resumeLeft(0),
     haveResumeOffset(false), haveDestination(false),
-    /*havePragmaNoCache(false),*/ tries(0) {
+    /*havePragmaNoCache(false),*/ tries(0), maxRanges(0), rangeUris(),
+    mainEnd(0), mainDone(0), ranges(), frontier(0), rangesDone(false),
+    rangeErrorVal(), runRangesId(0), absorbed() {
   debug("SingleUrl %1", this);
 }
 //________________________________________
 
 SingleUrl::~SingleUrl() {
   debug("~SingleUrl %1", this);
+  if (runRangesId != 0) g_source_remove(runRangesId);
+  deleteRanges();
+}
+
+void SingleUrl::deleteRanges() {
+  for (vector<Range*>::iterator i = ranges.begin(), e = ranges.end();
+       i != e; ++i)
+    delete *i;
+  ranges.clear();
+  for (vector<Range*>::iterator i = absorbed.begin(), e = absorbed.end();
+       i != e; ++i)
+    delete *i;
+  absorbed.clear();
 }
 
 const Progress* SingleUrl::progress() const { return &progressVal; }
@@ -73,12 +125,28 @@ void SingleUrl::setDestination(BfstreamCounted* destStream,
   haveDestination = true;
 }
 
+void SingleUrl::setRanges(unsigned n, const vector<string>& mirrors) {
+  maxRanges = n;
+  rangeUris.assign(1, download.uri());
+  for (vector<string>::const_iterator i = mirrors.begin(), e = mirrors.end();
+       i != e; ++i)
+    if (*i != download.uri()) rangeUris.push_back(*i);
+}
+
 void SingleUrl::run() {
   debug("SingleUrl %1 run()", this);
   if (!haveResumeOffset) setResumeOffset(0);
   haveResumeOffset = false;
   if (!haveDestination) setDestination(0, 0, 0);
   haveDestination = false;
+
+  // Forget about any earlier split download
+  if (runRangesId != 0) g_source_remove(runRangesId);
+  runRangesId = 0;
+  deleteRanges();
+  mainEnd = mainDone = frontier = 0;
+  rangesDone = false;
+  rangeErrorVal.erase();
 //   if (!havePragmaNoCache) setPragmaNoCache(false);
 //   havePragmaNoCache = false;
 
@@ -112,8 +180,15 @@ void SingleUrl::download_dataSize(uint64 n) {
     progressVal.setDataSize(n);
   } else {
     // Error if reported size of object does not match expected one
-    if (n > 0 && n != progressVal.dataSize()) resumeFailed();
+    if (n > 0 && n != progressVal.dataSize()) {
+      resumeFailed();
+      return; // job_failed was sent, do not start any ranges
+    }
   }
+  if (maxRanges > 1 && !split() && download.resumeOffset() == 0
+      && !download.interrupted() && destStream() != 0
+      && n >= 2 * MIN_RANGE_SIZE)
+    splitRanges(n);
   if (!resuming()) {
     IOSOURCE_SEND(DataSource::IO, io, dataSource_dataSize, (n));
     return;
@@ -159,7 +234,8 @@ bool SingleUrl::writeToDestStream(uint64 off, const Ubyte* data,
 void SingleUrl::download_data(const Ubyte* data, unsigned size,
                               uint64 currentSize) {
 # if DEBUG
-  Paranoid(resuming() || progressVal.currentSize() == currentSize - size);
+  Paranoid(resuming() || split()
+           || progressVal.currentSize() == currentSize - size);
   //g_usleep(10000);
   string s;
   unsigned limit = (size < 60 ? size : 60);
@@ -174,6 +250,22 @@ void SingleUrl::download_data(const Ubyte* data, unsigned size,
       && !download.paused())
     progressVal.setAutoTick(true);
 
+  if (mainEnd != 0) {
+    // Split download, we only fetch the first range
+    uint64 off = currentSize - size;
+    if (off >= mainEnd || !rangeErrorVal.empty()) return;
+    if (currentSize > mainEnd) absorbRanges();
+    if (currentSize > mainEnd) size = static_cast<unsigned>(mainEnd - off);
+    mainDone = off + size;
+    if (rangeData(off, data, size) == FAILURE) return;
+    if (mainDone == mainEnd) {
+      download.stop(); // The other ranges fetch the rest of the data
+      mainRangeEnded(false, string());
+    }
+    return;
+  }
+  if (split()) return; // Stopped by code above, more data arrived
+
   if (!resuming()) {
     // Normal case: Just write it to file and forward it downstream
     progressVal.setCurrentSize(currentSize);
@@ -192,35 +284,11 @@ void SingleUrl::download_data(const Ubyte* data, unsigned size,
   debug("RESUME left=%1 off=%2 fileoff=%3", resumeLeft,
         destOff + currentSize - size, destOff + currentSize - size);
 
-  // Read from file
-  unsigned toRead = min(resumeLeft, size);
-  Ubyte buf[toRead];
-  Ubyte* bufEnd = buf + toRead;
-  Ubyte* b = buf;
-  destStream()->seekg(destOff + currentSize - size, ios::beg);
-  while (*destStream() && toRead > 0) {
-    readBytes(*destStream(), b, toRead);
-    size_t n = destStream()->gcount();
-    //debug("during resume: read %1", n);
-    b += n;
-    toRead -= n;
-  }
-  if (toRead > 0 && !*destStream()) {
-    debug("  Error toRead=%1 `%L2'", toRead, strerror(errno));
+  if (resumeCompare(destOff + currentSize - size, &data, &size, &resumeLeft)
+      == FAILURE) {
     resumeFailed(); return;
   }
 
-  // Compare
-  b = buf;
-  while (size > 0 && b < bufEnd) {
-    if (*data != *b) {
-      resumeFailed();
-      debug("  fromfile=%1 fromnet=%2", int(*b), int(*data));
-      return;
-    }
-    ++data; ++b; --size; --resumeLeft;
-  }
-
   string info = subst(_("Resuming... %1kB"), resumeLeft / 1024);
   IOSOURCE_SEND(DataSource::IO, io, job_message, (info));
 
@@ -240,13 +308,55 @@ void SingleUrl::download_data(const Ubyte* data, unsigned size,
 }
 //______________________________________________________________________
 
+bool SingleUrl::resumeCompare(uint64 off, const Ubyte** data,
+                              unsigned* size, unsigned* left) {
+  // Read from file
+  unsigned toRead = min(*left, *size);
+  Ubyte buf[toRead];
+  Ubyte* bufEnd = buf + toRead;
+  Ubyte* b = buf;
+  destStream()->seekg(off, ios::beg);
+  while (*destStream() && toRead > 0) {
+    readBytes(*destStream(), b, toRead);
+    size_t n = destStream()->gcount();
+    //debug("during resume: read %1", n);
+    b += n;
+    toRead -= n;
+  }
+  if (toRead > 0 && !*destStream()) {
+    debug("  Error toRead=%1 `%L2'", toRead, strerror(errno));
+    return FAILURE;
+  }
+
+  // Compare
+  b = buf;
+  while (*size > 0 && b < bufEnd) {
+    if (**data != *b) {
+      debug("  fromfile=%1 fromnet=%2", int(*b), int(**data));
+      return FAILURE;
+    }
+    ++*data; ++b; --*size; --*left;
+  }
+  return SUCCESS;
+}
+//______________________________________________________________________
+
 void SingleUrl::download_succeeded() {
+  if (split()) {
+    // Server closed connection before end of first range, resume it
+    if (mainEnd != 0) mainRangeEnded(true, _("Transfer interrupted"));
+    return;
+  }
   progressVal.setAutoTick(false);
   IOSOURCE_SEND(DataSource::IO, io, job_succeeded, ());
 }
 //______________________________________________________________________
 
 void SingleUrl::download_failed(string* message) {
+  if (split()) {
+    if (mainEnd != 0) mainRangeEnded(download.interrupted(), *message);
+    return;
+  }
   progressVal.setAutoTick(false);
   IOSOURCE_SEND(DataSource::IO, io, job_failed, (*message));
 }
@@ -265,6 +375,9 @@ bool SingleUrl::paused() const {
 void SingleUrl::pause() {
   Paranoid(!paused());
   download.pause();
+  for (vector<Range*>::iterator i = ranges.begin(), e = ranges.end();
+       i != e; ++i)
+    if ((*i)->active) (*i)->download->pause();
   progressVal.setAutoTick(false);
 }
 
@@ -272,7 +385,307 @@ void SingleUrl::cont() {
   Paranoid(paused());
   progressVal.reset();
   download.cont();
+  for (vector<Range*>::iterator i = ranges.begin(), e = ranges.end();
+       i != e; ++i)
+    if ((*i)->active) (*i)->download->cont();
   // progressVal.setAutoTick(true) called from download_data() later
 }
+
+void SingleUrl::stop() {
+  download.stop();
+  for (vector<Range*>::iterator i = ranges.begin(), e = ranges.end();
+       i != e; ++i)
+    (*i)->stop();
+  // Do not restart ranges
+  if (runRangesId != 0) g_source_remove(runRangesId);
+  runRangesId = 0;
+}
+//______________________________________________________________________
+//======================================================================
+
+/* Downloading a large file over a single connection can be slow if the
+   server is far away or limits the bandwidth per connection. Once the size
+   of the data is known, the "download" object only fetches the first range
+   [0;mainEnd) and stops there. The other ranges are fetched by Range
+   objects at the same time, from different servers if possible. Their data
+   is written to destStream. Whatever data is at the frontier, i.e. follows
+   the data passed to io so far, is passed on immediately. Once a range
+   completes, catchUp() reads the data of the next one back from the file.
+   Since SingleUrl users (e.g. the MakeImageDl::Child) checksum the data
+   passed to io, the final content is verified as before. */
+
+void SingleUrl::splitRanges(uint64 size) {
+  uint64 count = size / MIN_RANGE_SIZE;
+  if (count > maxRanges) count = maxRanges;
+  uint64 rangeSize = size / count;
+  mainEnd = rangeSize;
+  mainDone = frontier = progressVal.currentSize();
+  debug("splitRanges: %1 bytes, %2 ranges", size, count);
+  for (uint64 i = 1; i < count; ++i) {
+    uint64 b = i * rangeSize;
+    Range* r = new Range(this, static_cast<size_t>(i % rangeUris.size()), b,
+                         (i + 1 == count ? size : b + rangeSize));
+    r->needRun = true;
+    ranges.push_back(r);
+  }
+  scheduleRanges(0); // Cannot start downloads from inside libcurl callback
+}
 //______________________________________________________________________
 
+bool SingleUrl::rangeData(uint64 off, const Ubyte* data, unsigned size) {
+  destStream()->seekp(destOff + off, ios::beg);
+  writeBytes(*destStream(), data, size);
+  if (!*destStream()) {
+    rangeError(subst("%L1", strerror(errno)));
+    return FAILURE;
+  }
+  rangeProgress();
+  if (off == frontier) {
+    frontier += size;
+    IOSOURCE_SEND(DataSource::IO, io, dataSource_data, (data, size, frontier));
+  }
+  return SUCCESS;
+}
+
+void SingleUrl::rangeProgress() {
+  uint64 n = (mainEnd != 0 ? mainDone : 0);
+  for (vector<Range*>::const_iterator i = ranges.begin(), e = ranges.end();
+       i != e; ++i)
+    n += (*i)->done;
+  progressVal.setCurrentSize(n);
+}
+//______________________________________________________________________
+
+/* Ranges inside [0;mainEnd) were absorbed and fetched by "download". Any
+   other orphans cannot be fetched from anywhere. */
+void SingleUrl::mainRangeEnded(bool interrupted, const string& message) {
+  vector<Range*>::iterator i = ranges.begin();
+  while (i != ranges.end() && (*i)->end <= mainEnd) {
+    Paranoid((*i)->orphan);
+    absorbed.push_back(*i); // Cannot delete from libcurl callback
+    i = ranges.erase(i);
+  }
+  for (; i != ranges.end(); ++i) {
+    if ((*i)->orphan) {
+      mainEnd = 0; // Not calling rangeFailed() for first range
+      rangeError((*i)->error);
+      return;
+    }
+  }
+
+  Range* r = new Range(this, 0, 0, mainEnd);
+  r->done = mainDone;
+  r->tries = tries;
+  ranges.insert(ranges.begin(), r);
+  mainEnd = 0;
+  if (r->done == r->end)
+    rangeSucceeded(r);
+  else
+    rangeFailed(r, interrupted, message);
+}
+
+void SingleUrl::rangeSucceeded(Range* r) {
+  debug("rangeSucceeded: %1-%2", r->begin, r->end);
+  r->active = false;
+  r->finished = true;
+  scheduleRanges(0);
+}
+
+void SingleUrl::rangeFailed(Range* r, bool interrupted,
+                            const string& message) {
+  r->active = false;
+  if (!rangeErrorVal.empty()) return;
+  debug("rangeFailed: %1-%2 try %3 at %4: %5", r->begin, r->end, r->tries,
+        rangeUris[r->uriNr], message);
+  if (interrupted && r->tries < MAX_TRIES) {
+    r->needRun = true;
+    scheduleRanges(RESUME_DELAY);
+  } else if (++r->uriFailures < rangeUris.size()) {
+    // Continue with next server, RESUME_SIZE overlap checks it is the same
+    r->uriNr = (r->uriNr + 1) % rangeUris.size();
+    r->tries = 0;
+    r->needRun = true;
+    scheduleRanges(0);
+  } else if (mainEnd != 0) {
+    /* E.g. servers do not support ranges. "download" requests the whole
+       file, maybe it can continue into this range. */
+    r->orphan = true;
+    r->done = 0;
+    r->error = message;
+    absorbRanges();
+  } else {
+    rangeError(message);
+  }
+}
+
+/* Extend the range of "download" over the ranges directly after it which
+   have failed or not received any data yet. Those ranges stay in "ranges"
+   until mainRangeEnded(), their downloads are stopped by
+   runRanges_callback(). */
+void SingleUrl::absorbRanges() {
+  for (vector<Range*>::iterator i = ranges.begin(), e = ranges.end();
+       i != e; ++i) {
+    Range* r = *i;
+    if (r->begin != mainEnd || !(r->orphan || r->done == 0)) continue;
+    debug("absorbRanges: %1-%2", r->begin, r->end);
+    r->orphan = true;
+    r->active = r->needRun = false;
+    mainEnd = r->end;
+    scheduleRanges(0);
+  }
+}
+
+void SingleUrl::rangeError(const string& message) {
+  if (!rangeErrorVal.empty()) return;
+  rangeErrorVal = message;
+  setNoResumePossible();
+  progressVal.setAutoTick(false);
+  scheduleRanges(0); // Stops downloads, sends job_failed()
+}
+//______________________________________________________________________
+
+bool SingleUrl::catchUp() {
+  const unsigned CHUNK = 64*1024;
+  Ubyte buf[CHUNK];
+  int chunksLeft = 16; // Limit work per call, for GUI responsiveness
+  while (true) {
+    // How much data is there after frontier?
+    uint64 avail = frontier;
+    for (vector<Range*>::const_iterator i = ranges.begin(),
+           e = ranges.end(); i != e; ++i) {
+      if ((*i)->begin <= frontier && frontier < (*i)->end) {
+        avail = (*i)->begin + (*i)->done;
+        break;
+      }
+    }
+    if (avail <= frontier) return false;
+    if (--chunksLeft < 0) return true;
+
+    unsigned n = (avail - frontier < CHUNK
+                  ? static_cast<unsigned>(avail - frontier) : CHUNK);
+    destStream()->seekg(destOff + frontier, ios::beg);
+    readBytes(*destStream(), buf, n);
+    if (static_cast<size_t>(destStream()->gcount()) != n) {
+      rangeError(subst("%L1", strerror(errno)));
+      return false;
+    }
+    frontier += n;
+    IOSOURCE_SEND(DataSource::IO, io, dataSource_data, (buf, n, frontier));
+  }
+}
+//______________________________________________________________________
+
+void SingleUrl::scheduleRanges(unsigned delay) {
+  if (runRangesId != 0) {
+    if (delay > 0) return; // Already scheduled, maybe earlier
+    g_source_remove(runRangesId);
+  }
+  runRangesId = g_timeout_add(delay, &runRanges_callback, (gpointer)this);
+}
+
+gboolean SingleUrl::runRanges_callback(gpointer data) {
+  SingleUrl* self = static_cast<SingleUrl*>(data);
+  self->runRangesId = 0;
+  if (self->rangesDone) return FALSE;
+
+  if (self->rangeErrorVal.empty() && self->catchUp())
+    self->scheduleRanges(0);
+
+  /* libcurl does not allow Download::stop() for other downloads from
+     within its callbacks, so stop them here */
+  for (vector<Range*>::iterator i = self->absorbed.begin(),
+         e = self->absorbed.end(); i != e; ++i)
+    (*i)->stop();
+  for (vector<Range*>::iterator i = self->ranges.begin(),
+         e = self->ranges.end(); i != e; ++i)
+    if ((*i)->orphan || !self->rangeErrorVal.empty()) (*i)->stop();
+
+  if (!self->rangeErrorVal.empty()) {
+    if (self->mainEnd != 0) self->download.stop();
+    self->rangesDone = true;
+    string error = self->rangeErrorVal;
+    IOSOURCE_SEND(DataSource::IO, self->io, job_failed, (error));
+    return FALSE;
+  }
+
+  bool finished = (self->mainEnd == 0);
+  for (vector<Range*>::iterator i = self->ranges.begin(),
+         e = self->ranges.end(); i != e; ++i) {
+    if ((*i)->needRun) (*i)->run();
+    if (!(*i)->finished) finished = false;
+  }
+  if (finished && self->frontier == self->ranges.back()->end) {
+    debug("runRanges_callback: All %1 ranges done", self->ranges.size());
+    self->rangesDone = true;
+    self->progressVal.setAutoTick(false);
+    IOSOURCE_SEND(DataSource::IO, self->io, job_succeeded, ());
+  }
+  return FALSE;
+}
+//______________________________________________________________________
+
+void SingleUrl::Range::run() {
+  const string& uri = master->rangeUris[uriNr];
+  debug("Range %1-%2: Try %3 at %4, have %5", begin, end, tries + 1, uri,
+        done);
+  needRun = false;
+  active = true;
+  ++tries;
+  // A finished Download cannot be restarted, so always use a new one
+  download.reset(new Download(uri, this));
+  resumeLeft = (done < RESUME_SIZE ? static_cast<unsigned>(done)
+                : RESUME_SIZE);
+  download->setResumeOffset(begin + done - resumeLeft);
+  download->setRangeEnd(end);
+  download->run();
+}
+
+void SingleUrl::Range::stop() {
+  active = needRun = false;
+  if (download.get() != 0) download->stop();
+}
+
+void SingleUrl::Range::download_dataSize(uint64 n) {
+  if (!active || n == end) return;
+  // Server sent the whole file, or its size differs from the first server
+  download->stop();
+  master->rangeFailed(this, false, _("Server sent unexpected data size"));
+}
+
+void SingleUrl::Range::download_data(const Ubyte* data, unsigned size,
+                                     uint64 currentSize) {
+  if (!active || !master->rangeErrorVal.empty()) return;
+  if (resumeLeft > 0) {
+    if (master->resumeCompare(master->destOff + currentSize - size, &data,
+                              &size, &resumeLeft) == FAILURE) {
+      download->stop();
+      master->rangeFailed(this, false, _("Resume failed"));
+      return;
+    }
+    if (size == 0) return;
+  }
+  if (currentSize > end) {
+    download->stop();
+    master->rangeFailed(this, false,
+                        _("Server sent more data than expected"));
+    return;
+  }
+  done = currentSize - begin;
+  if (master->rangeData(currentSize - size, data, size) == FAILURE)
+    download->stop();
+}
+
+void SingleUrl::Range::download_succeeded() {
+  if (!active) return;
+  if (begin + done == end)
+    master->rangeSucceeded(this);
+  else // Connection closed early
+    master->rangeFailed(this, true, _("Transfer interrupted"));
+}
+
+void SingleUrl::Range::download_failed(string* message) {
+  if (!active) return;
+  master->rangeFailed(this, download->interrupted(), *message);
+}
+
+void SingleUrl::Range::download_message(string*) { }
@@ -21,6 +21,9 @@
 #ifndef SINGLE_URL_HH
 #define SINGLE_URL_HH
 
+#include <string>
+#include <vector>
+
 #include <bstream-counted.hh>
 #include <datasource.hh>
 #include <download.hh>
@@ -48,6 +51,9 @@ namespace Job {
       <li>Contains a state machine which handles resuming the download a
       certain number of times if the connection is dropped.
 
+      <li>Optionally splits large downloads into several HTTP range
+      requests, possibly to different servers, see setRanges().
+
     </ul>
 
     This one will forever remain single since there are no single parties
@@ -66,6 +72,8 @@ public:
       is never read by SingleUrl itself, it's just a hint for code using
       SingleUrl. */
   static const int RESUME_DELAY = 3000;
+  /** Minimum size of each piece of a download split with setRanges() */
+  static const uint64 MIN_RANGE_SIZE = 4*1024*1024;
 
   /** Create object, but don't start the download yet - use run() to do that.
       @param uri URI to download */
@@ -98,6 +106,27 @@ public:
   void setDestination(BfstreamCounted* destStream,
                       uint64 destOffset, uint64 destEndOffset);
 
+  /** Fetch the data in up to n pieces at the same time, using range
+      requests. Unlike the settings above, this one is kept across calls to
+      run(). Splitting happens once the server has reported the size of the
+      data, and only if it is at least 2*MIN_RANGE_SIZE, there is a
+      destStream and the download starts at offset 0. The URI passed to the
+      ctor continues to deliver the first piece, the others are fetched from
+      mirrors and that URI in turn.
+
+      Each piece is written to destStream at its offset. Interrupted pieces
+      are resumed individually (with the RESUME_SIZE overlap check), a
+      server which fails permanently is replaced with the next one. If the
+      first piece is complete while the next has not received any data yet,
+      or if all servers failed for it (e.g. no support for ranges), the
+      first connection just continues with it. The IO object still receives
+      all data in order: Data of later pieces is read back from destStream
+      once the pieces before them have completed. resumePossible() is
+      always false for a split download which failed.
+      @param n Maximum number of pieces, 0 or 1 disables splitting
+      @param mirrors Further URIs for the same data */
+  void setRanges(unsigned n, const vector<string>& mirrors);
+
   /** Behaviour as above. Defaults if not called before run() is false, i.e.
       don't add "Pragma: no-cache" header.
       @param pragmaNoCache If true, perform a "reload", discarding anything
@@ -127,7 +156,7 @@ public:
   /** Continue downloading. From DataSource. */
   virtual void cont();
   /** Stop download. */
-  inline void stop();
+  void stop();
 
   /** Are we in the process of resuming, i.e. are we currently downloading
       data before the resume offset and comparing it? */
@@ -140,6 +169,9 @@ public:
       dropped) */
   inline bool succeeded() const;
 
+  /** Was the download split with setRanges()? */
+  inline bool split() const;
+
   /** Return the internal progress object. From DataSource. */
   virtual const Progress* progress() const;
   /** Return the URL used to download the data. From DataSource. */
@@ -163,6 +195,9 @@ public:
   inline void setNoResumePossible();
 
 private:
+  class Range;
+  friend class Range;
+
   // Virtual methods from Download::Output
   virtual void download_dataSize(uint64 n);
   virtual void download_data(const Ubyte* data, unsigned size,
@@ -185,6 +220,38 @@ private:
   // Call io->job_failed(), then stopLater()
   inline void resumeFailed();
 
+  /* Compare resume overlap with the bytes at offset off of destStream.
+     Skip the compared bytes in data/size, decrease left accordingly. */
+  bool resumeCompare(uint64 off, const Ubyte** data, unsigned* size,
+                     unsigned* left);
+
+  // Split download of size bytes into ranges
+  void splitRanges(uint64 size);
+  // Pass on downloaded data at offset off of a split download
+  bool rangeData(uint64 off, const Ubyte* data, unsigned size);
+  // Download of the first range ended, continue it with a Range object
+  void mainRangeEnded(bool interrupted, const string& message);
+  // Let "download" take over failed or stalled ranges after mainEnd
+  void absorbRanges();
+  void deleteRanges();
+  /* Range has failed. Retry, switch to next server, or make the whole
+     download fail. */
+  void rangeFailed(Range* r, bool interrupted, const string& message);
+  // Range has received all its data
+  void rangeSucceeded(Range* r);
+  // Make runRanges_callback() stop all downloads and send job_failed()
+  void rangeError(const string& message);
+  /* Read back data from destStream which was written by ranges after
+     frontier, pass it to io. Return true if there is more to do. */
+  bool catchUp();
+  // Call runRanges_callback() after delay millisec, or earlier
+  void scheduleRanges(unsigned delay);
+  /* Start ranges, pass data to io, send final job_succeeded/failed.
+     Never called from within a libcurl callback. */
+  static gboolean runRanges_callback(gpointer data);
+  // Set progressVal to the sum of data received by all ranges
+  void rangeProgress();
+
   SmartPtr<BfstreamCounted> destStreamVal;
   uint64 destOff, destEndOff;
   unsigned resumeLeft; // >0: Nr of bytes of resume overlap left
@@ -194,6 +261,20 @@ private:
   bool haveResumeOffset, haveDestination; //, havePragmaNoCache;
 
   int tries; // Nr of tries resuming after interrupted connection
+
+  unsigned maxRanges; // Value from setRanges()
+  vector<string> rangeUris; // Our URI, then mirrors from setRanges()
+  /* If non-zero, the download is split and "download" only fetches the
+     first range [0;mainEnd). Once it has ended, it is continued by
+     ranges[0] and mainEnd is set to 0. */
+  uint64 mainEnd;
+  uint64 mainDone; // Nr of bytes of first range received by "download"
+  vector<Range*> ranges; // Sorted by offset
+  uint64 frontier; // Data of a split download passed to io up to here
+  bool rangesDone; // Sent job_succeeded() or job_failed() for split d/l
+  string rangeErrorVal; // Non-empty if split download failed
+  unsigned runRangesId; // glib source id, or 0 if none
+  vector<Range*> absorbed; // Orphans removed from ranges, to be deleted
 };
 //======================================================================
 
@@ -204,8 +285,13 @@ private:
 // }
 int Job::SingleUrl::currentTry() const { return tries; }
 bool Job::SingleUrl::resuming() const { return resumeLeft > 0; }
-bool Job::SingleUrl::failed() const { return download.failed(); }
-bool Job::SingleUrl::succeeded() const { return download.succeeded(); }
+bool Job::SingleUrl::failed() const {
+  return split() ? !rangeErrorVal.empty() : download.failed(); }
+bool Job::SingleUrl::succeeded() const {
+  return split() ? rangesDone && rangeErrorVal.empty()
+                 : download.succeeded(); }
+bool Job::SingleUrl::split() const {
+  return mainEnd != 0 || !ranges.empty(); }
 BfstreamCounted* Job::SingleUrl::destStream() const {
   return destStreamVal.get(); }
 
@@ -221,8 +307,5 @@ bool Job::SingleUrl::resumePossible() const {
 void Job::SingleUrl::setNoResumePossible() {
   tries = MAX_TRIES; // Download failed permanently, do not resume
 }
-void Job::SingleUrl::stop() {
-  download.stop();
-}
 
 #endif
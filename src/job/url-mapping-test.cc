@@ -244,6 +244,162 @@ void score5() { // Full mesh, one leaf possibility
              "http://x/bm. http://x/cl. http://x/am. http://x/bl. "
              "http://x/al. http://x/co. http://x/bo. http://x/ao.");
 }
+
+void score6() { // peek() does not affect enumerate()
+  UrlMap m;
+  ap(m, md[2], "A:x --try-first=.3");
+  ap(m, md[2], "A:y --try-first=.2");
+  ap(m, md[2], "A:z --try-first=.1");
+  as(m, "A", "http://a/");
+  vector<string> peeked;
+  m[md[2]]->peek(&peeked, 2);
+  Assert(peeked.size() == 2);
+  Assert(peeked[0] == "http://a/x" && peeked[1] == "http://a/y");
+  vector<UrlMapping*> best;
+  Assert(m[md[2]]->enumerate(&best) == "http://a/x");
+  peeked.clear();
+  m[md[2]]->peek(&peeked, 5);
+  Assert(peeked.size() == 2 && peeked[0] == "http://a/y");
+  expectEnum(m[md[2]], "http://a/y http://a/z");
+}
+//______________________________________________________________________
+
+namespace {
+
+  double now = 1000.0; // Simulated clock
+
+  // Find url among the URLs for md[part], return its path
+  void pathFor(UrlMap& m, int part, const string& url,
+               vector<UrlMapping*>* path) {
+    string u;
+    do {
+      u = m[md[part]]->enumerate(path);
+      Assert(!u.empty());
+    } while (u != url);
+  }
+
+  /* Simulated server: Download from url for secs seconds, at the given
+     speed, after a latency of 0.2 secs */
+  void download(UrlMap& m, int part, const string& url, double bytesPerSec,
+                double secs, bool ok = true) {
+    vector<UrlMapping*> path;
+    pathFor(m, part, url, &path);
+    UrlTransfer t;
+    t.start(path, 0, now);
+    now += 0.2;
+    uint64 bytes = 1;
+    for (double s = 0.0; s < secs; s += 0.5) {
+      t.progress(bytes, now);
+      now += 0.5;
+      bytes += static_cast<uint64>(bytesPerSec * 0.5);
+    }
+    t.progress(bytes, now);
+    t.finished(ok, now);
+  }
+
+}
+
+void score7() { // Statistics of downloads from simulated servers
+  UrlMap m;
+  as(m, "M", "http://a/");
+  as(m, "M", "http://b/");
+  as(m, "M", "http://c/");
+  for (int i = 0; i < 10; ++i) ap(m, md[i], "M:f");
+  // Without statistics, the order is the same for all parts
+  expectEnum(m[md[3]], "http://a/f http://c/f http://b/f");
+  Assert(UrlTransfer::typicalSpeed() == 0.0);
+
+  download(m, 4, "http://a/f", 1000000.0, 20.0);
+  download(m, 5, "http://b/f", 100000.0, 20.0);
+  Assert(m.servers().find("M")->second->speed() > 900000.0);
+  double typical = UrlTransfer::typicalSpeed();
+  Assert(typical > 200000.0 && typical < 800000.0);
+  // Fast server first, unknown one (assumed typical) before slow one
+  expectEnum(m[md[6]], "http://a/f http://c/f http://b/f");
+
+  // Two downloads from a are running, so a new one should go elsewhere
+  vector<UrlMapping*> path;
+  pathFor(m, 7, "http://a/f", &path);
+  UrlTransfer t1, t2;
+  t1.start(path, 0, now);
+  t2.start(path, 0, now);
+  Assert(m.servers().find("M")->second->active() == 2);
+  expectEnum(m[md[8]], "http://c/f http://a/f http://b/f");
+  t2.stop();
+  t1.stop();
+  Assert(m.servers().find("M")->second->active() == 0);
+
+  // A failed, c is punished; the penalty fades with time
+  download(m, 9, "http://c/f", 0.0, 0.0, false);
+  expectEnum(m[md[0]], "http://a/f http://b/f http://c/f");
+  now += 3600.0;
+  download(m, 1, "http://a/f", 1000000.0, 1.0);
+  expectEnum(m[md[2]], "http://a/f http://c/f http://b/f");
+}
+
+void score8() { // User preferences are stronger than the statistics
+  UrlMap m;
+  as(m, "P", "http://fast/");
+  as(m, "P", "http://slow/ --try-first=.3");
+  for (int i = 0; i < 7; ++i) ap(m, md[i], "P:f");
+  for (int i = 7; i < 10; ++i) {
+    ap(m, md[i], "P:g");
+    ap(m, md[i], "P:h --try-first=.1");
+  }
+  download(m, 0, "http://fast/f", 10000000.0, 60.0);
+  download(m, 1, "http://slow/f", 1000.0, 60.0);
+  download(m, 2, "http://slow/f", 0.0, 0.0, false);
+  download(m, 7, "http://fast/g", 10000000.0, 60.0);
+  download(m, 8, "http://slow/h", 1000.0, 60.0);
+  // Measured slow and failing, but the user wants it first
+  expectEnum(m[md[6]], "http://slow/f http://fast/f");
+  // Same for a part mapping
+  expectEnum(m[md[9]],
+             "http://slow/h http://slow/g http://fast/h http://fast/g");
+}
+
+void stall1() { // Stalled downloads
+  UrlMap m;
+  as(m, "S", "http://s/");
+  ap(m, md[0], "S:f");
+  ap(m, md[1], "S:f");
+  download(m, 1, "http://s/f", 100000.0, 20.0);
+  vector<UrlMapping*> path;
+  pathFor(m, 0, "http://s/f", &path);
+  UrlTransfer t;
+  // No answer at all
+  t.start(path, 0, now);
+  now += UrlTransfer::STALL_TIME - 1.0;
+  t.progress(0, now);
+  Assert(!t.stalled(now));
+  now += 2.0;
+  Assert(t.stalled(now));
+  // Pausing does not count
+  t.wait(now);
+  Assert(!t.stalled(now));
+  // Data stops flowing
+  uint64 bytes = 0;
+  for (int i = 0; i < 20; ++i) {
+    bytes += 100000;
+    now += 1.0;
+    t.progress(bytes, now);
+  }
+  Assert(!t.stalled(now) && t.speed() > 50000.0);
+  now += UrlTransfer::STALL_TIME + 1.0;
+  t.progress(bytes, now);
+  Assert(t.stalled(now) && t.speed() < 50000.0);
+  // Data trickles in, much slower than typical
+  t.start(path, bytes, now);
+  for (int i = 0; i < 2 * UrlTransfer::STALL_TIME; ++i) {
+    bytes += 1000;
+    now += 1.0;
+    t.progress(bytes, now);
+    if (i < UrlTransfer::STALL_TIME - 1.0) Assert(!t.stalled(now));
+  }
+  Assert(t.stalled(now));
+  t.finished(false, now);
+  Assert(!t.running() && !t.stalled(now));
+}
 //______________________________________________________________________
 
 int main(int argc, char* argv[]) {
@@ -261,6 +417,10 @@ int main(int argc, char* argv[]) {
   score3();
   score4();
   score5();
+  score6();
+  score7();
+  score8();
+  stall1();
 
   msg("Graph build tests");
   loggerInit();
@@ -15,6 +15,9 @@
 
 #include <glib.h>
 #include <float.h>
+#include <math.h>
+
+#include <algorithm>
 
 #include <compat.hh>
 #include <debug.hh>
@@ -39,21 +42,210 @@ namespace {
 }
 
 const double UrlMapping::RANDOM_INIT_RANGE = 0.03125;
+const double UrlMapping::DYNAMIC_RANGE = 0.5;
+const double UrlMapping::AVERAGE_TIME = 20.0;
+const double UrlMapping::EXPLORE_TIME = 10.0;
+const double UrlMapping::ERROR_HALFLIFE = 300.0;
+
+namespace {
+
+  bool randomInit = true;
+
+  /* Statistics of all downloads: Typical speed of one successful
+     download, and the latest time passed to a UrlTransfer method. */
+  double typicalSpeedVal = 0.0;
+  double typicalTime = 0.0;
+  double latestTime = 0.0;
+
+  // Speeds below this are treated as this, to avoid log(0)
+  const double MIN_SPEED = 1.0;
+  // Latency of this many secs lowers the score like halving the speed
+  const double LATENCY_TIME = 2.0;
+  // Weight of errors, failing servers score like ones 2^x times slower
+  const double ERROR_PENALTY = 4.0;
+  // Path weights closer than this are equal, despite rounding errors
+  const double WEIGHT_EPSILON = 1e-9;
+
+  /* Update the time-weighted average *avg, which is based on *avgTime secs
+     of data so far, with a value measured over secs seconds */
+  void average(double* avg, double* avgTime, double value, double secs) {
+    if (*avgTime == 0.0)
+      *avg = value;
+    else
+      *avg += (value - *avg) * (1.0 - exp(-secs / UrlMapping::AVERAGE_TIME));
+    *avgTime += secs;
+  }
+
+}
 
-namespace { bool randomInit = true; }
 void UrlMapping::setNoRandomInitialWeight() { randomInit = false; }
 
 UrlMapping::UrlMapping()
-  : urlVal(), prepVal(0), nextVal(0)/*, tries(0), triesFailed(0)*/ {
+  : urlVal(), prepVal(0), nextVal(0), activeVal(0), speedVal(0.0),
+    speedTime(0.0), results(0), latencyVal(0.0), errorsVal(0.0),
+    errorsTime(0.0), weight(0.0) {
   if (randomInit)
-    weight = g_rand_double_range(r.r, -RANDOM_INIT_RANGE, RANDOM_INIT_RANGE);
+    randomWeight = g_rand_double_range(r.r, -RANDOM_INIT_RANGE,
+                                       RANDOM_INIT_RANGE);
   else
-    weight = 0.0;
+    randomWeight = 0.0;
 }
 
 UrlMapping::~UrlMapping() { }
 //______________________________________________________________________
 
+/* The score is calculated in units of "doublings of the expected speed of
+   a new download". The speed is relative to the typical speed, and shrunk
+   towards it for mappings with few measurements. A new download has to
+   share the mapping's bandwidth with those which are already running. */
+double UrlMapping::dynamicScore() const {
+  double x = 0.0;
+  double typical = typicalSpeedVal;
+  if (speedTime > 0.0 && typical > 0.0) {
+    double confidence = speedTime / (speedTime + EXPLORE_TIME);
+    x = confidence * log2(max(speedVal, MIN_SPEED) / max(typical, MIN_SPEED));
+  }
+  x -= log2(1.0 + activeVal);
+  x -= log2(1.0 + latencyVal / LATENCY_TIME);
+  if (errorsVal > 0.0)
+    x -= ERROR_PENALTY * errorsVal
+         * exp2((errorsTime - latestTime) / ERROR_HALFLIFE);
+  return x;
+}
+
+void UrlMapping::addSpeed(double bytesPerSec, double secs) {
+  average(&speedVal, &speedTime, bytesPerSec, secs);
+}
+
+/* Downloads of small files consist mostly of latency, so they are not
+   used for the speed, only for latency and errors */
+void UrlMapping::addResult(bool ok, bool gotData, double latency,
+                           double now) {
+  // Plain average for the first few results
+  ++results;
+  double alpha = max(0.25, 1.0 / results);
+  if (gotData) latencyVal += (latency - latencyVal) * alpha;
+  // Let earlier errors fade away before adding the new result
+  errorsVal *= exp2((errorsTime - now) / ERROR_HALFLIFE);
+  errorsVal += ((ok ? 0.0 : 1.0) - errorsVal) * alpha;
+  errorsTime = now;
+}
+//______________________________________________________________________
+
+const double UrlTransfer::STALL_TIME = 30.0;
+const double UrlTransfer::STALL_RATIO = 16.0;
+const double UrlTransfer::SAMPLE_TIME = 2.0;
+
+UrlTransfer::UrlTransfer()
+  : mappings(), startTime(0.0), gotData(false), latency(0.0),
+    firstData(0.0), lastData(0.0), lastBytes(0), dataBytes(0),
+    sampleStart(0.0),
+    sampleBytes(0), recentSpeed(0.0) { }
+
+UrlTransfer::~UrlTransfer() { stop(); }
+
+double UrlTransfer::typicalSpeed() { return typicalSpeedVal; }
+
+void UrlTransfer::start(const vector<UrlMapping*>& path, uint64 bytes,
+                        double now) {
+  stop();
+  for (vector<UrlMapping*>::const_iterator i = path.begin(), e = path.end();
+       i != e; ++i) {
+    if ((*i)->prepend() == 0) continue; // "http:" is shared by all servers
+    mappings.push_back(*i);
+    ++(*i)->activeVal;
+  }
+  startTime = now;
+  gotData = false;
+  lastBytes = bytes;
+  sampleBytes = 0;
+  recentSpeed = 0.0;
+  latestTime = now;
+}
+
+/* The speed is measured from the arrival of the first data, the time
+   before that is the latency. */
+void UrlTransfer::progress(uint64 bytes, double now) {
+  if (!running()) return;
+  latestTime = now;
+  if (bytes > lastBytes) {
+    if (!gotData) {
+      gotData = true;
+      latency = now - startTime;
+      firstData = sampleStart = now;
+      dataBytes = 0;
+    } else {
+      sampleBytes += bytes - lastBytes;
+      dataBytes += bytes - lastBytes;
+    }
+    lastData = now;
+  }
+  lastBytes = bytes; // Might also decrease, e.g. if server cannot resume
+  if (gotData && now - sampleStart >= SAMPLE_TIME) flushSample(now);
+}
+
+void UrlTransfer::wait(double now) {
+  if (!running()) return;
+  latestTime = now;
+  double t = now - (gotData ? lastData : startTime);
+  startTime += t;
+  firstData += t;
+  lastData = now;
+  sampleStart = now;
+  sampleBytes = 0;
+}
+
+void UrlTransfer::flushSample(double now) {
+  double secs = now - sampleStart;
+  if (secs <= 0.0) return;
+  double s = static_cast<double>(sampleBytes) / secs;
+  for (vector<UrlMapping*>::iterator i = mappings.begin(),
+         e = mappings.end(); i != e; ++i)
+    (*i)->addSpeed(s, secs);
+  // Short time constant, we want to notice quickly if a server stalls
+  if (now - firstData <= secs)
+    recentSpeed = s;
+  else
+    recentSpeed += (s - recentSpeed) * (1.0 - exp(-3.0 * secs / STALL_TIME));
+  sampleStart = now;
+  sampleBytes = 0;
+}
+
+void UrlTransfer::finished(bool ok, double now) {
+  if (!running()) return;
+  latestTime = now;
+  if (gotData) flushSample(now);
+  /* Stalls and failures would drag the typical speed down, making
+     stalled() less likely to notice them */
+  if (ok && gotData && now > firstData) {
+    double secs = now - firstData;
+    average(&typicalSpeedVal, &typicalTime,
+            static_cast<double>(dataBytes) / secs, secs);
+  }
+  debug("UrlTransfer: %1 after %2s, latency %3s, %4 bytes/sec",
+        (ok ? "OK" : "failed"), now - startTime, latency, recentSpeed);
+  for (vector<UrlMapping*>::iterator i = mappings.begin(),
+         e = mappings.end(); i != e; ++i)
+    (*i)->addResult(ok, gotData, latency, now);
+  stop();
+}
+
+void UrlTransfer::stop() {
+  for (vector<UrlMapping*>::iterator i = mappings.begin(),
+         e = mappings.end(); i != e; ++i)
+    --(*i)->activeVal;
+  mappings.clear();
+}
+
+bool UrlTransfer::stalled(double now) const {
+  if (!running()) return false;
+  if (!gotData) return now - startTime >= STALL_TIME;
+  if (now - lastData >= STALL_TIME) return true;
+  return now - firstData >= STALL_TIME
+         && recentSpeed * STALL_RATIO < typicalSpeedVal;
+}
+//______________________________________________________________________
+
 // map<MD5, SmartPtr<PartUrlMapping> > parts;
 
 /* Given an URL-like string of the form "Label:some/path" or
@@ -259,7 +451,7 @@ string PartUrlMapping::enumerate(vector<UrlMapping*>* bestPath) {
     seen.reset(new set<unsigned>());
 
   string result;
-  double bestScore = -FLT_MAX;
+  PathScore bestScore = { -FLT_MAX, -FLT_MAX };
   unsigned serialNr = 0;
   unsigned bestSerialNr = 0;
 
@@ -267,7 +459,7 @@ string PartUrlMapping::enumerate(vector<UrlMapping*>* bestPath) {
   UrlMapping* mapping = this;
   do {
     //debug("enumerate: at top-level: %1", mapping->url());
-    enumerate(0, mapping, 0.0, 0, &serialNr, &bestScore,
+    enumerate(0, mapping, 0.0, 0.0, 0, &serialNr, &bestScore,
               bestPath, &bestSerialNr); // Recurse
     mapping = mapping->next(); // Walk through list of peers
   } while (mapping != 0);
@@ -277,16 +469,37 @@ string PartUrlMapping::enumerate(vector<UrlMapping*>* bestPath) {
     for (vector<UrlMapping*>::iterator i = bestPath->begin(),
            e = bestPath->end(); i != e; ++i)
       result += (*i)->url(); // Construct URL
-    debug("enumerate: \"%1\" with score %2", result, bestScore);
+    debug("enumerate: \"%1\" with score %2/%3", result, bestScore.weight,
+          bestScore.dynamic);
   } else {
     debug("enumerate: end");
   }
   return result;
 }
 
+void PartUrlMapping::peek(vector<string>* result, unsigned n) {
+  if (seen.get() == 0)
+    seen.reset(new set<unsigned>());
+  set<unsigned> oldSeen(*seen);
+  vector<UrlMapping*> best;
+  for (unsigned i = 0; i < n; ++i) {
+    string url = enumerate(&best);
+    if (url.empty()) break;
+    result->push_back(url);
+  }
+  seen->swap(oldSeen);
+}
+
+bool PartUrlMapping::PathScore::operator>(const PathScore& x) const {
+  if (weight > x.weight + WEIGHT_EPSILON) return true;
+  if (weight < x.weight - WEIGHT_EPSILON) return false;
+  return dynamic > x.dynamic;
+}
+
 /* @param stackPtr For recording how we reached this "mapping".
    @param mapping Current node in graph
-   @param score Accumulated scores of objects through which we came here
+   @param weight Accumulated weights of objects through which we came here
+   @param dynamic Accumulated dynamic scores of these objects
    @param pathLen Nr of objects through which we reached "mapping"
    @param serialNr Nr of leaves encountered so far during recursion. One leaf
    may be reached through >1 paths in the graph; in that case, it counts >1
@@ -296,12 +509,14 @@ string PartUrlMapping::enumerate(vector<UrlMapping*>* bestPath) {
    @param bestSerialNr Value of serialNr for this leaf obj
 */
 void PartUrlMapping::enumerate(StackEntry* stackPtr, UrlMapping* mapping,
-    double score, unsigned pathLen, unsigned* serialNr, double* bestScore,
-    vector<UrlMapping*>* bestPath, unsigned* bestSerialNr) {
+    double weight, double dynamic, unsigned pathLen, unsigned* serialNr,
+    PathScore* bestScore, vector<UrlMapping*>* bestPath,
+    unsigned* bestSerialNr) {
 //   debug("enumerate: pathLen=%1 serialNr=%2 url=%3", pathLen, *serialNr,
 //         mapping->url());
   // Update score to include "mapping" object
-  score += mapping->weight;
+  weight += mapping->weight;
+  dynamic += mapping->randomWeight + mapping->dynamicScore();
   ++pathLen;
 
   if (mapping->prepend() == 0) {
@@ -313,11 +528,15 @@ void PartUrlMapping::enumerate(StackEntry* stackPtr, UrlMapping* mapping,
     if (*serialNr == 0) {
       --*serialNr; return; // Whoa, overflow! Should Not Happen(tm)
     }
-    // Score of path = SUM(scores_of_path_elements) / length_of_path
-    double pathScore = score / implicit_cast<double>(pathLen);
+    /* Weight of path = SUM(weights_of_path_elements) / length_of_path.
+       The dynamic score is limited per path, not per path element. */
+    PathScore pathScore;
+    pathScore.weight = weight / implicit_cast<double>(pathLen);
+    pathScore.dynamic = DYNAMIC_RANGE * dynamic / (fabs(dynamic) + 2.0);
     if (pathScore > *bestScore
         && seen->find(*serialNr) == seen->end()) {
-      debug("enumerate: New best score %1", pathScore);
+      debug("enumerate: New best score %1/%2", pathScore.weight,
+            pathScore.dynamic);
       // New best score found
       *bestScore = pathScore;
       *bestSerialNr = *serialNr;
@@ -338,8 +557,8 @@ void PartUrlMapping::enumerate(StackEntry* stackPtr, UrlMapping* mapping,
   stack.up = stackPtr;
   mapping = mapping->prepend(); // Descend
   do {
-    enumerate(&stack, mapping, score, pathLen, serialNr, bestScore,
-              bestPath, bestSerialNr); // Recurse
+    enumerate(&stack, mapping, weight, dynamic, pathLen, serialNr,
+              bestScore, bestPath, bestSerialNr); // Recurse
     mapping = mapping->next(); // Walk through list of peers
   } while (mapping != 0);
 }
@@ -91,16 +91,45 @@ public:
   /** Return true iff url().empty() && prepend() == 0 */
   bool empty() const { return url().empty() && prepend() == 0; }
 
+  /** Part of the score which is based on the statistics of earlier
+      downloads using this mapping, see UrlTransfer. Mappings whose
+      downloads were faster than the typical download get a higher score,
+      those with many running downloads, recent errors or high latency a
+      lower one. In units of "doublings of the expected speed of a new
+      download", not limited to any range; PartUrlMapping::enumerate()
+      adds up the values along a path and squashes the total into
+      (-DYNAMIC_RANGE;DYNAMIC_RANGE). */
+  double dynamicScore() const;
+  /** Average speed of downloads using this mapping in bytes/sec, or 0.0 if
+      unknown */
+  double speed() const { return speedVal; }
+  /** Nr of currently running downloads which use this mapping */
+  unsigned active() const { return activeVal; }
+
   /** Various knobs for the scoring algorithm */
 
   /** If two servers are rated equal by the scoring algorithm, the order in
       which the servers are tried should be random. Otherwise, if gazillions
       of people try to download the same thing using default settings (e.g.
       no country preference), the first server in its list shouldn't be hit
-      too hard. In practice, we achieve randomisation by initializing the
-      weight with a small random value, in the range
-      [-RANDOM_INIT_RANGE,RANDOM_INIT_RANGE) */
+      too hard. In practice, we achieve randomisation by adding a small
+      random value in the range [-RANDOM_INIT_RANGE,RANDOM_INIT_RANGE) to
+      the dynamicScore() of each mapping. */
   static const double RANDOM_INIT_RANGE;
+  /** Range of the dynamic score of a path. It must not override the
+      user's preferences, so it only decides between paths with equal
+      weights. */
+  static const double DYNAMIC_RANGE;
+  /** Time constant (secs) for the averages of speed and typical speed */
+  static const double AVERAGE_TIME;
+  /** Exploration: Until a mapping's downloads have transferred data for
+      about this many seconds, its speed is assumed to be closer to the
+      typical speed than measured. Servers that were tried only briefly,
+      or not at all, thus get a fair chance against ones that were measured
+      to be slightly faster. */
+  static const double EXPLORE_TIME;
+  /** The penalty for errors is halved after this many seconds */
+  static const double ERROR_HALFLIFE;
 
 private:
   string urlVal; // Part of URL
@@ -108,12 +137,18 @@ private:
   SmartPtr<UrlMapping> nextVal; // Alt. to this mapping; singly linked list
   //LineInJigdoFilePointer def; // Definition of this mapping in .jigdo file
 
-  // Statistics, for server selection
+  // Statistics, for server selection, updated by UrlTransfer
+  friend class UrlTransfer;
+  void addSpeed(double bytesPerSec, double secs);
+  void addResult(bool ok, bool gotData, double latency, double now);
 
-  // Nr of times we tried to download an URL generated using this mapping
-  //unsigned tries; // 0 or 1 for PartUrlMapping, more possible for servers
-  // Number of above tries which failed (404 not found, checksum error etc)
-  //unsigned triesFailed;
+  unsigned activeVal; // Nr of running UrlTransfers using this mapping
+  double speedVal; // Time-weighted average speed, or 0.0 if none yet
+  double speedTime; // Secs of data transfer that speedVal is based on
+  unsigned results; // Nr of finished UrlTransfers using this mapping
+  double latencyVal; // Average secs until the first byte arrived
+  double errorsVal; // Average of 1.0 for failed, 0.0 for OK downloads
+  double errorsTime; // Time of last update of errorsVal
 
   /* Mapping-specific weight, includes user's global country preference,
      preference for this jigdo download's servers, global server preference.
@@ -121,6 +156,8 @@ private:
      higher the value, the higher the preference that will be given to this
      mapping. */
   double weight;
+  // Random part of the dynamic score, see RANDOM_INIT_RANGE
+  double randomWeight;
 };
 //______________________________________________________________________
 
@@ -152,6 +189,11 @@ public:
       long time. */
   string enumerate(vector<UrlMapping*>* best);
 
+  /** Append up to n URLs to result, namely the ones which the next calls
+      to enumerate() would return. Unlike enumerate(), does not mark them
+      as returned. */
+  void peek(vector<string>* result, unsigned n);
+
 private:
   /* Because the UrlMapping data structure is not a tree, but an acyclic
      directed graph (i.e. tree with some branches coming together again),
@@ -161,9 +203,18 @@ private:
     StackEntry* up;
   };
 
+  /* Score of a path: The average of the weights of its mappings, i.e. the
+     user's preferences, is compared first. Only if it is equal, the
+     squashed sum of their dynamic scores decides. */
+  struct PathScore {
+    double weight, dynamic;
+    bool operator>(const PathScore& x) const;
+  };
+
   void enumerate(StackEntry* stackPtr, UrlMapping* mapping,
-    double score, unsigned pathLen, unsigned* serialNr, double* bestScore,
-    vector<UrlMapping*>* bestPath, unsigned* bestSerialNr);
+    double weight, double dynamic, unsigned pathLen, unsigned* serialNr,
+    PathScore* bestScore, vector<UrlMapping*>* bestPath,
+    unsigned* bestSerialNr);
 
   /* Set of URLs that were already returned by bestUnvisitedUrl(). Each URL
      is represented by a unique number, which is assigned to it by a
@@ -172,6 +223,73 @@ private:
 };
 //______________________________________________________________________
 
+/** Measurements of one download of an URL which
+    PartUrlMapping::enumerate() returned. The speed, latency and success of
+    the download are recorded with all mappings on its path which have a
+    prepend(), i.e. the server and part mappings, but not the "http:"
+    mappings, and they also update the typical download speed. Future
+    calls to enumerate() take these statistics into account.
+
+    All times are seconds since an arbitrary point in time, and must not
+    decrease between calls. */
+class UrlTransfer : NoCopy {
+public:
+  UrlTransfer();
+  /** Calls stop() */
+  ~UrlTransfer();
+
+  /** A download started, from the URL whose mappings are in path.
+      @param bytes Current size of the data, e.g. the resume offset */
+  void start(const vector<UrlMapping*>& path, uint64 bytes, double now);
+  /** Is a download running, i.e. start() called but not finished()? */
+  bool running() const { return !mappings.empty(); }
+  /** Report the current size of the data. Should be called whenever data
+      arrives, and regularly (every few secs) if none arrives. */
+  void progress(uint64 bytes, double now);
+  /** Do not count the time since the last call to progress() at all, e.g.
+      because the download was paused */
+  void wait(double now);
+  /** The download ended, ok is false for failure. Also call this if the
+      download was stopped because it is too slow. */
+  void finished(bool ok, double now);
+  /** End the running download without recording a result. */
+  void stop();
+
+  /** Is the download stalled? This is the case if no data has arrived for
+      STALL_TIME seconds, or if its speed has been less than 1/STALL_RATIO
+      of the typical speed for that long. */
+  bool stalled(double now) const;
+
+  /** Speed of the download during the last few secs, or 0.0 */
+  double speed() const { return recentSpeed; }
+
+  /** Typical speed of a download, averaged over all successful transfers,
+      or 0.0 */
+  static double typicalSpeed();
+
+  static const double STALL_TIME;
+  static const double STALL_RATIO;
+  /** Speed measurements are taken over intervals of at least this length */
+  static const double SAMPLE_TIME;
+
+private:
+  // Pass sample to mappings and recentSpeed, start new one at now
+  void flushSample(double now);
+
+  vector<UrlMapping*> mappings; // Mappings to record results with
+  double startTime; // Time of start(), moved forward by wait()
+  bool gotData; // Has any data arrived since start()?
+  double latency; // If gotData, secs until first data arrived
+  double firstData; // If gotData, time of first data (moved by wait())
+  double lastData; // If gotData, time data last arrived
+  uint64 lastBytes; // Value from last call to start()/progress()
+  uint64 dataBytes; // If gotData, bytes received after the first data
+  double sampleStart; // Start of the current speed measurement
+  uint64 sampleBytes; // Bytes received since sampleStart
+  double recentSpeed; // Average over the last few samples
+};
+//______________________________________________________________________
+
 /** Object containing list of all Part and Server mappings in a .jigdo
     file */
 class UrlMap : public NoCopy {
@@ -31,6 +31,7 @@
 #include <compat.hh>
 #include <log.hh>
 #include <mkimage.hh>
+#include <multidigest.hh>
 #include <scan.hh>
 #include <serialize.hh>
 #include <string.hh>
@@ -444,132 +445,100 @@ namespace {
   }
   //______________________________
 
-  /* Read up to file.size() of bytes from file, write it to image
-     stream. Check MD5/rsync sum if requested. Take care not to write
-     more than specified amount to image, even if file is longer. */
-  int fileToImageMD5(bostream* img, FilePart& file,
-      const JigdoDesc::MatchedFileMD5& matched, bool checkChecksum, size_t rsyncLen,
-      ProgressReporter& reporter, Ubyte* buf, size_t readAmount, uint64& off,
-      uint64& nextReport, const uint64 totalBytes) {
-    uint64 toWrite = file.size();
-    MD5Sum md;
-    RsyncSum64 rs;
-    size_t rl = 0; // Length covered by rs so far
-    string fileName(file.getPath());
-    fileName += file.leafName();
-    bifstream f(fileName.c_str(), ios::binary);
-    string err; // !err.empty() => error occurred
+  /* Without checksum checks, the file data need not pass through our
+     buffer: If the image is a file (imgName != 0), have the kernel copy
+     the data straight to the right place in it, see compat_copyFile().
+     Returns the nr of bytes copied, img and f are positioned after them.
+     The caller writes the rest of the file as usual. */
+  uint64 fileToImageDirect(bostream* img, const char* imgName,
+      const string& fileName, bifstream& f, uint64 imgOff, uint64 len) {
+    if (imgName == 0 || !*img || !f) return 0;
+    img->flush();
+    uint64 n = compat_copyFile(fileName.c_str(), imgName, imgOff, len);
+    if (n == 0) return 0;
+    debug("fileToImageDirect: %1 of %2 bytes of `%3'", n, len, fileName);
+    img->seekp(imgOff + n, ios::beg);
+    f.seekg(n, ios::beg);
+    return n;
+  }
+  //______________________________
 
-    // Read from file, write to image
-    // First couple of k: Calculate RsyncSum rs and MD5Sum md
-    if (checkChecksum && rsyncLen > 0) {
-      while (*img && f && !f.eof() && toWrite > 0) {
-        size_t n = (size_t)(toWrite < readAmount ? toWrite : readAmount);
-        readBytes(f, buf, n);
-        n = f.gcount();
-        writeBytes(*img, buf, n);
-        reportBytesWritten(n, off, nextReport, totalBytes, reporter);
-        toWrite -= n;
-        md.update(buf, n);
-        // Update RsyncSum
-        Paranoid(rl < rsyncLen);
-        size_t rsyncToAdd = rsyncLen - rl;
-        if (rsyncToAdd > n) rsyncToAdd = n;
-        rs.addBack(buf, rsyncToAdd);
-        rl += rsyncToAdd;
-        Paranoid(rl <= rsyncLen);
-        if (rl >= rsyncLen) break;
-      }
-    }
-    // Rest of file: Only calculate MD5Sum md
-    while (*img && f && !f.eof() && toWrite > 0) {
-      size_t n = (size_t)(toWrite < readAmount ? toWrite : readAmount);
-      readBytes(f, buf, n);
-      n = f.gcount();
-      writeBytes(*img, buf, n);
-      reportBytesWritten(n, off, nextReport, totalBytes, reporter);
-      toWrite -= n;
-      if (checkChecksum) md.update(buf, n);
-    }
+  /* Checksum types for fileToImage(): Which sum a MatchedFile* entry of
+     the template carries */
+  struct MD5Digest {
+    typedef MD5Sum Sum;
+    typedef JigdoDesc::MatchedFileMD5 Matched;
+    static const MD5& expected(const Matched& m) { return m.md5(); }
+  };
+  struct SHA256Digest {
+    typedef SHA256Sum Sum;
+    typedef JigdoDesc::MatchedFileSHA256 Matched;
+    static const SHA256& expected(const Matched& m) { return m.sha256(); }
+  };
 
-    if (toWrite > 0 && (!f || f.eof())) {
-      const char* errDetail = "";
-      if (errno != 0) errDetail = strerror(errno);
-      else if (f.eof()) errDetail = _("file is too short");
-      err = subst(_("Error reading from `%1' (%2)"), fileName, errDetail);
-      // Even if there was an error - always try to write right amount
-      memClear(buf, readAmount);
-      while (*img && toWrite > 0) {
-        size_t n = (size_t)(toWrite < readAmount ? toWrite : readAmount);
-        writeBytes(*img, buf, n);
-        reportBytesWritten(n, off, nextReport, totalBytes, reporter);
-        toWrite -= n;
-      }
-    } else if (checkChecksum
-               && (md.finish() != matched.md5()
-                   || (rsyncLen > 0 && rs != matched.rsync()))) {
-      err = subst(_("Error: `%1' does not match checksum in template data"),
-                  fileName);
+  // Rsync sum of only the first len bytes of the data passed to update()
+  class RsyncPrefix {
+  public:
+    RsyncPrefix(RsyncSum64& s, size_t len) : sum(s), left(len) { }
+    void update(const Ubyte* data, size_t n) {
+      if (n > left) n = left;
+      sum.addBack(data, n);
+      left -= n;
     }
+  private:
+    RsyncSum64& sum;
+    size_t left;
+  };
 
-    if (err.empty()) return 0; // Success
-    reporter.error(err);
-    if (toWrite == 0)
-      return 2; // "May have to fix something before you can continue"
-    else
-      return 3; // Yaargh, disaster! Please delete the .tmp file for me
-  }
+  // copyAndDigest() callback, calls reportBytesWritten()
+  struct ReportWritten {
+    ReportWritten(uint64& o, uint64& nr, uint64 t, ProgressReporter& r)
+      : off(o), nextReport(nr), totalBytes(t), reporter(r) { }
+    void operator()(uint64 n) {
+      reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+    }
+    uint64& off;
+    uint64& nextReport;
+    const uint64 totalBytes;
+    ProgressReporter& reporter;
+  };
   //______________________________
 
-  /* Read up to file.size() of bytes from file, write it to image
-     stream. Check SHA256/rsync sum if requested. Take care not to
-     write more than specified amount to image, even if file is
-     longer. */
-  int fileToImageSHA256(bostream* img, FilePart& file,
-      const JigdoDesc::MatchedFileSHA256& matched, bool checkChecksum, size_t rsyncLen,
-      ProgressReporter& reporter, Ubyte* buf, size_t readAmount, uint64& off,
-      uint64& nextReport, const uint64 totalBytes) {
+  /* Read up to file.size() of bytes from file, write it to image stream.
+     Check the file's checksum (MD5 or SHA256, depending on Digest) and
+     the rsync sum of its first rsyncLen bytes if requested - all in the
+     same pass over the data. Take care not to write more than specified
+     amount to image, even if file is longer. imgName is the name of the
+     file behind img, or null if img is not a file. */
+  template <class Digest>
+  int fileToImage(bostream* img, const char* imgName, FilePart& file,
+      const typename Digest::Matched& matched, bool checkChecksum,
+      size_t rsyncLen, ProgressReporter& reporter, Ubyte* buf,
+      size_t readAmount, uint64& off, uint64& nextReport,
+      const uint64 totalBytes) {
     uint64 toWrite = file.size();
-    SHA256Sum md;
+    typename Digest::Sum md;
     RsyncSum64 rs;
-    size_t rl = 0; // Length covered by rs so far
+    RsyncPrefix rsPrefix(rs, rsyncLen);
     string fileName(file.getPath());
     fileName += file.leafName();
     bifstream f(fileName.c_str(), ios::binary);
     string err; // !err.empty() => error occurred
+    ReportWritten report(off, nextReport, totalBytes, reporter);
 
-    // Read from file, write to image
-    // First couple of k: Calculate RsyncSum rs and SHA256Sum md
-    if (checkChecksum && rsyncLen > 0) {
-      while (*img && f && !f.eof() && toWrite > 0) {
-        size_t n = (size_t)(toWrite < readAmount ? toWrite : readAmount);
-        readBytes(f, buf, n);
-        n = f.gcount();
-        writeBytes(*img, buf, n);
-        reportBytesWritten(n, off, nextReport, totalBytes, reporter);
-        toWrite -= n;
-        md.update(buf, n);
-        // Update RsyncSum
-        Paranoid(rl < rsyncLen);
-        size_t rsyncToAdd = rsyncLen - rl;
-        if (rsyncToAdd > n) rsyncToAdd = n;
-        rs.addBack(buf, rsyncToAdd);
-        rl += rsyncToAdd;
-        Paranoid(rl <= rsyncLen);
-        if (rl >= rsyncLen) break;
-      }
-    }
-    // Rest of file: Only calculate SHA256Sum md
-    while (*img && f && !f.eof() && toWrite > 0) {
-      size_t n = (size_t)(toWrite < readAmount ? toWrite : readAmount);
-      readBytes(f, buf, n);
-      n = f.gcount();
-      writeBytes(*img, buf, n);
-      reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+    if (!checkChecksum) {
+      uint64 n = fileToImageDirect(img, imgName, fileName, f,
+                                   matched.offset(), toWrite);
+      report(n);
       toWrite -= n;
-      if (checkChecksum) md.update(buf, n);
     }
 
+    // Read from file, write to image, calculate checksums if requested
+    MultiDigest<typename Digest::Sum, RsyncPrefix> digests(
+        checkChecksum ? &md : 0, checkChecksum ? &rsPrefix : 0);
+    toWrite -= copyAndDigest(f, img, toWrite, buf, readAmount, digests,
+                             report);
+
     if (toWrite > 0 && (!f || f.eof())) {
       const char* errDetail = "";
       if (errno != 0) errDetail = strerror(errno);
@@ -580,11 +549,11 @@ namespace {
       while (*img && toWrite > 0) {
         size_t n = (size_t)(toWrite < readAmount ? toWrite : readAmount);
         writeBytes(*img, buf, n);
-        reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+        report(n);
         toWrite -= n;
       }
     } else if (checkChecksum
-               && (md.finish() != matched.sha256()
+               && (md.finish() != Digest::expected(matched)
                    || (rsyncLen > 0 && rs != matched.rsync()))) {
       err = subst(_("Error: `%1' does not match checksum in template data"),
                   fileName);
@@ -636,6 +605,8 @@ namespace {
        when it is compressed again by jigdo, it will get slightly
        larger. */
     unique_ptr<Zibstream> data(new Zibstream(*templ, (unsigned int)readAmount + 8*1024));
+    data->setThreads(cache->getThreads());
+    const char* imgName = (img != 0 ? name : 0); // For fileToImageDirect()
 #   if HAVE_WORKING_FSTREAM
     if (img == 0) img = &cout; // EEEEEK!
 #   else
@@ -719,9 +690,9 @@ namespace {
             } else {
               /* Copy data from file to image, taking care not to
                  write beyond toWrite. */
-              int status = fileToImageMD5(img, *mfile, *self, checkChecksum,
-                  (size_t)blockLength, reporter, buf, readAmount, off,
-                  nextReport, totalBytes);
+              int status = fileToImage<MD5Digest>(img, imgName, *mfile,
+                  *self, checkChecksum, (size_t)blockLength, reporter, buf,
+                  readAmount, off, nextReport, totalBytes);
               toCopy.pop();
               if (result < status) result = status;
               if (status == 0) { // Mark file as written to image
@@ -765,9 +736,9 @@ namespace {
             } else {
               /* Copy data from file to image, taking care not to
                  write beyond toWrite. */
-              int status = fileToImageSHA256(img, *mfile, *self, checkChecksum,
-                  (size_t)blockLength, reporter, buf, readAmount, off,
-                  nextReport, totalBytes);
+              int status = fileToImage<SHA256Digest>(img, imgName, *mfile,
+                  *self, checkChecksum, (size_t)blockLength, reporter, buf,
+                  readAmount, off, nextReport, totalBytes);
               toCopy.pop();
               if (result < status) result = status;
               if (status == 0) { // Mark file as written to image
@@ -892,9 +863,9 @@ namespace {
 	  result = 2;
 	  break;
 	}
-	int status = fileToImageMD5(img, *mfile, *matchMD5, checkChecksum,
-            (size_t)blockLength, reporter, buf, readAmount, bytesWritten,
-            nextReport, totalBytes);
+	int status = fileToImage<MD5Digest>(img, imageTmpFile.c_str(),
+            *mfile, *matchMD5, checkChecksum, (size_t)blockLength, reporter,
+            buf, readAmount, bytesWritten, nextReport, totalBytes);
 	toCopy.pop();
 	if (result < status)
           result = status;
@@ -924,9 +895,9 @@ namespace {
 	  result = 2;
 	  break;
 	}
-	int status = fileToImageSHA256(img, *mfile, *matchSHA256, checkChecksum,
-            (size_t)blockLength, reporter, buf, readAmount, bytesWritten,
-            nextReport, totalBytes);
+	int status = fileToImage<SHA256Digest>(img, imageTmpFile.c_str(),
+            *mfile, *matchSHA256, checkChecksum, (size_t)blockLength, reporter,
+            buf, readAmount, bytesWritten, nextReport, totalBytes);
 	toCopy.pop();
 	if (result < status)
           result = status;
@@ -986,49 +957,45 @@ namespace {
 } // end local namespace
 //______________________________________________________________________
 
-namespace {
+/// Read template data from templ (name in templFile) into files
+void JigdoDesc::readTemplate(JigdoDescVec& files, const string& templFile,
+                             bistream* templ) {
+  if (JigdoDesc::isTemplate(*templ) == false) { // Check for template hdr
+    string err = subst(_("`%1' is not a template file"), templFile);
+    throw JigdoDescError(err);
+  }
+  /* Read info at end of template data. NB: Exceptions are not
+     caught here, but e.g. in ::makeImage() (cf. jigdo-file.cc) */
+  JigdoDesc::seekFromEnd(*templ);
+  *templ >> files;
+}
+//________________________________________
 
-  /// Read template data from templ (name in templFile) into files
-  void readTemplate(JigdoDescVec& files, const string& templFile,
-                    bistream* templ) {
-    if (JigdoDesc::isTemplate(*templ) == false) { // Check for template hdr
-      string err = subst(_("`%1' is not a template file"), templFile);
-      throw JigdoDescError(err);
-    }
-    /* Read info at end of template data. NB: Exceptions are not
-       caught here, but e.g. in ::makeImage() (cf. jigdo-file.cc) */
-    JigdoDesc::seekFromEnd(*templ);
-    *templ >> files;
+/** Read data from end of temporary file imageTmp, output it to
+    filesTmp. Next, compare it to template data in "files". If tmp
+    file is OK for re-using return NULL - this means that the DESC
+    entries match *exactly* - the only difference allowed is
+    MatchedFile* turning into WrittenFile*. Otherwise, return a
+    pointer to an error message describing the reason why the
+    tmpfile data does not match the template data. */
+const char* JigdoDesc::readTmpFile(bistream& imageTmp, JigdoDescVec& filesTmp,
+                                   const JigdoDescVec& files) {
+  try {
+    JigdoDesc::seekFromEnd(imageTmp);
+    imageTmp >> filesTmp;
+  } catch (JigdoDescError e) {
+    return _("it was not created by jigdo-file, or is corrupted.");
   }
-  //________________________________________
-
-  /** Read data from end of temporary file imageTmp, output it to
-      filesTmp. Next, compare it to template data in "files". If tmp
-      file is OK for re-using return NULL - this means that the DESC
-      entries match *exactly* - the only difference allowed is
-      MatchedFile* turning into WrittenFile*. Otherwise, return a
-      pointer to an error message describing the reason why the
-      tmpfile data does not match the template data. */
-  const char* readTmpFile(bistream& imageTmp, JigdoDescVec& filesTmp,
-                          const JigdoDescVec& files) {
-    try {
-      JigdoDesc::seekFromEnd(imageTmp);
-      imageTmp >> filesTmp;
-    } catch (JigdoDescError e) {
-      return _("it was not created by jigdo-file, or is corrupted.");
-    }
-    if (*files.back() != *filesTmp.back())
-      return _("it corresponds to a different image/template.");
-    if (files.size() != filesTmp.size())
+  if (*files.back() != *filesTmp.back())
+    return _("it corresponds to a different image/template.");
+  if (files.size() != filesTmp.size())
+    return _("since its creation, the template was regenerated.");
+  for (size_t i = 0; i < files.size() - 1; ++i) {
+    //cerr << "cmp " << i << '/' << (files.size() - 1) << endl;
+    if (*files[i] != *filesTmp[i])
       return _("since its creation, the template was regenerated.");
-    for (size_t i = 0; i < files.size() - 1; ++i) {
-      //cerr << "cmp " << i << '/' << (files.size() - 1) << endl;
-      if (*files[i] != *filesTmp[i])
-        return _("since its creation, the template was regenerated.");
-    }
-    return 0;
   }
-
+  return 0;
 }
 //________________________________________
 
@@ -1038,7 +1005,8 @@ namespace {
 int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
     const string& imageTmpFile, const string& templFile,
     bistream* templ, const bool optForce, ProgressReporter& reporter,
-    const size_t readAmount, const bool optMkImageCheck) {
+    const size_t readAmount, const bool optMkImageCheck,
+    const bool optCreateTmp) {
 
   Task task = CREATE_TMP;
 
@@ -1107,7 +1075,6 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
      them. */
   queue<FilePart*> toCopy;
   int missing = 0; // Nr of files that were not found
-  JigdoCache::iterator ci, ce = cache->end();
   uint64 totalBytes = 0; // Total amount of data to be written, for "x% done"
 
   for (vector<JigdoDesc*>::iterator i = files.begin(), e = files.end();
@@ -1122,22 +1089,15 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
         //totalBytes += m->size();
 
         // Search for file with matching MD5 sum
-	ci = cache->begin();
-	bool found = false;
-	while (ci != ce) {
-          // The call to getMD5Sum() may cause the whole file to be read!
-          const MD5Sum* md = ci->getMD5Sum(cache);
-	  if (md != 0 && *md == m->md5()) {
-            toCopy.push(&*ci); // Found matching file
-	    totalBytes += m->size();
-	    debug("%1 found, pushed %2", m->md5().toString(), &*ci);
-	    found = true;
-	    break;
-	  }
-	  ++ci;
-	}
-	if (!found)
+        // The call to findMD5() may cause files to be read!
+        FilePart* file = cache->findMD5(m->md5(), m->size());
+        if (file != 0) {
+          toCopy.push(file); // Found matching file
+          totalBytes += m->size();
+          debug("%1 found, pushed %2", m->md5().toString(), file);
+        } else {
           ++missing;
+        }
       }
       break;
 
@@ -1148,22 +1108,15 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
         //totalBytes += m->size();
 
         // Search for file with matching SHA256 sum
-	ci = cache->begin();
-	bool found = false;
-	while (ci != ce) {
-          // The call to getSHA256Sum() may cause the whole file to be read!
-          const SHA256Sum* md = ci->getSHA256Sum(cache);
-	  if (md != 0 && *md == m->sha256()) {
-            toCopy.push(&*ci); // Found matching file
-	    totalBytes += m->size();
-	    debug("%1 found, pushed %2", m->sha256().toString(), &*ci);
-	    found = true;
-	    break;
-	  }
-	  ++ci;
-	}
-	if (!found)
+        // The call to findSHA256() may cause files to be read!
+        FilePart* file = cache->findSHA256(m->sha256(), m->size());
+        if (file != 0) {
+          toCopy.push(file); // Found matching file
+          totalBytes += m->size();
+          debug("%1 found, pushed %2", m->sha256().toString(), file);
+        } else {
           ++missing;
+        }
       }
       break;
 
@@ -1200,7 +1153,8 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
      template actually contains at least one MatchedFile* (i.e. *do*
      write if template consists entirely of UnmatchedData). */
 # ifndef MKIMAGE_ALWAYS_CREATE_TMPFILE
-  if (task == CREATE_TMP && toCopy.size() == 0 && missing != 0) {
+  if (task == CREATE_TMP && toCopy.size() == 0 && missing != 0
+      && !optCreateTmp) {
     const char* m = _("Will not create image or temporary file - try again "
                       "with different input files");
     reporter.info(m);
@@ -1219,7 +1173,7 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
     int result = writeMerge(files, toCopy, missing, readAmount, img,
                             imageTmpFile, optMkImageCheck, reporter, cache,
                             totalBytes);
-    if (missing != 0 && result < 3)
+    if (missing != 0 && result < 3 && !optCreateTmp)
       info_NeedMoreFiles(reporter, imageTmpFile);
     if (result == 0) {
       if (compat_rename(imageTmpFile.c_str(), imageFile.c_str()) != 0)
@@ -1277,7 +1231,7 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
   if (result >= 3) return result;
 
   if (task == CREATE_TMP && result == 1) {
-    info_NeedMoreFiles(reporter, imageTmpFile);
+    if (!optCreateTmp) info_NeedMoreFiles(reporter, imageTmpFile);
   } else if (result == 0) {
     if (img != 0)
       img->close(); // Necessary on Windows before renaming is possible
@@ -1290,9 +1244,11 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
 }
 //______________________________________________________________________
 
-int JigdoDesc::listMissingMD5(set<MD5>& result, const string& imageTmpFile,
-    const string& templFile, bistream* templ, ProgressReporter& reporter) {
-  result.clear();
+int JigdoDesc::listMissing(set<MD5>& md5Result, set<SHA256>& sha256Result,
+    const string& imageTmpFile, const string& templFile, bistream* templ,
+    ProgressReporter& reporter, JigdoCache* cache) {
+  md5Result.clear();
+  sha256Result.clear();
 
   // Read info from template
   JigdoDescVec contents;
@@ -1315,47 +1271,19 @@ int JigdoDesc::listMissingMD5(set<MD5>& result, const string& imageTmpFile,
     }
   }
 
-  // Output MD5 sums of MatchedFileMD5 (but not WrittenFileMD5) entries
+  /* Output checksums of MatchedFile* (but not WrittenFile*) entries. The
+     type() checks are needed because WrittenFile* derive from them. */
   for (size_t i = 0; i < contents.size() - 1; ++i) {
-    MatchedFileMD5* mf = dynamic_cast<MatchedFileMD5*>(contents[i]);
-    if (mf != 0 && mf->type() == MATCHED_FILE_MD5)
-      result.insert(mf->md5());
-  }
-  return 0;
-}
-//______________________________________________________________________
-
-int JigdoDesc::listMissingSHA256(set<SHA256>& result, const string& imageTmpFile,
-    const string& templFile, bistream* templ, ProgressReporter& reporter) {
-  result.clear();
-
-  // Read info from template
-  JigdoDescVec contents;
-  readTemplate(contents, templFile, templ);
-
-  // Read info from temporary file, if any
-  if (!imageTmpFile.empty()) {
-    bifstream imageTmp(imageTmpFile.c_str(), ios::binary);
-    if (imageTmp) {
-      JigdoDescVec contentsTmp;
-      const char* wontReuse = readTmpFile(imageTmp, contentsTmp, contents);
-      if (wontReuse != 0) {
-        string msg = subst(_("Ignoring existing temporary file `%1' - %2"),
-                           imageTmpFile, wontReuse);
-        reporter.info(msg);
-      } else {
-        // tmp file present & valid - use *it* below to output missing parts
-        swap(contents, contentsTmp);
-      }
+    if (contents[i]->type() == MATCHED_FILE_MD5) {
+      MatchedFileMD5* mf = dynamic_cast<MatchedFileMD5*>(contents[i]);
+      if (cache == 0 || cache->findMD5(mf->md5(), mf->size()) == 0)
+        md5Result.insert(mf->md5());
+    } else if (contents[i]->type() == MATCHED_FILE_SHA256) {
+      MatchedFileSHA256* mf = dynamic_cast<MatchedFileSHA256*>(contents[i]);
+      if (cache == 0 || cache->findSHA256(mf->sha256(), mf->size()) == 0)
+        sha256Result.insert(mf->sha256());
     }
   }
-
-  // Output SHA256 sums of MatchedFileSHA256 (but not WrittenFileSHA256) entries
-  for (size_t i = 0; i < contents.size() - 1; ++i) {
-    MatchedFileSHA256* mf = dynamic_cast<MatchedFileSHA256*>(contents[i]);
-    if (mf != 0 && mf->type() == MATCHED_FILE_SHA256)
-      result.insert(mf->sha256());
-  }
   return 0;
 }
 //______________________________________________________________________
@@ -31,6 +31,8 @@
 #include <serialize.hh>
 //______________________________________________________________________
 
+class JigdoDescVec;
+
 /** Errors thrown by the JigdoDesc code */
 struct JigdoDescError : Error {
   explicit JigdoDescError(const string& m) : Error(m) { }
@@ -81,24 +83,33 @@ public:
       file pointer to the start of the section, allowing you to call
       read() immediately afterwards. */
   static void seekFromEnd(bistream& file);
-  /** Create image file from template and files (via JigdoCache) */
+  /** Read the DESC section of template data templ (name in templFile)
+      into files. Throws JigdoDescError if templ is not a template. */
+  static void readTemplate(JigdoDescVec& files, const string& templFile,
+                           bistream* templ);
+  /** Read the DESC section at the end of temporary file imageTmp into
+      filesTmp and compare it to the template's DESC section in files.
+      @return null if the .tmp file can be reused, else a message
+      explaining why not */
+  static const char* readTmpFile(bistream& imageTmp, JigdoDescVec& filesTmp,
+                                 const JigdoDescVec& files);
+  /** Create image file from template and files (via JigdoCache). If
+      optCreateTmp is true, the .tmp file is created even if none of
+      the files were found, e.g. because the caller will fetch them. */
   static int makeImage(JigdoCache* cache, const string& imageFile,
     const string& imageTmpFile, const string& templFile,
     bistream* templ, const bool optForce,
     ProgressReporter& pr = noReport, size_t readAmnt = 128U*1024,
-    const bool optMkImageCheck = true);
-  /** Return list of MD5sums of files that still need to be copied to
-      the image to complete it. Reads info from tmp file or (if
-      imageTmpFile.empty() or error opening tmp file) outputs complete
-      list from template. */
-  static int listMissingMD5(set<MD5>& result, const string& imageTmpFile,
-    const string& templFile, bistream* templ, ProgressReporter& reporter);
-  /** Return list of SHA256sums of files that still need to be copied to
-      the image to complete it. Reads info from tmp file or (if
+    const bool optMkImageCheck = true, const bool optCreateTmp = false);
+  /** Return lists of MD5sums and SHA256sums of files that still need to
+      be copied to the image to complete it, depending on which checksum
+      the template uses for each file. Reads info from tmp file or (if
       imageTmpFile.empty() or error opening tmp file) outputs complete
-      list from template. */
-  static int listMissingSHA256(set<SHA256>& result, const string& imageTmpFile,
-    const string& templFile, bistream* templ, ProgressReporter& reporter);
+      lists from template, reading it only once. If cache is non-null,
+      files which are present in it are not included in the lists. */
+  static int listMissing(set<MD5>& md5Result, set<SHA256>& sha256Result,
+    const string& imageTmpFile, const string& templFile, bistream* templ,
+    ProgressReporter& reporter, JigdoCache* cache = 0);
 
   class ImageInfoMD5;
   class ImageInfoSHA256;
@@ -0,0 +1,23 @@
+. $srcdir/mktemplate-funcs.sh
+
+# Template with ZSTD parts, the same with and without threads; make-image
+# restores the image from it
+if ../jigdo-file make-template --zstd 2>&1 | grep libzstd >/dev/null; then
+    echo "Skipped, jigdo-file was compiled without libzstd"
+    exit 0
+fi
+random 100k >in1
+random 1100k >image
+cat in1 >>image
+random 1100k >>image
+
+mt --zstd --threads=1 in1
+mv image.template image.template1
+mt -f --zstd --threads=4 in1
+cmp image.template1 image.template
+grep ZSTD image.template >/dev/null
+
+rm -f image.out
+../jigdo-file make-image --report=quiet --image=image.out \
+    --jigdo=image.jigdo --template=image.template in1
+cmp image image.out
@@ -32,6 +32,7 @@
 #include <zlib.h>
 
 #include <algorithm>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <map>
@@ -41,13 +42,17 @@
 #include <compat.hh>
 #include <debug.hh>
 #include <log.hh>
+#include <mappedfile.hh>
 #include <mimestream.hh>
 #include <mkimage.hh>
 #include <mktemplate.hh>
+#include <nocopy.hh>
 #include <scan.hh>
 #include <string.hh>
+#include <threadpool.hh>
 #include <zstream-gz.hh>
 #include <zstream-bz.hh>
+#include <zstream-zstd.hh>
 //______________________________________________________________________
 
 void MkTemplate::ProgressReporter::error(const string& message) {
@@ -63,15 +68,16 @@ MkTemplate::ProgressReporter MkTemplate::noReport;
 MkTemplate::MkTemplate(JigdoCache* jcache, bistream* imageStream,
     JigdoConfig* jigdoInfo, bostream* templateStream, ProgressReporter& pr,
     int zipQuality, size_t readAmnt, bool addImage, bool addServers,
-    bool useBzip2, int checksumChoice)
-  : fileSizeTotal(0U), fileCount(0U), block(), readAmount(readAmnt),
+    int compression, int checksumChoice)
+  : fileSizeTotal(0U), fileCount(0U), rsyncTable(), rsyncFiles(),
+    readAmount(readAmnt),
     off(), unmatchedStart(), greedyMatching(true),
     cache(jcache),
-    image(imageStream), templ(templateStream), zip(0),
+    image(imageStream), imageMap(0), templ(templateStream), zip(0),
     zipQual(zipQuality), reporter(pr), matches(new PartialMatchQueue()),
-    sectorLength(),
+    sectorLength(), scanAhead(0),
     jigdo(jigdoInfo), addImageSection(addImage),
-    addServersSection(addServers), useBzLib(useBzip2),
+    addServersSection(addServers), compressType(compression),
     useChecksum(checksumChoice), matchExec() { }
 //______________________________________________________________________
 
@@ -83,20 +89,6 @@ Logger MkTemplate::debug("make-template");
 
 namespace {
 
-  // Find the position of the highest set bit (e.g. for 0x20, result is 5)
-  inline int bitWidth(uint32 x) {
-    int r = 0;
-    Assert(x <= 0xffffffff); // Can't cope with >32 bits
-    if (x & 0xffff0000) { r += 16; x >>= 16; }
-    if (x & 0xff00) { r += 8; x >>= 8; }
-    if (x & 0xf0) { r += 4; x >>= 4; }
-    if (x & 0xc) { r += 2; x >>= 2; }
-    if (x & 2) { r += 1; x >>=1; }
-    if (x & 1) r += 1;
-    return r;
-  }
-  //________________________________________
-
   /* Avoid integer divisions: Modulo addition/subtraction, with
      certain assertions */
   // Returns (a + b) % m, if (a < m && b <= m)
@@ -222,25 +214,383 @@ private:
    to make such large functions inline, but there is only one call to
    them, anyway. */
 
-inline bool MkTemplate::scanFiles(size_t blockLength, uint32 blockMask,
+inline bool MkTemplate::scanFiles(size_t blockLength,
                                   size_t csumBlockLength) {
   bool result = SUCCESS;
 
   cache->setParams(blockLength, csumBlockLength);
-  FileVec::iterator hashPos;
+  rsyncTable.init(fileCount);
 
-  for (JigdoCache::iterator file = cache->begin();
-       file != cache->end(); ++file) {
+  // Files are read on the cache's worker threads, in parallel
+  JigdoCache::ReadAhead files(cache, false);
+  while (FilePart* file = files.next()) {
     const RsyncSum64* sum = file->getRsyncSum(cache);
     if (sum == 0) continue; // Error - skip
-    // Add file to hash list
-    hashPos = block.begin() + (sum->getHi() & blockMask);
-    hashPos->push_back(&*file);
+    // Add file to hash table
+    rsyncTable.insert(*sum, (uint32)rsyncFiles.size());
+    rsyncFiles.push_back(file);
   }
   return result;
 }
 //________________________________________
 
+/* Helper for scanImage() if the image is mapped into memory and several
+   threads are available. Worker threads run ahead of the main loop:
+
+   - The image is divided into segments. For each one, a thread rolls the
+     rsum over the data and records the offsets at which
+     rsyncTable.mightContain() is true (the "hits"), and among them the
+     offsets at which the rsum equals that of a file's first block
+     ("matches"). scanImage_mainLoop_ahead() then jumps from one of these
+     offsets to the next instead of rolling the rsum itself.
+
+   - Once the first checksum block of a partial match has been confirmed,
+     prefetch() has threads calculate the checksums of the image data
+     covered by the following blocks of the file, so checkChecksumMatch()
+     only needs to compare them.
+
+   Offsets are values of MkTemplate::off, i.e. the rsum "at offset p"
+   covers the blockLength bytes before p. If the main loop needs a segment
+   or a block checksum whose job has not started yet, it does the work
+   itself instead of waiting. */
+class MkTemplate::ScanAhead : NoCopy {
+public:
+  ScanAhead(const MappedFile* imageMap, const RsyncTable& table,
+            size_t blockLength, size_t csumBlockLength, int checksumType,
+            unsigned threads);
+  ~ScanAhead();
+
+  static const uint64 NONE = ~(uint64)0;
+  /** Lowest offset in (off, limit] with a hit, or NONE. off must never
+      decrease between calls. */
+  uint64 nextHit(uint64 off, uint64 limit);
+  /** Lowest offset in (off, limit] with a match, or NONE. Stores its rsum
+      in sum. */
+  uint64 nextMatch(uint64 off, uint64 limit, RsyncSum64* sum);
+
+  /** Make sure checksums are being calculated for the next few blocks of
+      x, starting with x->blockNumber() */
+  void prefetch(const PartialMatch* x);
+  /** If the checksum of the image data covered by x's current block has
+      been prefetched, store it in result and return true. */
+  bool blockSum(const PartialMatch* x, MD5* result);
+  bool blockSum(const PartialMatch* x, SHA256* result);
+  /** Stop calculating checksums for partial matches that are no longer
+      in the queue. Cheap unless called often, does something at most
+      once per csumBlockLength bytes. */
+  void prune(uint64 off, const PartialMatchQueue* matches);
+
+private:
+  static const uint64 SEGMENT_LENGTH = 4*1024*1024;
+  static const size_t SLICE_LENGTH = 1024*1024; // Prefetched at a time
+  enum State { IDLE, QUEUED, RUNNING, DONE };
+
+  struct Match {
+    uint64 off;
+    RsyncSum64 sum;
+    bool operator<(uint64 o) const { return off < o; }
+  };
+  struct Segment { // Offsets (begin, end]
+    uint64 begin, end;
+    State state;
+    vector<uint64> hits;
+    vector<Match> matches;
+  };
+  struct Slice { // Checksums of a number of consecutive blocks
+    State state;
+    vector<MD5> md5;
+    vector<SHA256> sha256;
+  };
+  struct Area { // Checksums for the blocks of a partial match
+    uint64 start, size;
+    vector<Slice> slices;
+    bool used; // For prune()
+  };
+  typedef map<pair<uint64, uint64>, shared_ptr<Area> > AreaMap;
+
+  bool claim(State* state); // QUEUED => RUNNING, return true if done so
+  void finished(State* state); // RUNNING => DONE
+  void await(State* state); // Do the job or wait until it is DONE
+  void discard(uint64 off);
+  const Segment* segment(uint64 off);
+  void scanSegment(Segment* s);
+  void segmentJob(Segment* s);
+  const Slice* slice(const PartialMatch* x);
+  void hashSlice(Area* a, size_t n);
+  void sliceJob(shared_ptr<Area> a, size_t n);
+
+  const MappedFile* image;
+  const RsyncTable& rsyncTable;
+  size_t blockLength, csumBlockLength;
+  int useChecksum;
+  size_t sliceBlocks; // Nr of csumBlockLength blocks per Slice
+  size_t aheadSegments, aheadSlices; // How far to run ahead
+  uint64 firstSegment; // Index of segments.front()
+  deque<unique_ptr<Segment> > segments;
+  AreaMap areas;
+  uint64 nextPrune;
+  bool stopping; // Set by dtor to make queued jobs return immediately
+  Mutex lock; // Protects stopping and the state of Segments and Slices
+  Condition stateChanged;
+  ThreadPool pool; // Must come last, its dtor waits for the threads
+};
+
+MkTemplate::ScanAhead::ScanAhead(const MappedFile* imageMap,
+    const RsyncTable& table, size_t blockLen, size_t csumBlockLen,
+    int checksumType, unsigned threads)
+  : image(imageMap), rsyncTable(table), blockLength(blockLen),
+    csumBlockLength(csumBlockLen), useChecksum(checksumType),
+    sliceBlocks(max((size_t)1, SLICE_LENGTH / csumBlockLen)),
+    aheadSegments(4 * threads), aheadSlices(2 * threads),
+    firstSegment(0), nextPrune(0), stopping(false), pool(threads) { }
+
+MkTemplate::ScanAhead::~ScanAhead() {
+  MutexLock l(lock);
+  stopping = true;
+}
+//____________________
+
+bool MkTemplate::ScanAhead::claim(State* state) {
+  MutexLock l(lock);
+  if (stopping || *state != QUEUED) return false;
+  *state = RUNNING;
+  return true;
+}
+
+void MkTemplate::ScanAhead::finished(State* state) {
+  MutexLock l(lock);
+  *state = DONE;
+  l.unlock();
+  stateChanged.notify_all();
+}
+
+void MkTemplate::ScanAhead::await(State* state) {
+  MutexLock l(lock);
+  while (*state == RUNNING) stateChanged.wait(l);
+}
+//____________________
+
+// Forget about segments which only contain offsets <= off
+void MkTemplate::ScanAhead::discard(uint64 off) {
+  while (!segments.empty() && segments.front()->end <= off) {
+    segments.pop_front();
+    ++firstSegment;
+  }
+}
+
+/* Return the segment which contains offset off, once it is DONE. More
+   segments are queued as needed. */
+const MkTemplate::ScanAhead::Segment*
+MkTemplate::ScanAhead::segment(uint64 off) {
+  uint64 n = (off - 1) / SEGMENT_LENGTH;
+  Assert(n >= firstSegment);
+  uint64 next = firstSegment + segments.size();
+  while ((next <= n || next < firstSegment + aheadSegments)
+         && next * SEGMENT_LENGTH < image->size()) {
+    Segment* s = new Segment();
+    s->begin = next * SEGMENT_LENGTH;
+    s->end = min(s->begin + SEGMENT_LENGTH, image->size());
+    s->state = QUEUED;
+    segments.push_back(unique_ptr<Segment>(s));
+    pool.submit(bind(&ScanAhead::segmentJob, this, s));
+    ++next;
+  }
+  Segment* s = segments[(size_t)(n - firstSegment)].get();
+  if (claim(&s->state)) {
+    scanSegment(s);
+    finished(&s->state);
+  }
+  await(&s->state);
+  return s;
+}
+
+void MkTemplate::ScanAhead::segmentJob(Segment* s) {
+  if (!claim(&s->state)) return;
+  scanSegment(s);
+  finished(&s->state);
+}
+
+/* Same calculation as in scanImage(), including the blockLength bytes
+   0x7f before the start of the image */
+void MkTemplate::ScanAhead::scanSegment(Segment* s) {
+  const Ubyte* data = image->data();
+  uint64 off = s->begin;
+  RsyncSum64 rsum;
+  if (off < blockLength) {
+    rsum.addBackNtimes(0x7f, (size_t)(blockLength - off));
+    rsum.addBack(data, (size_t)off);
+  } else {
+    rsum.addBack(data + off - blockLength, blockLength);
+  }
+
+  size_t pos;
+  while (off < s->end && off < blockLength) {
+    rsum.removeFront(0x7f, blockLength);
+    rsum.addBack(data[off]);
+    ++off;
+    if (!rsyncTable.mightContain(rsum.getHi())) continue;
+    s->hits.push_back(off);
+    pos = rsyncTable.start(rsum);
+    if (rsyncTable.next(rsum, pos) == RsyncTable::NONE) continue;
+    Match m = { off, rsum };
+    s->matches.push_back(m);
+  }
+
+  uint32 hi[32];
+  while (off < s->end) {
+    size_t len = (size_t)min((uint64)32, s->end - off);
+    RsyncSum64 rsumOld = rsum;
+    rsum.roll(data + off - blockLength, data + off, len, blockLength, hi);
+    size_t i = 0;
+    while (i < len && !rsyncTable.mightContain(hi[i])) ++i;
+    if (i == len) { off += len; continue; }
+    ++i;
+    rsum = rsumOld;
+    rsum.roll(data + off - blockLength, data + off, i, blockLength, hi);
+    off += i;
+    s->hits.push_back(off);
+    pos = rsyncTable.start(rsum);
+    if (rsyncTable.next(rsum, pos) == RsyncTable::NONE) continue;
+    Match m = { off, rsum };
+    s->matches.push_back(m);
+  }
+}
+
+uint64 MkTemplate::ScanAhead::nextHit(uint64 off, uint64 limit) {
+  discard(off);
+  while (off < limit && off < image->size()) {
+    const Segment* s = segment(off + 1);
+    vector<uint64>::const_iterator i =
+      upper_bound(s->hits.begin(), s->hits.end(), off);
+    if (i != s->hits.end()) return (*i <= limit ? *i : NONE);
+    off = s->end;
+  }
+  return NONE;
+}
+
+uint64 MkTemplate::ScanAhead::nextMatch(uint64 off, uint64 limit,
+                                        RsyncSum64* sum) {
+  discard(off);
+  while (off < limit && off < image->size()) {
+    const Segment* s = segment(off + 1);
+    vector<Match>::const_iterator i =
+      lower_bound(s->matches.begin(), s->matches.end(), off + 1);
+    if (i != s->matches.end()) {
+      if (i->off > limit) return NONE;
+      *sum = i->sum;
+      return i->off;
+    }
+    off = s->end;
+  }
+  return NONE;
+}
+//____________________
+
+void MkTemplate::ScanAhead::prefetch(const PartialMatch* x) {
+  shared_ptr<Area>& a = areas[make_pair(x->startOffset(), x->file()->size())];
+  if (!a) {
+    a.reset(new Area());
+    a->start = x->startOffset();
+    a->size = x->file()->size();
+    uint64 blocks = (a->size + csumBlockLength - 1) / csumBlockLength;
+    a->slices.resize((size_t)((blocks + sliceBlocks - 1) / sliceBlocks));
+    for (size_t i = 0; i < a->slices.size(); ++i)
+      a->slices[i].state = IDLE;
+  }
+  size_t first = x->blockNumber() / sliceBlocks;
+  size_t end = min(first + aheadSlices, a->slices.size());
+  for (size_t i = first; i < end; ++i) {
+    Slice& s = a->slices[i];
+    if (s.state != IDLE) continue;
+    if (a->start + i * sliceBlocks * csumBlockLength >= image->size()) break;
+    if (useChecksum == CHECK_MD5)
+      s.md5.resize(sliceBlocks);
+    else
+      s.sha256.resize(sliceBlocks);
+    s.state = QUEUED;
+    pool.submit(bind(&ScanAhead::sliceJob, this, a, i));
+  }
+}
+
+void MkTemplate::ScanAhead::sliceJob(shared_ptr<Area> a, size_t n) {
+  if (!claim(&a->slices[n].state)) return;
+  hashSlice(a.get(), n);
+  finished(&a->slices[n].state);
+}
+
+// Blocks which extend beyond the end of the image are left out
+void MkTemplate::ScanAhead::hashSlice(Area* a, size_t n) {
+  Slice& s = a->slices[n];
+  uint64 start = a->start + n * sliceBlocks * csumBlockLength;
+  if (start >= image->size()) return;
+  uint64 end = min(start + sliceBlocks * csumBlockLength, a->start + a->size);
+  if (end > image->size())
+    end = start + (image->size() - start) / csumBlockLength * csumBlockLength;
+  if (end == start) return;
+  // The blocks are independent, so several can be hashed at once
+  const Ubyte* data = image->data() + start;
+  if (useChecksum == CHECK_MD5)
+    MD5Sum::blockSums(data, (size_t)(end - start), csumBlockLength, &s.md5[0]);
+  else
+    SHA256Sum::blockSums(data, (size_t)(end - start), csumBlockLength,
+                         &s.sha256[0]);
+}
+
+const MkTemplate::ScanAhead::Slice*
+MkTemplate::ScanAhead::slice(const PartialMatch* x) {
+  AreaMap::iterator i =
+    areas.find(make_pair(x->startOffset(), x->file()->size()));
+  if (i == areas.end()) return 0;
+  Area* a = i->second.get();
+  size_t n = x->blockNumber() / sliceBlocks;
+  if (n >= a->slices.size() || a->slices[n].state == IDLE) return 0;
+  Slice* s = &a->slices[n];
+  if (claim(&s->state)) {
+    hashSlice(a, n);
+    finished(&s->state);
+  }
+  await(&s->state);
+  return s;
+}
+
+bool MkTemplate::ScanAhead::blockSum(const PartialMatch* x, MD5* result) {
+  const Slice* s = slice(x);
+  if (s == 0) return false;
+  *result = s->md5[x->blockNumber() % sliceBlocks];
+  return true;
+}
+
+bool MkTemplate::ScanAhead::blockSum(const PartialMatch* x, SHA256* result) {
+  const Slice* s = slice(x);
+  if (s == 0) return false;
+  *result = s->sha256[x->blockNumber() % sliceBlocks];
+  return true;
+}
+
+void MkTemplate::ScanAhead::prune(uint64 off,
+                                  const PartialMatchQueue* matches) {
+  if (off < nextPrune || areas.empty()) return;
+  nextPrune = off + csumBlockLength;
+  for (AreaMap::iterator i = areas.begin(); i != areas.end(); ++i)
+    i->second->used = false;
+  for (const PartialMatch* x = matches->front(); x != 0; x = x->next()) {
+    AreaMap::iterator i =
+      areas.find(make_pair(x->startOffset(), x->file()->size()));
+    if (i != areas.end()) i->second->used = true;
+  }
+  MutexLock l(lock);
+  AreaMap::iterator i = areas.begin();
+  while (i != areas.end()) {
+    if (i->second->used) { ++i; continue; }
+    // Jobs which have not started yet will do nothing
+    vector<Slice>& slices = i->second->slices;
+    for (size_t j = 0; j < slices.size(); ++j)
+      if (slices[j].state == QUEUED) slices[j].state = DONE;
+    areas.erase(i++);
+  }
+}
+//________________________________________
+
 void MkTemplate::checkRsyncSumMatch2(const size_t blockLen,
     const size_t back, const size_t csumBlockLength, uint64& nextEvent,
     FilePart* file) {
@@ -294,23 +644,16 @@ void MkTemplate::checkRsyncSumMatch2(const size_t blockLen,
 /* Look for matches of sum (i.e. scanImage()'s rsum). If found, insert
    appropriate entry in "matches". */
 void MkTemplate::checkRsyncSumMatch(const RsyncSum64& sum,
-    const uint32& bitMask, const size_t blockLen, const size_t back,
-    const size_t csumBlockLength, uint64& nextEvent) {
-
-  typedef const vector<FilePart*> FVec;
-  FVec& hashEntry = block[sum.getHi() & bitMask];
-  if (hashEntry.empty()) return;
-
-  FVec::const_iterator i = hashEntry.begin(), e = hashEntry.end();
-  do {
-    FilePart* file = *i;
-    const RsyncSum64* fileSum = file->getRsyncSum(cache);
-    if (fileSum != 0 && *fileSum == sum)
-      // Insert new partial file match in "matches" queue
-      checkRsyncSumMatch2(blockLen, back, csumBlockLength, nextEvent, file);
-    ++i;
-  } while (i != e);
-  return;
+    const size_t blockLen, const size_t back, const size_t csumBlockLength,
+    uint64& nextEvent) {
+  if (!rsyncTable.mightContain(sum.getHi())) return;
+  size_t pos = rsyncTable.start(sum);
+  uint32 i;
+  while ((i = rsyncTable.next(sum, pos)) != RsyncTable::NONE) {
+    // Insert new partial file match in "matches" queue
+    checkRsyncSumMatch2(blockLen, back, csumBlockLength, nextEvent,
+                        rsyncFiles[i]);
+  }
 }
 //________________________________________
 
@@ -473,15 +816,19 @@ bool MkTemplate::checkChecksumMatch(Ubyte* const buf,
      wraparound. NB 0 <= x->blockOff < bufferLength, but 1 <= data <
      bufferLength+1 */
   if (useChecksum == CHECK_MD5) {
-    static MD5Sum md;
-    md.reset();
-    if (x->blockOffset() < data) {
-      md.update(buf + x->blockOffset(), data - x->blockOffset());
-    } else {
-      md.update(buf + x->blockOffset(), bufferLength - x->blockOffset());
-      md.update(buf, data);
+    MD5 md;
+    if (scanAhead == 0 || !scanAhead->blockSum(x, &md)) {
+      static MD5Sum mdSum;
+      mdSum.reset();
+      if (x->blockOffset() < data) {
+        mdSum.update(buf + x->blockOffset(), data - x->blockOffset());
+      } else {
+        mdSum.update(buf + x->blockOffset(),
+                     bufferLength - x->blockOffset());
+        mdSum.update(buf, data);
+      }
+      md = mdSum.finishForReuse();
     }
-    md.finishForReuse();
 
     const MD5* xfileSum = x->file()->getMD5Sums(cache, x->blockNumber());
     if (debug)
@@ -497,15 +844,19 @@ bool MkTemplate::checkChecksumMatch(Ubyte* const buf,
       return checkMatch_mismatch(stillBuffered, x, desc);
     }
   } else {
-    static SHA256Sum sd;
-    sd.reset();
-    if (x->blockOffset() < data) {
-      sd.update(buf + x->blockOffset(), data - x->blockOffset());
-    } else {
-      sd.update(buf + x->blockOffset(), bufferLength - x->blockOffset());
-      sd.update(buf, data);
+    SHA256 sd;
+    if (scanAhead == 0 || !scanAhead->blockSum(x, &sd)) {
+      static SHA256Sum sdSum;
+      sdSum.reset();
+      if (x->blockOffset() < data) {
+        sdSum.update(buf + x->blockOffset(), data - x->blockOffset());
+      } else {
+        sdSum.update(buf + x->blockOffset(),
+                     bufferLength - x->blockOffset());
+        sdSum.update(buf, data);
+      }
+      sd = sdSum.finishForReuse();
     }
-    sd.finishForReuse();
 
     const SHA256* xfileSum = x->file()->getSHA256Sums(cache, x->blockNumber());
     if (debug)
@@ -532,6 +883,7 @@ bool MkTemplate::checkChecksumMatch(Ubyte* const buf,
     nextEvent = min(nextEvent, x->nextEvent());
     debug("checkChecksumMatch: match and more to go, next at off %1",
           x->nextEvent());
+    if (scanAhead != 0) scanAhead->prefetch(x);
     return SUCCESS;
   }
   //____________________
@@ -656,8 +1008,7 @@ bool MkTemplate::unmatchedAtEnd(Ubyte* const buf,
    time. */
 void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
     RsyncSum64* rsum, Ubyte* buf, size_t* data, size_t* n, size_t* rsumBack,
-    size_t bufferLength, size_t blockLength, uint32 blockMask,
-    size_t csumBlockLength) {
+    size_t bufferLength, size_t blockLength, size_t csumBlockLength) {
 
 # if 0
   // Simple version
@@ -670,7 +1021,7 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
     ++*data; ++off; --*n;
     *rsumBack = modAdd(*rsumBack, 1, bufferLength);
     if (((off - blockLength) & sectorMask) == 0) {
-      checkRsyncSumMatch(*rsum, blockMask, blockLength, *rsumBack,
+      checkRsyncSumMatch(*rsum, blockLength, *rsumBack,
                          csumBlockLength, nextEvent);
       sectorMask = sectorLength - 1;
       Paranoid(matches->empty()
@@ -738,7 +1089,7 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
 
     if (off == nextAlignedOff) {
       Paranoid(((off - blockLength) & sectorMask) == 0);
-      checkRsyncSumMatch(*rsum, blockMask, blockLength, *rsumBack,
+      checkRsyncSumMatch(*rsum, blockLength, *rsumBack,
                          csumBlockLength, nextEvent);
       Paranoid(matches->empty()
                || matches->front()->startOffset() >= unmatchedStart);
@@ -750,12 +1101,267 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
 }
 //________________________________________
 
+/* Variant of the innermost loops of scanImage() for when scanAhead has
+   already located the offsets at which the rsum might match. Instead of
+   rolling the rsum, jump from one such offset to the next; at all other
+   offsets, checkRsyncSumMatch() would not do anything anyway. The steps
+   of the unrolled loop and the switch to fast forward mode once the
+   queue is full are reproduced exactly, so the same offsets are checked
+   as by the other loops, and the template is identical. rsum is not
+   updated. nextEvent can only decrease, so offsets looked up with an
+   earlier value of it stay valid. */
+void MkTemplate::scanImage_mainLoop_ahead(uint64 nextEvent, size_t* data,
+    size_t* n, size_t* rsumBack, size_t bufferLength, size_t blockLength,
+    size_t csumBlockLength) {
+  RsyncSum64 sum; // Of the match at offset "match"
+  uint64 match = scanAhead->nextMatch(off, nextEvent, &sum);
+  size_t len;
+
+  if (!matches->full()) {
+    sectorLength = INITIAL_SECTOR_LENGTH;
+    // Mirrors the unrolled loop, whose steps depend on the hits
+    uint64 hit = scanAhead->nextHit(off, nextEvent);
+    while (off + 32 < nextEvent && *rsumBack < bufferLength - 32) {
+      len = (hit > off + 32 ? 32 : (size_t)(hit - off));
+      *data += len; *rsumBack += len; off += len; *n -= len;
+      if (off < hit) continue;
+      if (off == match) {
+        checkRsyncSumMatch(sum, blockLength, *rsumBack, csumBlockLength,
+                           nextEvent);
+        match = scanAhead->nextMatch(off, nextEvent, &sum);
+      }
+      if (matches->full()) break;
+      hit = scanAhead->nextHit(off, nextEvent);
+    }
+  }
+
+  bool full = matches->full();
+  if (full) debug("DROPPING, fast forward (queue full)");
+  while (off < nextEvent) {
+    len = (size_t)(min(match, nextEvent) - off);
+    *data += len; off += len; *n -= len;
+    *rsumBack = modAdd(*rsumBack, len, bufferLength);
+    if (off < match) break;
+    // Once full, only check offsets where a match would be sector-aligned
+    if (!full || ((off - blockLength) & (sectorLength - 1)) == 0) {
+      checkRsyncSumMatch(sum, blockLength, *rsumBack, csumBlockLength,
+                         nextEvent);
+    }
+    match = scanAhead->nextMatch(off, nextEvent, &sum);
+  }
+}
+//________________________________________
+
+namespace {
+
+  /* Reads the image for scanImage() and calculates its MD5 and SHA256
+     sums. With threads > 1, a reader thread fills a ring of buffers ahead
+     of the scanner, and each of the two checksums is calculated by a
+     thread of its own, so reading, scanning and checksumming overlap.
+     Otherwise, read() reads straight into the caller's buffer.
+     If the image is mapped into memory, there is no reader thread and
+     no ring: The checksums are calculated directly over the mapped
+     pages, and read() copies from the mapping. */
+  class ImageReader : NoCopy {
+  public:
+    ImageReader(bistream* imageStream, const MappedFile* imageMap,
+                size_t readAmount, unsigned threads);
+    ~ImageReader();
+
+    /* False once the end of the image has been returned by read() */
+    bool good();
+    /* Copy between 0 and len bytes of image data to buf, return count */
+    size_t read(Ubyte* buf, size_t len);
+    /* Call after the last read() to finish the whole-image checksums */
+    void finish();
+    const MD5Sum& md5() const { return imageMd5Sum; }
+    const SHA256Sum& sha256() const { return imageSha256Sum; }
+
+  private:
+    enum { SCANNER, MD5, SHA256, CONSUMERS }; // Indexes into consumed[]
+    static const unsigned RING = 8; // Nr of buffers in ring
+    static const size_t MAP_SLICE = 1024*1024; // Checksummed at a time
+    static const uint64 MAP_AHEAD = 8*1024*1024; // Readahead for scanner
+    struct Chunk { vector<Ubyte> data; size_t size; };
+
+    uint64 minConsumed() const;
+    void readImage(); // Reader thread
+    void hash(unsigned consumer); // MD5 or SHA256 thread
+    void hashMapped(unsigned consumer); // Same for mapped image
+
+    bistream* image;
+    const MappedFile* map; // Non-null => read image from here
+    uint64 mapPos; // Offset of scanner in map
+    uint64 nextWillNeed; // Once mapPos reaches this, ask for readahead
+    MD5Sum imageMd5Sum;
+    SHA256Sum imageSha256Sum;
+    vector<Chunk> ring;
+    uint64 filled; // Nr of chunks read so far
+    uint64 consumed[CONSUMERS]; // Nr of chunks each consumer is done with
+    size_t chunkPos; // Offset of scanner in chunk nr consumed[SCANNER]
+    bool eof; // Reader has read the last chunk
+    bool stopping; // Set by dtor to make threads exit early
+    Mutex lock; // Protects filled, consumed, eof, stopping
+    Condition changed; // Signalled whenever filled or consumed changes
+    ThreadPool pool; // Must come last, its dtor waits for the threads
+  };
+
+  ImageReader::ImageReader(bistream* imageStream, const MappedFile* imageMap,
+                           size_t readAmount, unsigned threads)
+      : image(imageStream), map(imageMap), mapPos(0), nextWillNeed(0),
+        ring(), filled(0), chunkPos(0), eof(false), stopping(false),
+        lock(), changed(),
+        pool(threads < 2 ? 0 : imageMap != 0 ? 2 : 3) {
+    for (unsigned i = 0; i < CONSUMERS; ++i) consumed[i] = 0;
+    if (pool.threads() == 0) return;
+    if (map != 0) {
+      pool.submit(bind(&ImageReader::hashMapped, this, (unsigned)MD5));
+      pool.submit(bind(&ImageReader::hashMapped, this, (unsigned)SHA256));
+      return;
+    }
+    ring.resize(RING);
+    for (unsigned i = 0; i < RING; ++i) ring[i].data.resize(readAmount);
+    // All three jobs must run at the same time, hence 3 threads
+    pool.submit(bind(&ImageReader::readImage, this));
+    pool.submit(bind(&ImageReader::hash, this, (unsigned)MD5));
+    pool.submit(bind(&ImageReader::hash, this, (unsigned)SHA256));
+  }
+
+  ImageReader::~ImageReader() {
+    MutexLock l(lock);
+    stopping = true;
+    l.unlock();
+    changed.notify_all();
+  }
+  //________________________________________
+
+  uint64 ImageReader::minConsumed() const {
+    uint64 result = consumed[0];
+    for (unsigned i = 1; i < CONSUMERS; ++i)
+      result = min(result, consumed[i]);
+    return result;
+  }
+
+  void ImageReader::readImage() {
+    MutexLock l(lock);
+    while (true) {
+      while (!stopping && filled - minConsumed() >= RING) changed.wait(l);
+      if (stopping) return;
+      Chunk& c = ring[filled % RING];
+      l.unlock();
+      readBytes(*image, &c.data[0], c.data.size());
+      c.size = image->gcount();
+      bool more = image->good();
+      l.lock();
+      ++filled;
+      eof = !more;
+      changed.notify_all();
+      if (eof) return;
+    }
+  }
+
+  void ImageReader::hash(unsigned consumer) {
+    MutexLock l(lock);
+    uint64& i = consumed[consumer];
+    while (true) {
+      while (!stopping && !eof && i == filled) changed.wait(l);
+      if (stopping || i == filled) return;
+      const Chunk& c = ring[i % RING];
+      l.unlock();
+      if (consumer == MD5)
+        imageMd5Sum.update(&c.data[0], c.size);
+      else
+        imageSha256Sum.update(&c.data[0], c.size);
+      l.lock();
+      ++i;
+      changed.notify_all();
+    }
+  }
+
+  void ImageReader::hashMapped(unsigned consumer) {
+    const Ubyte* p = map->data();
+    uint64 left = map->size();
+    while (left > 0) {
+      MutexLock l(lock);
+      if (stopping) return;
+      l.unlock();
+      size_t n = (size_t)min(left, (uint64)MAP_SLICE);
+      if (consumer == MD5)
+        imageMd5Sum.update(p, n);
+      else
+        imageSha256Sum.update(p, n);
+      p += n;
+      left -= n;
+    }
+  }
+  //________________________________________
+
+  bool ImageReader::good() {
+    if (map != 0) return mapPos < map->size();
+    if (pool.threads() == 0) return image->good();
+    MutexLock l(lock);
+    return !eof || consumed[SCANNER] < filled;
+  }
+
+  size_t ImageReader::read(Ubyte* buf, size_t len) {
+    if (map != 0) {
+      if (mapPos >= nextWillNeed) {
+        map->willNeed(mapPos, MAP_AHEAD);
+        nextWillNeed = mapPos + MAP_AHEAD / 2;
+      }
+      const Ubyte* p = map->data() + mapPos;
+      size_t n = (size_t)min((uint64)len, map->size() - mapPos);
+      memcpy(buf, p, n);
+      mapPos += n;
+      if (pool.threads() == 0) {
+        imageMd5Sum.update(p, n);
+        imageSha256Sum.update(p, n);
+      }
+      return n;
+    }
+
+    if (pool.threads() == 0) {
+      readBytes(*image, buf, len);
+      size_t n = image->gcount();
+      imageMd5Sum.update(buf, n);
+      imageSha256Sum.update(buf, n);
+      return n;
+    }
+
+    MutexLock l(lock);
+    uint64& i = consumed[SCANNER];
+    while (!eof && i == filled) changed.wait(l);
+    if (i == filled) return 0;
+    l.unlock();
+    const Chunk& c = ring[i % RING];
+    size_t n = min(len, c.size - chunkPos);
+    if (n > 0) memcpy(buf, &c.data[chunkPos], n);
+    chunkPos += n;
+    if (chunkPos == c.size) { // Hand chunk back to reader
+      chunkPos = 0;
+      l.lock();
+      ++i;
+      changed.notify_all();
+    }
+    return n;
+  }
+
+  void ImageReader::finish() {
+    pool.wait();
+    imageMd5Sum.finish();
+    imageSha256Sum.finish();
+  }
+
+}
+//________________________________________
+
 /* Scan image. Central function for template generation.
 
    Treat buf as a circular buffer. Read new data into at most half the
    buffer. Calculate a rolling checksum covering blockLength bytes. When it
-   matches an entry in block, start calculating checksums of blocks of length
-   csumBlockLength.
+   matches an entry in rsyncTable, start calculating checksums of blocks of
+   length csumBlockLength. If the image is mapped into memory, worker
+   threads can do most of this ahead of the main loop, see ScanAhead.
 
    Since both image and templ can be non-seekable, we run into a problem in
    the following case: After the initial RsyncSum match, a few of the
@@ -765,12 +1371,12 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
    can't if the image is stdin! Solution: Since we know that the checksum of a
    block matched part of an input file, we can re-read from there. */
 inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
-    size_t blockLength, uint32 blockMask, size_t csumBlockLength,
-    MD5Sum& templMd5Sum, SHA256Sum& templSHA256Sum) {
+    size_t blockLength, size_t csumBlockLength, MD5Sum& templMd5Sum,
+    SHA256Sum& templSHA256Sum) {
   bool result = SUCCESS;
 
   /* Cause input files to be analysed */
-  if (scanFiles(blockLength, blockMask, csumBlockLength))
+  if (scanFiles(blockLength, csumBlockLength))
     result = FAILURE;
 
   /* Initialise rolling sums with blockSize bytes 0x7f, and do the same with
@@ -786,14 +1392,21 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
 
   // Compression pipe for templ data
   unique_ptr<Zobstream> zipDel;
-  if (useBzLib)
+  if (compressType == COMPRESS_BZIP2)
     zipDel.reset(implicit_cast<Zobstream*>(
       new ZobstreamBz(*templ, zipQual, 256U, &templMd5Sum, &templSHA256Sum) ));
+# if HAVE_ZSTD
+  else if (compressType == COMPRESS_ZSTD)
+    zipDel.reset(implicit_cast<Zobstream*>(
+      new ZobstreamZstd(*templ, zipQual, ZSTDCHUNK_SIZE, 256U,
+                        &templMd5Sum, &templSHA256Sum) ));
+# endif
   else
     zipDel.reset(implicit_cast<Zobstream*>(
       new ZobstreamGz(*templ, ZIPCHUNK_SIZE, zipQual, 15, 8, 256U,
                       &templMd5Sum, &templSHA256Sum) ));
   zip = zipDel.get();
+  zip->setThreads(cache->getThreads());
   Desc desc; // Buffer for DESC data, will be appended to templ at end
   size_t data = 0; // Offset into buf of byte currently being processed
   off = 0; // Current absolute offset in image, corresponds to "data"
@@ -806,20 +1419,26 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
      within the image. */
   unmatchedStart = 0;
 
-  MD5Sum imageMd5Sum; // MD5 of whole image
   MD5Sum md; // Re-used for each 2nd-level check of any rsum match
-  SHA256Sum imageSha256Sum; // SHA256 of whole image
   SHA256Sum sd; // Re-used for each 2nd-level check of any rsum match
   matches->erase();
   sectorLength = INITIAL_SECTOR_LENGTH;
 
   // Read image
   size_t rsumBack = bufferLength - blockLength;
+  // Also calculates MD5 and SHA256 of whole image
+  ImageReader reader(image, imageMap, readAmount, cache->getThreads());
+  unique_ptr<ScanAhead> scanAheadDel;
+  if (HAVE_THREADS && imageMap != 0 && cache->getThreads() > 1) {
+    scanAheadDel.reset(new ScanAhead(imageMap, rsyncTable, blockLength,
+        csumBlockLength, useChecksum, cache->getThreads()));
+  }
+  scanAhead = scanAheadDel.get();
 
   try {
     /* Catch Zerrors, which can occur in zip->write(), writeBuf(),
        checkChecksumMatch(), zip->close() */
-    while (image->good()) {
+    while (reader.good()) {
 
       debug("---------- main loop. off=%1 data=%2 unmatchedStart=%3",
             off, data, unmatchedStart);
@@ -866,52 +1485,47 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
         debug("thisReadAmount=%1", thisReadAmount);
       }
 #     endif
-      readBytes(*image, buf + data, thisReadAmount);
-      size_t n = image->gcount();
-      imageMd5Sum.update(buf + data, n);
-      imageSha256Sum.update(buf + data, n);
+      size_t n = reader.read(buf + data, thisReadAmount);
 
       while (n > 0) { // Still unprocessed bytes left
         uint64 nextEvent = off + n; // Special event: end of buffer
         if (!matches->empty())
           nextEvent = min(nextEvent, matches->front()->nextEvent());
 
-        if (!matches->full()) {
+        if (scanAhead != 0) {
+          scanImage_mainLoop_ahead(nextEvent, &data, &n, &rsumBack,
+              bufferLength, blockLength, csumBlockLength);
+        } else if (!matches->full()) {
           sectorLength = INITIAL_SECTOR_LENGTH;
 
           /* Unrolled innermost loop - see below for single-iteration
-             version. Also see checkRsyncSumMatch above. */
+             version. Also see checkRsyncSumMatch above. rsum is rolled
+             over 32 bytes in one go, then the 32 intermediate values of
+             getHi() are looked up. If one of them might be a match,
+             roll again from the old rsum up to that position. */
           while (off + 32 < nextEvent && rsumBack < bufferLength - 32) {
-            size_t dataOld = data;
-            do {
-              const vector<FilePart*>* hashEntry;
-#             define x ; \
-              rsum.removeFront(buf[rsumBack], blockLength); \
-              rsum.addBack(buf[data]); \
-              ++data; ++rsumBack; \
-              hashEntry = &block[rsum.getHi() & blockMask]; \
-              if (hashEntry->size() > 1) break; \
-              if (hashEntry->size() == 1) { \
-                FilePart* file = (*hashEntry)[0]; \
-                const RsyncSum64* fileSum = file->getRsyncSum(cache); \
-                if (fileSum != 0 && *fileSum == rsum) break; \
-              }
-              x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x
-#             undef x
-              dataOld = data; // Special case: "Did not break out of loop"
-            } while (false);
-            if (dataOld == data) {
-              off += 32; n -= 32;
+            uint32 hi[32];
+            RsyncSum64 rsumOld = rsum;
+            rsum.roll(buf + rsumBack, buf + data, 32, blockLength, hi);
+            size_t i = 0;
+            while (i < 32 && !rsyncTable.mightContain(hi[i])) ++i;
+            if (i == 32) {
+              data += 32; rsumBack += 32; off += 32; n -= 32;
             } else {
-              dataOld = data - dataOld; off += dataOld; n -= dataOld;
-              checkRsyncSumMatch(rsum, blockMask, blockLength, rsumBack,
+              ++i;
+              rsum = rsumOld;
+              rsum.roll(buf + rsumBack, buf + data, i, blockLength, hi);
+              data += i; rsumBack += i; off += i; n -= i;
+              checkRsyncSumMatch(rsum, blockLength, rsumBack,
                                  csumBlockLength, nextEvent);
             }
             if (matches->full()) break;
           }
         } // endif (!matches->full())
 
-        if (!matches->full()) {
+        if (scanAhead != 0) {
+          // Nothing left to do, off == nextEvent
+        } else if (!matches->full()) {
           // Innermost loop - single-byte version, matches not full
           while (off < nextEvent) {
             // Roll checksum by one byte
@@ -922,7 +1536,7 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
 
             /* Look for matches of rsum. If found, insert appropriate
                entry in matches list and maybe modify nextEvent. */
-            checkRsyncSumMatch(rsum, blockMask, blockLength, rsumBack,
+            checkRsyncSumMatch(rsum, blockLength, rsumBack,
                                csumBlockLength, nextEvent);
 
             /* We mustn't by accident schedule an event for a part of
@@ -934,8 +1548,7 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
         } else {
           // Innermost loop - MATCHES IS FULL
           scanImage_mainLoop_fastForward(nextEvent, &rsum, buf, &data, &n,
-              &rsumBack, bufferLength, blockLength, blockMask,
-              csumBlockLength);
+              &rsumBack, bufferLength, blockLength, csumBlockLength);
         } // endif (matches->full())
         if (matches->empty())
           debug(" %1: Event, matches empty", off);
@@ -954,6 +1567,7 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
 				 nextEvent, stillBuffered, desc))
             return FAILURE; // no recovery possible, exit immediately
         }
+        if (scanAhead != 0) scanAhead->prune(off, matches);
 
         Assert(matches->empty() || matches->nextEvent() > off);
       } // endwhile (n > 0), i.e. more unprocessed bytes left in buffer
@@ -961,7 +1575,7 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
       if (data == bufferLength) data = 0;
       Assert(data < bufferLength);
 
-    } // endwhile (image->good()), i.e. more data left in input image
+    } // endwhile (reader.good()), i.e. more data left in input image
 
     // End of image data - any remaining partial match is UNMATCHED
     if (unmatchedStart < off
@@ -979,12 +1593,11 @@ inline bool MkTemplate::scanImage(Ubyte* buf, size_t bufferLength,
     return FAILURE;
   }
 
-  imageMd5Sum.finish();
-  imageSha256Sum.finish();
+  reader.finish();
   if (useChecksum == CHECK_MD5) {
-    desc.imageInfoMD5(off, imageMd5Sum, cache->getBlockLen());
+    desc.imageInfoMD5(off, reader.md5(), cache->getBlockLen());
   } else {
-    desc.imageInfoSha256(off, imageSha256Sum, cache->getBlockLen());
+    desc.imageInfoSha256(off, reader.sha256(), cache->getBlockLen());
   }
   desc.put(*templ, &templMd5Sum, &templSHA256Sum, useChecksum);
   if (!*templ) {
@@ -1013,6 +1626,11 @@ bool MkTemplate::run(const string& imageLeafName,
     major = 1;
     minor = 2;
   }
+  // ZSTD parts need a 2.1 reader, whatever the checksum
+  if (compressType == COMPRESS_ZSTD) {
+    major = 2;
+    minor = 1;
+  }
 
   // Kick out files that are too small
   for (JigdoCache::iterator f = cache->begin(), e = cache->end();
@@ -1025,11 +1643,6 @@ bool MkTemplate::run(const string& imageLeafName,
     ++fileCount;
   }
 
-  // Hash table performance drops when linked lists become long => "+1"
-  int    blockBits = bitWidth((uint32)fileCount) + 1;
-  uint32 blockMask = (1 << blockBits) - 1;
-  block.resize(blockMask + 1);
-
   size_t max_checksumLen_blockLen =
       cache->getBlockLen() + 64; // +64 for Assert below
   if (max_checksumLen_blockLen < cache->getChecksumBlockLen())
@@ -1049,7 +1662,7 @@ bool MkTemplate::run(const string& imageLeafName,
   Assert(cache->getChecksumBlockLen() > cache->getBlockLen());
 
   if (debug) {
-    debug("Nr of files: %1 (%2 bits)", fileCount, blockBits);
+    debug("Nr of files: %1", fileCount);
     debug("Total bytes: %1", fileSizeTotal);
     debug("blockLength: %1", cache->getBlockLen());
     debug("csumBlockLen: %1", cache->getChecksumBlockLen());
@@ -1085,7 +1698,7 @@ bool MkTemplate::run(const string& imageLeafName,
   }
 
   // Read input image and output parts that do not match
-  if (scanImage(buf, bufferLength, cache->getBlockLen(), blockMask,
+  if (scanImage(buf, bufferLength, cache->getBlockLen(),
                 cache->getChecksumBlockLen(), templMd5Sum, templSha256Sum)) {
     result = FAILURE;
   }
@@ -44,8 +44,11 @@
 #include <md5sum.hh>
 #include <sha256sum.hh>
 #include <rsyncsum.hh>
+#include <rsynctable.hh>
 #include <scan.fh>
 #include <zstream.fh>
+
+class MappedFile;
 //______________________________________________________________________
 
 /** Create location list (jigdo) and image template (template) from
@@ -63,6 +66,13 @@ public:
     CHECK_SHA256 = 2,
   };
 
+  /* Choice of compression for the template data */
+  enum CompressionType {
+    COMPRESS_GZIP = 0,
+    COMPRESS_BZIP2 = 1,
+    COMPRESS_ZSTD = 2
+  };
+
   class ProgressReporter;
 
   /** A create operation with no files known to it yet.
@@ -73,7 +83,8 @@ public:
       @param pr Function object which is called at regular intervals
       during run() to inform about files scanned, nr of bytes scanned,
       matches found etc.
-      @param zipQuality 0 (fast) to 9 (smallest output)
+      @param zipQuality 0 (fast) to 9 (smallest output), or 1 to 22 for
+      COMPRESS_ZSTD
       @param readAmnt Number of bytes that are read at a time with one
       read() call by the operation before the data is processed.
       Should not be too large because the OS copes best when small
@@ -81,12 +92,13 @@ public:
       practice, the default seems to work well.
       @param addImage Add a [Image] section to the output .jigdo.
       @param addServers Add a [Servers] section to the output .jigdo.
-      @param useBzip2 false=>gzip, true=>bzip2 */
+      @param compression One of the COMPRESS_* values; COMPRESS_ZSTD is
+      only available if HAVE_ZSTD */
   MkTemplate(JigdoCache* jcache, bistream* imageStream,
              JigdoConfig* jigdoInfo, bostream* templateStream,
              ProgressReporter& pr = noReport, int zipQuality = 9,
              size_t readAmnt = 128U*1024, bool addImage = true,
-             bool addServers = true, bool useBzip2 = false,
+             bool addServers = true, int compression = COMPRESS_GZIP,
 	     int checksumChoice = CHECK_MD5);
   inline ~MkTemplate();
 
@@ -99,6 +111,11 @@ public:
   inline void setGreedyMatching(bool x) { greedyMatching = x; }
   inline bool getGreedyMatching() const { return greedyMatching; }
 
+  /** Read the image from a memory mapping of the image file instead of
+      imageStream. Null (the default) means use imageStream. The mapping
+      is not deleted in the dtor. */
+  inline void setImageMap(const MappedFile* m) { imageMap = m; }
+
   /** First scan through all the individual files, creating checksums,
       then read image file and find matches. Write .template and .jigdo
       files.
@@ -145,21 +162,21 @@ private:
   class PartialMatch;
   class PartialMatchQueue;
   friend class PartialMatchQueue;
+  class ScanAhead;
   void prepareJigdo(const int major, const int minor);
   void finalizeJigdo(const string& imageLeafName,
     const string& templLeafName, const MD5Sum& templMd5Sum,
     const SHA256Sum& templSHA256Sum, int checksumChoice);
-  INLINE bool scanFiles(size_t blockLength, uint32 blockMask,
-    size_t csumBlockLength);
+  INLINE bool scanFiles(size_t blockLength, size_t csumBlockLength);
   INLINE bool scanImage(Ubyte* buf, size_t bufferLength, size_t blockLength,
-    uint32 blockMask, size_t csumBlockLength, MD5Sum&, SHA256Sum&);
+    size_t csumBlockLength, MD5Sum&, SHA256Sum&);
   static INLINE void insertInTodo(PartialMatchQueue& matches,
     PartialMatch* x);
   void checkRsyncSumMatch2(const size_t blockLen, const size_t back,
     const size_t csumBlockLength, uint64& nextEvent, FilePart* file);
   INLINE void checkRsyncSumMatch(const RsyncSum64& sum,
-    const uint32& bitMask, const size_t blockLen, const size_t back,
-    const size_t csumBlockLength, uint64& nextEvent);
+    const size_t blockLen, const size_t back, const size_t csumBlockLength,
+    uint64& nextEvent);
   INLINE bool checkChecksumMatch(Ubyte* const buf,
     const size_t bufferLength, const size_t data,
     const size_t csumBlockLength, uint64& nextEvent,
@@ -171,7 +188,9 @@ private:
   bool rereadUnmatched(FilePart* file, uint64 count);
   INLINE void scanImage_mainLoop_fastForward(uint64 nextEvent,
     RsyncSum64* rsum, Ubyte* buf, size_t* data, size_t* n, size_t* rsumBack,
-    size_t bufferLength, size_t blockLength, uint32 blockMask,
+    size_t bufferLength, size_t blockLength, size_t csumBlockLength);
+  INLINE void scanImage_mainLoop_ahead(uint64 nextEvent, size_t* data,
+    size_t* n, size_t* rsumBack, size_t bufferLength, size_t blockLength,
     size_t csumBlockLength);
   INLINE bool matchExecCommands(PartialMatch* x);
 
@@ -184,9 +203,10 @@ private:
   uint64 fileSizeTotal; // Accumulated lengths of all the files
   size_t fileCount; // Total number of files added
 
-  // Look up list of FileParts by hash of RsyncSum
-  typedef vector<vector<FilePart*> > FileVec;
-  FileVec block;
+  /* Look up FileParts by the RsyncSum of their first block. The table
+     holds indexes into rsyncFiles. */
+  RsyncTable rsyncTable;
+  vector<FilePart*> rsyncFiles;
 
   // Nr of bytes to read in one go, as specified by caller of MkTemplate()
   size_t readAmount;
@@ -203,13 +223,16 @@ private:
 
   JigdoCache* cache;
   bistream* image;
+  const MappedFile* imageMap; // If non-null, read image from here
   bostream* templ;
   Zobstream* zip; // Compressing stream for template data output
 
-  int zipQual; // 0..9, passed to zlib
+  int zipQual; // 0..9, passed to zlib/libbz2; 1..22 for libzstd
   ProgressReporter& reporter;
   PartialMatchQueue* matches; // queue of partially matched files
   unsigned sectorLength;
+  // Non-null during scanImage() if worker threads scan the mapped image
+  ScanAhead* scanAhead;
   //____________________
 
   JigdoConfig* jigdo;
@@ -220,7 +243,7 @@ private:
   // true => add a [Image/Servers] section to the output .jigdo file
   bool addImageSection;
   bool addServersSection;
-  bool useBzLib;
+  int compressType; // COMPRESS_*
   int useChecksum;
   string matchExec;
   //____________________
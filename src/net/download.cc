@@ -19,6 +19,8 @@
 #include <config.h>
 
 #include <iostream>
+#include <map>
+#include <vector>
 #include <glib.h>
 
 #include <ctype.h>
@@ -39,6 +41,8 @@
 
 string Download::userAgent;
 struct curl_slist* Download::extraHeaders = 0;
+unsigned Download::maxPerHost = 0;
+bool Download::http2 = false;
 
 DEBUG_UNIT("download")
 
@@ -46,15 +50,46 @@ namespace {
 
   Logger curlDebug("curl");
 
+  /* Idle easy handles, indexed by "scheme://host:port" of the URI they
+     were last used for. Creating a new handle for each of the thousands
+     of parts of an image is wasteful; a handle which is reused keeps its
+     DNS cache and the connection it last used. */
+  typedef map<string, vector<CURL*> > HandlePool;
+  HandlePool handlePool;
+
+  // Key for handlePool: Everything up to the path of the URI
+  string poolKey(const string& uri) {
+    string::size_type i = uri.find("://");
+    if (i == string::npos) return uri;
+    i = uri.find('/', i + 3);
+    return uri.substr(0, i);
+  }
+
 }
 
-// CURLSH* Download::shHandle = 0;
+CURLSH* Download::shHandle = 0;
 
 // Initialize (g)libcurl
 void Download::init() {
   glibcurl_init();
-//   shHandle = curl_share_init();
-//   curl_share_setopt(shHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  /* Share DNS lookups, TLS sessions and open connections between all
+     downloads, so a new download from a server we already talked to does
+     not need a new lookup, TCP connection and TLS handshake. No locking
+     is necessary, everything runs in the glib main loop's thread. */
+  shHandle = curl_share_init();
+  curl_share_setopt(shHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(shHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+# if LIBCURL_VERSION_NUM >= 0x073900 /* 7.57.0 */
+  curl_share_setopt(shHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+# endif
+  CURLM* multi = glibcurl_handle();
+# if LIBCURL_VERSION_NUM >= 0x071e00 /* 7.30.0 */
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)maxPerHost);
+# endif
+# if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING,
+                    http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+# endif
   glibcurl_set_callback(glibcurlCallback, 0);
 
   if (extraHeaders == 0) {
@@ -104,8 +139,18 @@ void Download::init() {
 
 void Download::cleanup() {
   debug("cleanup");
-  // Dumps core when called - wish I knew why:
-  //curl_share_cleanup(shHandle);
+  for (HandlePool::iterator i = handlePool.begin(), e = handlePool.end();
+       i != e; ++i) {
+    for (vector<CURL*>::iterator h = i->second.begin(), he = i->second.end();
+         h != he; ++h)
+      curl_easy_cleanup(*h);
+  }
+  handlePool.clear();
+  /* Only possible once no easy handle uses the share any longer, otherwise
+     it fails with CURLSHE_IN_USE. Must happen before the
+     curl_global_cleanup() in glibcurl_cleanup(). */
+  if (shHandle != 0 && curl_share_cleanup(shHandle) == CURLSHE_OK)
+    shHandle = 0;
   glibcurl_cleanup();
 
   if (extraHeaders != 0) curl_slist_free_all(extraHeaders);
@@ -116,7 +161,7 @@ void Download::cleanup() {
 
 Download::Download(const string& uri, Output* o)
     : handle(0), uriVal(uri), uriValWithoutNull(uri), resumeOffsetVal(0),
-      currentSize(0),
+      rangeEndVal(0), rangeVal(), rangeIgnored(false), currentSize(0),
       outputVal(o), state(CREATED), stopLaterId(0), insideNewData(false) {
   /* string::data() just points at the "raw" memory that contains the string
      data. In contrast, string::c_str() may create a temporary buffer, add
@@ -137,12 +182,25 @@ Download::~Download() {
   delete[] curlError;
 
   //   stop();
-  if (handle != 0) {
-    glibcurl_remove(handle);
-    debug("~Download: curl_easy_cleanup(%1)", (void*)handle);
+  releaseHandle();
+  if (stopLaterId != 0) g_source_remove(stopLaterId);
+}
+//______________________________________________________________________
+
+void Download::releaseHandle() {
+  if (handle == 0) return;
+  glibcurl_remove(handle);
+  vector<CURL*>& idle = handlePool[poolKey(uriValWithoutNull)];
+  if (idle.size() < POOL_SIZE) {
+    debug("releaseHandle: curl_easy_reset(%1)", (void*)handle);
+    // Keeps the handle's connections and DNS cache
+    curl_easy_reset(handle);
+    idle.push_back(handle);
+  } else {
+    debug("releaseHandle: curl_easy_cleanup(%1)", (void*)handle);
     curl_easy_cleanup(handle);
   }
-  if (stopLaterId != 0) g_source_remove(stopLaterId);
+  handle = 0;
 }
 //______________________________________________________________________
 
@@ -163,7 +221,14 @@ void Download::run() {
   Assert(outputVal != 0); // Must have set up output
 
   if (handle == 0) {
-    handle = curl_easy_init();
+    vector<CURL*>& idle = handlePool[poolKey(uriValWithoutNull)];
+    if (idle.empty()) {
+      handle = curl_easy_init();
+    } else {
+      handle = idle.back();
+      idle.pop_back();
+    }
+    debug("run: handle %1", (void*)handle);
     Assert(handle != 0);
   }
 
@@ -190,7 +255,16 @@ void Download::run() {
 
   curl_easy_setopt(handle, CURLOPT_HTTPHEADER, extraHeaders);
 
-  //curl_easy_setopt(handle, CURLOPT_SHARE, shHandle);
+  if (shHandle != 0) curl_easy_setopt(handle, CURLOPT_SHARE, shHandle);
+# if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+  if (http2) {
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+                     (long)CURL_HTTP_VERSION_2TLS);
+    /* Rather wait for a connection to the host which is being set up
+       than open another one - it can probably be multiplexed */
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+  }
+# endif
   glibcurl_add(handle);
 
   // Set URL
@@ -201,7 +275,17 @@ void Download::run() {
 
   // Shall we resume the download from a certain offset?
   currentSize = resumeOffset();
-  curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE, resumeOffset());
+  rangeIgnored = false;
+  if (rangeEnd() == 0) {
+    curl_easy_setopt(handle, CURLOPT_RANGE, (char*)0);
+    curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE, resumeOffset());
+  } else {
+    // Only fetch [resumeOffset;rangeEnd)
+    Paranoid(resumeOffset() < rangeEnd());
+    rangeVal = subst("%1-%2", resumeOffset(), rangeEnd() - 1);
+    curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE, uint64(0));
+    curl_easy_setopt(handle, CURLOPT_RANGE, rangeVal.c_str());
+  }
 
   // TODO: CURLOPT_PROXY*
 
@@ -215,6 +299,19 @@ size_t Download::curlWriter(void* data, size_t size, size_t nmemb,
   unsigned len = size * nmemb;
 
   if (self->stopLaterId != 0) return len;
+
+  if (self->rangeEnd() != 0 && self->currentSize == self->resumeOffset()
+      && self->uriVal.compare(0, 4, "http") == 0) {
+    /* libcurl does not check whether an HTTP server honoured CURLOPT_RANGE.
+       A "200 OK" reply contains the whole file, not the range. */
+    long code = 0;
+    curl_easy_getinfo(self->handle, CURLINFO_RESPONSE_CODE, &code);
+    if (code == 200) {
+      debug("curlWriter: Server ignored range %1", self->rangeVal);
+      self->rangeIgnored = true;
+      return 0; // Abort transfer, makes generateError() output a message
+    }
+  }
   self->insideNewData = true;
 
   double contentLen;
@@ -223,6 +320,10 @@ size_t Download::curlWriter(void* data, size_t size, size_t nmemb,
       && contentLen > 0.5) {
     self->outputVal->download_dataSize(
       static_cast<uint64>(contentLen + self->resumeOffset()));
+    if (self->stopLaterId != 0) { // Size was rejected, stop() was called
+      self->insideNewData = false;
+      return len;
+    }
   }
 
   //if (self->state == PAUSE_SCHEDULED) self->pauseNow();
@@ -271,16 +372,32 @@ void Download::glibcurlCallback(void*) {
 // }
 
 void Download::pause() {
-  Assert(!insideNewData);
   state = PAUSED;
   if (handle == 0) return;
+# if LIBCURL_VERSION_NUM >= 0x071200 /* 7.18.0 */
+  /* Also allowed from download_data(). libcurl keeps the connection and
+     holds back data that arrives in the meantime. */
+  curl_easy_pause(handle, CURLPAUSE_RECV);
+# else
+  Assert(!insideNewData);
   Assert(glibcurl_remove(handle) == CURLM_OK);
+# endif
   debug("Download::pause");
 }
 
 // Analogous to pauseNow() above
 void Download::cont() {
-
+  //if (state == PAUSE_SCHEDULED) state = RUNNING;
+  if (state == RUNNING) return;
+  Assert(paused());
+  state = RUNNING;
+  if (handle == 0) return;
+  debug("Download::cont");
+# if LIBCURL_VERSION_NUM >= 0x071200 /* 7.18.0 */
+  /* Passes any held back data to download_data() before returning, which
+     may pause() again */
+  curl_easy_pause(handle, CURLPAUSE_CONT);
+# else
   /* Broken ATM: libcurl will go
 * Connection 0 seems to be dead!
 * Closing connection #0
@@ -288,14 +405,8 @@ void Download::cont() {
 * Connected to localhost (127.0.0.1) port 8000
 ... and then restart the transfer, but without the right range header */
   Assert(false);
-
-  //if (state == PAUSE_SCHEDULED) state = RUNNING;
-  if (state == RUNNING) return;
-  Assert(paused());
-  state = RUNNING;
-  if (handle == 0) return;
   glibcurl_add(handle);
-  debug("Download::cont");
+# endif
 }
 //______________________________________________________________________
 
@@ -306,17 +417,15 @@ void Download::stop() {
 
   if (insideNewData) {
     debug("stop later");
-    // Cannot call curl_easy_cleanup() (segfaults), so do it later
+    // Cannot call curl_easy_cleanup()/reset() (segfaults), so do it later
     if (stopLaterId != 0) return;
     stopLaterId = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
                                   &stopLater_callback,
                                   (gpointer)this, NULL);
     Assert(stopLaterId != 0); // because we use 0 as a special value
   } else {
-    debug("stop now: curl_easy_cleanup(%1)", (void*)handle);
-    glibcurl_remove(handle);
-    curl_easy_cleanup(handle);
-    handle = 0;
+    debug("stop now");
+    releaseHandle();
   }
 
   // None of this is really the right thing. Believe me, I tried both. ;-/
@@ -329,12 +438,8 @@ gboolean Download::stopLater_callback(gpointer data) {
   Download* self = static_cast<Download*>(data);
   Assert(!self->insideNewData);
 
-  debug("stopLater_callback: curl_easy_cleanup(%1)", (void*)self->handle);
-  if (self->handle != 0) {
-    glibcurl_remove(self->handle);
-    curl_easy_cleanup(self->handle);
-    self->handle = 0;
-  }
+  debug("stopLater_callback: %1", (void*)self->handle);
+  self->releaseHandle();
   self->stopLaterId = 0;
   return FALSE; // "Don't call me again"
 }
@@ -388,6 +493,12 @@ void Download::generateError(State newState, int cc) {
     }
     break;
   }
+  case CURLE_WRITE_ERROR:
+    if (rangeIgnored) {
+      s = _("Server does not support HTTP ranges");
+      break;
+    }
+    // Fall through
   default:
 #   if ENABLE_NLS
     // See lib/strerror.c in curl's source for possible error strings
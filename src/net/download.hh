@@ -54,6 +54,19 @@ public:
   /** Clean up - call this after all requests are finished */
   static void cleanup();
 
+  /** Maximum nr of connections to the same host at the same time, or 0
+      for no limit. libcurl queues further downloads from that host until
+      a connection becomes free. Set this before init(). */
+  static unsigned maxPerHost;
+  /** Use HTTP/2 with servers which support it, and multiplex downloads
+      from the same host over one connection instead of opening one
+      connection per download. Off by default, because MakeImageDl's
+      range requests are meant to use separate connections. Set this
+      before init(). */
+  static bool http2;
+  /** Max nr of idle easy handles kept for reuse, per host */
+  static const unsigned POOL_SIZE = 8;
+
   Download(const string& uri, Output* o /*= 0*/);
   ~Download();
 
@@ -65,6 +78,15 @@ public:
   /** Value passed to setResumeOffset() */
   inline uint64 resumeOffset() const;
 
+  /** Only download the data up to (excluding) this offset, with a "Range"
+      request. 0 means no limit, which is the default. As with
+      setResumeOffset(), the value is reused if you re-run(). If an HTTP
+      server does not support ranges and sends the whole file, the download
+      fails. */
+  inline void setRangeEnd(uint64 rangeEnd);
+  /** Value passed to setRangeEnd() */
+  inline uint64 rangeEnd() const;
+
   /** Whether to send a "Pragma: no-cache" header. The header is sent iff
       pragmaNoCache==true. Caution: The setting is not reset after the
       download has finished/failed and will be reused if you re-run(), so
@@ -80,11 +102,11 @@ public:
 
   inline const string& uri() const;
 
-  /** Pause the request. Actually, this only sets a flag, which causes the
-      request to be paused at the next convenient opportunity. The socket of
-      the Download is no longer passed to select(). */
+  /** Pause the request. libcurl stops receiving data for it, but keeps the
+      connection open. Can be called from Output::download_data(). */
   /*inline*/ void pause();
-  /** Continue with the download */
+  /** Continue with the download. Can call Output::download_data() before
+      it returns. */
   void cont();
   /** Is the download paused? (i.e. really paused now, not just pause()
       called.) */
@@ -120,7 +142,7 @@ private:
     CREATED, // but not run() yet
     RUNNING, // downloading
     //PAUSE_SCHEDULED, // will switch to pause next time data arrives
-    PAUSED, // socket no longer being polled, we'll get no more data
+    PAUSED, // libcurl holds back data, we'll get no more until cont()
     INTERRUPTED, // like ERROR, but will try resuming the download
     ERROR, SUCCEEDED
   };
@@ -140,14 +162,20 @@ private:
      executed. This delayed execution is necessary because libwww doesn't
      like Download::stop() being called from download_newData(). */
   static gboolean stopLater_callback(gpointer data);
+  /* Remove handle from the multi handle, return it to the pool of idle
+     handles for our host, or free it if the pool is full. */
+  void releaseHandle();
 
-  //   static CURLSH* shHandle; // Handle of curl_shared object
+  static CURLSH* shHandle; // Handle of curl_shared object
   CURL* handle; // Handle of curl_easy object
   char* curlError; // Curl error string buffer
 
   string uriVal; // Careful: Includes a trailing null byte!
   string uriValWithoutNull;
   uint64 resumeOffsetVal;
+  uint64 rangeEndVal;
+  string rangeVal; // CURLOPT_RANGE value, e.g. "100-199"
+  bool rangeIgnored; // Server sent whole file in reply to Range request
   uint64 currentSize;
   Output* outputVal; // Usually points to a Job::SingleUrl
   State state;
@@ -227,4 +255,7 @@ void Download::setResumeOffset(uint64 resumeOffset) {
   resumeOffsetVal = resumeOffset;
 }
 
+uint64 Download::rangeEnd() const { return rangeEndVal; }
+void Download::setRangeEnd(uint64 rangeEnd) { rangeEndVal = rangeEnd; }
+
 #endif
@@ -25,14 +25,24 @@
   This goes into great contortions in order to first access
   non-symlink objects and then symlinks.
 
+  With several threads, the worker threads read each directory into a
+  Listing (names and stat() results, in readdir() order), and queue
+  the Listings of its subdirectories. getName() goes through the
+  Listings like through the directories themselves, so the output does
+  not depend on which thread was faster. If getName() needs a Listing
+  which no worker has started yet, it reads the directory itself
+  instead of waiting.
+
 */
 
 #include <config.h>
 
 #include <recursedir.hh>
 
+#include <functional>
 #include <iostream>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -59,6 +69,162 @@ namespace {
 
 //______________________________________________________________________
 
+struct RecurseDir::Listing {
+  enum State { QUEUED, RUNNING, DONE };
+  struct Entry {
+    Entry() : name(), fileInfo(), error(0), sub() { }
+    string name;
+    struct stat fileInfo; // lstat() result
+    int error; // errno if lstat() failed, else 0
+    ListingP sub; // Set for directories not yet handed to the workers
+  };
+  explicit Listing(const string& n) : name(n), state(QUEUED), error(0),
+                                      entries() { }
+  string name; // Directory name, ending with DIRSEP
+  State state; // Protected by RecurseDir::lock
+  int error; // errno if opendir() failed, else 0
+  vector<Entry> entries;
+};
+
+void RecurseDir::setThreads(unsigned n) {
+  if (n == threadCount) return;
+  threadCount = n;
+  pool.reset();
+  if (n < 2) return;
+  pool.reset(new ThreadPool(n));
+  if (pool->threads() == 0) pool.reset(); // Compiled without threads
+}
+
+// Executed by a worker thread
+void RecurseDir::runListing(ListingP listing) {
+  MutexLock l(lock);
+  if (stopping || listing->state != Listing::QUEUED) return;
+  listing->state = Listing::RUNNING;
+  l.unlock();
+  readListing(*listing);
+}
+
+/* Read the directory, mark the listing as DONE and queue the listings
+   of any subdirectories not seen before. The caller must have set the
+   state to RUNNING. */
+void RecurseDir::readListing(Listing& listing) {
+  vector<ListingP> subs;
+  DIR* dir = opendir(listing.name.c_str());
+  if (dir == 0) {
+    listing.error = errno;
+  } else {
+#   if HAVE_FSTATAT && HAVE_DIRFD
+    int fd = dirfd(dir);
+#   endif
+    while (struct dirent* entry = readdir(dir)) {
+      const char* n = entry->d_name;
+      if (n[0] == '.' && (n[1] == 0 || (n[1] == '.' && n[2] == 0)))
+        continue;
+      listing.entries.push_back(Listing::Entry());
+      Listing::Entry& e = listing.entries.back();
+      e.name = n;
+#     if HAVE_FSTATAT && HAVE_DIRFD
+      if (fstatat(fd, n, &e.fileInfo, AT_SYMLINK_NOFOLLOW) != 0)
+        e.error = errno;
+#     else
+      if (lstat((listing.name + e.name).c_str(), &e.fileInfo) != 0)
+        e.error = errno;
+#     endif
+    }
+    closedir(dir);
+  }
+
+  MutexLock l(lock);
+  for (vector<Listing::Entry>::iterator i = listing.entries.begin(),
+         end = listing.entries.end(); i != end; ++i) {
+    if (i->error != 0 || !S_ISDIR(i->fileInfo.st_mode)) continue;
+    if (!listedDirs.insert(DevIno(&i->fileInfo)).second) continue;
+    i->sub.reset(new Listing(listing.name + i->name + DIRSEP));
+    subs.push_back(i->sub);
+  }
+  listing.state = Listing::DONE;
+  l.unlock();
+  listingDone.notify_all();
+
+  for (vector<ListingP>::iterator i = subs.begin(), end = subs.end();
+       i != end; ++i)
+    pool->submit(bind(&RecurseDir::runListing, this, *i));
+}
+
+// Read the listing now if no worker has started it, else wait for it
+void RecurseDir::waitForListing(const ListingP& listing) {
+  MutexLock l(lock);
+  if (listing->state == Listing::QUEUED) {
+    listing->state = Listing::RUNNING;
+    l.unlock();
+    readListing(*listing);
+    return;
+  }
+  while (listing->state != Listing::DONE) listingDone.wait(l);
+}
+//______________________________________________________________________
+
+bool RecurseDir::nextEntry(Level& level, string& result,
+                           struct stat* fileInfo, ListingP& sub) {
+  if (level.listing) {
+    vector<Listing::Entry>& entries = level.listing->entries;
+    if (level.pos == entries.size()) return false;
+    Listing::Entry& e = entries[level.pos++];
+    result = curDir;
+    result += e.name;
+    if (e.error != 0) {
+      errno = e.error;
+      throw_RecurseError_forObject(result);
+    }
+    *fileInfo = e.fileInfo;
+    sub.swap(e.sub);
+    return true;
+  }
+
+  struct dirent* entry;
+  while (true) {
+    entry = readdir(level.dir);
+#   if UNIX || WINDOWS
+    if (entry == 0) break;
+    const char* n = entry->d_name;
+    if (n[0] == '.' && (n[1] == 0 || (n[1] == '.' && n[2] == 0))) {
+      //cerr << "Recurse: Skip `" << n << "'" << endl;
+      continue;
+    }
+#   endif
+    break;
+  }
+  if (entry == 0) return false;
+  result = curDir;
+  result += entry->d_name;
+  if (lstat(result.c_str(), fileInfo) != 0)
+    throw_RecurseError_forObject(result);
+  return true;
+}
+
+void RecurseDir::pushDir(const string& name, ListingP sub) {
+  string dirName = name;
+  if (dirName[dirName.size() - 1] != DIRSEP) dirName += DIRSEP;
+  if (!pool) {
+    DIR* dir = opendir(name.c_str());
+    if (dir == 0)
+      throw_RecurseError_forDir(name);
+    curDir.swap(dirName);
+    recurseStack.push(Level(dir, curDir.length()));
+    return;
+  }
+
+  if (!sub) sub.reset(new Listing(dirName));
+  waitForListing(sub);
+  if (sub->error != 0) {
+    errno = sub->error;
+    throw_RecurseError_forDir(name);
+  }
+  curDir.swap(dirName);
+  recurseStack.push(Level(sub, curDir.length()));
+}
+//______________________________________________________________________
+
 /* Assign the next object name to result. Returns FAILURE if no more
    names available. Note: An object name is immediately removed from
    the start of "objects" when it is copied to "result". The name of
@@ -147,20 +313,8 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
     if (!recurseStack.empty()) {
       // Continue recursing through directories
       Level& level = recurseStack.top();
-      struct dirent* entry;
-      while (true) {
-        entry = readdir(level.dir);
-#       if UNIX || WINDOWS
-        if (entry == 0) break;
-        const char* n = entry->d_name;
-        if (n[0] == '.' && (n[1] == 0 || (n[1] == '.' && n[2] == 0))) {
-          //cerr << "Recurse: Skip `" << n << "'" << endl;
-          continue;
-        }
-#       endif
-        break;
-      }
-      if (entry == 0) {
+      ListingP sub;
+      if (!nextEntry(level, result, fileInfo, sub)) {
         // End-of-directory reached, continue one dir level up
         //cerr << "Recurse: End of dir `" << curDir << "'" << endl;
         level.close();
@@ -172,10 +326,6 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
       //____________________
 
       // Valid object name was read from directory
-      result = curDir;
-      result += entry->d_name;
-      if (lstat(result.c_str(), fileInfo) != 0)
-        throw_RecurseError_forObject(result);
       if (isSymlink(fileInfo)) {
         // Do not handle object now, push at end of queue
         objects.push(result);
@@ -199,12 +349,7 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
 
       // Object is a directory - recurse
       //cerr << "Recurse: into `" << result << "'" << endl;
-      DIR* dir = opendir(result.c_str());
-      if (dir == 0)
-        throw_RecurseError_forDir(result);
-      curDir += entry->d_name;
-      curDir += DIRSEP;
-      recurseStack.push(Level(dir, curDir.length()));
+      pushDir(result, sub);
       continue;
 
     } // endif (!recurseStack.empty())
@@ -254,12 +399,7 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
     }
 
     // Object is directory - recurse
-    DIR* dir = opendir(result.c_str());
-    if (dir == 0)
-      throw_RecurseError_forDir(result);
-    curDir = result;
-    if (curDir[curDir.size() - 1] != DIRSEP) curDir += DIRSEP;
-    recurseStack.push(Level(dir, curDir.length()));
+    pushDir(result, ListingP());
     continue;
 
   } // endwhile (true)
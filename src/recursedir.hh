@@ -22,9 +22,11 @@
 
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <queue>
 #include <set>
 #include <stack>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -32,6 +34,7 @@
 
 #include <debug.hh>
 #include <recursedir.fh>
+#include <threadpool.hh>
 //______________________________________________________________________
 
 /** Errors which occur during RecurseDir's work */
@@ -46,13 +49,22 @@ struct RecurseError : Error {
     than one name for an inode, and avoid symlink loops. If an inode
     can be reached both through its "normal" name and through symlinks
     during recursion into one directory, it is guaranteed that the
-    normal name will be listed. */
+    normal name will be listed.
+
+    With setThreads(), the directories are read and their entries
+    stat()ed by worker threads, ahead of the names being returned. The
+    names and their order are the same as without threads. */
 class RecurseDir {
 public:
   RecurseDir() : curDir(), recurseStack(), objects(), objectsFrom(),
-                 fileList(), listStream(0) { }
+                 fileList(), listStream(0), threadCount(1), lock(),
+                 listingDone(), listedDirs(), stopping(false), pool() { }
   inline ~RecurseDir();
 
+  /** Number of threads which read directories. 1 means that
+      getName() reads each directory when it gets to it. */
+  void setThreads(unsigned n);
+
   /** Provide single file/directory name to output or recurse into */
   void addFile(const char* name) { objects.push(string(name)); }
   /** Provide single file/directory name to output or recurse into */
@@ -90,16 +102,40 @@ private:
       return (ino < d.ino) || (ino == d.ino && dev < d.dev); }
     dev_t dev; ino_t ino;
   };
+  // Contents of a directory, read by a worker thread
+  struct Listing;
+  typedef shared_ptr<Listing> ListingP;
   // One stack entry (recursion level) when recursing into directories
   struct Level {
-    Level(DIR* d, size_t l) : dir(d), dirNameLen(l) { }
-    void close() { if (dir == 0) return; closedir(dir); dir = 0; }
-    DIR* dir; // Handle for readdir()
+    Level(DIR* d, size_t l) : dir(d), listing(), pos(0), dirNameLen(l) { }
+    Level(const ListingP& li, size_t l)
+      : dir(0), listing(li), pos(0), dirNameLen(l) { }
+    void close() {
+      listing.reset();
+      if (dir == 0) return;
+      closedir(dir); dir = 0;
+    }
+    DIR* dir; // Handle for readdir(), or null if listing is used
+    ListingP listing;
+    size_t pos; // Index of next entry of listing
     size_t dirNameLen; // Length to shorten curDir to to get this dir's name
   };
   string curDir;
   stack<Level> recurseStack;
 
+  /* Put the next entry of the directory into result and fileInfo,
+     return false at its end. If listings are used and the entry is a
+     directory, sub may be set to its listing. */
+  bool nextEntry(Level& level, string& result, struct stat* fileInfo,
+                 ListingP& sub);
+  /* Start recursing into a directory. If listings are used and the
+     directory's listing is not known, it is read now. */
+  void pushDir(const string& name, ListingP sub);
+  // Used by the worker threads
+  void runListing(ListingP listing);
+  void readListing(Listing& listing);
+  void waitForListing(const ListingP& listing);
+
   inline bool getNextObjectName(string& result);
   queue<string> objects; // Queue of filenames to output/dirs to recurse into
   queue<string> objectsFrom; // Files containing filenames
@@ -108,6 +144,13 @@ private:
 # if HAVE_LSTAT
   set<DevIno> beenThere; // Already visited inodes, for loop prevention
 # endif
+
+  unsigned threadCount;
+  Mutex lock; // Protects the members below and the Listing states
+  Condition listingDone;
+  set<DevIno> listedDirs; // Directories already handed to the workers
+  bool stopping; // Set by dtor, makes jobs return without reading
+  unique_ptr<ThreadPool> pool; // Null unless threadCount > 1. Keep last!
 };
 //______________________________________________________________________
 
@@ -128,6 +171,11 @@ private:
 //____________________
 
 RecurseDir::~RecurseDir() {
+  // Do not read the directories which have not been started yet
+  MutexLock l(lock);
+  stopping = true;
+  l.unlock();
+  pool.reset();
   if (listStream != 0 && listStream != &cin) fileList.close();
   while (!recurseStack.empty()) {
     recurseStack.top().close();
@@ -16,6 +16,7 @@
 
 #include <config.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -50,23 +51,77 @@ JigdoCache::ProgressReporter JigdoCache::noReport;
 struct stat JigdoCache::fileInfo;
 //______________________________________________________________________
 
-#if HAVE_LIBDB
+FilePart::FilePart(const FilePart& f)
+  : path(f.path), dirName(f.dirName), leaf(f.leaf), fileSize(f.fileSize),
+    fileMtime(f.fileMtime), rsyncSum(f.rsyncSum), sums(0),
+    sumBlocks(f.sumBlocks), digests(f.digests),
+    wholeDigests(f.wholeDigests), md5Sum(f.md5Sum), sha256Sum(f.sha256Sum),
+    flags(f.flags) {
+  size_t len = sumBlocks * sumSize(digests);
+  if (len == 0) return;
+  sums = new Ubyte[len];
+  memcpy(sums, f.sums, len);
+}
+
+FilePart& FilePart::operator=(const FilePart& f) {
+  if (this == &f) return *this;
+  path = f.path; dirName = f.dirName; leaf = f.leaf;
+  fileSize = f.fileSize; fileMtime = f.fileMtime; rsyncSum = f.rsyncSum;
+  md5Sum = f.md5Sum; sha256Sum = f.sha256Sum; flags = f.flags;
+  allocSums(0, 0);
+  sumBlocks = f.sumBlocks;
+  digests = f.digests;
+  wholeDigests = f.wholeDigests;
+  size_t len = sumBlocks * sumSize(digests);
+  if (len > 0) {
+    sums = new Ubyte[len];
+    memcpy(sums, f.sums, len);
+  }
+  return *this;
+}
+
+void FilePart::allocSums(size_t n, unsigned d) {
+  if (n == sumBlocks && d == digests) return;
+  Ubyte* newSums = 0;
+  size_t len = n * sumSize(d);
+  if (len > 0) newSums = new Ubyte[len];
+  if (n == sumBlocks) {
+    // Copy the checksums of the families present before and after
+    MD5* md5s = MD5sums();
+    SHA256* sha256s = SHA256sums();
+    if (md5s != 0 && (d & MD5_DIGEST) != 0)
+      memcpy(newSums, md5s, n * sizeof(MD5));
+    if (sha256s != 0 && (d & SHA256_DIGEST) != 0)
+      memcpy(newSums + ((d & MD5_DIGEST) != 0 ? n * sizeof(MD5) : 0),
+             sha256s, n * sizeof(SHA256));
+    wholeDigests = static_cast<unsigned char>(wholeDigests & d);
+  } else {
+    wholeDigests = 0;
+  }
+  delete[] sums;
+  sums = newSums;
+  sumBlocks = n;
+  digests = static_cast<unsigned char>(d);
+}
+//______________________________________________________________________
 
-// How much checksum data do we have per checksum entry?
-#define CSUM_SIZE (16 + 32) // md5 size + sha256 size
+#if HAVE_CACHEFILE
 
 /* Interpret a string of bytes (out of the file cache) like this:
 
    4   blockLength (of rsync sum)
    4   csumBlockLength
-   4   blocks (number of valid md5 blocks in this entry), curr. always >0
+   4   blocks (number of valid checksum blocks in this entry), curr.
+       always >0, ORed with NO_MD5SUMS and/or NO_SHA256SUMS if the
+       entry does not contain that digest family's checksums
    8   rsyncSum of file start (only valid if blocks > 0)
   16   fileMD5Sum (only valid if
                    blocks == (fileSize+csumBlockLength-1)/csumBlockLength )
   32   fileSHA256Sum (only valid if
                       blocks == (fileSize+csumBlockLength-1)/csumBlockLength )
-  followed by n entries:
+  followed by n entries unless NO_MD5SUMS:
     16   md5sum of block of size csumBlockLength
+  followed by n entries unless NO_SHA256SUMS:
     32   sha256sum of block of size csumBlockLength
 
   If stored csumBlockLength doesn't match supplied length, do nothing.
@@ -82,51 +137,56 @@ size_t FilePart::unserializeCacheEntry(const Ubyte* data, size_t dataSize,
                                        size_t csumBlockLength){
   Assert(dataSize > PART_MD5SUMS);
 
-  // The resize() must have been made by the caller
-  Paranoid(MD5sums.size() == (size() + csumBlockLength - 1) / csumBlockLength);
-  Paranoid(SHA256sums.size() == (size() + csumBlockLength - 1) / csumBlockLength);
-
   size_t cachedBlockLength;
   data = unserialize4(cachedBlockLength, data);
   size_t cachedCsumBlockLength;
   data = unserialize4(cachedCsumBlockLength, data);
   if (cachedCsumBlockLength != csumBlockLength) return 0;
 
-  size_t blocks;
-  data = unserialize4(blocks, data);
+  size_t cachedBlocks;
+  data = unserialize4(cachedBlocks, data);
+  unsigned cachedDigests = ALL_DIGESTS;
+  if ((cachedBlocks & NO_MD5SUMS) != 0) cachedDigests &= ~MD5_DIGEST;
+  if ((cachedBlocks & NO_SHA256SUMS) != 0) cachedDigests &= ~SHA256_DIGEST;
+  cachedBlocks &= BLOCKS_MASK;
+  size_t n = (size_t)((size() + csumBlockLength - 1) / csumBlockLength);
   // Ignore strange-looking entries
-  if (blocks == 0) {
-    debug("ERR #blocks == 0");
+  if (cachedBlocks == 0 || cachedBlocks > n) {
+    debug("ERR #blocks == %1", cachedBlocks);
     return 0;
   }
-  if (dataSize - PART_MD5SUMS != (blocks * CSUM_SIZE)) {
+  if (dataSize - PART_MD5SUMS != cachedBlocks * sumSize(cachedDigests)) {
     debug("ERR wrong entry size (%1 vs %2)",
-	  blocks * CSUM_SIZE, dataSize - PART_MD5SUMS);
+	  cachedBlocks * sumSize(cachedDigests), dataSize - PART_MD5SUMS);
     return 0;
   }
+  allocSums(0, 0);
+  allocSums(n, cachedDigests);
   Paranoid(serialSizeOf(rsyncSum) == 8);
   data = unserialize(rsyncSum, data);
   Paranoid(serialSizeOf(md5Sum) == 16);
   Paranoid(serialSizeOf(sha256Sum) == 32);
   // All blocks of file present?
-  if (blocks == MD5sums.size() + SHA256sums.size()) {
-    setFlag(MD_VALID);
-    data = unserialize(md5Sum, data);
-    data = unserialize(sha256Sum, data);
-  } else {
-    clearFlag(MD_VALID);
-    data += CSUM_SIZE;
+  if (cachedBlocks == n) {
+    wholeDigests = static_cast<unsigned char>(cachedDigests);
+    if ((wholeDigests & MD5_DIGEST) != 0)
+      unserialize(md5Sum, data);
+    if ((wholeDigests & SHA256_DIGEST) != 0)
+      unserialize(sha256Sum, data + 16);
   }
-  // Read md5sums of individual chunks of file
-  vector<MD5>::iterator sum = MD5sums.begin();
-  for (size_t i = blocks; i > 0; --i) {
-    data = unserialize(*sum, data);
-    ++sum;
+  data += 16 + 32;
+  // Read checksums of individual chunks of file
+  if (MD5* sum = MD5sums()) {
+    for (size_t i = cachedBlocks; i > 0; --i) {
+      data = unserialize(*sum, data);
+      ++sum;
+    }
   }
-  vector<SHA256>::iterator sum2 = SHA256sums.begin();
-  for (size_t i = blocks; i > 0; --i) {
-    data = unserialize(*sum2, data);
-    ++sum2;
+  if (SHA256* sum2 = SHA256sums()) {
+    for (size_t i = cachedBlocks; i > 0; --i) {
+      data = unserialize(*sum2, data);
+      ++sum2;
+    }
   }
 
   return cachedBlockLength;
@@ -134,7 +194,7 @@ size_t FilePart::unserializeCacheEntry(const Ubyte* data, size_t dataSize,
 #endif
 //______________________________________________________________________
 
-#if HAVE_LIBDB
+#if HAVE_CACHEFILE
 /** Opposite of unserializeCacheEntry; create byte stream from object */
 struct FilePart::SerializeCacheEntry {
   SerializeCacheEntry(const FilePart& f, JigdoCache* c, size_t blockLen,
@@ -145,51 +205,77 @@ struct FilePart::SerializeCacheEntry {
   size_t blockLength;
   size_t csumBlockLength;
 
+  /* Either all blocks of the families of which the whole file was
+     read, or only the first block */
+  unsigned entryDigests() const {
+    return (file.wholeDigests != 0 ? file.wholeDigests : file.digests);
+  }
+  size_t entryBlocks() const {
+    return (file.wholeDigests != 0 ? file.blocks() : 1);
+  }
+
   size_t serialSizeOf() {
-    return PART_MD5SUMS + (file.mdValid() ? file.MD5sums.size() * CSUM_SIZE : CSUM_SIZE);
+    return PART_MD5SUMS + entryBlocks() * sumSize(entryDigests());
   }
 
   void operator()(Ubyte* data) {
     Paranoid(file.getFlag(TO_BE_WRITTEN));
     // If empty(), shouldn't have been marked TO_BE_WRITTEN:
-    Assert(!file.MD5sums.empty());
-    Assert(!file.SHA256sums.empty());
+    Assert(file.blocks() > 0);
 
+    unsigned digests = entryDigests();
     data = serialize4(blockLength, data);
     data = serialize4(csumBlockLength, data);
     // Nr of valid blocks - either 1 or all
-    size_t blocks = (file.mdValid() ? file.MD5sums.size() : 1);
-    data = serialize4(blocks, data);
+    size_t blocks = entryBlocks();
+    size_t blocksField = blocks;
+    if ((digests & MD5_DIGEST) == 0) blocksField |= NO_MD5SUMS;
+    if ((digests & SHA256_DIGEST) == 0) blocksField |= NO_SHA256SUMS;
+    data = serialize4(blocksField, data);
     data = serialize(file.rsyncSum, data);
-    data = serialize(file.md5Sum, data);
-    data = serialize(file.sha256Sum, data);
+    memset(data, 0, 16 + 32);
+    if ((file.wholeDigests & MD5_DIGEST) != 0)
+      serialize(file.md5Sum, data);
+    if ((file.wholeDigests & SHA256_DIGEST) != 0)
+      serialize(file.sha256Sum, data + 16);
+    data += 16 + 32;
     // Write md5sums of individual chunks of file
-    vector<MD5>::const_iterator sum = file.MD5sums.begin();
-    for (size_t i = blocks; i > 0; --i) {
-      data = serialize(*sum, data);
-      ++sum;
+    if ((digests & MD5_DIGEST) != 0) {
+      const MD5* sum = file.MD5sums();
+      for (size_t i = blocks; i > 0; --i) {
+        data = serialize(*sum, data);
+        ++sum;
+      }
     }
-    // Write md5sums of individual chunks of file
-    vector<SHA256>::const_iterator sum2 = file.SHA256sums.begin();
-    for (size_t i = blocks; i > 0; --i) {
-      data = serialize(*sum2, data);
-      ++sum2;
+    // Write sha256sums of individual chunks of file
+    if ((digests & SHA256_DIGEST) != 0) {
+      const SHA256* sum2 = file.SHA256sums();
+      for (size_t i = blocks; i > 0; --i) {
+        data = serialize(*sum2, data);
+        ++sum2;
+      }
     }
   }
 };
 #endif
 //______________________________________________________________________
 
-#if HAVE_LIBDB
+#if HAVE_CACHEFILE
 JigdoCache::JigdoCache(const string& cacheFileName, size_t expiryInSeconds,
-                       size_t bufLen, ProgressReporter& pr)
-  : blockLength(0), csumBlockLength(0), checkFiles(true), files(), nrOfFiles(0),
+                       size_t bufLen, ProgressReporter& pr,
+                       size_t cacheMemory, CacheFile::Format cacheFormat)
+  : blockLength(0), csumBlockLength(0), digests(FilePart::ALL_DIGESTS),
+    checkFiles(true), files(), nrOfFiles(0),
     locationPaths(), readAmount(bufLen), buffer(), reporter(pr),
-    cacheExpiry(expiryInSeconds) {
+    threadCount(1), md5Index(), sha256Index(), md5Unindexed(),
+    sha256Unindexed(), indexedFiles(0),
+    cacheExpiry(expiryInSeconds), lookedUpFiles(0), toWrite(),
+    lastWrite(time(0)) {
   cacheFile = 0;
   try {
     if (!cacheFileName.empty())
-      cacheFile = new CacheFile(cacheFileName.c_str());
+      cacheFile = new CacheFile(cacheFileName.c_str(), cacheMemory,
+                                cacheFormat);
   } catch (DbError e) {
     string err = subst(_("Could not open cache file: %L1"), e.message);
     reporter.error(err);
@@ -197,29 +283,26 @@ JigdoCache::JigdoCache(const string& cacheFileName, size_t expiryInSeconds,
 }
 #else
 JigdoCache::JigdoCache(const string&, size_t, size_t bufLen,
-                       ProgressReporter& pr)
-  : blockLength(0), csumBlockLength(0), files(), nrOfFiles(0),
-    locationPaths(), readAmount(bufLen), buffer(), reporter(pr) { }
+                       ProgressReporter& pr, size_t, CacheFile::Format)
+  : blockLength(0), csumBlockLength(0), digests(FilePart::ALL_DIGESTS),
+    checkFiles(true), files(), nrOfFiles(0),
+    locationPaths(), readAmount(bufLen), buffer(), reporter(pr),
+    threadCount(1), md5Index(), sha256Index(), md5Unindexed(),
+    sha256Unindexed(), indexedFiles(0) { }
 #endif
 //______________________________________________________________________
 
 JigdoCache::~JigdoCache() {
-# if HAVE_LIBDB
+# if HAVE_CACHEFILE
   if (cacheFile) {
     // Write out any cache entries that need it
-    for (list<FilePart>::const_iterator i = files.begin(), e = files.end();
+    toWrite.clear();
+    for (deque<FilePart>::iterator i = files.begin(), e = files.end();
          i != e; ++i) {
       if (i->deleted() || !i->getFlag(FilePart::TO_BE_WRITTEN)) continue;
-      debug("Writing %1", i->leafName());
-      FilePart::SerializeCacheEntry serializer(*i, this, blockLength,
-                                               csumBlockLength);
-      try {
-        cacheFile->insert(serializer, serializer.serialSizeOf(),
-                          i->leafName(), i->mtime(), i->size());
-      } catch (DbError e) {
-        reporter.error(e.message);
-      }
+      toWrite.push_back(&*i);
     }
+    writeCacheFile(toWrite);
 
     if (cacheExpiry > 0) {
       // Expire old cache entries from cache
@@ -243,76 +326,185 @@ JigdoCache::~JigdoCache() {
 }
 //______________________________________________________________________
 
+#if HAVE_CACHEFILE
+/* Helper for readCacheFile(): Restore FileParts from the cache entries
+   with their leafName(), mtime and size */
+struct JigdoCache::BulkLookup : CacheFile::Lookup {
+  typedef unordered_map<string, vector<FilePart*> > Files;
+  BulkLookup(size_t blockLen, size_t csumBlockLen)
+    : blockLength(blockLen), csumBlockLength(csumBlockLen), files(),
+      retry() { }
+  bool operator()(const string& fileName, uint64 fileSize, time_t mtime,
+                  const Ubyte* data, size_t size) {
+    Files::iterator f = files.find(fileName);
+    if (f == files.end()) return false;
+    bool used = false;
+    for (vector<FilePart*>::iterator i = f->second.begin(),
+           e = f->second.end(); i != e; ++i) {
+      FilePart* file = *i;
+      if (file->size() != fileSize || file->mtime() != mtime) continue;
+      if (file->unserializeCacheEntry(data, size, csumBlockLength)
+          == blockLength) {
+        debug("%1 loaded, digests %2/%3 in cache", fileName,
+              unsigned(file->digests), unsigned(file->wholeDigests));
+        used = true;
+        continue;
+      }
+      /* Unusable, e.g. because blockLength differs - leave it to
+         getChecksumsCached(), which knows what to do in that case */
+      file->allocSums(0, 0);
+      retry.push_back(file);
+    }
+    return used;
+  }
+  size_t blockLength, csumBlockLength;
+  Files files; // Files to look up, by leafName()
+  vector<FilePart*> retry;
+};
+
+void JigdoCache::readCacheFile() {
+  if (cacheFile == 0 || csumBlockLength == 0
+      || lookedUpFiles == files.size()) return;
+  deque<FilePart>::iterator i = files.begin() + lookedUpFiles,
+    e = files.end();
+  BulkLookup lookup(blockLength, csumBlockLength);
+  vector<FilePart*> parts;
+  for (; i != e; ++i, ++lookedUpFiles) {
+    if (i->deleted() || i->rsyncValid()
+        || i->getFlag(FilePart::WAS_LOOKED_UP)) continue;
+    lookup.files[i->leafName()].push_back(&*i);
+    parts.push_back(&*i);
+  }
+  if (parts.size() < BULK_LOOKUP) return;
+
+  debug("readCacheFile: Looking up %1 files", parts.size());
+  vector<string> names;
+  names.reserve(lookup.files.size());
+  for (BulkLookup::Files::iterator i = lookup.files.begin(),
+         e = lookup.files.end(); i != e; ++i)
+    names.push_back(i->first);
+  try {
+    cacheFile->findAll(lookup, &names);
+  } catch (DbError e) {
+    string err = subst(_("Error accessing cache: %1"), e.message);
+    reporter.error(err);
+  }
+  // Whether found or not, no need to look up again
+  for (vector<FilePart*>::iterator i = parts.begin(), e = parts.end();
+       i != e; ++i)
+    (*i)->setFlag(FilePart::WAS_LOOKED_UP);
+  for (vector<FilePart*>::iterator i = lookup.retry.begin(),
+         e = lookup.retry.end(); i != e; ++i)
+    (*i)->clearFlag(FilePart::WAS_LOOKED_UP);
+}
+//________________________________________
+
+void JigdoCache::writeCacheFileLater(FilePart* file) {
+  if (cacheFile == 0) return;
+  toWrite.push_back(file);
+  time_t now = time(0);
+  if (toWrite.size() < WRITE_BATCH && now - lastWrite < WRITE_INTERVAL)
+    return;
+  writeCacheFile(toWrite);
+  toWrite.clear();
+  lastWrite = now;
+}
+
+/* libdb keeps a btree sorted by filename, so inserting in that order
+   means that each page is visited only once. leafName() is assembled
+   from the FilePart's dir and leaf, so only do that once per file. */
+void JigdoCache::writeCacheFile(vector<FilePart*>& parts) {
+  typedef vector<pair<string, FilePart*> > Keys;
+  Keys keys;
+  keys.reserve(parts.size());
+  for (vector<FilePart*>::iterator i = parts.begin(), e = parts.end();
+       i != e; ++i) {
+    FilePart* file = *i;
+    if (file->deleted() || !file->getFlag(FilePart::TO_BE_WRITTEN))
+      continue;
+    keys.push_back(make_pair(file->leafName(), file));
+  }
+  sort(keys.begin(), keys.end());
+  try {
+    for (Keys::iterator i = keys.begin(), e = keys.end(); i != e; ++i) {
+      FilePart* file = i->second;
+      if (!file->getFlag(FilePart::TO_BE_WRITTEN)) continue; // Duplicate
+      debug("Writing %1", i->first);
+      FilePart::SerializeCacheEntry serializer(*file, this, blockLength,
+                                               csumBlockLength);
+      cacheFile->insert(serializer, serializer.serialSizeOf(),
+                        i->first, file->mtime(), file->size());
+      file->clearFlag(FilePart::TO_BE_WRITTEN);
+    }
+    cacheFile->sync();
+  } catch (DbError e) {
+    reporter.error(e.message);
+  }
+}
+#endif
+//______________________________________________________________________
+
 /* Either:
-   
-   1. read data for the first block and create rsyncSum, MD5sums[0]
-      SHA256sums[0], or;
 
-   2. read the whole file and create rsyncSum, plus both checksums for
-      all the blocks and both checksums for the whole file.
+   1. read data for the first block and create rsyncSum and the
+      checksums of the first block, or;
+
+   2. read the whole file and create rsyncSum, plus the checksums of
+      all the blocks and of the whole file.
+
+   Only the digest families asked for and those set with
+   JigdoCache::setDigests() are calculated. Checksums already known
+   are kept, e.g. if only the MD5 checksums of a file are known, a
+   request for its SHA256 checksum only calculates that.
 */
 
-bool FilePart::getChecksumsRead(JigdoCache* c, size_t blockNr) {
-  // Should do this check before calling:
-  Paranoid((blockNr == 0 && MD5sums.empty() && SHA256sums.empty()) || !mdValid());
+bool FilePart::getChecksumsRead(JigdoCache* c, size_t blockNr,
+                                unsigned want) {
+  if (getChecksumsPrepare(c, blockNr, want)) return true;
+  string err;
+  if (getChecksumsCalc(c, blockNr, want, c->buffer, true, err)) return true;
+  markAsDeleted(c);
+  c->reporter.error(err); // might throw
+  return 0;
+}
+//________________________________________
 
+bool FilePart::getChecksumsPrepare(JigdoCache* c, size_t blockNr,
+                                   unsigned& want) {
   // Do not forget to setParams() before calling this!
   Assert(c->csumBlockLength != 0);
-  const size_t thisBlockLength = c->blockLength;
-
-  int64_t num_csum_blocks = (size() + c->csumBlockLength - 1) / c->csumBlockLength;
 
-  MD5sums.resize((size_t)num_csum_blocks);
-  SHA256sums.resize((size_t)num_csum_blocks);
+  want |= c->digests;
+  size_t num_csum_blocks = (size_t)((size() + c->csumBlockLength - 1)
+                                    / c->csumBlockLength);
   //____________________
 
-# if HAVE_LIBDB
+# if HAVE_CACHEFILE
   // Can we maybe get the info from the cache?
-  if (c->cacheFile != 0 && !getFlag(WAS_LOOKED_UP)) {
-    setFlag(WAS_LOOKED_UP);
-    const Ubyte* data;
-    size_t dataSize;
-    try {
-      /* Unserialize will do nothing if csumBlockLength differs. If
-         csumBlockLength matches, but returned blockLength doesn't, we
-         need to re-read the first block. */
-      if (c->cacheFile->find(data, dataSize, leafName(), size(), mtime())
-          .ok()) {
-        debug("%1 found, want block#%2", leafName(), blockNr);
-        size_t cachedBlockLength = unserializeCacheEntry(data, dataSize,
-                                                         c->csumBlockLength);
-        // Was all necessary data in cache? Yes => return it now.
-        if (cachedBlockLength == thisBlockLength
-            && (blockNr == 0 || mdValid())) {
-          debug("%1 loaded, blockLen (%2) matched, %3/%4 in cache",
-                leafName(), thisBlockLength, (mdValid() ? MD5sums.size() : 1),
-                MD5sums.size());
-          return true;
-        }
-        /* blockLengths didn't match and/or the cache only contained
-           the checksum for the first block while we asked for a later
-           one. It's as if we never queried the cache, except for the
-           case when we need to re-read the first block because the
-           blockLength changed, but *all* blocks' checksums were in the
-           cache. */
-        debug("%1 loaded, NO match (blockLen %2 vs %3), %4/%5 in cache",
-              leafName(), cachedBlockLength, thisBlockLength,
-              (mdValid() ? MD5sums.size() : 1), MD5sums.size());
-      }
-    } catch (DbError e) {
-      string err = subst(_("Error accessing cache: %1"), e.message);
-      c->reporter.error(err);
-    }
-  }
-# endif /* HAVE_LIBDB */
-  //____________________
+  if (c->cacheFile != 0 && !getFlag(WAS_LOOKED_UP)
+      && getChecksumsCached(c, blockNr, want))
+    return true;
+# endif /* HAVE_CACHEFILE */
+
+  // Only calculate what is not known yet
+  want &= ~(blockNr == 0 ? digests : wholeDigests);
+  if (want == 0 && rsyncValid()) return true;
+  allocSums(num_csum_blocks, digests | want);
+  return false;
+}
+//________________________________________
+
+bool FilePart::getChecksumsCalc(const JigdoCache* c, size_t blockNr,
+    unsigned calc, vector<Ubyte>& buffer, bool report, string& err) {
+  const size_t thisBlockLength = c->blockLength;
+  const bool calcMD5 = (calc & MD5_DIGEST) != 0;
+  const bool calcSHA256 = (calc & SHA256_DIGEST) != 0;
 
   // Open input file
   string name(getPath());
   name += leafName();
   bifstream input(name.c_str(), ios::binary);
   if (!input) {
-    string err;
     if (name == "-") {
       /* Actually, stdin /would/ be allowed /here/, but it isn't
          possible with mktemplate. */
@@ -326,165 +518,186 @@ bool FilePart::getChecksumsRead(JigdoCache* c, size_t blockNr) {
         err += ')';
       }
     }
-    markAsDeleted(c);
-    c->reporter.error(err); // might throw
-    return 0;
+    return false;
   }
   //____________________
 
   // We're going to write this to the cache later on
-  setFlag(TO_BE_WRITTEN);
-
-  // Allocate or resize buffer, or do nothing if already right size
-  c->buffer.resize(c->readAmount > c->csumBlockLength ?
-                   c->readAmount : c->csumBlockLength);
+  if (calc != 0) setFlag(TO_BE_WRITTEN);
+
+  /* Read whole checksum blocks into the buffer, several at a time if
+     reading the whole file. Allocate or resize buffer, or do nothing
+     if already right size */
+  const size_t batchLength =
+    (blockNr == 0 ? 1 : SUM_BATCH) * c->csumBlockLength;
+  if (buffer.size() < batchLength) buffer.resize(batchLength);
   //______________________________
 
   // Read data and create checksums
 
   uint64 off = 0; // File offset of first byte in buf
-  // Nr of bytes before we are to reset() md
-  size_t mdLeft = c->csumBlockLength;
   /* Call reporter once off reaches this value - only report something
      if scanning >1 checksum block */
-  uint64 nextReport = mdLeft;
-  MD5Sum md;
-  md5Sum.reset();
-  vector<MD5>::iterator sum = MD5sums.begin();
-  SHA256Sum sd;
-  sha256Sum.reset();
-  vector<SHA256>::iterator sum2 = SHA256sums.begin();
-  //____________________
-
-  // Calculate RsyncSum of head of file and MD5 and SHA256 for all blocks
-
+  uint64 nextReport = c->csumBlockLength;
+  size_t block = 0; // Nr of block checksums written so far
+  if (calcMD5) md5Sum.reset();
+  if (calcSHA256) sha256Sum.reset();
   Assert(thisBlockLength <= c->csumBlockLength);
-  Ubyte* buf = &c->buffer[0];
-  Ubyte* bufpos = buf;
-  Ubyte* bufend = buf + (c->readAmount > thisBlockLength ?
-                        c->readAmount : thisBlockLength);
-  while (input && static_cast<size_t>(bufpos - buf) < thisBlockLength) {
-    readBytes(input, bufpos, bufend - bufpos);
-    size_t nn = input.gcount();
-    bufpos += nn;
-    debug("Read %1", nn);
-  }
-  size_t n = bufpos - buf;
-
-  // Create RsyncSum of 1st bytes of file, or leave at 0 if file too small
-  rsyncSum.reset();
-  if (n >= thisBlockLength)
-    rsyncSum.addBack(buf, thisBlockLength);
-  //__________
+  Ubyte* buf = &buffer[0];
+  Ubyte* bufend = buf + batchLength;
 
   while (true) { // Will break out if error or whole file read
 
+    Ubyte* bufpos = buf;
+    while (input && bufpos < bufend) {
+      size_t toRead = (size_t)(bufend - bufpos);
+      readBytes(input, bufpos, min(toRead, c->readAmount));
+      bufpos += input.gcount();
+    }
     // n is number of valid bytes in buf[]
+    size_t n = bufpos - buf;
+    debug("%1: read %2", name, n);
+
+    // Create RsyncSum of 1st bytes of file, or leave at 0 if too small
+    if (off == 0) {
+      rsyncSum.reset();
+      if (n >= thisBlockLength)
+        rsyncSum.addBack(buf, thisBlockLength);
+    }
+
     off += n;
     if (off > size())
       break; // Argh - file size changed
 
-    if (off >= nextReport) {
+    if (report && off >= nextReport) {
       c->reporter.scanningFile(this, off);
       nextReport += REPORT_INTERVAL;
     }
 
-    // Create checksums for chunks of size csumBlockLength
-    if (n < mdLeft) {
-      md.update(buf, n);
-      sd.update(buf, n);
-      mdLeft -= n;
-    } else {
-      md.update(buf, mdLeft);
-      sd.update(buf, mdLeft);
-      Ubyte* cur = buf + mdLeft;
-      size_t nn = n - mdLeft;
-      do {
-        md.finishForReuse();
-        sd.finishForReuse();
-        debug("%1: mdLeft (0), switching to next md at off %2, left %3, "
-              "writing sum#%4: %5/%6", name, off - n + cur - buf, nn,
-              sum - MD5sums.begin(), md.toString(), sd.toString());
-        Paranoid(sum != MD5sums.end());
-        *sum = md;
-        *sum2 = sd;
-        ++sum;
-	++sum2;
-        size_t m = (nn < c->csumBlockLength ? nn : c->csumBlockLength);
-        md.reset().update(cur, m);
-        sd.reset().update(cur, m);
-        cur += m;
-	nn -= m;
-        mdLeft = c->csumBlockLength - m;
-      } while (nn > 0);
-    }
-
-    md5Sum.update(buf, n); // Create MD5 for the whole file
-    sha256Sum.update(buf, n); // Create MD5 for the whole file
-
-    if (blockNr == 0 && sum != MD5sums.begin())
+    /* Create checksums for chunks of size csumBlockLength. If n is not
+       a multiple of it, the file ends here, and the last checksum is
+       that of its trailing bytes. */
+    size_t nBlocks = (n + c->csumBlockLength - 1) / c->csumBlockLength;
+    Paranoid(block + nBlocks <= blocks());
+    if (calcMD5)
+      MD5Sum::blockSums(buf, n, c->csumBlockLength, MD5sums() + block);
+    if (calcSHA256)
+      SHA256Sum::blockSums(buf, n, c->csumBlockLength, SHA256sums() + block);
+    debug("%1: %2 block sums from #%3", name, nBlocks, block);
+    block += nBlocks;
+
+    // Create checksums for the whole file
+    if (calcMD5) md5Sum.update(buf, n);
+    if (calcSHA256) sha256Sum.update(buf, n);
+
+    if (blockNr == 0 && block != 0)
       break; // Only wanted 1st block
 
     if (!input)
       break; // End of file or error
 
-    // Read more data
-    readBytes(input, buf, c->readAmount);
-    n = input.gcount();
-    debug("%1: read %2", name, n);
-
   } // Endwhile (true), will break out if error or whole file read
 
-  Paranoid(sum != MD5sums.end() // >=1 trailing bytes
-           || mdLeft == c->csumBlockLength); // 0 trailing bytes
+  /* If the file ends exactly after the first block, eof may not have
+     been seen yet */
+  if (off == size() && !input.eof() && input) input.peek();
   if (off == size() && input.eof()) {
     // Whole file was read
-    c->reporter.scanningFile(this, size()); // 100% scanned
-    if (mdLeft < c->csumBlockLength) {
-      (*sum) = md.finish(); // Digest of trailing bytes
-      (*sum2) = sd.finish(); // Digest of trailing bytes
-      debug("%1: writing trailing sum#%2: %3/%4",
-            name, sum - MD5sums.begin(), md.toString(), sd.toString());
-    }
-    md5Sum.finish(); // Digest of whole file
-    sha256Sum.finish(); // Digest of whole file
-    setFlag(MD_VALID);
+    if (report) c->reporter.scanningFile(this, size()); // 100% scanned
+    Paranoid(block == blocks());
+    // Digest of whole file
+    if (calcMD5) md5Sum.finish();
+    if (calcSHA256) sha256Sum.finish();
+    wholeDigests = static_cast<unsigned char>(wholeDigests | calc);
     return true;
-  } else if (blockNr == 0 && sum != MD5sums.begin()) {
-    // Only first md5 block of file was read
+  } else if (blockNr == 0 && block != 0) {
+    // Only first block of file was read
     debug("%1: file header read, sum#0 written", name);
-#   if DEBUG
-    md5Sum.finish(); // else failed assert in FilePart::SerializeCacheEntry
-    sha256Sum.finish();
-#   else
-    md5Sum.abort(); // Saves the memory until whole file is read
-    sha256Sum.abort(); // Saves the memory until whole file is read
-#   endif
+    // Saves the memory until whole file is read
+    if (calcMD5) md5Sum.abort();
+    if (calcSHA256) sha256Sum.abort();
     return true;
   }
   //____________________
 
   // Some error happened
-  string err = subst(_("Error while reading `%1' - file will be ignored "
-                       "(%2)"), name, strerror(errno));
-  markAsDeleted(c);
-  c->reporter.error(err);
+  err = subst(_("Error while reading `%1' - file will be ignored "
+                "(%2)"), name, strerror(errno));
+  return false;
+}
+//______________________________________________________________________
+
+#if HAVE_CACHEFILE
+bool FilePart::getChecksumsCached(JigdoCache* c, size_t blockNr,
+                                  unsigned want) {
+  Paranoid(c->cacheFile != 0);
+  setFlag(WAS_LOOKED_UP);
+  const size_t thisBlockLength = c->blockLength;
+  const Ubyte* data;
+  size_t dataSize;
+  try {
+    /* Unserialize will do nothing if csumBlockLength differs. If
+       csumBlockLength matches, but returned blockLength doesn't, we
+       need to re-read the first block. */
+    if (c->cacheFile->find(data, dataSize, leafName(), size(), mtime())
+        .ok()) {
+      debug("%1 found, want block#%2", leafName(), blockNr);
+      size_t cachedBlockLength = unserializeCacheEntry(data, dataSize,
+                                                       c->csumBlockLength);
+      // Was all necessary data in cache? Yes => return it now.
+      if (cachedBlockLength == thisBlockLength) {
+        debug("%1 loaded, blockLen (%2) matched, digests %3/%4 in cache",
+              leafName(), thisBlockLength, unsigned(digests),
+              unsigned(wholeDigests));
+        return hasDigests(blockNr, want);
+      }
+      /* blockLengths didn't match, so rsyncSum is useless. It's as if
+         we never queried the cache. */
+      debug("%1 loaded, NO match (blockLen %2 vs %3)",
+            leafName(), cachedBlockLength, thisBlockLength);
+      allocSums(0, 0);
+    }
+  } catch (DbError e) {
+    string err = subst(_("Error accessing cache: %1"), e.message);
+    c->reporter.error(err);
+  }
+  return false;
+}
+#endif
+//______________________________________________________________________
+
+unsigned FilePart::getChecksumsKnown(JigdoCache* c) {
+  if (wholeDigests != 0) return wholeDigests;
+# if HAVE_CACHEFILE
+  if (c->cacheFile == 0 || getFlag(WAS_LOOKED_UP)) return 0;
+  size_t blocks = (size_t)((size() + c->csumBlockLength - 1)
+                           / c->csumBlockLength);
+  if (getChecksumsCached(c, blocks - 1, 0) && wholeDigests != 0)
+    return wholeDigests;
+  /* Not (completely) in the cache - revert to the state of a file
+     that has not been read from, so getChecksumsRead() will look up
+     and/or read it properly later. */
+  allocSums(0, 0);
+  clearFlag(WAS_LOOKED_UP);
+# else
+  (void)c;
+# endif
   return 0;
 }
 //______________________________________________________________________
 
 const MD5Sum* FilePart::getMD5SumRead(JigdoCache* c) {
-  if (!getChecksumsRead(c, (size_t)((fileSize + c->csumBlockLength - 1) / c->csumBlockLength - 1)))
+  if (!getChecksumsRead(c, (size_t)((fileSize + c->csumBlockLength - 1) / c->csumBlockLength - 1), MD5_DIGEST))
       return 0;
-  Paranoid(mdValid());
+  Paranoid((wholeDigests & MD5_DIGEST) != 0);
   return &md5Sum;
 }
 //______________________________________________________________________
 
 const SHA256Sum* FilePart::getSHA256SumRead(JigdoCache* c) {
-  if (!getChecksumsRead(c, (size_t)(fileSize + c->csumBlockLength - 1) / c->csumBlockLength - 1))
+  if (!getChecksumsRead(c, (size_t)(fileSize + c->csumBlockLength - 1) / c->csumBlockLength - 1, SHA256_DIGEST))
       return 0;
-  Paranoid(mdValid());
+  Paranoid((wholeDigests & SHA256_DIGEST) != 0);
   return &sha256Sum;
 }
 //______________________________________________________________________
@@ -495,10 +708,172 @@ void JigdoCache::setParams(size_t blockLen, size_t csumBlockLen) {
   blockLength = blockLen;
   csumBlockLength = csumBlockLen;
   Assert(blockLength <= csumBlockLength);
-  for (list<FilePart>::iterator file = files.begin(), end = files.end();
-       file != end; ++file) {
-    file->MD5sums.resize(0);
-    file->SHA256sums.resize(0);
+  for (deque<FilePart>::iterator file = files.begin(), end = files.end();
+       file != end; ++file)
+    file->allocSums(0, 0);
+}
+//______________________________________________________________________
+
+void JigdoCache::updateIndex() {
+  if (indexedFiles == files.size()) return;
+# if HAVE_CACHEFILE
+  readCacheFile();
+# endif
+  deque<FilePart>::iterator i = files.begin() + indexedFiles,
+    e = files.end();
+  for (; i != e; ++i, ++indexedFiles) {
+    if (i->deleted()) continue;
+    unsigned known = i->getChecksumsKnown(this);
+    if (known != 0) addToIndex(&*i, known);
+    if ((known & FilePart::MD5_DIGEST) == 0)
+      md5Unindexed[i->size()].push_back(&*i);
+    if ((known & FilePart::SHA256_DIGEST) == 0)
+      sha256Unindexed[i->size()].push_back(&*i);
+  }
+  debug("updateIndex: %1/%2 files indexed, %3/%4 distinct sizes left to "
+        "read", md5Index.size(), sha256Index.size(), md5Unindexed.size(),
+        sha256Unindexed.size());
+}
+//________________________________________
+
+FilePart* JigdoCache::indexFilesOfSize(uint64 fileSize, const MD5* md,
+                                       const SHA256* sd) {
+  UnindexedMap& unindexed = (md != 0 ? md5Unindexed : sha256Unindexed);
+  UnindexedMap::iterator b = unindexed.find(fileSize);
+  if (b == unindexed.end()) return 0;
+  vector<FilePart*>& parts = b->second;
+  FilePart* result = 0;
+  size_t n = 0;
+  while (n < parts.size() && result == 0) {
+    FilePart* file = parts[n++];
+    if (file->deleted()) continue;
+    // This may cause the whole file to be read!
+    bool ok = (md != 0 ? file->getMD5Sum(this) != 0
+               : file->getSHA256Sum(this) != 0);
+    if (!ok) continue; // Error, file now deleted
+    addToIndex(file, md != 0 ? FilePart::MD5_DIGEST
+                             : FilePart::SHA256_DIGEST);
+    if ((md != 0 && file->md5Sum == *md)
+        || (sd != 0 && file->sha256Sum == *sd))
+      result = file;
+  }
+  parts.erase(parts.begin(), parts.begin() + n);
+  if (parts.empty()) unindexed.erase(b);
+  return result;
+}
+//________________________________________
+
+namespace {
+
+  /* Return the first indexed file with the checksum which has not been
+     deleted (e.g. because it could not be read), or null */
+  template<class Index, class Sum>
+  FilePart* findIndexed(Index& index, const Sum& sum) {
+    pair<typename Index::iterator, typename Index::iterator> r =
+      index.equal_range(sum);
+    for (typename Index::iterator i = r.first; i != r.second; ++i)
+      if (!i->second->deleted()) return i->second;
+    return 0;
+  }
+
+}
+
+FilePart* JigdoCache::findMD5(const MD5& md, uint64 fileSize) {
+  updateIndex();
+  FilePart* file = findIndexed(md5Index, md);
+  if (file != 0) return file;
+  return indexFilesOfSize(fileSize, &md, 0);
+}
+
+FilePart* JigdoCache::findSHA256(const SHA256& sd, uint64 fileSize) {
+  updateIndex();
+  FilePart* file = findIndexed(sha256Index, sd);
+  if (file != 0) return file;
+  return indexFilesOfSize(fileSize, 0, &sd);
+}
+//______________________________________________________________________
+
+JigdoCache::ReadAhead::ReadAhead(JigdoCache* c, bool whole)
+    : cache(c), wholeFile(whole), pos(c->begin()),
+      window(4 * c->getThreads()), jobs(), buffers(), lock(), jobDone(),
+      pool(c->getThreads()) {
+# if HAVE_CACHEFILE
+  cache->readCacheFile();
+# endif
+}
+
+JigdoCache::ReadAhead::~ReadAhead() {
+  pool.wait();
+  for (vector<vector<Ubyte>*>::iterator i = buffers.begin(),
+         e = buffers.end(); i != e; ++i)
+    delete *i;
+}
+//________________________________________
+
+void JigdoCache::ReadAhead::calc(Job* job) {
+  MutexLock l(lock);
+  vector<Ubyte>* buf;
+  if (buffers.empty()) {
+    buf = new vector<Ubyte>();
+  } else {
+    buf = buffers.back();
+    buffers.pop_back();
+  }
+  l.unlock();
+
+  job->ok = job->file->getChecksumsCalc(cache, job->blockNr, job->calc,
+                                        *buf, false, job->error);
+
+  l.lock();
+  buffers.push_back(buf);
+  job->done = true;
+  l.unlock();
+  jobDone.notify_all();
+}
+//________________________________________
+
+void JigdoCache::ReadAhead::fill() {
+  JigdoCache::iterator end = cache->end();
+  while (jobs.size() < window && pos != end) {
+    FilePart* file = &*pos;
+    ++pos;
+    // Anything to do, and is the data maybe in the cache file?
+    size_t blockNr = 0;
+    if (wholeFile)
+      blockNr = (size_t)((file->size() + cache->csumBlockLength - 1)
+                         / cache->csumBlockLength - 1);
+    unsigned calc = cache->digests;
+    bool known = file->rsyncValid() && file->hasDigests(blockNr, calc);
+    if (!known) known = file->getChecksumsPrepare(cache, blockNr, calc);
+    jobs.push_back(Job(file, !known, blockNr, calc));
+    // No - have it read by a worker
+    if (!known) pool.submit(bind(&ReadAhead::calc, this, &jobs.back()));
+  }
+}
+//________________________________________
+
+FilePart* JigdoCache::ReadAhead::next() {
+  while (true) {
+    fill();
+    if (jobs.empty()) return 0;
+    Job& job = jobs.front();
+    MutexLock l(lock);
+    while (!job.done) jobDone.wait(l);
+    l.unlock();
+    FilePart* file = job.file;
+    bool read = job.read, ok = job.ok;
+    string err;
+    err.swap(job.error);
+    jobs.pop_front();
+    if (ok) {
+      if (read && wholeFile) cache->reporter.scanningFile(file, file->size());
+#     if HAVE_CACHEFILE
+      if (read) cache->writeCacheFileLater(file);
+#     endif
+      return file;
+    }
+    file->markAsDeleted(cache);
+    cache->reporter.error(err); // might throw
   }
 }
 //______________________________________________________________________
@@ -554,6 +929,11 @@ void JigdoCache::addFile(const string& name) {
   Paranoid(i != locationPaths.end());
 
   // Append new obj at end of list
-  FilePart fp(i, nameRest, fileInfo.st_size, fileInfo.st_mtime);
+  string::size_type leafStart = nameRest.rfind(DIRSEP);
+  leafStart = (leafStart == string::npos ? 0 : leafStart + 1);
+  const string* dir = names.intern(nameRest.substr(0, leafStart));
+  const char* leaf = names.add(nameRest.data() + leafStart,
+                               nameRest.size() - leafStart);
+  FilePart fp(i, dir, leaf, fileInfo.st_size, fileInfo.st_mtime);
   files.push_back(fp);
 }
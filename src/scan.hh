@@ -21,20 +21,26 @@
 
 #include <config.h>
 
-#include <list>
+#include <deque>
+#include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
+#include <string.h>
 #include <time.h>
 #include <sys/stat.h>
 
 #include <cachefile.hh>
 #include <debug.hh>
 #include <md5sum.hh>
+#include <nocopy.hh>
 #include <sha256sum.hh>
 #include <recursedir.fh>
 #include <rsyncsum.hh>
 #include <scan.fh>
 #include <string.hh>
+#include <stringpool.hh>
+#include <threadpool.hh>
 //______________________________________________________________________
 
 /** First part of the filename of a "part", a directory on the local
@@ -76,12 +82,19 @@ class FilePart {
   /** Objects are only created by JigdoCache */
   friend class JigdoCache;
 public:
+  /** Digest families, see JigdoCache::setDigests() */
+  enum Digests {
+    MD5_DIGEST = 1,
+    SHA256_DIGEST = 2,
+    ALL_DIGESTS = MD5_DIGEST | SHA256_DIGEST
+  };
+
   /** Sort FileParts by RsyncSum of first bytes */
   inline const string& getPath() const;
   LocationPathSet::iterator getLocation() { return path; }
   /** @return The further dir names and the leafname, after what getPath()
       returns. */
-  inline const string& leafName() const;
+  inline string leafName() const;
   inline uint64 size() const;
   inline time_t mtime() const;
   /** Returns null ptr if error and you don't throw it in your
@@ -109,57 +122,115 @@ public:
       failed, or other reasons. */
   bool deleted() const { return fileSize == 0; }
 
-  /** Do not call - this is public only because list<> must be able to
-      delete FileParts */
-  ~FilePart() { }
-  // default copy ctor / assignment op
+  /** Do not call - these are public only because deque<> must be able
+      to copy and delete FileParts */
+  ~FilePart() { delete[] sums; }
+  FilePart(const FilePart& f);
+  FilePart& operator=(const FilePart& f);
   //__________
 
 private:
-  inline FilePart(LocationPathSet::iterator p, string rest, uint64 fSize,
-                  time_t fMtime);
+  inline FilePart(LocationPathSet::iterator p, const string* dir,
+                  const char* leaf, uint64 fSize, time_t fMtime);
 
   /* Called when the methods getMD5Sums/getMD5Sum() need data read from
-     file. Might return false on failure. */
-  bool getChecksumsRead(JigdoCache* c, size_t blockNr);
+     file. want are the digest families needed, in addition to the
+     JigdoCache's. Might return false on failure. */
+  bool getChecksumsRead(JigdoCache* c, size_t blockNr, unsigned want);
+  /* First half of getChecksumsRead(): Try to get the checksums from
+     the cache file, else allocate space for them. Returns true if
+     nothing needs to be read from the file, else changes want to the
+     digest families which need to be calculated. */
+  bool getChecksumsPrepare(JigdoCache* c, size_t blockNr, unsigned& want);
+  /* Second half of getChecksumsRead(): Read the file and calculate
+     the checksums of the digest families calc, using the supplied
+     buffer. Only reads the members of c, so may be called from a
+     worker thread for several different FileParts at once if report
+     is false. If report is true, progress is passed to c's reporter.
+     On error, returns false and sets err; the caller must call
+     markAsDeleted() and report the error. */
+  bool getChecksumsCalc(const JigdoCache* c, size_t blockNr, unsigned calc,
+                        vector<Ubyte>& buffer, bool report, string& err);
+  /* When reading the whole file, getChecksumsCalc() reads this many
+     checksum blocks at a time, so blockSums() of MD5Sum and SHA256Sum
+     can process them at once */
+  static const size_t SUM_BATCH = 8;
 
   const MD5Sum* getMD5SumRead(JigdoCache* c);
   const SHA256Sum* getSHA256SumRead(JigdoCache* c);
+
+  /* Return the digest families of which the checksums of the whole
+     file are known without reading the file, maybe after looking it
+     up in the cache file. */
+  unsigned getChecksumsKnown(JigdoCache* c);
+# if HAVE_CACHEFILE
+  /* Look up the file in the cache file. Returns true if all data
+     needed for block blockNr of the digest families want was found
+     there. */
+  bool getChecksumsCached(JigdoCache* c, size_t blockNr, unsigned want);
+# endif
   //__________
 
   /* There are 3 states of a FilePart:
-     a) MD5sums.empty(): File has not been read from so far
-     b) !MD5sums.empty() && !mdValid: MD5sums[0] and rsyncSum are valid
-     c) !MD5sums.empty() && mdValid: all MD5sums[] and rsyncSum and md5Sum valid*/
+     a) blocks() == 0: File has not been read from so far
+     b) blocks() > 0: rsyncSum is valid, and the checksums of the first
+        block for each digest family in "digests"
+     c) additionally, for the families in wholeDigests (a subset of
+        digests), all block checksums and the whole file's checksum
+        are valid */
 
   LocationPathSet::iterator path;
-  string pathRest; // further dir names after "path", and leafname of file
+  /* Further dir names after "path", interned in JigdoCache::names,
+     and leafname of file, stored there */
+  const string* dirName;
+  const char* leaf;
   uint64 fileSize;
   time_t fileMtime;
 
   /* RsyncSum64 of the first MkTemplate::blockLength bytes of the
      file. */
   RsyncSum64 rsyncSum;
-  bool rsyncValid() const { return MD5sums.size() > 0; }
+  bool rsyncValid() const { return sumBlocks > 0; }
 
   /* File is split up into chunks of length csumBlockLength (the last
-     one may be smaller) and the MD5 checksum of each is
-     calculated. */
-  vector<MD5> MD5sums;
-  vector<SHA256> SHA256sums;
-
-  /* Hash of complete file contents. mdValid is true iff md5Sum is
-     cached and valid. NB, it is possible that mdValid==true, but
-     MD5sums.size()==0, after csumBlockLength has been changed. If
-     MD5sums.size()==fileSize/csumBlockLength, then not necessarily
-     mdValid==true */
+     one may be smaller) and the MD5 and/or SHA256 checksum of each is
+     calculated. They are stored in one allocation: sumBlocks MD5s,
+     followed by sumBlocks SHA256s, each only if the family is in
+     "digests". */
+  size_t blocks() const { return sumBlocks; }
+  MD5* MD5sums() const {
+    return ((digests & MD5_DIGEST) != 0 ? reinterpret_cast<MD5*>(sums) : 0);
+  }
+  SHA256* SHA256sums() const {
+    if ((digests & SHA256_DIGEST) == 0) return 0;
+    return reinterpret_cast<SHA256*>(
+      (digests & MD5_DIGEST) != 0 ? sums + sumBlocks * sizeof(MD5) : sums);
+  }
+  // Bytes of block checksums per block for the digest families d
+  static size_t sumSize(unsigned d) {
+    return ((d & MD5_DIGEST) != 0 ? sizeof(MD5) : 0)
+      + ((d & SHA256_DIGEST) != 0 ? sizeof(SHA256) : 0);
+  }
+  /* Make room for the checksums of n blocks of the digest families d.
+     If n == blocks(), those of the families already in "digests" are
+     kept, else all checksums are discarded. */
+  void allocSums(size_t n, unsigned d);
+  Ubyte* sums;
+  size_t sumBlocks;
+  unsigned char digests, wholeDigests; // Digest families, see above
+  // Are the checksums of the digest families d known for block blockNr?
+  bool hasDigests(size_t blockNr, unsigned d) const {
+    return blockNr < sumBlocks
+      && (d & ~(blockNr == 0 ? digests : wholeDigests)) == 0;
+  }
+
+  /* Hash of complete file contents, valid if its family is in
+     wholeDigests */
   MD5Sum md5Sum;
   SHA256Sum sha256Sum;
 
   enum Flags {
     EMPTY = 0,
-    // Bit flag is set iff md5Sum and sha256Sum contains the whole file's checksum
-    MD_VALID = 1,
     /* This file was looked up in the cache file (whether successfully
        or not doesn't matter) - don't look it up again. */
     WAS_LOOKED_UP = 2,
@@ -170,9 +241,8 @@ private:
   bool getFlag(Flags f) const { return (flags & f) != 0; }
   inline void setFlag(Flags f);
   inline void clearFlag(Flags f);
-  bool mdValid() const { return getFlag(MD_VALID); }
 
-# if HAVE_LIBDB
+# if HAVE_CACHEFILE
   // Offsets for binary representation in database (see cachefile.hh)
   enum {
     BLOCKLEN = 0,
@@ -185,6 +255,12 @@ private:
     // Can't point directly to the offset for PART_SHA256SUM, as
     // things are dynamic after PART_MD5SUMS
   };
+  // Bits in the CSUMBLOCKS field
+  enum {
+    BLOCKS_MASK = 0x0fffffff,
+    NO_MD5SUMS = 0x10000000, // Entry contains no MD5 checksums
+    NO_SHA256SUMS = 0x20000000 // Entry contains no SHA256 checksums
+  };
 
   size_t unserializeCacheEntry(const Ubyte* data, size_t dataSize,
       size_t csumBlockLength); // Byte stream => FilePart
@@ -203,7 +279,8 @@ struct JigdoCacheError : Error {
 
 /** A list of FileParts that is "lazy": Nothing is actually read from
     the files passed to it until that is really necessary. JigdoCache
-    behaves like a list<FilePart>.
+    behaves like a list<FilePart>: Adding files does not move the
+    FileParts already present.
 
     A JigdoCache cannot hold zero-length files. They will be silently
     skipped when you try to add them.
@@ -216,16 +293,24 @@ class JigdoCache {
   friend class FilePart;
 public:
   class ProgressReporter;
-  /** cacheFileName can be "" for no file cache */
+  class ReadAhead;
+  /** cacheFileName can be "" for no file cache. cacheMemory is the
+      size of the cache file's in-memory page cache. */
   explicit JigdoCache(const string& cacheFileName,
       size_t expiryInSeconds = 60*60*24*30, size_t bufLen = 128*1024,
-      ProgressReporter& pr = noReport);
-  /** The dtor will try to write cached data to the cache file */
+      ProgressReporter& pr = noReport,
+      size_t cacheMemory = CacheFile::DEFAULT_CACHE_MEMORY,
+      CacheFile::Format cacheFormat = CacheFile::DEFAULT_FORMAT);
+  /** The dtor will try to write cached data to the cache file. While
+      ReadAhead reads files, their data is also written every few
+      seconds. */
   ~JigdoCache();
 
   /** Read a list of filenames from the object and store them in the
       JigdoCache. Only the file size is read during the call,
-      Checksums are calculated later, if/when needed. */
+      Checksums are calculated later, if/when needed. With more than
+      one thread (see setThreads()), directories are read in
+      parallel. */
   template <class RecurseDir>
   inline void readFilenames(RecurseDir& rd);
   /** Set the sizes of cache's blockLength and csumBlockLength
@@ -240,6 +325,15 @@ public:
   size_t getBlockLen() const { return blockLength; }
   size_t getChecksumBlockLen() const { return csumBlockLength; }
 
+  /** Set the digest families (FilePart::MD5_DIGEST, SHA256_DIGEST)
+      whose checksums are calculated whenever a file is read, in
+      addition to the one being asked for. Default is
+      FilePart::ALL_DIGESTS, 0 means that only the family being asked
+      for is calculated. Missing families are calculated later if
+      needed; the checksums already known are kept. */
+  void setDigests(unsigned d) { digests = d; }
+  unsigned getDigests() const { return digests; }
+
   /** Amount of data that JigdoCache will attempt to read per call to
       ifstream::read(), and size of buffer allocated. Minimum: 64k */
   inline void setReadAmount(size_t Ubytes);
@@ -249,6 +343,11 @@ public:
       re-opened/re-allocated automatically if/when needed. */
   void deallocBuffer() { buffer.resize(0); }
 
+  /** Number of threads used by ReadAhead to read files in parallel.
+      1 means that all files are read by the calling thread. */
+  void setThreads(unsigned n) { threadCount = (n == 0 ? 1 : n); }
+  unsigned getThreads() const { return threadCount; }
+
   /** Return reporter supplied by JigdoCache creator */
   ProgressReporter* getReporter() { return &reporter; }
 
@@ -271,6 +370,17 @@ public:
   const LocationPathSet::iterator addLabel(
     const StringP& path, const StringL& label, const StringU& uri = "");
 
+  /** Return a file whose entire contents have the given MD5 checksum,
+      or null if none of the files in the cache matches. The lookup
+      is lazy: Files whose checksums are already known (e.g. from the
+      cache file) are indexed without reading them. Of the remaining
+      files, only those of size fileSize are read, and only until a
+      match is found. Returns null ptr if error and you don't throw
+      it in your JigdoCache error handler. */
+  FilePart* findMD5(const MD5& md, uint64 fileSize);
+  /** Like findMD5(), for the SHA256 checksum of the file */
+  FilePart* findSHA256(const SHA256& sd, uint64 fileSize);
+
   /** Access to the members like for a list<> */
   typedef FilePart value_type;
   typedef FilePart& reference;
@@ -283,8 +393,8 @@ public:
   public:
     iterator() { }
     inline iterator& operator++(); // might throw(RecurseError, bad_alloc)
-    FilePart& operator*() { return *part; }
-    FilePart* operator->() { return &*part; }
+    FilePart& operator*() { return cache->files[part]; }
+    FilePart* operator->() { return &cache->files[part]; }
     // Won't compare cache members - their being different is usu. a bug
     bool operator==(const iterator& i) const {
       Paranoid(cache == i.cache);
@@ -293,17 +403,16 @@ public:
     bool operator!=(const iterator& i) const { return !(*this == i); }
     // Default dtor
   private:
-    iterator(JigdoCache* c, const list<FilePart>::iterator& p)
-      : cache(c), part(p) { }
+    iterator(JigdoCache* c, size_t p) : cache(c), part(p) { }
     JigdoCache* cache;
-    list<FilePart>::iterator part;
+    size_t part; // Index in cache->files
   };
   friend class JigdoCache::iterator;
   /** First element of the JigdoCache */
   inline iterator begin();
   /** NB the list auto-extends, so the value of end() may change while
       you iterate over a JigdoCache. */
-  iterator end() { return iterator(this, files.end()); }
+  iterator end() { return iterator(this, files.size()); }
   //____________________
 
 private:
@@ -312,15 +421,44 @@ private:
   /// Default reporter: Only prints error messages to stderr
   static ProgressReporter noReport;
 
+  // Add files appended to "files" since the last call to the index
+  void updateIndex();
+  /* Add file to md5Index and/or sha256Index, digests is a set of
+     FilePart::Digests whose checksums are known */
+  inline void addToIndex(FilePart* file, unsigned digests);
+  /* Read the not yet indexed files of the given size, adding them to
+     the index, until one matches md or sd (one of them is null) */
+  FilePart* indexFilesOfSize(uint64 fileSize, const MD5* md,
+                             const SHA256* sd);
+
+# if HAVE_CACHEFILE
+  /* Look up the files appended to "files" since the last call in the
+     cache file, all in one pass over it. Does nothing if there are
+     fewer than BULK_LOOKUP files; they are looked up one by one by
+     FilePart::getChecksumsCached() instead. */
+  void readCacheFile();
+  // Queue file for writeCacheFile(), call it if it is time to
+  void writeCacheFileLater(FilePart* file);
+  // Write the TO_BE_WRITTEN ones of parts to the cache file, sorted
+  void writeCacheFile(vector<FilePart*>& parts);
+  struct BulkLookup;
+  static const size_t BULK_LOOKUP = 1000;
+  static const size_t WRITE_BATCH = 4096; // Write after this many files
+  static const time_t WRITE_INTERVAL = 10; // or after this many seconds
+# endif
+
   size_t blockLength, csumBlockLength;
+  unsigned digests; // See setDigests()
 
   /* Check if files exist in the filesystem */
   bool checkFiles;
 
   /* List of files in the cache (not vector<> because jigdo-file keeps
      ptrs, and if a vector realloc()s, all elements' addresses may
-     change) */
-  list<FilePart> files;
+     change; deque<> only allocates large chunks) */
+  deque<FilePart> files;
+  // The FileParts' directory names and leafnames
+  StringPool names;
   // Equal to files.size() less any files that are deleted()
   size_t nrOfFiles;
   // Temporarily used during readFilenames()
@@ -332,10 +470,38 @@ private:
   size_t readAmount;
   vector<Ubyte> buffer;
   ProgressReporter& reporter;
-
-# if HAVE_LIBDB
+  unsigned threadCount;
+
+  /* Index of checksum of whole file => FilePart, built lazily by
+     findMD5()/findSHA256(). The checksums are uniformly distributed,
+     so their first bytes make a good enough hash value. If several
+     files have the same contents, all of them are indexed, so another
+     one can be used if the first turns out to be unreadable. */
+  struct ChecksumHash {
+    size_t operator()(const MD5& x) const { return hash(x.sum); }
+    size_t operator()(const SHA256& x) const { return hash(x.sum); }
+    static size_t hash(const Ubyte* sum) {
+      size_t h; memcpy(&h, sum, sizeof(h)); return h;
+    }
+  };
+  typedef unordered_multimap<MD5, FilePart*, ChecksumHash> MD5Index;
+  typedef unordered_multimap<SHA256, FilePart*, ChecksumHash> SHA256Index;
+  MD5Index md5Index;
+  SHA256Index sha256Index;
+  /* Files whose MD5/SHA256 checksums are not yet known, by file
+     size. A file is in both if neither is known. */
+  typedef map<uint64, vector<FilePart*> > UnindexedMap;
+  UnindexedMap md5Unindexed, sha256Unindexed;
+  // Number of entries at the start of "files" seen by updateIndex()
+  size_t indexedFiles;
+
+# if HAVE_CACHEFILE
   CacheFile* cacheFile;
   size_t cacheExpiry;
+  // Number of entries at the start of "files" seen by readCacheFile()
+  size_t lookedUpFiles;
+  vector<FilePart*> toWrite; // For writeCacheFileLater()
+  time_t lastWrite;
 # endif
 };
 //______________________________________________________________________
@@ -367,21 +533,73 @@ public:
 };
 //______________________________________________________________________
 
-FilePart::FilePart(LocationPathSet::iterator p, string rest, uint64 fSize,
-                   time_t fMtime)
-  : path(p), pathRest(rest), fileSize(fSize), fileMtime(fMtime),
-    rsyncSum(), MD5sums(), md5Sum(), flags(EMPTY) {
-  //pathRest.reserve(0);
-}
+/** Iterate over the files of a JigdoCache like JigdoCache::iterator,
+    but have JigdoCache::getThreads() worker threads read the files and
+    calculate their checksums ahead of the iteration. Each FilePart is
+    returned once its checksums are available, in the same order as
+    with JigdoCache::iterator. Files which cannot be read are skipped
+    after the error has been passed to the JigdoCache's reporter.
+
+    Only the cache file lookups and the error handling are done by the
+    thread calling next(), so access to the cache file and the
+    reporter stay serialized. */
+class JigdoCache::ReadAhead : NoCopy {
+public:
+  /** @param wholeFile If true, calculate checksums of the whole file
+      like FilePart::getMD5Sum(), else only those of the first block
+      like FilePart::getRsyncSum(). Only the JigdoCache's digest
+      families (see setDigests()) are calculated. */
+  ReadAhead(JigdoCache* c, bool wholeFile);
+  /** Waits for any files still being read */
+  ~ReadAhead();
+  /** Return next file, or null after the last one */
+  FilePart* next();
+
+private:
+  struct Job {
+    Job(FilePart* f, bool r, size_t b, unsigned c)
+      : file(f), read(r), done(!r), ok(true), blockNr(b), calc(c) { }
+    FilePart* file;
+    bool read; // File is read by a worker, else checksums already known
+    bool done; // Protected by lock
+    bool ok;
+    size_t blockNr; // Arguments for getChecksumsCalc()
+    unsigned calc;
+    string error;
+  };
+  // Worker thread: Calculate checksums for job
+  void calc(Job* job);
+  // Submit jobs until the window is full or all files are submitted
+  void fill();
+
+  JigdoCache* cache;
+  bool wholeFile;
+  JigdoCache::iterator pos; // Next file to submit
+  size_t window; // Max. nr of files being read ahead
+  deque<Job> jobs; // Submitted but not yet returned by next()
+  vector<vector<Ubyte>*> buffers; // Read buffers not in use by a worker
+  Mutex lock;
+  Condition jobDone;
+  ThreadPool pool; // Must come last: Its dtor waits for all jobs
+};
+//______________________________________________________________________
+
+FilePart::FilePart(LocationPathSet::iterator p, const string* dir,
+                   const char* l, uint64 fSize, time_t fMtime)
+  : path(p), dirName(dir), leaf(l), fileSize(fSize), fileMtime(fMtime),
+    rsyncSum(), sums(0), sumBlocks(0), digests(0), wholeDigests(0),
+    md5Sum(), sha256Sum(), flags(EMPTY) { }
 
 const string& FilePart::getPath() const {
   Paranoid(!deleted());
   return path->getPath();
 }
 
-const string& FilePart::leafName() const {
+string FilePart::leafName() const {
   Paranoid(!deleted());
-  return pathRest;
+  string result(*dirName);
+  result += leaf;
+  return result;
 }
 
 uint64 FilePart::size() const {
@@ -396,15 +614,15 @@ time_t FilePart::mtime() const {
 
 const MD5* FilePart::getMD5Sums(JigdoCache* c, size_t blockNr) {
   Paranoid(!deleted());
-  if ( ((blockNr > 0) || MD5sums.empty()) && !mdValid() )
-    if (!getChecksumsRead(c, blockNr))
+  if (!hasDigests(blockNr, MD5_DIGEST))
+    if (!getChecksumsRead(c, blockNr, MD5_DIGEST))
       return 0;
-  return &MD5sums[blockNr];
+  return &MD5sums()[blockNr];
 }
 
 const MD5Sum* FilePart::getMD5Sum(JigdoCache* c) {
   Paranoid(!deleted());
-  if (mdValid())
+  if ((wholeDigests & MD5_DIGEST) != 0)
     return &md5Sum;
   else
     return getMD5SumRead(c);
@@ -412,22 +630,22 @@ const MD5Sum* FilePart::getMD5Sum(JigdoCache* c) {
 
 const SHA256* FilePart::getSHA256Sums(JigdoCache* c, size_t blockNr) {
   Paranoid(!deleted());
-  if ( ((blockNr > 0) || SHA256sums.empty()) && !mdValid() )
-    if (!getChecksumsRead(c, blockNr))
+  if (!hasDigests(blockNr, SHA256_DIGEST))
+    if (!getChecksumsRead(c, blockNr, SHA256_DIGEST))
       return 0;
-  return &SHA256sums[blockNr];
+  return &SHA256sums()[blockNr];
 }
 
 const SHA256Sum* FilePart::getSHA256Sum(JigdoCache* c) {
   Paranoid(!deleted());
-  if (mdValid()) return &sha256Sum;
+  if ((wholeDigests & SHA256_DIGEST) != 0) return &sha256Sum;
   else return getSHA256SumRead(c);
 }
 
 const RsyncSum64* FilePart::getRsyncSum(JigdoCache* c) {
   Paranoid(!deleted());
   if (!rsyncValid()) {
-    if (! getChecksumsRead(c, 0))
+    if (! getChecksumsRead(c, 0, 0))
       return 0;
   }
   Paranoid(rsyncValid());
@@ -436,8 +654,7 @@ const RsyncSum64* FilePart::getRsyncSum(JigdoCache* c) {
 
 void FilePart::markAsDeleted(JigdoCache* c) {
   fileSize = 0;
-  MD5sums.resize(0);
-  SHA256sums.resize(0);
+  allocSums(0, 0);
   --(c->nrOfFiles);
 }
 
@@ -452,6 +669,13 @@ void FilePart::clearFlag(Flags f) {
 }
 //________________________________________
 
+void JigdoCache::addToIndex(FilePart* file, unsigned digests) {
+  if ((digests & FilePart::MD5_DIGEST) != 0)
+    md5Index.insert(make_pair(MD5(file->md5Sum), file));
+  if ((digests & FilePart::SHA256_DIGEST) != 0)
+    sha256Index.insert(make_pair(SHA256(file->sha256Sum), file));
+}
+
 void JigdoCache::setReadAmount(size_t bytes) {
   if (bytes < 64*1024) bytes = 64*1024;
   readAmount = bytes;
@@ -460,11 +684,12 @@ void JigdoCache::setReadAmount(size_t bytes) {
 template <class RecurseDir>
 void JigdoCache::readFilenames(RecurseDir& rd) {
   string name;
+  rd.setThreads(threadCount);
   while (true) {
     bool status = rd.getName(name, &fileInfo, checkFiles); // Might throw error
     if (status == FAILURE) return; // No more names
     off_t stSize = fileInfo.st_size;
-#   if HAVE_LIBDB
+#   if HAVE_CACHEFILE
     if (!checkFiles) {
       const Ubyte* data;
       size_t dataSize;
@@ -484,14 +709,14 @@ void JigdoCache::readFilenames(RecurseDir& rd) {
 }
 
 JigdoCache::iterator JigdoCache::begin() {
-  list<FilePart>::iterator i = files.begin();
-  while (i != files.end() && i->deleted()) ++i;
+  size_t i = 0;
+  while (i < files.size() && files[i].deleted()) ++i;
   return iterator(this, i);
 }
 
 JigdoCache::iterator& JigdoCache::iterator::operator++() {
-  list<FilePart>::iterator end = cache->files.end();
-  do ++part; while (part != end && part->deleted());
+  size_t end = cache->files.size();
+  do ++part; while (part < end && cache->files[part].deleted());
   return *this;
 }
 //______________________________________________________________________
@@ -201,7 +201,7 @@ inline Iterator serialize8(NumType x, Iterator i) {
   *i = (x >> 32) & 0xff; ++i;
   *i = (x >> 40) & 0xff; ++i;
   *i = (x >> 48) & 0xff; ++i;
-  *i = (x >> 56) & 0xff; ++i;
+  *i = static_cast<Ubyte>(x >> 56); ++i;
   return i;
 }
 template<class NumType, class ConstIterator>
@@ -80,6 +80,7 @@ public:
   inline int put(int c) { return putc(c, f); }
   bostream& seekp(off_t off, ios::seekdir dir = ios::beg);
   inline bostream& write(const char* p, streamsize n);
+  bostream& flush() { fflush(f); return *this; }
   bostream(FILE* stream) : bios(stream) { }
 protected:
   bostream() { }
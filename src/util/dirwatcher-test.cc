@@ -0,0 +1,117 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Notification about changes to files below a set of directories
+
+  #test-deps util/dirwatcher.o
+
+*/
+
+#include <config.h>
+
+#include <dirwatcher.hh>
+#if HAVE_DIRWATCHER
+
+#include <fstream>
+#include <set>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd-jigdo.h>
+
+#include <debug.hh>
+#include <log.hh>
+//______________________________________________________________________
+
+namespace {
+
+  const char* const dirName = "dirwatcher-test.tmp";
+
+  struct Record : DirWatcher::Handler {
+    Record() : changed(), removed(), dirsAdded(), dirsRemoved() { }
+    void fileChanged(const string& path) { changed.insert(path); }
+    void fileRemoved(const string& path) { removed.insert(path); }
+    void dirAdded(const string& path) { dirsAdded.insert(path); }
+    void dirRemoved(const string& path) { dirsRemoved.insert(path); }
+    void overflow() { Assert(false); }
+    void clear() {
+      changed.clear(); removed.clear();
+      dirsAdded.clear(); dirsRemoved.clear();
+    }
+    set<string> changed, removed, dirsAdded, dirsRemoved;
+  };
+
+  void writeFile(const string& name) {
+    ofstream f(name.c_str());
+    f << "x";
+  }
+
+  void removeFiles() {
+    string d = dirName;
+    remove((d + "/b/c/y").c_str());
+    remove((d + "/b/c").c_str());
+    remove((d + "/b/x").c_str());
+    remove((d + "/b").c_str());
+    remove((d + "/a").c_str());
+    remove(dirName);
+  }
+
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+  removeFiles();
+  string d = dirName;
+  mkdir(dirName, 0755);
+
+  DirWatcher w;
+  w.watch(d);
+  Assert(w.size() == 1);
+  Record r;
+  w.readEvents(r); // Nothing happened yet
+  Assert(r.changed.empty() && r.dirsAdded.empty());
+
+  writeFile(d + "/a");
+  mkdir((d + "/b").c_str(), 0755);
+  w.readEvents(r);
+  Assert(r.changed.size() == 1 && r.changed.count(d + "/a") == 1);
+  Assert(r.dirsAdded.size() == 1 && r.dirsAdded.count(d + "/b") == 1);
+  Assert(w.size() == 2);
+
+  // The new subdirectory is watched, and directories created in it
+  r.clear();
+  writeFile(d + "/b/x");
+  mkdir((d + "/b/c").c_str(), 0755);
+  w.readEvents(r);
+  Assert(r.changed.count(d + "/b/x") == 1);
+  Assert(r.dirsAdded.count(d + "/b/c") == 1);
+  Assert(w.size() == 3);
+  r.clear();
+  writeFile(d + "/b/c/y");
+  remove((d + "/a").c_str());
+  w.readEvents(r);
+  Assert(r.changed.size() == 1 && r.changed.count(d + "/b/c/y") == 1);
+  Assert(r.removed.size() == 1 && r.removed.count(d + "/a") == 1);
+
+  // Removing a directory stops watching it
+  r.clear();
+  remove((d + "/b/c/y").c_str());
+  remove((d + "/b/c").c_str());
+  w.readEvents(r);
+  Assert(r.removed.count(d + "/b/c/y") == 1);
+  Assert(r.dirsRemoved.size() == 1 && r.dirsRemoved.count(d + "/b/c") == 1);
+  Assert(w.size() == 2);
+
+  removeFiles();
+  return 0;
+}
+
+#else
+
+int main() { return 0; }
+
+#endif
@@ -0,0 +1,153 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Notification about changes to files below a set of directories
+
+*/
+
+#include <config.h>
+
+#include <dirwatcher.hh>
+#if HAVE_DIRWATCHER
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd-jigdo.h>
+
+#include <log.hh>
+#include <string.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("dirwatcher")
+
+namespace {
+
+  const uint32_t WATCH_MASK = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE
+    | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR
+    | IN_DONT_FOLLOW;
+  const size_t READ_SIZE = 64 * 1024;
+
+  DirWatchError watchError(const string& dir) {
+    return DirWatchError(subst(_("Cannot watch `%L1': %L2"), dir,
+                               strerror(errno)));
+  }
+
+  // dir + "/" + name, without doubling the "/"
+  string subPath(const string& dir, const char* name) {
+    string result = dir;
+    if (!result.empty() && result[result.size() - 1] != DIRSEP)
+      result += DIRSEP;
+    result += name;
+    return result;
+  }
+
+}
+//______________________________________________________________________
+
+DirWatcher::DirWatcher() : inotifyFd(-1), watches(), buf() {
+  inotifyFd = inotify_init();
+  if (inotifyFd == -1) throw watchError("inotify");
+  fcntl(inotifyFd, F_SETFL, fcntl(inotifyFd, F_GETFL) | O_NONBLOCK);
+}
+
+DirWatcher::~DirWatcher() {
+  close(inotifyFd);
+}
+
+void DirWatcher::watch(const string& dir) {
+  addWatch(dir, true);
+  debug("Watching %1 directories", watches.size());
+}
+
+void DirWatcher::addWatch(const string& dir, bool required) {
+  int wd = inotify_add_watch(inotifyFd, dir.c_str(), WATCH_MASK);
+  if (wd == -1) {
+    // A new subdirectory may already be gone again
+    if (!required && (errno == ENOENT || errno == ENOTDIR)) return;
+    throw watchError(dir);
+  }
+  watches[wd] = dir;
+
+  // Watch subdirectories, but do not follow symlinks
+  DIR* d = opendir(dir.c_str());
+  if (d == 0) return;
+  try {
+    while (struct dirent* e = readdir(d)) {
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+        continue;
+      string sub = subPath(dir, e->d_name);
+      struct stat fileInfo;
+      if (lstat(sub.c_str(), &fileInfo) == 0 && S_ISDIR(fileInfo.st_mode))
+        addWatch(sub, false);
+    }
+  } catch (...) {
+    closedir(d);
+    throw;
+  }
+  closedir(d);
+}
+//______________________________________________________________________
+
+void DirWatcher::readEvents(Handler& h) {
+  char data[READ_SIZE];
+  ssize_t n;
+  while ((n = read(inotifyFd, data, READ_SIZE)) > 0)
+    buf.append(data, n);
+
+  size_t pos = 0; // Events before this have been passed to h
+  try {
+    while (buf.size() - pos >= sizeof(struct inotify_event)) {
+      struct inotify_event ev;
+      memcpy(&ev, buf.data() + pos, sizeof(ev));
+      size_t evSize = sizeof(ev) + ev.len;
+      if (buf.size() - pos < evSize) break; // Not possible with inotify
+      // ev.name is null-terminated, maybe followed by more padding nulls
+      const char* evName = buf.data() + pos + sizeof(ev);
+      string name(evName, strnlen(evName, ev.len));
+      pos += evSize;
+      readEvent(h, ev, name);
+    }
+  } catch (...) {
+    buf.erase(0, pos);
+    throw;
+  }
+  buf.erase(0, pos);
+}
+
+void DirWatcher::readEvent(Handler& h, const struct inotify_event& ev,
+                           const string& name) {
+  if (ev.mask & IN_Q_OVERFLOW) {
+    h.overflow();
+    return;
+  }
+  Watches::iterator w = watches.find(ev.wd);
+  if (w == watches.end()) return;
+  if (ev.mask & IN_IGNORED) { // Directory gone or moved away
+    watches.erase(w);
+    return;
+  }
+  if (ev.len == 0) return; // Event for the directory itself
+  string path = subPath(w->second, name.c_str());
+
+  if ((ev.mask & IN_ISDIR) == 0) {
+    if (ev.mask & (IN_DELETE | IN_MOVED_FROM))
+      h.fileRemoved(path);
+    else
+      h.fileChanged(path);
+  } else if (ev.mask & (IN_CREATE | IN_MOVED_TO)) {
+    h.dirAdded(path);
+    addWatch(path, false);
+  } else if (ev.mask & (IN_DELETE | IN_MOVED_FROM)) {
+    h.dirRemoved(path);
+  }
+}
+
+#endif /* HAVE_DIRWATCHER */
@@ -0,0 +1,95 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Notification about changes to files below a set of directories
+
+  Uses inotify, so HAVE_DIRWATCHER is only 1 on Linux. Subdirectories
+  are watched too, including ones created later, but symlinks to
+  directories are not followed. The paths passed to the Handler are
+  the watched directory's name as given to watch(), followed by the
+  names of the subdirectories and the file, so any "//" in the
+  directory name is preserved.
+
+*/
+
+#ifndef DIRWATCHER_HH
+#define DIRWATCHER_HH
+
+#include <config.h>
+
+#define HAVE_DIRWATCHER HAVE_SYS_INOTIFY_H
+
+#if HAVE_DIRWATCHER
+
+#include <map>
+#include <string>
+#include <sys/inotify.h>
+
+#include <debug.hh>
+#include <nocopy.hh>
+//______________________________________________________________________
+
+/** Errors which occur while setting up a watch */
+struct DirWatchError : Error {
+  explicit DirWatchError(const string& m) : Error(m) { }
+};
+
+/** Watch directories for changes to the files in them. Events are only
+    read and passed to a Handler by readEvents(), e.g. after poll() on
+    fd() has returned. */
+class DirWatcher : NoCopy {
+public:
+  /** Receives the events read by readEvents() */
+  class Handler {
+  public:
+    virtual ~Handler() { }
+    /** A file was created, written to, moved into a watched directory,
+        or its attributes changed. Several calls for one file are
+        likely, e.g. while it is being written. */
+    virtual void fileChanged(const string& path) = 0;
+    /** A file was deleted or moved away */
+    virtual void fileRemoved(const string& path) = 0;
+    /** A directory was created or moved into a watched directory. It
+        may already contain files. Unless readEvents() throws, it and
+        its subdirectories are watched after the call. */
+    virtual void dirAdded(const string& path) = 0;
+    /** A directory was deleted or moved away */
+    virtual void dirRemoved(const string& path) = 0;
+    /** Too many events happened, some were lost */
+    virtual void overflow() = 0;
+  };
+
+  /** Throws DirWatchError if inotify is not available */
+  DirWatcher();
+  ~DirWatcher();
+
+  /** Watch dir and all directories below it. Throws DirWatchError if
+      dir or one of its subdirectories cannot be watched. */
+  void watch(const string& dir);
+  /** Number of watched directories */
+  size_t size() const { return watches.size(); }
+
+  /** File descriptor which becomes readable when events are pending */
+  int fd() const { return inotifyFd; }
+  /** Pass all pending events to h, return without waiting if there
+      are none. Throws DirWatchError if a new directory cannot be
+      watched; the remaining events are returned by the next call. */
+  void readEvents(Handler& h);
+
+private:
+  void addWatch(const string& dir, bool required);
+  void readEvent(Handler& h, const struct inotify_event& ev,
+                 const string& name);
+  int inotifyFd;
+  typedef map<int, string> Watches;
+  Watches watches; // Directory name, by watch descriptor
+  string buf; // Events read, but not yet passed to a Handler
+};
+
+#endif /* HAVE_DIRWATCHER */
+#endif
@@ -215,8 +215,10 @@ SHA256Sum::sha256_process_bytes (const void *buffer, size_t len, struct sha256_c
 
 /* Process LEN bytes of BUFFER, accumulating context into CTX.
    It is assumed that LEN % 64 == 0.  */
+/* jigdo: sha256_process_block() in sha256sum.cc calls this unless the
+   CPU has the SHA extensions. */
 void
-SHA256Sum::sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+SHA256Sum::sha256_process_block_portable (const void *buffer, size_t len, struct sha256_ctx *ctx)
 {
   const uint32_t *words = (uint32 *)buffer;
   size_t nwords = len / sizeof (uint32_t);
@@ -0,0 +1,83 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Read-only memory mapping of a whole file
+
+*/
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd-jigdo.h>
+#if HAVE_MMAP
+#  include <sys/mman.h>
+#endif
+
+#include <debug.hh>
+#include <log.hh>
+#include <mappedfile.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("mappedfile")
+
+#if HAVE_MMAP
+
+bool MappedFile::open(const string& name) {
+  close();
+  if (name == "-") return false;
+  int fd = ::open(name.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  struct stat fileInfo;
+  void* m = MAP_FAILED;
+  if (fstat(fd, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode)
+      && fileInfo.st_size > 0
+      && (uint64)fileInfo.st_size <= (uint64)(size_t)-1) {
+    m = mmap(0, (size_t)fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd); // The mapping stays valid
+  if (m == MAP_FAILED) {
+    debug("Not mapping `%1'", name);
+    return false;
+  }
+  mapData = static_cast<Ubyte*>(m);
+  mapSize = fileInfo.st_size;
+# if HAVE_MADVISE
+  madvise(mapData, (size_t)mapSize, MADV_SEQUENTIAL);
+# endif
+  debug("Mapped `%1', %2 bytes", name, mapSize);
+  return true;
+}
+
+void MappedFile::close() {
+  if (mapData == 0) return;
+  munmap(mapData, (size_t)mapSize);
+  mapData = 0;
+  mapSize = 0;
+}
+
+void MappedFile::willNeed(uint64 off, uint64 len) const {
+# if HAVE_MADVISE
+  if (off >= mapSize) return;
+  if (len > mapSize - off) len = mapSize - off;
+  // madvise() needs a page-aligned start address
+  static const uint64 pageMask = (uint64)sysconf(_SC_PAGESIZE) - 1;
+  uint64 start = off & ~pageMask;
+  madvise(mapData + start, (size_t)(off + len - start), MADV_WILLNEED);
+# else
+  (void)off; (void)len;
+# endif
+}
+//______________________________________________________________________
+
+#else // !HAVE_MMAP
+
+bool MappedFile::open(const string&) { return false; }
+void MappedFile::close() { }
+void MappedFile::willNeed(uint64, uint64) const { }
+
+#endif
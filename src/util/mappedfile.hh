@@ -0,0 +1,57 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Read-only memory mapping of a whole file
+
+  Used for large inputs like the image of make-template and verify: The
+  checksums can be calculated directly over the mapped pages instead of
+  first copying the data into a buffer. Mapping is only an optimization,
+  so open() simply fails if it is not possible (no mmap(), stdin, not a
+  regular file, too large for the address space) and the caller falls
+  back to reading the file with a stream.
+
+*/
+
+#ifndef MAPPEDFILE_HH
+#define MAPPEDFILE_HH
+
+#include <config.h>
+
+#include <string>
+
+#include <nocopy.hh>
+//______________________________________________________________________
+
+class MappedFile : NoCopy {
+public:
+  MappedFile() : mapData(0), mapSize(0) { }
+  ~MappedFile() { close(); }
+
+  /** Map the named file. The kernel is told that the mapping will be
+      read sequentially.
+      @return false if the file could not be mapped, in which case the
+      object stays closed */
+  bool open(const string& name);
+  void close();
+  bool is_open() const { return mapData != 0; }
+
+  /** Start of mapped data, null if not open */
+  const Ubyte* data() const { return mapData; }
+  /** Size of file, 0 if not open */
+  uint64 size() const { return mapSize; }
+
+  /** Hint that the given range will be accessed soon, so the kernel
+      starts reading it in. Does nothing if madvise() is unavailable. */
+  void willNeed(uint64 off, uint64 len) const;
+
+private:
+  Ubyte* mapData;
+  uint64 mapSize;
+};
+
+#endif
@@ -12,20 +12,28 @@
 
   Quite secure 128-bit checksum
 
+  With arguments "--bench N", compare the speed of blockSums() with SIMD
+  and with the portable code for N MB of data.
+
   #test-deps util/glibc-md5.o util/md5sum.o
 
 */
 
 #include <config.h>
 
+#include <string.h>
+
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <bstream.hh>
 #include <log.hh>
 #include <md5sum.hh>
 #include <mimestream.hh>
+#include <simdkernels.hh>
 //______________________________________________________________________
 
 namespace {
@@ -101,8 +109,74 @@ void printBlockSums(size_t blockSize, const char* fileName) {
   }
   exit(0);
 }
+//______________________________________________________________________
+
+const char* const simdNames[] = { "none", "avx2", 0 };
+
+/* With all implementations, blockSums() must calculate the same as one
+   MD5Sum per block. The block lengths cover all cases for the padding
+   of the last 64-byte chunk. */
+void checkSimd() {
+  const size_t blockLens[] = { 1, 40, 55, 56, 63, 64, 65, 119, 120,
+                               1000, 64 * 9 + 55, 0 };
+  vector<Ubyte> data(20 * 1000);
+  SimdKernels::fill(&data[0], data.size());
+  MD5Sum md;
+  MD5 sums[20];
+  for (const char* const* name = simdNames; *name != 0; ++name) {
+    if (!MD5Sum::setSimd(*name)) continue; // Not supported by CPU
+    for (const size_t* blockLen = blockLens; *blockLen != 0; ++blockLen) {
+      for (size_t len = 0; len <= 18 * *blockLen; len += *blockLen / 2 + 1) {
+        MD5Sum::blockSums(&data[0], len, *blockLen, sums);
+        for (size_t i = 0; i * *blockLen < len; ++i) {
+          size_t off = i * *blockLen;
+          md.reset().update(&data[off], min(*blockLen, len - off))
+            .finishForReuse();
+          if (sums[i] == md) continue;
+          msg("ERROR: %1 blockSums(%2, %3) #%4: Expected %5, got %6",
+              *name, len, *blockLen, i, md.toString(), sums[i].toString());
+          returnCode = 1;
+        }
+      }
+    }
+  }
+  MD5Sum::setSimd(0);
+}
+
+void bench(size_t megabytes) {
+  const size_t BLOCK_LENGTH = 128*1024 - 9; // jigdo-file's csumBlockLength
+  vector<Ubyte> data(megabytes << 20);
+  SimdKernels::fill(&data[0], data.size());
+  vector<MD5> sums(data.size() / BLOCK_LENGTH + 1);
+  double mb = (double)megabytes;
+  cout << "Default: " << MD5Sum::simdName() << endl;
+  // One MD5Sum for all data, for comparison
+  double time = 1e9;
+  for (int i = 0; i < 3; ++i) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    MD5Sum md;
+    md.update(&data[0], data.size()).finish();
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    time = min(time, t.count());
+  }
+  cout << "update:\t" << mb / time << " MB/s" << endl;
+  for (const char* const* name = simdNames; *name != 0; ++name) {
+    if (!MD5Sum::setSimd(*name)) continue;
+    time = 1e9; // Best of 3 runs
+    for (int i = 0; i < 3; ++i) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      MD5Sum::blockSums(&data[0], data.size(), BLOCK_LENGTH, &sums[0]);
+      chrono::duration<double> t = chrono::steady_clock::now() - start;
+      time = min(time, t.count());
+    }
+    cout << *name << ":\tblockSums " << mb / time << " MB/s" << endl;
+  }
+  exit(0);
+}
 
 int main(int argc, char* argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--bench") == 0)
+    bench(atoi(argv[2]));
   if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
   if (argc == 3) {
     // 2 cmdline args, blocksize and filename. Print RsyncSums of all blocks
@@ -144,5 +218,7 @@ int main(int argc, char* argv[]) {
   sum = all.finish().digest();
   compare(sAll, sum);
 
+  checkSimd();
+
   return returnCode;
 }
@@ -18,12 +18,22 @@
 
 #include <config.h>
 
+#include <string.h>
+#if HAVE_X86_SIMD
+#  include <immintrin.h>
+#endif
+
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
 #include <glibc-md5.hh>
 #include <md5sum.hh>
 #include <md5sum.ih>
+#include <simdkernels.hh>
+#if HAVE_X86_SIMD
+#  include <simdlanes.hh>
+#endif
 //______________________________________________________________________
 
 void MD5Sum::ProgressReporter::error(const string& message) {
@@ -129,3 +139,202 @@ uint64 MD5Sum::updateFromStream(bistream& s, uint64 size, size_t bufSize,
   }
   return bytesRead;
 }
+//______________________________________________________________________
+
+namespace {
+
+# if HAVE_X86_SIMD
+  using SimdLanes::LANES;
+  using SimdLanes::rotl;
+
+  /* Process one 64-byte chunk at p[i] + off for each of the 8 lanes, with
+     the same steps as md5_process_block() in glibc-md5.cc */
+  __attribute__((target("avx2")))
+  void chunkAvx2(__m256i state[4], const Ubyte* const p[LANES],
+                 size_t off) {
+    __m256i X[16];
+    SimdLanes::load8x8(p, off, X);
+    SimdLanes::load8x8(p, off + 32, X + 8);
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    const __m256i ones = _mm256_set1_epi32(-1);
+#   define FF(b, c, d) \
+      _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#   define FG(b, c, d) \
+      _mm256_xor_si256(c, _mm256_and_si256(d, _mm256_xor_si256(b, c)))
+#   define FH(b, c, d) _mm256_xor_si256(b, _mm256_xor_si256(c, d))
+#   define FI(b, c, d) \
+      _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, ones)))
+#   define OP(f, a, b, c, d, k, s, T) \
+      a = _mm256_add_epi32(a, _mm256_add_epi32(f(b, c, d), \
+            _mm256_add_epi32(X[k], _mm256_set1_epi32((int)T)))); \
+      a = _mm256_add_epi32(b, rotl(a, s));
+    // Round 1
+    OP(FF, a, b, c, d,  0,  7, 0xd76aa478)
+    OP(FF, d, a, b, c,  1, 12, 0xe8c7b756)
+    OP(FF, c, d, a, b,  2, 17, 0x242070db)
+    OP(FF, b, c, d, a,  3, 22, 0xc1bdceee)
+    OP(FF, a, b, c, d,  4,  7, 0xf57c0faf)
+    OP(FF, d, a, b, c,  5, 12, 0x4787c62a)
+    OP(FF, c, d, a, b,  6, 17, 0xa8304613)
+    OP(FF, b, c, d, a,  7, 22, 0xfd469501)
+    OP(FF, a, b, c, d,  8,  7, 0x698098d8)
+    OP(FF, d, a, b, c,  9, 12, 0x8b44f7af)
+    OP(FF, c, d, a, b, 10, 17, 0xffff5bb1)
+    OP(FF, b, c, d, a, 11, 22, 0x895cd7be)
+    OP(FF, a, b, c, d, 12,  7, 0x6b901122)
+    OP(FF, d, a, b, c, 13, 12, 0xfd987193)
+    OP(FF, c, d, a, b, 14, 17, 0xa679438e)
+    OP(FF, b, c, d, a, 15, 22, 0x49b40821)
+    // Round 2
+    OP(FG, a, b, c, d,  1,  5, 0xf61e2562)
+    OP(FG, d, a, b, c,  6,  9, 0xc040b340)
+    OP(FG, c, d, a, b, 11, 14, 0x265e5a51)
+    OP(FG, b, c, d, a,  0, 20, 0xe9b6c7aa)
+    OP(FG, a, b, c, d,  5,  5, 0xd62f105d)
+    OP(FG, d, a, b, c, 10,  9, 0x02441453)
+    OP(FG, c, d, a, b, 15, 14, 0xd8a1e681)
+    OP(FG, b, c, d, a,  4, 20, 0xe7d3fbc8)
+    OP(FG, a, b, c, d,  9,  5, 0x21e1cde6)
+    OP(FG, d, a, b, c, 14,  9, 0xc33707d6)
+    OP(FG, c, d, a, b,  3, 14, 0xf4d50d87)
+    OP(FG, b, c, d, a,  8, 20, 0x455a14ed)
+    OP(FG, a, b, c, d, 13,  5, 0xa9e3e905)
+    OP(FG, d, a, b, c,  2,  9, 0xfcefa3f8)
+    OP(FG, c, d, a, b,  7, 14, 0x676f02d9)
+    OP(FG, b, c, d, a, 12, 20, 0x8d2a4c8a)
+    // Round 3
+    OP(FH, a, b, c, d,  5,  4, 0xfffa3942)
+    OP(FH, d, a, b, c,  8, 11, 0x8771f681)
+    OP(FH, c, d, a, b, 11, 16, 0x6d9d6122)
+    OP(FH, b, c, d, a, 14, 23, 0xfde5380c)
+    OP(FH, a, b, c, d,  1,  4, 0xa4beea44)
+    OP(FH, d, a, b, c,  4, 11, 0x4bdecfa9)
+    OP(FH, c, d, a, b,  7, 16, 0xf6bb4b60)
+    OP(FH, b, c, d, a, 10, 23, 0xbebfbc70)
+    OP(FH, a, b, c, d, 13,  4, 0x289b7ec6)
+    OP(FH, d, a, b, c,  0, 11, 0xeaa127fa)
+    OP(FH, c, d, a, b,  3, 16, 0xd4ef3085)
+    OP(FH, b, c, d, a,  6, 23, 0x04881d05)
+    OP(FH, a, b, c, d,  9,  4, 0xd9d4d039)
+    OP(FH, d, a, b, c, 12, 11, 0xe6db99e5)
+    OP(FH, c, d, a, b, 15, 16, 0x1fa27cf8)
+    OP(FH, b, c, d, a,  2, 23, 0xc4ac5665)
+    // Round 4
+    OP(FI, a, b, c, d,  0,  6, 0xf4292244)
+    OP(FI, d, a, b, c,  7, 10, 0x432aff97)
+    OP(FI, c, d, a, b, 14, 15, 0xab9423a7)
+    OP(FI, b, c, d, a,  5, 21, 0xfc93a039)
+    OP(FI, a, b, c, d, 12,  6, 0x655b59c3)
+    OP(FI, d, a, b, c,  3, 10, 0x8f0ccc92)
+    OP(FI, c, d, a, b, 10, 15, 0xffeff47d)
+    OP(FI, b, c, d, a,  1, 21, 0x85845dd1)
+    OP(FI, a, b, c, d,  8,  6, 0x6fa87e4f)
+    OP(FI, d, a, b, c, 15, 10, 0xfe2ce6e0)
+    OP(FI, c, d, a, b,  6, 15, 0xa3014314)
+    OP(FI, b, c, d, a, 13, 21, 0x4e0811a1)
+    OP(FI, a, b, c, d,  4,  6, 0xf7537e82)
+    OP(FI, d, a, b, c, 11, 10, 0xbd3af235)
+    OP(FI, c, d, a, b,  2, 15, 0x2ad7d2bb)
+    OP(FI, b, c, d, a,  9, 21, 0xeb86d391)
+#   undef OP
+#   undef FF
+#   undef FG
+#   undef FH
+#   undef FI
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+  }
+
+  // Checksums of the 8 messages of len bytes at p[0..7]
+  __attribute__((target("avx2")))
+  void lanesAvx2(const Ubyte* const p[LANES], size_t len,
+                 MD5* const sums[LANES]) {
+    __m256i state[4] = {
+      _mm256_set1_epi32(0x67452301), _mm256_set1_epi32((int)0xefcdab89),
+      _mm256_set1_epi32((int)0x98badcfe), _mm256_set1_epi32(0x10325476)
+    };
+    size_t full = len & ~(size_t)63;
+    for (size_t off = 0; off < full; off += 64) chunkAvx2(state, p, off);
+
+    Ubyte tails[LANES][128];
+    const Ubyte* tailp[LANES];
+    size_t padded = 0;
+    for (int i = 0; i < LANES; ++i) {
+      padded = SimdLanes::pad(tails[i], p[i], len, false);
+      tailp[i] = tails[i];
+    }
+    for (size_t off = 0; off < padded; off += 64) chunkAvx2(state, tailp, off);
+
+    uint32 words[4][LANES];
+    for (int j = 0; j < 4; ++j)
+      _mm256_storeu_si256((__m256i*)words[j], state[j]);
+    for (int i = 0; i < LANES; ++i) {
+      Ubyte digest[16];
+      for (int j = 0; j < 4; ++j) {
+        uint32 x = words[j][i];
+        digest[4 * j] = static_cast<Ubyte>(x);
+        digest[4 * j + 1] = static_cast<Ubyte>(x >> 8);
+        digest[4 * j + 2] = static_cast<Ubyte>(x >> 16);
+        digest[4 * j + 3] = static_cast<Ubyte>(x >> 24);
+      }
+      sums[i]->unserialize(digest);
+    }
+  }
+# endif // HAVE_X86_SIMD
+  //________________________________________
+
+  struct Kernels {
+    const char* name;
+    bool lanes; // Use lanesAvx2() for blockSums()
+  };
+
+  // In order of preference
+  const Kernels allKernels[] = {
+    { "none", false },
+#   if HAVE_X86_SIMD
+    { "avx2", true },
+#   endif
+    { 0, false }
+  };
+
+  SimdKernels::Selection<Kernels> kernels = { allKernels, 0, 0 };
+
+} // namespace
+//________________________________________
+
+void MD5Sum::blockSums(const Ubyte* mem, size_t len, size_t blockLen,
+                       MD5* sums) {
+  size_t n = (len + blockLen - 1) / blockLen;
+  size_t full = len / blockLen;
+  size_t i = 0;
+# if HAVE_X86_SIMD
+  /* Process 8 blocks at a time. For fewer than 8 blocks, the remaining
+     lanes just repeat the last block; from 2 blocks on, this is still
+     faster than the portable code. */
+  if (kernels.get().lanes) {
+    while (i + 1 < full) {
+      const Ubyte* p[LANES];
+      MD5* out[LANES];
+      for (int l = 0; l < LANES; ++l) {
+        size_t b = min(i + l, full - 1);
+        p[l] = mem + b * blockLen;
+        out[l] = &sums[b];
+      }
+      lanesAvx2(p, blockLen, out);
+      i = min(i + LANES, full);
+    }
+  }
+# endif
+  MD5Sum md;
+  for (; i < n; ++i) {
+    size_t off = i * blockLen;
+    md.reset().update(mem + off, min(blockLen, len - off)).finishForReuse();
+    sums[i] = md;
+  }
+}
+
+const char* MD5Sum::simdName() { return kernels.get().name; }
+
+bool MD5Sum::setSimd(const char* name) { return kernels.set(name); }
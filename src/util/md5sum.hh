@@ -146,6 +146,24 @@ public:
   uint64 updateFromStream(bistream& s, uint64 size,
       size_t bufSize = 128*1024, ProgressReporter& pr = noReport);
 
+  /** Calculate the checksums of consecutive blocks of blockLen bytes,
+      and store them in sums[0], sums[1] etc. The last block is shorter
+      if len is not a multiple of blockLen. Gives the same results as
+      one MD5Sum per block, but on CPUs with SIMD instructions, several
+      blocks are processed at once, which is several times faster.
+      @param mem Data of all blocks, len bytes
+      @param sums Receives (len + blockLen - 1) / blockLen checksums */
+  static void blockSums(const Ubyte* mem, size_t len, size_t blockLen,
+                        MD5* sums);
+  /** Name of the implementation used by blockSums(): "avx2" or "none"
+      for the portable code. By default, the fastest one on this CPU is
+      used. */
+  static const char* simdName();
+  /** Use the named implementation from now on, or the default one if
+      name is null. For tests and benchmarks.
+      @return false if the CPU or compiler does not support it */
+  static bool setSimd(const char* name);
+
   /* Serializing an MD5Sum is only allowed after finish(). The
      serialization is compatible with that of MD5. */
   template<class Iterator>
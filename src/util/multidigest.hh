@@ -0,0 +1,85 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Calculate several checksums over the same data in a single pass
+
+  For example, MultiDigest<MD5Sum, SHA256Sum> d(&md, &sd) feeds all
+  data passed to d.update() to both md and sd. A null pointer means that
+  the respective checksum is not needed this time. copyAndDigest() reads
+  a stream once, optionally writes the data to another stream, and
+  updates all checksums along the way.
+
+*/
+
+#ifndef MULTIDIGEST_HH
+#define MULTIDIGEST_HH
+
+#include <config.h>
+
+#include <bstream.hh>
+//______________________________________________________________________
+
+/** Each Sum must have an update(const Ubyte*, size_t) member */
+template <class... Sums> class MultiDigest;
+
+template <>
+class MultiDigest<> {
+public:
+  void update(const Ubyte*, size_t) { }
+};
+
+template <class Sum, class... Rest>
+class MultiDigest<Sum, Rest...> : public MultiDigest<Rest...> {
+public:
+  explicit MultiDigest(Sum* s, Rest*... rest)
+    : MultiDigest<Rest...>(rest...), sum(s) { }
+  void update(const Ubyte* data, size_t len) {
+    if (sum != 0) sum->update(data, len);
+    MultiDigest<Rest...>::update(data, len);
+  }
+private:
+  Sum* sum;
+};
+//______________________________________________________________________
+
+/** Read up to len bytes from in, write them to out unless it is null,
+    and feed them to all checksums in digests. report(n) is called after
+    every n bytes. Stops early if either stream fails or in ends.
+    @param buf Buffer of bufSize bytes
+    @return Number of bytes read */
+template <class Digests, class Report>
+uint64 copyAndDigest(bistream& in, bostream* out, uint64 len, Ubyte* buf,
+                     size_t bufSize, Digests& digests, Report& report) {
+  uint64 done = 0;
+  while (in && !in.eof() && len > 0 && (out == 0 || *out)) {
+    size_t n = (size_t)(len < bufSize ? len : bufSize);
+    readBytes(in, buf, n);
+    n = (size_t)in.gcount();
+    if (out != 0) writeBytes(*out, buf, n);
+    digests.update(buf, n);
+    report(n);
+    done += n;
+    len -= n;
+  }
+  return done;
+}
+
+/** Like copyAndDigest(), for data which is already in memory */
+template <class Digests, class Report>
+void digestMemory(const Ubyte* data, uint64 len, size_t sliceSize,
+                  Digests& digests, Report& report) {
+  while (len > 0) {
+    size_t n = (size_t)(len < sliceSize ? len : sliceSize);
+    digests.update(data, n);
+    report(n);
+    data += n;
+    len -= n;
+  }
+}
+
+#endif
@@ -15,6 +15,9 @@
   Command line argument: Name of file to use for test. Will not output
   anything if test is OK.
 
+  With arguments "--bench N", compare the speed of the SIMD and the
+  portable code for N MB of data.
+
   #test-deps util/rsyncsum.o
 
 */
@@ -22,12 +25,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <string.h>
+
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <bstream.hh>
 #include <rsyncsum.hh>
 #include <log.hh>
+#include <simdkernels.hh>
 //______________________________________________________________________
 
 #ifdef CREATE_CONSTANTS
@@ -86,7 +94,78 @@ void printBlockSums(size_t blockSize, const char* fileName) {
   exit(0);
 }
 
+const char* const simdNames[] = { "none", "sse4.1", "avx2", 0 };
+
+/* All SIMD implementations must calculate exactly the same as the portable
+   code, for all lengths and alignments */
+void checkSimd() {
+  vector<Ubyte> data(4096);
+  SimdKernels::fill(&data[0], data.size());
+  const Ubyte* mem = &data[0];
+  for (const char* const* name = simdNames + 1; *name != 0; ++name) {
+    if (!RsyncSum64::setSimd(*name)) continue; // Not supported by CPU
+    for (size_t len = 0; len < 100; ++len) {
+      for (size_t align = 0; align < 8; ++align) {
+        RsyncSum64 scalar(mem, 300), simd(scalar);
+        uint32 scalarHi[100], simdHi[100];
+        RsyncSum64::setSimd(*name);
+        simd.addBack(mem + align, len)
+            .roll(mem + align, mem + 1000 + align, len, 300, simdHi);
+        RsyncSum64::setSimd("none");
+        scalar.addBack(mem + align, len)
+              .roll(mem + align, mem + 1000 + align, len, 300, scalarHi);
+        error(5, scalar == simd);
+        error(5, memcmp(scalarHi, simdHi, len * sizeof(uint32)) == 0);
+      }
+    }
+  }
+  RsyncSum64::setSimd(0);
+}
+
+double benchAddBack(const vector<Ubyte>& data) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  RsyncSum64 sum(&data[0], data.size());
+  chrono::duration<double> t = chrono::steady_clock::now() - start;
+  if (sum.empty()) cout << ' '; // Prevent optimizing away the calculation
+  return t.count();
+}
+
+// Like scanImage() in mktemplate.cc, roll over 32 bytes at a time
+double benchRoll(const vector<Ubyte>& data, size_t areaSize) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  RsyncSum64 sum(&data[0], areaSize);
+  uint32 hi[32], acc = 0;
+  for (size_t i = 0; i + areaSize + 32 <= data.size(); i += 32) {
+    sum.roll(&data[i], &data[i + areaSize], 32, areaSize, hi);
+    acc ^= hi[31];
+  }
+  chrono::duration<double> t = chrono::steady_clock::now() - start;
+  if (acc == 0) cout << ' ';
+  return t.count();
+}
+
+void bench(size_t megabytes) {
+  vector<Ubyte> data(megabytes << 20);
+  SimdKernels::fill(&data[0], data.size());
+  double mb = (double)megabytes;
+  cout << "Default: " << RsyncSum64::simdName() << endl;
+  for (const char* const* name = simdNames; *name != 0; ++name) {
+    if (!RsyncSum64::setSimd(*name)) continue;
+    // Best of 3 runs
+    double addBackTime = 1e9, rollTime = 1e9;
+    for (int i = 0; i < 3; ++i) {
+      addBackTime = min(addBackTime, benchAddBack(data));
+      rollTime = min(rollTime, benchRoll(data, 8192));
+    }
+    cout << *name << ":\taddBack " << mb / addBackTime << " MB/s,\troll "
+         << mb / rollTime << " MB/s" << endl;
+  }
+  exit(0);
+}
+
 int main(int argc, char* argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--bench") == 0)
+    bench(atoi(argv[2]));
   if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
 
   if (argc == 3) {
@@ -169,6 +248,8 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  checkSimd();
+
   if (errs != 0) {
     printf("%s %s\n", estr, argv[1]);
     return 1;
@@ -15,8 +15,18 @@
 */
 
 #include <config.h>
+
+#include <string.h>
+#if HAVE_X86_SIMD
+#  include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+
 #include <rsyncsum.hh>
 #include <rsyncsum.ih>
+#include <simdkernels.hh>
 //______________________________________________________________________
 
 // NB: The following assumes that uint32 is at least 32 bits, but may be 64
@@ -73,39 +83,278 @@ RsyncSum& RsyncSum::removeFront(const Ubyte* mem, size_t len,
 }
 //______________________________________________________________________
 
-RsyncSum64& RsyncSum64::addBack2(const Ubyte* mem, size_t len) {
-  uint32 a = sumLo;
-  uint32 b = sumHi;
-  const Ubyte* blockLimit = mem + (len / 16) * 16;
-  const Ubyte* limit = mem + len; // 1st byte not to process
+/* RsyncSum64::addBack(mem, len) and roll() are implemented by one of
+   several kernels, selected at runtime depending on the CPU. All kernels
+   calculate exactly the same values. */
+namespace {
 
-  while (mem < blockLimit) {
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
-    a += charTable[*mem++]; b += a;
+  typedef void (*AddBackKernel)(const uint32* table, uint32& lo, uint32& hi,
+                                const Ubyte* mem, size_t len);
+  typedef void (*RollKernel)(const uint32* table, uint32& lo, uint32& hi,
+                             const Ubyte* front, const Ubyte* back,
+                             size_t n, uint32 areaSize, uint32* hiOut);
+
+  void addBackScalar(const uint32* table, uint32& lo, uint32& hi,
+                     const Ubyte* mem, size_t len) {
+    uint32 a = lo;
+    uint32 b = hi;
+    const Ubyte* blockLimit = mem + (len / 16) * 16;
+    const Ubyte* limit = mem + len; // 1st byte not to process
+
+    while (mem < blockLimit) {
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+      a += table[*mem++]; b += a;
+    }
+
+    while (mem < limit) {
+      a += table[*mem++]; b += a;
+    }
+
+    lo = a & 0xffffffff;
+    hi = b & 0xffffffff;
   }
 
-  while (mem < limit) {
-    a += charTable[*mem++]; b += a;
+  void rollScalar(const uint32* table, uint32& lo, uint32& hi,
+                  const Ubyte* front, const Ubyte* back, size_t n,
+                  uint32 areaSize, uint32* hiOut) {
+    uint32 a = lo;
+    uint32 b = hi;
+    for (size_t i = 0; i < n; ++i) {
+      uint32 f = table[front[i]];
+      b -= areaSize * f;
+      a += table[back[i]] - f;
+      b += a;
+      hiOut[i] = b & 0xffffffff;
+    }
+    lo = a & 0xffffffff;
+    hi = b & 0xffffffff;
+  }
+  //________________________________________
+
+# if HAVE_X86_SIMD
+  /* The checksum of a block is a prefix sum over the table values of its
+     bytes (for sumLo) and a prefix sum over that (for sumHi). The vector
+     versions look up the values for 4 or 8 bytes at once and add them up
+     with log2(4) or log2(8) shift+add steps. Arithmetic is modulo 2^32
+     for both the scalar and vector code, so the results are identical. */
+
+  // Prefix sum of 4 lanes: x[i] = x[0] + ... + x[i]
+  __attribute__((target("sse4.1")))
+  inline __m128i prefix4(__m128i x) {
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+  }
+
+  // SSE4.1 has no gather instruction, lookups are done by the scalar unit
+  __attribute__((target("sse4.1")))
+  inline __m128i lookup4(const uint32* table, const Ubyte* mem) {
+    return _mm_set_epi32((int)table[mem[3]], (int)table[mem[2]],
+                         (int)table[mem[1]], (int)table[mem[0]]);
+  }
+
+  __attribute__((target("sse4.1")))
+  void addBackSse41(const uint32* table, uint32& lo, uint32& hi,
+                    const Ubyte* mem, size_t len) {
+    const Ubyte* limit = mem + (len & ~size_t(3));
+    __m128i a = _mm_set1_epi32((int)lo); // Current sumLo in all lanes
+    __m128i b = _mm_setzero_si128(); // Sum of all sumLo values so far
+    while (mem < limit) {
+      __m128i x = _mm_add_epi32(prefix4(lookup4(table, mem)), a);
+      b = _mm_add_epi32(b, x);
+      a = _mm_shuffle_epi32(x, 0xff);
+      mem += 4;
+    }
+    b = _mm_add_epi32(b, _mm_srli_si128(b, 8));
+    b = _mm_add_epi32(b, _mm_srli_si128(b, 4));
+    lo = (uint32)_mm_cvtsi128_si32(a);
+    hi += (uint32)_mm_cvtsi128_si32(b);
+    addBackScalar(table, lo, hi, mem, len & 3);
+  }
+
+  __attribute__((target("sse4.1")))
+  void rollSse41(const uint32* table, uint32& lo, uint32& hi,
+                 const Ubyte* front, const Ubyte* back, size_t n,
+                 uint32 areaSize, uint32* hiOut) {
+    size_t blocks = n / 4;
+    __m128i a = _mm_set1_epi32((int)lo);
+    __m128i b = _mm_set1_epi32((int)hi);
+    __m128i area = _mm_set1_epi32((int)areaSize);
+    for (size_t i = 0; i < blocks; ++i) {
+      __m128i f = lookup4(table, front);
+      __m128i d = _mm_sub_epi32(lookup4(table, back), f);
+      a = _mm_add_epi32(prefix4(d), a);
+      __m128i e = _mm_sub_epi32(a, _mm_mullo_epi32(f, area));
+      b = _mm_add_epi32(prefix4(e), b);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(hiOut), b);
+      a = _mm_shuffle_epi32(a, 0xff);
+      b = _mm_shuffle_epi32(b, 0xff);
+      front += 4; back += 4; hiOut += 4;
+    }
+    lo = (uint32)_mm_cvtsi128_si32(a);
+    hi = (uint32)_mm_cvtsi128_si32(b);
+    rollScalar(table, lo, hi, front, back, n & 3, areaSize, hiOut);
+  }
+  //________________________________________
+
+  // Prefix sum of 8 lanes
+  __attribute__((target("avx2")))
+  inline __m256i prefix8(__m256i x) {
+    // Shifts only work within each 128-bit half...
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    // ...so add the total of the lower half to all lanes of the upper one
+    __m256i low = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(3));
+    return _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(),
+                                                  low, 0xf0));
   }
 
-  sumLo = a & 0xffffffff;
-  sumHi = b & 0xffffffff;
+  __attribute__((target("avx2")))
+  inline __m256i lookup8(const uint32* table, const Ubyte* mem) {
+    __m256i idx = _mm256_cvtepu8_epi32(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(mem)));
+    return _mm256_i32gather_epi32(reinterpret_cast<const int*>(table),
+                                  idx, 4);
+  }
+
+  // Broadcast lane 7 to all lanes
+  __attribute__((target("avx2")))
+  inline __m256i last8(__m256i x) {
+    return _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7));
+  }
+
+  __attribute__((target("avx2")))
+  void addBackAvx2(const uint32* table, uint32& lo, uint32& hi,
+                   const Ubyte* mem, size_t len) {
+    const Ubyte* limit = mem + (len & ~size_t(7));
+    __m256i a = _mm256_set1_epi32((int)lo);
+    __m256i b = _mm256_setzero_si256();
+    while (mem < limit) {
+      __m256i x = _mm256_add_epi32(prefix8(lookup8(table, mem)), a);
+      b = _mm256_add_epi32(b, x);
+      a = last8(x);
+      mem += 8;
+    }
+    __m128i b4 = _mm_add_epi32(_mm256_castsi256_si128(b),
+                               _mm256_extracti128_si256(b, 1));
+    b4 = _mm_add_epi32(b4, _mm_srli_si128(b4, 8));
+    b4 = _mm_add_epi32(b4, _mm_srli_si128(b4, 4));
+    lo = (uint32)_mm256_cvtsi256_si32(a);
+    hi += (uint32)_mm_cvtsi128_si32(b4);
+    addBackScalar(table, lo, hi, mem, len & 7);
+  }
+
+  __attribute__((target("avx2")))
+  void rollAvx2(const uint32* table, uint32& lo, uint32& hi,
+                const Ubyte* front, const Ubyte* back, size_t n,
+                uint32 areaSize, uint32* hiOut) {
+    size_t blocks = n / 8;
+    __m256i a = _mm256_set1_epi32((int)lo);
+    __m256i b = _mm256_set1_epi32((int)hi);
+    __m256i area = _mm256_set1_epi32((int)areaSize);
+    for (size_t i = 0; i < blocks; ++i) {
+      __m256i f = lookup8(table, front);
+      __m256i d = _mm256_sub_epi32(lookup8(table, back), f);
+      a = _mm256_add_epi32(prefix8(d), a);
+      __m256i e = _mm256_sub_epi32(a, _mm256_mullo_epi32(f, area));
+      b = _mm256_add_epi32(prefix8(e), b);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(hiOut), b);
+      a = last8(a);
+      b = last8(b);
+      front += 8; back += 8; hiOut += 8;
+    }
+    lo = (uint32)_mm256_cvtsi256_si32(a);
+    hi = (uint32)_mm256_cvtsi256_si32(b);
+    rollScalar(table, lo, hi, front, back, n & 7, areaSize, hiOut);
+  }
+# endif // HAVE_X86_SIMD
+  //________________________________________
+
+  struct Kernels {
+    const char* name;
+    AddBackKernel addBack;
+    RollKernel roll;
+  };
+
+  const Kernels allKernels[] = {
+    { "none", addBackScalar, rollScalar },
+#   if HAVE_X86_SIMD
+    { "sse4.1", addBackSse41, rollSse41 },
+    { "avx2", addBackAvx2, rollAvx2 },
+#   endif
+    { 0, 0, 0 }
+  };
+
+  /* Whether the vector code is actually faster depends heavily on the CPU:
+     The table lookups dominate, and on some x86 models, the AVX2 gather
+     instruction is slower than individual loads. Like the Linux kernel
+     does for its RAID checksums, time all supported kernels once with a
+     little data, and use the fastest one. The values in the lookup table
+     do not matter for this. */
+  const Kernels* fastestKernels() {
+    const size_t DATA_SIZE = 16384, AREA_SIZE = 4096;
+    Ubyte data[DATA_SIZE];
+    uint32 table[256];
+    SimdKernels::fill(data, DATA_SIZE);
+    SimdKernels::fill(reinterpret_cast<Ubyte*>(table), sizeof(table));
+
+    const size_t COUNT = sizeof(allKernels) / sizeof(allKernels[0]) - 1;
+    chrono::steady_clock::duration time[COUNT];
+    for (size_t k = 0; k < COUNT; ++k)
+      time[k] = chrono::steady_clock::duration::max();
+    // Interleave the runs, so all kernels suffer equally from disturbances
+    for (int run = 0; run < 5; ++run) {
+      for (size_t k = 0; k < COUNT; ++k) {
+        if (!SimdKernels::supported(allKernels[k].name)) continue;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        uint32 lo = 0, hi = 0, hiOut[32];
+        allKernels[k].addBack(table, lo, hi, data, AREA_SIZE);
+        for (size_t i = 0; i + AREA_SIZE + 32 <= DATA_SIZE; i += 32)
+          allKernels[k].roll(table, lo, hi, data + i, data + i + AREA_SIZE,
+                             32, AREA_SIZE, hiOut);
+        time[k] = min(time[k], chrono::steady_clock::now() - start);
+      }
+    }
+    size_t best = 0; // Portable code
+    for (size_t k = 1; k < COUNT; ++k)
+      if (time[k] < time[best]) best = k;
+    return &allKernels[best];
+  }
+
+  SimdKernels::Selection<Kernels> kernels = {
+    allKernels, &fastestKernels, 0 };
+
+} // namespace
+//________________________________________
+
+RsyncSum64& RsyncSum64::addBack2(const Ubyte* mem, size_t len) {
+  kernels.get().addBack(charTable, sumLo, sumHi, mem, len);
   return *this;
 }
+
+RsyncSum64& RsyncSum64::roll(const Ubyte* front, const Ubyte* back,
+                             size_t n, size_t areaSize, uint32* hiOut) {
+  kernels.get().roll(charTable, sumLo, sumHi, front, back, n,
+                     (uint32)areaSize, hiOut);
+  return *this;
+}
+
+const char* RsyncSum64::simdName() { return kernels.get().name; }
+
+bool RsyncSum64::setSimd(const char* name) { return kernels.set(name); }
 //________________________________________
 
 RsyncSum64& RsyncSum64::removeFront(const Ubyte* mem, size_t len,
@@ -113,6 +113,12 @@ public:
   INLINE RsyncSum64& addBackNtimes(Ubyte x, size_t n);
   RsyncSum64& removeFront(const Ubyte* mem, size_t len, size_t areaSize);
   inline RsyncSum64& removeFront(Ubyte x, size_t areaSize);
+  /** Roll the checksum over n bytes: For 0<=i<n, the same as
+      removeFront(front[i], areaSize).addBack(back[i]), storing getHi()
+      after the i-th step in hiOut[i]. Faster than n single-byte steps if
+      the CPU supports SIMD instructions. */
+  RsyncSum64& roll(const Ubyte* front, const Ubyte* back, size_t n,
+                   size_t areaSize, uint32* hiOut);
   /** Return lower 32 bits of checksum */
   uint32 getLo() const { return sumLo; }
   /** Return higher 32 bits of checksum */
@@ -126,6 +132,16 @@ public:
   inline ConstIterator unserialize(ConstIterator i);
   inline size_t serialSizeOf() const;
 
+  /** Name of the implementation used by addBack(mem, len) and roll():
+      "avx2", "sse4.1" or "none" for the portable code. By default, the
+      fastest one on this CPU is chosen when the first checksum is
+      calculated. */
+  static const char* simdName();
+  /** Use the named implementation from now on, or the default one if
+      name is null. For tests and benchmarks.
+      @return false if the CPU or compiler does not support it */
+  static bool setSimd(const char* name);
+
 private:
   RsyncSum64& addBack2(const Ubyte* mem, size_t len);
   static const uint32 charTable[256];
@@ -0,0 +1,206 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Hash table for looking up the RsyncSum64 of the first block of files
+
+  With arguments "--bench FILES MB", compare the speed of scanning MB
+  megabytes of data against FILES sums, using RsyncTable and using the
+  vector of vectors of FileParts of earlier versions of MkTemplate.
+
+  #test-deps util/rsynctable.o util/rsyncsum.o
+
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <debug.hh>
+#include <log.hh>
+#include <rsynctable.hh>
+//______________________________________________________________________
+
+namespace {
+
+  uint32 randState = 0x12345678;
+  uint32 rand32() {
+    randState = randState * 1664525 + 1013904223;
+    uint32 r = randState >> 16;
+    randState = randState * 1664525 + 1013904223;
+    return (r << 16) ^ (randState >> 16);
+  }
+
+  RsyncSum64 randomSum() {
+    Ubyte b[8];
+    for (int i = 0; i < 8; ++i) b[i] = (Ubyte)rand32();
+    return RsyncSum64(b, sizeof(b));
+  }
+
+  // All values for sum, in the order the table returns them
+  vector<uint32> lookup(const RsyncTable& t, const RsyncSum64& sum) {
+    vector<uint32> result;
+    size_t pos = t.start(sum);
+    uint32 v;
+    while ((v = t.next(sum, pos)) != RsyncTable::NONE) result.push_back(v);
+    return result;
+  }
+
+  // Duplicates and sums which differ only in getLo()
+  void testDuplicates() {
+    Ubyte a[] = { 1, 2, 3, 4 };
+    Ubyte b[] = { 2, 1, 3, 4 }; // same getLo(), different getHi()
+    RsyncSum64 sa(a, 4), sb(b, 4);
+    RsyncTable t;
+    t.init(4);
+    t.insert(sa, 10);
+    t.insert(sb, 11);
+    t.insert(sa, 12);
+    vector<uint32> r = lookup(t, sa);
+    Assert(r.size() == 2 && r[0] == 10 && r[1] == 12);
+    r = lookup(t, sb);
+    Assert(r.size() == 1 && r[0] == 11);
+    Assert(t.mightContain(sa.getHi()) && t.mightContain(sb.getHi()));
+    Assert(t.size() == 3);
+    t.init(4);
+    Assert(t.size() == 0 && lookup(t, sa).empty());
+  }
+
+  // Compare with a multimap for many random sums
+  void testRandom(size_t n) {
+    typedef multimap<RsyncSum64, uint32> Map;
+    Map ref;
+    vector<RsyncSum64> sums;
+    RsyncTable t;
+    t.init(n);
+    for (uint32 i = 0; i < n; ++i) {
+      // Every 10th sum is used twice
+      RsyncSum64 s = (i % 10 == 9 ? sums[rand32() % i] : randomSum());
+      sums.push_back(s);
+      t.insert(s, i);
+      ref.insert(make_pair(s, i));
+    }
+    for (size_t i = 0; i < n; ++i) {
+      vector<uint32> r = lookup(t, sums[i]);
+      pair<Map::iterator, Map::iterator> range = ref.equal_range(sums[i]);
+      vector<uint32> expected;
+      for (Map::iterator j = range.first; j != range.second; ++j)
+        expected.push_back(j->second);
+      Assert(r == expected); // Also checks insertion order
+    }
+    size_t mightContain = 0;
+    for (size_t i = 0; i < 10 * n; ++i) {
+      RsyncSum64 s = randomSum();
+      if (ref.find(s) != ref.end()) continue;
+      Assert(lookup(t, s).empty());
+      if (t.mightContain(s.getHi())) ++mightContain;
+    }
+    // False positives are possible, but must be rare
+    Assert(mightContain <= n / 2 + 1); // i.e. about 5% of the lookups
+  }
+  //______________________________________________________________________
+
+  /* What MkTemplate did before: A vector of vectors of pointers to
+     FileParts, the RsyncSum is inside the FilePart */
+  struct FakeFilePart {
+    char otherMembers[120];
+    RsyncSum64 sum;
+  };
+
+  typedef double (*ScanFunction)(const vector<Ubyte>& data, size_t mb,
+                                 size_t& candidates);
+
+  RsyncTable table;
+
+  vector<vector<FakeFilePart*> > oldTable;
+  uint32 oldMask;
+
+  const size_t AREA_SIZE = 4096;
+
+  // Roll over the data like MkTemplate::scanImage(), count possible matches
+  template <class Lookup>
+  double scan(const vector<Ubyte>& data, size_t mb, size_t& candidates,
+              Lookup& lookup) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    candidates = 0;
+    uint32 hi[32];
+    uint64 todo = (uint64)mb << 20;
+    while (todo > 0) {
+      RsyncSum64 sum(&data[0], AREA_SIZE);
+      for (size_t i = 0; i + AREA_SIZE + 32 <= data.size() && todo > 0;
+           i += 32, todo -= 32) {
+        sum.roll(&data[i], &data[i + AREA_SIZE], 32, AREA_SIZE, hi);
+        for (int j = 0; j < 32; ++j)
+          if (lookup(hi[j])) ++candidates;
+      }
+    }
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    return t.count();
+  }
+
+  struct NewLookup {
+    bool operator()(uint32 hi) { return table.mightContain(hi); }
+  };
+
+  struct OldLookup {
+    bool operator()(uint32 hi) {
+      const vector<FakeFilePart*>& hashEntry = oldTable[hi & oldMask];
+      if (hashEntry.size() > 1) return true;
+      return (hashEntry.size() == 1 && hashEntry[0]->sum.getHi() == hi);
+    }
+  };
+
+  void bench(size_t files, size_t mb) {
+    vector<Ubyte> data(64 << 20);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = (Ubyte)rand32();
+
+    table.init(files);
+    oldMask = 1;
+    while (oldMask < files) oldMask = 2 * oldMask + 1;
+    oldMask = 2 * oldMask + 1;
+    oldTable.resize(oldMask + 1);
+    vector<unique_ptr<FakeFilePart> > parts;
+    for (size_t i = 0; i < files; ++i) {
+      parts.push_back(unique_ptr<FakeFilePart>(new FakeFilePart()));
+      FakeFilePart* part = parts.back().get();
+      part->sum = randomSum();
+      oldTable[part->sum.getHi() & oldMask].push_back(part);
+      table.insert(part->sum, (uint32)i);
+    }
+
+    size_t candidates;
+    OldLookup oldLookup;
+    double t = scan(data, mb, candidates, oldLookup);
+    cout << "vector<vector<FilePart*> >: " << (double)mb / t << " MB/s, "
+         << candidates << " possible matches" << endl;
+    NewLookup newLookup;
+    t = scan(data, mb, candidates, newLookup);
+    cout << "RsyncTable:                 " << (double)mb / t << " MB/s, "
+         << candidates << " possible matches" << endl;
+  }
+
+}
+//______________________________________________________________________
+
+int main(int argc, char* argv[]) {
+  if (argc == 4 && strcmp(argv[1], "--bench") == 0) {
+    bench(atoi(argv[2]), atoi(argv[3]));
+    return 0;
+  }
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+
+  testDuplicates();
+  testRandom(1);
+  testRandom(1000);
+  testRandom(100000);
+  return 0;
+}
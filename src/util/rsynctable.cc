@@ -0,0 +1,45 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Hash table for looking up the RsyncSum64 of the first block of files
+
+*/
+
+#include <config.h>
+
+#include <rsynctable.hh>
+//______________________________________________________________________
+
+void RsyncTable::init(size_t n) {
+  /* At most 1/2 of the slots are used, otherwise the runs of occupied
+     slots which lookups have to skip become long */
+  size_t slotCount = 2;
+  while (slotCount < 2 * n) slotCount *= 2;
+  mask = slotCount - 1;
+  count = 0;
+  Slot empty;
+  empty.value = NONE;
+  slots.assign(slotCount, empty);
+  /* 32 bits per entry => about 1 in 32 lookups of a missing value gets
+     past the filter. Not more than 32 bits of getHi() can be used. */
+  uint64 filterBits = 32;
+  while (filterBits < 32 * (uint64)n && filterBits < (uint64)1 << 32)
+    filterBits *= 2;
+  filterMask = (uint32)(filterBits - 1);
+  filter.assign((size_t)(filterBits / 32), 0);
+}
+
+void RsyncTable::insert(const RsyncSum64& sum, uint32 value) {
+  Assert(2 * (count + 1) <= mask + 1);
+  Assert(value != NONE);
+  size_t i = sum.getHi() & mask;
+  while (slots[i].value != NONE) i = (i + 1) & mask;
+  slots[i].sum = sum;
+  slots[i].value = value;
+  uint32 bit = sum.getHi() & filterMask;
+  filter[bit / 32] |= 1U << (bit % 32);
+  ++count;
+}
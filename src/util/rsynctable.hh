@@ -0,0 +1,89 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Hash table for looking up the RsyncSum64 of the first block of files
+
+  make-template rolls an RsyncSum64 over the image and looks up the sum
+  at every byte offset; nearly all lookups fail. The table is flat, with
+  open addressing and linear probing: Each slot holds the sum itself and
+  a 32-bit value (an index into MkTemplate's array of files), so no
+  pointers need to be followed to compare sums. In front of it, a bitmap
+  with one bit per possible value of some bits of getHi() acts as a
+  filter: A failed lookup usually only tests one bit. The bitmap is small
+  enough to stay in the CPU cache, and the test is a branch which the CPU
+  predicts correctly nearly every time.
+
+*/
+
+#ifndef RSYNCTABLE_HH
+#define RSYNCTABLE_HH
+
+#include <config.h>
+
+#include <vector>
+
+#include <debug.hh>
+#include <rsyncsum.hh>
+//______________________________________________________________________
+
+class RsyncTable {
+public:
+  /** Returned by next() if there are no more entries */
+  static const uint32 NONE = 0xffffffff;
+
+  RsyncTable() : mask(0), filterMask(0), count(0) { }
+
+  /** Empty the table and make room for up to n entries */
+  void init(size_t n);
+
+  /** Add an entry. Several entries may have the same sum; a lookup
+      returns them in the order they were inserted. */
+  void insert(const RsyncSum64& sum, uint32 value);
+
+  /** Return false if no entry has the given getHi() value. Very fast,
+      and usually (for about 97% of the other values) correct if it
+      returns true. */
+  inline bool mightContain(uint32 hi) const;
+
+  /** Find all entries for sum:<code>
+      size_t pos = table.start(sum);
+      uint32 v;
+      while ((v = table.next(sum, pos)) != RsyncTable::NONE) ...</code> */
+  size_t start(const RsyncSum64& sum) const { return sum.getHi() & mask; }
+  inline uint32 next(const RsyncSum64& sum, size_t& pos) const;
+
+  size_t size() const { return count; }
+
+private:
+  struct Slot {
+    RsyncSum64 sum;
+    uint32 value; // NONE for an empty slot
+  };
+  size_t mask; // Nr of slots minus 1, nr of slots is a power of 2
+  uint32 filterMask; // Nr of bits in filter minus 1, also a power of 2
+  size_t count; // Nr of entries
+  vector<uint32> filter;
+  vector<Slot> slots;
+};
+//______________________________________________________________________
+
+bool RsyncTable::mightContain(uint32 hi) const {
+  uint32 bit = hi & filterMask;
+  return (filter[bit / 32] >> (bit % 32)) & 1;
+}
+
+uint32 RsyncTable::next(const RsyncSum64& sum, size_t& pos) const {
+  while (true) {
+    const Slot& s = slots[pos];
+    if (s.value == NONE) return NONE;
+    pos = (pos + 1) & mask;
+    if (s.sum == sum) return s.value;
+  }
+}
+
+#endif
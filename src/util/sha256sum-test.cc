@@ -12,19 +12,27 @@
 
   Quite secure 256-bit checksum
 
+  With arguments "--bench N", compare the speed of update() and
+  blockSums() with all implementations for N MB of data.
+
   #test-deps util/glibc-sha256.o util/sha256sum.o
 
 */
 
 #include <config.h>
 
+#include <string.h>
+
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <bstream.hh>
 #include <log.hh>
 #include <sha256sum.hh>
+#include <simdkernels.hh>
 #include <mimestream.hh>
 //______________________________________________________________________
 
@@ -32,31 +40,39 @@ namespace {
 
 int returnCode = 0;
 
-// SHA256 test suite (see end of RFC1321)
+// The strings of the MD5 test suite (see end of RFC1321), with their SHA256s
 
 const Ubyte t1[] = "";
 const Ubyte s1[] =
-"\xd4\x1d\x8c\xd9\x8f\x00\xb2\x04\xe9\x80\x09\x98\xec\xf8\x42\x7e";
+"\xe3\xb0\xc4\x42\x98\xfc\x1c\x14\x9a\xfb\xf4\xc8\x99\x6f\xb9\x24"
+"\x27\xae\x41\xe4\x64\x9b\x93\x4c\xa4\x95\x99\x1b\x78\x52\xb8\x55";
 const Ubyte t2[] = "a";
 const Ubyte s2[] =
-"\x0c\xc1\x75\xb9\xc0\xf1\xb6\xa8\x31\xc3\x99\xe2\x69\x77\x26\x61";
+"\xca\x97\x81\x12\xca\x1b\xbd\xca\xfa\xc2\x31\xb3\x9a\x23\xdc\x4d"
+"\xa7\x86\xef\xf8\x14\x7c\x4e\x72\xb9\x80\x77\x85\xaf\xee\x48\xbb";
 const Ubyte t3[] = "abc";
 const Ubyte s3[] =
-"\x90\x01\x50\x98\x3c\xd2\x4f\xb0\xd6\x96\x3f\x7d\x28\xe1\x7f\x72";
+"\xba\x78\x16\xbf\x8f\x01\xcf\xea\x41\x41\x40\xde\x5d\xae\x22\x23"
+"\xb0\x03\x61\xa3\x96\x17\x7a\x9c\xb4\x10\xff\x61\xf2\x00\x15\xad";
 const Ubyte t4[] = "message digest";
 const Ubyte s4[] =
-"\xf9\x6b\x69\x7d\x7c\xb7\x93\x8d\x52\x5a\x2f\x31\xaa\xf1\x61\xd0";
+"\xf7\x84\x6f\x55\xcf\x23\xe1\x4e\xeb\xea\xb5\xb4\xe1\x55\x0c\xad"
+"\x5b\x50\x9e\x33\x48\xfb\xc4\xef\xa3\xa1\x41\x3d\x39\x3c\xb6\x50";
 const Ubyte t5[] = "abcdefghijklmnopqrstuvwxyz";
 const Ubyte s5[] =
-"\xc3\xfc\xd3\xd7\x61\x92\xe4\x00\x7d\xfb\x49\x6c\xca\x67\xe1\x3b";
+"\x71\xc4\x80\xdf\x93\xd6\xae\x2f\x1e\xfa\xd1\x44\x7c\x66\xc9\x52"
+"\x5e\x31\x62\x18\xcf\x51\xfc\x8d\x9e\xd8\x32\xf2\xda\xf1\x8b\x73";
 const Ubyte t6[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
 const Ubyte s6[] =
-"\xd1\x74\xab\x98\xd2\x77\xd9\xf5\xa5\x61\x1c\x2c\x9f\x41\x9d\x9f";
+"\xdb\x4b\xfc\xbd\x4d\xa0\xcd\x85\xa6\x0c\x3c\x37\xd3\xfb\xd8\x80"
+"\x5c\x77\xf1\x5f\xc6\xb1\xfd\xfe\x61\x4e\xe0\xa7\xc8\xfd\xb4\xc0";
 const Ubyte t7[] = "12345678901234567890123456789012345678901234567890123456789012345678901234567890";
 const Ubyte s7[] =
-"\x57\xed\xf4\xa2\x2b\xe3\xc9\x55\xac\x49\xda\x2e\x21\x07\xb6\x7a";
+"\xf3\x71\xbc\x4a\x31\x1f\x2b\x00\x9e\xef\x95\x2d\xd8\x3c\xa8\x0e"
+"\x2b\x60\x02\x6c\x8e\x93\x55\x92\xd0\xf9\xc3\x08\x45\x3c\x81\x3e";
 const Ubyte sAll[] =
-"\x6f\xec\x75\xd4\xe7\xfc\xd7\xe9\x66\x46\xb4\xc7\xaf\x96\xbc\xe2";
+"\xb8\x88\x4f\x1d\xa7\xd2\xf8\x08\x66\xac\xf1\x5b\x23\x9f\x73\xa6"
+"\xf8\x81\xe8\x35\x93\xe3\x51\xab\x83\x06\xdf\xd1\x34\xab\x61\xc2";
 
 const char* const hexDigits = "0123456789abcdef";
 
@@ -101,8 +117,97 @@ void printBlockSums(size_t blockSize, const char* fileName) {
   }
   exit(0);
 }
+//______________________________________________________________________
+
+const char* const simdNames[] = { "none", "sha", "avx2", 0 };
+
+/* With all implementations, update() in uneven pieces must calculate the
+   same as the portable code, and so must blockSums() for each block. The
+   block lengths cover all cases for the padding of the last 64-byte
+   chunk. */
+void checkSimd() {
+  const size_t blockLens[] = { 1, 40, 55, 56, 63, 64, 65, 119, 120,
+                               1000, 64 * 9 + 55, 0 };
+  vector<Ubyte> data(20 * 1000);
+  SimdKernels::fill(&data[0], data.size());
+  SHA256Sum::setSimd("none");
+  SHA256Sum whole;
+  whole.update(&data[0], data.size()).finish();
+  vector<SHA256> expected[sizeof(blockLens) / sizeof(blockLens[0])];
+  for (size_t b = 0; blockLens[b] != 0; ++b) {
+    SHA256Sum sd;
+    for (size_t off = 0; off < 19 * blockLens[b]; off += blockLens[b]) {
+      sd.reset().update(&data[off], blockLens[b]).finishForReuse();
+      expected[b].push_back(sd);
+    }
+  }
+
+  SHA256 sums[20];
+  for (const char* const* name = simdNames + 1; *name != 0; ++name) {
+    if (!SHA256Sum::setSimd(*name)) continue; // Not supported by CPU
+    SHA256Sum sd;
+    for (size_t off = 0, n = 1; off < data.size(); off += n, n = n * 3 + 1)
+      sd.update(&data[off], min(n, data.size() - off));
+    if (sd.finish() != whole) {
+      msg("ERROR: %1 update(): Expected %2, got %3",
+          *name, whole.toString(), sd.toString());
+      returnCode = 1;
+    }
+    for (size_t b = 0; blockLens[b] != 0; ++b) {
+      const size_t blockLen = blockLens[b];
+      for (size_t len = 0; len <= 18 * blockLen; len += blockLen / 2 + 1) {
+        SHA256Sum::blockSums(&data[0], len, blockLen, sums);
+        for (size_t i = 0; i * blockLen < len; ++i) {
+          SHA256 x = expected[b][i];
+          if (len - i * blockLen < blockLen) { // Shorter last block
+            SHA256Sum::setSimd("none");
+            sd.reset().update(&data[i * blockLen], len - i * blockLen)
+              .finishForReuse();
+            SHA256Sum::setSimd(*name);
+            x = sd;
+          }
+          if (sums[i] == x) continue;
+          msg("ERROR: %1 blockSums(%2, %3) #%4: Expected %5, got %6",
+              *name, len, blockLen, i, x.toString(), sums[i].toString());
+          returnCode = 1;
+        }
+      }
+    }
+  }
+  SHA256Sum::setSimd(0);
+}
+
+void bench(size_t megabytes) {
+  const size_t BLOCK_LENGTH = 128*1024 - 9; // jigdo-file's csumBlockLength
+  vector<Ubyte> data(megabytes << 20);
+  SimdKernels::fill(&data[0], data.size());
+  vector<SHA256> sums(data.size() / BLOCK_LENGTH + 1);
+  double mb = (double)megabytes;
+  cout << "Default: " << SHA256Sum::simdName() << endl;
+  for (const char* const* name = simdNames; *name != 0; ++name) {
+    if (!SHA256Sum::setSimd(*name)) continue;
+    // Best of 3 runs
+    double updateTime = 1e9, blockSumsTime = 1e9;
+    for (int i = 0; i < 3; ++i) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      SHA256Sum sd;
+      sd.update(&data[0], data.size()).finish();
+      chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+      SHA256Sum::blockSums(&data[0], data.size(), BLOCK_LENGTH, &sums[0]);
+      chrono::duration<double> t1 = middle - start;
+      chrono::duration<double> t2 = chrono::steady_clock::now() - middle;
+      updateTime = min(updateTime, t1.count());
+      blockSumsTime = min(blockSumsTime, t2.count());
+    }
+    cout << *name << ":\tupdate " << mb / updateTime << " MB/s,\tblockSums "
+         << mb / blockSumsTime << " MB/s" << endl;
+  }
+  exit(0);
+}
 
 int main(int argc, char* argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--bench") == 0)
+    bench(atoi(argv[2]));
   if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
   if (argc == 3) {
     // 2 cmdline args, blocksize and filename. Print RsyncSums of all blocks
@@ -144,5 +249,7 @@ int main(int argc, char* argv[]) {
   sum = all.finish().digest();
   compare(sAll, sum);
 
+  checkSimd();
+
   return returnCode;
 }
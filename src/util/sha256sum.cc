@@ -14,12 +14,22 @@
 
 #include <config.h>
 
+#include <string.h>
+#if HAVE_X86_SIMD
+#  include <immintrin.h>
+#endif
+
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
 #include <glibc-sha256.hh>
 #include <sha256sum.hh>
 #include <sha256sum.ih>
+#include <simdkernels.hh>
+#if HAVE_X86_SIMD
+#  include <simdlanes.hh>
+#endif
 //______________________________________________________________________
 
 void SHA256Sum::ProgressReporter::error(const string& message) {
@@ -157,3 +167,263 @@ uint64 SHA256Sum::updateFromStream(bistream& s, uint64 size, size_t bufSize,
   }
   return bytesRead;
 }
+//______________________________________________________________________
+
+namespace {
+
+  const uint32 initH[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+# if HAVE_X86_SIMD
+  // Constants for SHA256 from FIPS 180-2:4.2.2, as in glibc-sha256.cc
+  const uint32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+# endif
+  //________________________________________
+
+# if HAVE_X86_SHA
+  /* Process len bytes (a multiple of 64) with the SHA extensions. The
+     instructions want the state as the two halves ABEF and CDGH, and
+     process 4 rounds with two sha256rnds2 each. sha256msg1/2 calculate
+     the message schedule, 4 words at a time. */
+  __attribute__((target("sha,sse4.1")))
+  void processShaNi(uint32 H[8], const Ubyte* data, size_t len) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                            0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&H[0]),
+                                    0xb1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&H[4]),
+                                       0x1b); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+    for (; len >= 64; len -= 64, data += 64) {
+      __m128i save0 = state0, save1 = state1;
+      __m128i m0, m1, m2, m3, msg;
+      /* Rounds 4*i to 4*i+3 with the schedule words in cur. Meanwhile,
+         finish the words of the next group, and start the words of the
+         group after it, which will overwrite prev. */
+#     define ROUNDS4(i, cur, prev, next) \
+        if (i < 4) \
+          cur = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 16 * i)), \
+                                 byteSwap); \
+        msg = _mm_add_epi32(cur, _mm_loadu_si128((__m128i*)&K[4 * i])); \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+        if (i >= 3 && i <= 14) { \
+          next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)); \
+          next = _mm_sha256msg2_epu32(next, cur); \
+        } \
+        msg = _mm_shuffle_epi32(msg, 0x0e); \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+        if (i >= 1 && i <= 12) prev = _mm_sha256msg1_epu32(prev, cur);
+      ROUNDS4(0, m0, m3, m1)
+      ROUNDS4(1, m1, m0, m2)
+      ROUNDS4(2, m2, m1, m3)
+      ROUNDS4(3, m3, m2, m0)
+      ROUNDS4(4, m0, m3, m1)
+      ROUNDS4(5, m1, m0, m2)
+      ROUNDS4(6, m2, m1, m3)
+      ROUNDS4(7, m3, m2, m0)
+      ROUNDS4(8, m0, m3, m1)
+      ROUNDS4(9, m1, m0, m2)
+      ROUNDS4(10, m2, m1, m3)
+      ROUNDS4(11, m3, m2, m0)
+      ROUNDS4(12, m0, m3, m1)
+      ROUNDS4(13, m1, m0, m2)
+      ROUNDS4(14, m2, m1, m3)
+      ROUNDS4(15, m3, m2, m0)
+#     undef ROUNDS4
+      state0 = _mm_add_epi32(state0, save0);
+      state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+    _mm_storeu_si128((__m128i*)&H[0],
+                     _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+    _mm_storeu_si128((__m128i*)&H[4],
+                     _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+  }
+# endif
+  //________________________________________
+
+# if HAVE_X86_SIMD
+  using SimdLanes::LANES;
+  using SimdLanes::rotl;
+
+  __attribute__((target("avx2")))
+  inline __m256i rotr(__m256i x, int n) { return rotl(x, 32 - n); }
+
+  /* Process one 64-byte chunk at p[i] + off for each of the 8 lanes.
+     Same as sha256_process_block_portable() in glibc-sha256.cc, except
+     that the message schedule is only kept for the last 16 rounds. */
+  __attribute__((target("avx2")))
+  void chunkAvx2(__m256i H[8], const Ubyte* const p[LANES], size_t off) {
+    const __m256i byteSwap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i W[16];
+    SimdLanes::load8x8(p, off, W);
+    SimdLanes::load8x8(p, off + 32, W + 8);
+    for (int t = 0; t < 16; ++t) W[t] = _mm256_shuffle_epi8(W[t], byteSwap);
+    __m256i a = H[0], b = H[1], c = H[2], d = H[3];
+    __m256i e = H[4], f = H[5], g = H[6], h = H[7];
+    for (int t = 0; t < 64; ++t) {
+      __m256i& w = W[t & 15];
+      if (t >= 16) {
+        __m256i w2 = W[(t - 2) & 15], w15 = W[(t - 15) & 15];
+        __m256i r1 = _mm256_xor_si256(
+            _mm256_xor_si256(rotr(w2, 17), rotr(w2, 19)),
+            _mm256_srli_epi32(w2, 10));
+        __m256i r0 = _mm256_xor_si256(
+            _mm256_xor_si256(rotr(w15, 7), rotr(w15, 18)),
+            _mm256_srli_epi32(w15, 3));
+        w = _mm256_add_epi32(_mm256_add_epi32(w, r1),
+                             _mm256_add_epi32(W[(t - 7) & 15], r0));
+      }
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(e, 6), rotr(e, 11)),
+                                    rotr(e, 25));
+      __m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e,
+                                               _mm256_xor_si256(f, g)));
+      __m256i t1 = _mm256_add_epi32(
+          _mm256_add_epi32(h, s1),
+          _mm256_add_epi32(_mm256_add_epi32(ch, w),
+                           _mm256_set1_epi32((int)K[t])));
+      __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(a, 2), rotr(a, 13)),
+                                    rotr(a, 22));
+      __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                        _mm256_and_si256(c, _mm256_or_si256(a, b)));
+      h = g; g = f; f = e;
+      e = _mm256_add_epi32(d, t1);
+      d = c; c = b; b = a;
+      a = _mm256_add_epi32(t1, _mm256_add_epi32(s0, maj));
+    }
+    H[0] = _mm256_add_epi32(H[0], a); H[1] = _mm256_add_epi32(H[1], b);
+    H[2] = _mm256_add_epi32(H[2], c); H[3] = _mm256_add_epi32(H[3], d);
+    H[4] = _mm256_add_epi32(H[4], e); H[5] = _mm256_add_epi32(H[5], f);
+    H[6] = _mm256_add_epi32(H[6], g); H[7] = _mm256_add_epi32(H[7], h);
+  }
+
+  // Checksums of the 8 messages of len bytes at p[0..7]
+  __attribute__((target("avx2")))
+  void lanesAvx2(const Ubyte* const p[LANES], size_t len,
+                 SHA256* const sums[LANES]) {
+    __m256i H[8];
+    for (int j = 0; j < 8; ++j) H[j] = _mm256_set1_epi32((int)initH[j]);
+    size_t full = len & ~(size_t)63;
+    for (size_t off = 0; off < full; off += 64) chunkAvx2(H, p, off);
+
+    Ubyte tails[LANES][128];
+    const Ubyte* tailp[LANES];
+    size_t padded = 0;
+    for (int i = 0; i < LANES; ++i) {
+      padded = SimdLanes::pad(tails[i], p[i], len, true);
+      tailp[i] = tails[i];
+    }
+    for (size_t off = 0; off < padded; off += 64) chunkAvx2(H, tailp, off);
+
+    uint32 words[8][LANES];
+    for (int j = 0; j < 8; ++j) _mm256_storeu_si256((__m256i*)words[j], H[j]);
+    for (int i = 0; i < LANES; ++i) {
+      Ubyte digest[32];
+      for (int j = 0; j < 8; ++j) {
+        uint32 x = words[j][i];
+        digest[4 * j] = static_cast<Ubyte>(x >> 24);
+        digest[4 * j + 1] = static_cast<Ubyte>(x >> 16);
+        digest[4 * j + 2] = static_cast<Ubyte>(x >> 8);
+        digest[4 * j + 3] = static_cast<Ubyte>(x);
+      }
+      sums[i]->unserialize(digest);
+    }
+  }
+# endif // HAVE_X86_SIMD
+  //________________________________________
+
+  struct Kernels {
+    const char* name;
+    bool shaNi; // Use processShaNi() instead of the portable code
+    bool lanes; // Use lanesAvx2() for blockSums()
+  };
+
+  /* In order of preference: With the SHA extensions, one block takes less
+     time than 8 blocks with AVX2 per block. */
+  const Kernels allKernels[] = {
+    { "none", false, false },
+#   if HAVE_X86_SIMD
+    { "avx2", false, true },
+#   endif
+#   if HAVE_X86_SHA
+    { "sha", true, false },
+#   endif
+    { 0, false, false }
+  };
+
+  SimdKernels::Selection<Kernels> kernels = { allKernels, 0, 0 };
+
+} // namespace
+//________________________________________
+
+void SHA256Sum::sha256_process_block(const void* buffer, size_t len,
+                                     sha256_ctx* ctx) {
+# if HAVE_X86_SHA
+  if (kernels.get().shaNi) {
+    ctx->total64 += len;
+    processShaNi(ctx->H, static_cast<const Ubyte*>(buffer), len);
+    return;
+  }
+# endif
+  sha256_process_block_portable(buffer, len, ctx);
+}
+
+void SHA256Sum::blockSums(const Ubyte* mem, size_t len, size_t blockLen,
+                          SHA256* sums) {
+  size_t n = (len + blockLen - 1) / blockLen;
+  size_t full = len / blockLen;
+  size_t i = 0;
+# if HAVE_X86_SIMD
+  /* Process 8 blocks at a time. For fewer than 8 blocks, the remaining
+     lanes just repeat the last block; from 2 blocks on, this is still
+     faster than the portable code. */
+  if (kernels.get().lanes) {
+    while (i + 1 < full) {
+      const Ubyte* p[LANES];
+      SHA256* out[LANES];
+      for (int l = 0; l < LANES; ++l) {
+        size_t b = min(i + l, full - 1);
+        p[l] = mem + b * blockLen;
+        out[l] = &sums[b];
+      }
+      lanesAvx2(p, blockLen, out);
+      i = min(i + LANES, full);
+    }
+  }
+# endif
+  SHA256Sum sd;
+  for (; i < n; ++i) {
+    size_t off = i * blockLen;
+    sd.reset().update(mem + off, min(blockLen, len - off)).finishForReuse();
+    sums[i] = sd;
+  }
+}
+
+const char* SHA256Sum::simdName() { return kernels.get().name; }
+
+bool SHA256Sum::setSimd(const char* name) { return kernels.set(name); }
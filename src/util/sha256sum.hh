@@ -141,6 +141,25 @@ public:
   uint64 updateFromStream(bistream& s, uint64 size,
       size_t bufSize = 128*1024, ProgressReporter& pr = noReport);
 
+  /** Calculate the checksums of consecutive blocks of blockLen bytes,
+      and store them in sums[0], sums[1] etc. The last block is shorter
+      if len is not a multiple of blockLen. Gives the same results as
+      one SHA256Sum per block, but is faster on CPUs with SIMD
+      instructions.
+      @param mem Data of all blocks, len bytes
+      @param sums Receives (len + blockLen - 1) / blockLen checksums */
+  static void blockSums(const Ubyte* mem, size_t len, size_t blockLen,
+                        SHA256* sums);
+  /** Name of the implementation used by update() and blockSums():
+      "sha" for the x86 SHA extensions, "avx2" if only blockSums() is
+      vectorized, processing several blocks at once, or "none" for the
+      portable code. By default, the fastest one on this CPU is used. */
+  static const char* simdName();
+  /** Use the named implementation from now on, or the default one if
+      name is null. For tests and benchmarks.
+      @return false if the CPU or compiler does not support it */
+  static bool setSimd(const char* name);
+
   /* Serializing an SHA256Sum is only allowed after finish(). The
      serialization is compatible with that of SHA256. */
   template<class Iterator>
@@ -181,6 +200,8 @@ private:
   static Ubyte* sha256_read_ctx(const sha256_ctx *ctx, Ubyte* resbuf);
   static void sha256_process_block(const void* buffer, size_t len,
                                 sha256_ctx* ctx);
+  static void sha256_process_block_portable(const void* buffer, size_t len,
+                                           sha256_ctx* ctx);
   SHA256 sum;
   struct sha256_ctx* p; // null once MD creation is finished
 
@@ -0,0 +1,110 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Runtime selection of the SIMD code of a checksum algorithm
+
+  A checksum with SIMD code has a table of its implementations, called
+  kernels: structs with a "const char* name" member and whatever else
+  the algorithm needs, e.g. function pointers. The first entry is the
+  portable code, named "none", the last one has a null name. The table
+  only contains the kernels which the compiler supports; a
+  Selection<Kernels> picks the one to use on this CPU.
+
+*/
+
+#ifndef SIMDKERNELS_HH
+#define SIMDKERNELS_HH
+
+#include <config.h>
+
+#include <string.h>
+//______________________________________________________________________
+
+namespace SimdKernels {
+
+  /** Can this CPU run the kernels with the given name? Known names are
+      "sse4.1", "avx2", "sha" (which also needs SSE4.1) and "none" */
+  inline bool supported(const char* name) {
+#   if HAVE_X86_SIMD
+    // May run before constructors of libgcc, so initialize explicitly
+    __builtin_cpu_init();
+#   if HAVE_X86_SHA
+    if (strcmp(name, "sha") == 0)
+      return __builtin_cpu_supports("sha")
+        && __builtin_cpu_supports("sse4.1");
+#   endif
+    if (strcmp(name, "sse4.1") == 0)
+      return __builtin_cpu_supports("sse4.1");
+    if (strcmp(name, "avx2") == 0)
+      return __builtin_cpu_supports("avx2");
+#   endif
+    return strcmp(name, "none") == 0;
+  }
+
+  /** For tables in order of preference: The last supported entry */
+  template<class Kernels>
+  const Kernels* preferred(const Kernels* all) {
+    const Kernels* best = all;
+    for (const Kernels* k = all; k->name != 0; ++k)
+      if (supported(k->name)) best = k;
+    return best;
+  }
+
+  /** Pseudo-random data, the same for every run, for timing kernels and
+      for tests */
+  inline void fill(Ubyte* data, size_t len) {
+    uint32 x = 0x12345678;
+    for (size_t i = 0; i < len; ++i) {
+      x = x * 1664525 + 1013904223;
+      data[i] = static_cast<Ubyte>(x >> 24);
+    }
+  }
+
+  /** The kernels of one checksum which are used from now on. Initialize
+      as an aggregate, e.g. "Selection<Kernels> kernels = { table, 0, 0 }",
+      so it is usable before constructors run. As the default is cached
+      per Kernels type, that type must only be used by one Selection. */
+  template<class Kernels>
+  struct Selection {
+    const Kernels* all; // The table
+    // Returns the default kernels, called once; if null, use preferred()
+    const Kernels* (*choose)();
+    const Kernels* forced; // Set by set()
+
+    /** The kernels passed to set(), otherwise the default ones */
+    inline const Kernels& get() const;
+
+    /** Use the named kernels from now on, or the default ones if name is
+        null. For checksum classes' setSimd().
+        @return false if the CPU or compiler does not support them */
+    bool set(const char* name);
+  };
+
+}
+//______________________________________________________________________
+
+template<class Kernels>
+const Kernels& SimdKernels::Selection<Kernels>::get() const {
+  if (forced != 0) return *forced;
+  static const Kernels* fastest = (choose != 0 ? choose() : preferred(all));
+  return *fastest;
+}
+
+template<class Kernels>
+bool SimdKernels::Selection<Kernels>::set(const char* name) {
+  if (name == 0) { forced = 0; return true; }
+  for (const Kernels* k = all; k->name != 0; ++k) {
+    if (strcmp(k->name, name) != 0) continue;
+    if (!supported(k->name)) return false;
+    forced = k;
+    return true;
+  }
+  return false;
+}
+
+#endif
@@ -0,0 +1,89 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Helpers for multi-buffer checksum code with x86 AVX2
+
+  A multi-buffer implementation of a checksum algorithm processes 8
+  independent messages of the same length at once. Each 32-bit lane of
+  a vector register holds the value of one message's state variable,
+  so the algorithm itself is the same as the scalar code, just with
+  vector instead of integer arithmetic.
+
+  Only for util/md5sum.cc and util/sha256sum.cc; only include this
+  header if HAVE_X86_SIMD.
+
+*/
+
+#ifndef SIMDLANES_HH
+#define SIMDLANES_HH
+
+#include <config.h>
+
+#include <immintrin.h>
+//______________________________________________________________________
+
+namespace SimdLanes {
+
+  const int LANES = 8;
+
+  /** Load 32 bytes from p[0]+off, ..., p[7]+off, and transpose them, so
+      that w[j] contains the j-th 32-bit word of each of the 8 messages.
+      The words are read in little-endian byte order. */
+  __attribute__((target("avx2")))
+  inline void load8x8(const Ubyte* const p[LANES], size_t off,
+                      __m256i w[8]) {
+    __m256i r[LANES], t[LANES];
+    for (int i = 0; i < LANES; ++i)
+      r[i] = _mm256_loadu_si256((const __m256i*)(p[i] + off));
+    for (int i = 0; i < LANES; i += 2) {
+      t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+      t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    // Words (0 4), (1 5), (2 6), (3 7) of lanes 0-3 and 4-7
+    r[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+    r[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+    r[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+    r[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+    r[4] = _mm256_unpacklo_epi64(t[4], t[6]);
+    r[5] = _mm256_unpackhi_epi64(t[4], t[6]);
+    r[6] = _mm256_unpacklo_epi64(t[5], t[7]);
+    r[7] = _mm256_unpackhi_epi64(t[5], t[7]);
+    for (int j = 0; j < 4; ++j) {
+      w[j] = _mm256_permute2x128_si256(r[j], r[j + 4], 0x20);
+      w[j + 4] = _mm256_permute2x128_si256(r[j], r[j + 4], 0x31);
+    }
+  }
+
+  __attribute__((target("avx2")))
+  inline __m256i rotl(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_slli_epi32(x, n),
+                           _mm256_srli_epi32(x, 32 - n));
+  }
+
+  /** Pad the last len % 64 bytes of a message of length len, for MD5 if
+      bigEndian is false, otherwise for SHA256. The result is 64 or 128
+      bytes long and stored in buf.
+      @return Length of the padded data */
+  inline size_t pad(Ubyte buf[128], const Ubyte* mem, size_t len,
+                    bool bigEndian) {
+    size_t tail = len % 64;
+    size_t padded = (tail < 56 ? 64 : 128);
+    for (size_t i = 0; i < tail; ++i) buf[i] = mem[len - tail + i];
+    buf[tail] = 0x80;
+    for (size_t i = tail + 1; i < padded - 8; ++i) buf[i] = 0;
+    uint64 bits = (uint64)len << 3;
+    for (int i = 0; i < 8; ++i) {
+      int shift = (bigEndian ? 56 - 8 * i : 8 * i);
+      buf[padded - 8 + i] = static_cast<Ubyte>(bits >> shift);
+    }
+    return padded;
+  }
+
+}
+
+#endif
@@ -0,0 +1,56 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Storage for many small strings which live as long as their owner
+
+  #test-deps util/stringpool.o
+
+*/
+
+#include <config.h>
+
+#include <string.h>
+#include <vector>
+
+#include <debug.hh>
+#include <log.hh>
+#include <string.hh>
+#include <stringpool.hh>
+//______________________________________________________________________
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+
+  StringPool pool;
+  vector<const char*> copies;
+  string s;
+  // Enough strings to need several blocks
+  for (unsigned i = 0; i < 100000; ++i) {
+    append(s = "pool/main/f/foo/foo_", i);
+    copies.push_back(pool.add(s));
+  }
+  // A long string gets its own block
+  string longStr(100000, 'x');
+  const char* longCopy = pool.add(longStr);
+  const char* after = pool.add("after", 5);
+  for (unsigned i = 0; i < 100000; ++i) {
+    append(s = "pool/main/f/foo/foo_", i);
+    Assert(strcmp(copies[i], s.c_str()) == 0);
+  }
+  Assert(longStr == longCopy);
+  Assert(strcmp(after, "after") == 0);
+  Assert(*pool.add("", 0) == '\0');
+
+  // Interned strings are only stored once
+  const string* a = pool.intern("pool/main/f/foo/");
+  const string* b = pool.intern(string("pool/main/f/") + "foo/");
+  const string* c = pool.intern("pool/main/b/bar/");
+  Assert(a == b);
+  Assert(a != c);
+  Assert(*a == "pool/main/f/foo/");
+  Assert(*c == "pool/main/b/bar/");
+  return 0;
+}
@@ -0,0 +1,43 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Storage for many small strings which live as long as their owner
+
+*/
+
+#include <config.h>
+
+#include <string.h>
+
+#include <stringpool.hh>
+//______________________________________________________________________
+
+StringPool::~StringPool() {
+  for (vector<char*>::iterator i = blocks.begin(), e = blocks.end();
+       i != e; ++i)
+    delete[] *i;
+}
+
+const char* StringPool::add(const char* s, size_t len) {
+  char* result;
+  if (len + 1 <= left) {
+    result = next;
+    next += len + 1;
+    left -= len + 1;
+  } else if (len + 1 > BLOCK_SIZE / 4) {
+    // Long string gets its own block, keep using the current one
+    result = new char[len + 1];
+    blocks.push_back(result);
+  } else {
+    result = new char[BLOCK_SIZE];
+    blocks.push_back(result);
+    next = result + len + 1;
+    left = BLOCK_SIZE - len - 1;
+  }
+  memcpy(result, s, len);
+  result[len] = '\0';
+  return result;
+}
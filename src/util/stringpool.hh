@@ -0,0 +1,55 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Storage for many small strings which live as long as their owner
+
+  Instead of one heap allocation per string, the characters are copied
+  into large blocks, which are only freed by the StringPool's dtor.
+  Strings which occur many times (e.g. directory names) can be
+  interned, so only one copy is kept.
+
+*/
+
+#ifndef STRINGPOOL_HH
+#define STRINGPOOL_HH
+
+#include <config.h>
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <nocopy.hh>
+//______________________________________________________________________
+
+/** Pool of strings; nothing is freed before the pool is destroyed */
+class StringPool : NoCopy {
+public:
+  StringPool() : blocks(), next(0), left(0), interned() { }
+  ~StringPool();
+
+  /** Return a null-terminated copy of the len bytes at s */
+  const char* add(const char* s, size_t len);
+  const char* add(const string& s) { return add(s.data(), s.size()); }
+
+  /** Return a copy of s. For equal strings, the same copy is returned,
+      so they can also be compared by address. */
+  const string* intern(const string& s) {
+    return &*interned.insert(s).first;
+  }
+
+private:
+  static const size_t BLOCK_SIZE = 64 * 1024;
+
+  vector<char*> blocks;
+  char* next; // Free space in the last block
+  size_t left; // Number of bytes free at next
+  unordered_set<string> interned; // Elements are never moved
+};
+
+#endif
@@ -0,0 +1,66 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Fixed-size pool of worker threads
+
+  #test-deps util/threadpool.o
+  #test-ldflags $(LIBS)
+
+*/
+
+#include <config.h>
+
+#include <vector>
+
+#include <debug.hh>
+#include <log.hh>
+#include <threadpool.hh>
+//______________________________________________________________________
+
+namespace {
+
+  Mutex lock;
+  unsigned count = 0;
+
+  void add(unsigned* result, unsigned x) {
+    result[x] = x * x;
+    MutexLock l(lock);
+    ++count;
+  }
+
+  // Submit n jobs to a pool with the given nr of threads, check results
+  void test(unsigned threads, unsigned n) {
+    vector<unsigned> result(n, 0);
+    count = 0;
+    {
+      ThreadPool pool(threads);
+      Assert(pool.threads() == (threads < 2 ? 0 : threads));
+      for (unsigned i = 0; i < n / 2; ++i)
+        pool.submit(bind(&add, &result[0], i));
+      pool.wait();
+      MutexLock l(lock);
+      Assert(count == n / 2);
+      l.unlock();
+      for (unsigned i = n / 2; i < n; ++i)
+        pool.submit(bind(&add, &result[0], i));
+      // Dtor waits for the remaining jobs
+    }
+    Assert(count == n);
+    for (unsigned i = 0; i < n; ++i)
+      Assert(result[i] == i * i);
+  }
+
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+  Assert(ThreadPool::cpus() >= 1);
+  test(0, 100);
+  test(1, 100);
+  test(2, 1000);
+  test(8, 10000);
+  return 0;
+}
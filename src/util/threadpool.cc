@@ -0,0 +1,90 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Fixed-size pool of worker threads
+
+*/
+
+#include <config.h>
+
+#include <debug.hh>
+#include <log.hh>
+#include <threadpool.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("threadpool")
+
+#if HAVE_THREADS
+
+ThreadPool::ThreadPool(unsigned n)
+    : threadCount(n < 2 ? 0 : n), workers(), jobs(), running(0),
+      stopping(false) {
+  debug("Starting %1 threads", threadCount);
+  workers.reserve(threadCount);
+  for (unsigned i = 0; i < threadCount; ++i)
+    workers.push_back(thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool() {
+  MutexLock l(lock);
+  stopping = true;
+  l.unlock();
+  jobAdded.notify_all();
+  for (vector<thread>::iterator i = workers.begin(), e = workers.end();
+       i != e; ++i)
+    i->join();
+}
+//________________________________________
+
+void ThreadPool::submit(const Job& job) {
+  if (threadCount == 0) { job(); return; }
+  MutexLock l(lock);
+  jobs.push_back(job);
+  l.unlock();
+  jobAdded.notify_one();
+}
+
+void ThreadPool::wait() {
+  MutexLock l(lock);
+  while (!jobs.empty() || running > 0) jobDone.wait(l);
+}
+//________________________________________
+
+// Main loop of each worker thread
+void ThreadPool::work() {
+  MutexLock l(lock);
+  while (true) {
+    // Finish all queued jobs before exiting
+    while (jobs.empty() && !stopping) jobAdded.wait(l);
+    if (jobs.empty()) return;
+    Job job;
+    job.swap(jobs.front());
+    jobs.pop_front();
+    ++running;
+    l.unlock();
+    job();
+    l.lock();
+    --running;
+    if (jobs.empty() && running == 0) jobDone.notify_all();
+  }
+}
+//________________________________________
+
+unsigned ThreadPool::cpus() {
+  unsigned n = thread::hardware_concurrency();
+  return (n == 0 ? 1 : n);
+}
+//______________________________________________________________________
+
+#else
+
+ThreadPool::ThreadPool(unsigned) : threadCount(0) { }
+ThreadPool::~ThreadPool() { }
+void ThreadPool::submit(const Job& job) { job(); }
+void ThreadPool::wait() { }
+unsigned ThreadPool::cpus() { return 1; }
+
+#endif
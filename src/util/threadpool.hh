@@ -0,0 +1,101 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Fixed-size pool of worker threads
+
+  If jigdo was compiled without thread support (HAVE_THREADS == 0) or
+  the pool has no worker threads, submitted jobs are executed right
+  away by the thread calling submit(). Code using a ThreadPool
+  therefore needs no special case for the single-threaded build, as
+  long as it only waits for jobs it has already submitted.
+
+*/
+
+#ifndef THREADPOOL_HH
+#define THREADPOOL_HH
+
+#include <config.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+#if HAVE_THREADS
+#  include <condition_variable>
+#  include <mutex>
+#  include <thread>
+#endif
+
+#include <nocopy.hh>
+//______________________________________________________________________
+
+/** @name
+    Synchronization primitives for code which shares data with
+    ThreadPool jobs. Without thread support, these do nothing. */
+//@{
+#if HAVE_THREADS
+typedef mutex Mutex;
+typedef unique_lock<mutex> MutexLock;
+typedef condition_variable Condition;
+#else
+struct Mutex { };
+struct MutexLock {
+  explicit MutexLock(Mutex&) { }
+  void lock() { }
+  void unlock() { }
+};
+/* All jobs have finished by the time anyone waits, so whatever was
+   waited for has already happened */
+struct Condition {
+  void wait(MutexLock&) { }
+  void notify_one() { }
+  void notify_all() { }
+};
+#endif
+//@}
+//______________________________________________________________________
+
+/** A number of threads which execute jobs taken from a FIFO queue */
+class ThreadPool : NoCopy {
+public:
+  typedef function<void()> Job;
+
+  /** Start the given number of worker threads. 0 or 1 means that no
+      threads are started and all jobs run in the thread which calls
+      submit(). */
+  explicit ThreadPool(unsigned threadCount);
+  /** Waits for all submitted jobs to finish */
+  ~ThreadPool();
+
+  /** Number of worker threads, 0 if jobs are run by submit() */
+  unsigned threads() const { return threadCount; }
+  /** Queue a job for execution by one of the worker threads. The job
+      must not throw exceptions; if it needs to report errors, it
+      should store them somewhere for the submitter to pick up. */
+  void submit(const Job& job);
+  /** Wait until all jobs submitted so far have finished */
+  void wait();
+
+  /** Number of CPUs available, or 1 if this cannot be determined */
+  static unsigned cpus();
+
+private:
+  unsigned threadCount;
+# if HAVE_THREADS
+  void work();
+
+  vector<thread> workers;
+  deque<Job> jobs; // Not yet started
+  unsigned running; // Number of jobs being executed
+  bool stopping; // Set by dtor to make workers exit
+  Mutex lock;
+  Condition jobAdded; // Signalled when jobs is nonempty, or stopping
+  Condition jobDone; // Signalled when jobs is empty and running == 0
+# endif
+};
+
+#endif
@@ -203,3 +203,36 @@ void ZobstreamBz::zip2(Ubyte* start, unsigned len, bool finish) {
     if (status != BZ_RUN_OK && status != BZ_FINISH_OK) throwZerrorBz(status);
   }
 }
+//______________________________________________________________________
+
+/* Compress one chunk with a bz_stream of its own. The result is the same
+   as that of zip2() for a chunk of chunkLim() bytes. */
+unsigned ZobstreamBz::zipChunk(const Ubyte* start, unsigned len,
+                               vector<Ubyte>& out) const {
+  bz_stream s;
+  s.bzalloc = 0;
+  s.bzfree = 0;
+  s.opaque = 0;
+  int status = BZ2_bzCompressInit(&s, compressLevel, 0/*verbosity*/,
+                                  0/*default workFactor*/);
+  if (status != BZ_OK) throwZerrorBz(status);
+
+  // Max size of compressed data according to the libbz2 documentation
+  out.resize(len + len / 100 + 600);
+  s.next_in = reinterpret_cast<char*>(const_cast<Ubyte*>(start));
+  s.avail_in = len;
+  s.next_out = reinterpret_cast<char*>(&out[0]);
+  s.avail_out = (unsigned)out.size();
+  status = BZ2_bzCompress(&s, BZ_FINISH);
+  while (status == BZ_FINISH_OK) { // Just in case, should not happen
+    size_t done = out.size() - s.avail_out;
+    out.resize(2 * out.size());
+    s.next_out = reinterpret_cast<char*>(&out[done]);
+    s.avail_out = (unsigned)(out.size() - done);
+    status = BZ2_bzCompress(&s, BZ_FINISH);
+  }
+  out.resize(out.size() - s.avail_out);
+  BZ2_bzCompressEnd(&s);
+  if (status != BZ_STREAM_END) throwZerrorBz(status);
+  return 0x50495a42u; // BZIP
+}
@@ -39,7 +39,7 @@ public:
                      unsigned todoBufSz /*= 256U*/,
 		     MD5Sum* md /*= 0*/,
 		     SHA256Sum* sd /*= 0*/);
-  ~ZobstreamBz() { Assert(memReleased); }
+  ~ZobstreamBz() { endThreads(); Assert(memReleased); }
 
   /** @param s Output stream
       @param level 1 to 9 (0 is allowed but interpreted as 1)
@@ -68,6 +68,8 @@ protected:
   virtual void setNextIn(Ubyte* n) {
     z.next_in = reinterpret_cast<char*>(n); }
   virtual void zip2(Ubyte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const Ubyte* start, unsigned len,
+                            vector<Ubyte>& out) const;
 
 private:
   bz_stream z;
@@ -81,6 +81,9 @@ namespace {
 
 void ZobstreamGz::open(bostream& s, unsigned chunkLimit, int level,
                        int windowBits, int memLevel, unsigned todoBufSz) {
+  compressLevel = level;
+  compressWindowBits = windowBits;
+  compressMemLevel = memLevel;
   z.next_in = 0;
   z.next_out = zipBuf->data;
   z.avail_out = (zipBuf == 0 ? 0 : ZIPDATA_SIZE);
@@ -168,3 +171,35 @@ void ZobstreamGz::zip2(Ubyte* start, unsigned len, bool finish) {
     if (status != Z_OK) throwZerrorGz(status, z.msg);
   }
 }
+//______________________________________________________________________
+
+// Compress one chunk with a z_stream of its own
+unsigned ZobstreamGz::zipChunk(const Ubyte* start, unsigned len,
+                               vector<Ubyte>& out) const {
+  z_stream s;
+  s.zalloc = (alloc_func)0;
+  s.zfree = (free_func)0;
+  s.opaque = 0;
+  int status = deflateInit2(&s, compressLevel, Z_DEFLATED,
+                            compressWindowBits, compressMemLevel,
+                            Z_DEFAULT_STRATEGY);
+  if (status != Z_OK) throwZerrorGz(status, s.msg);
+
+  // With enough room for the output, one deflate() call is sufficient
+  out.resize(deflateBound(&s, len));
+  s.next_in = const_cast<Ubyte*>(start);
+  s.avail_in = len;
+  s.next_out = &out[0];
+  s.avail_out = (unsigned)out.size();
+  status = deflate(&s, Z_FINISH);
+  out.resize(s.total_out);
+  if (status != Z_STREAM_END) {
+    string m;
+    if (s.msg != 0) m = s.msg;
+    ::deflateEnd(&s);
+    throwZerrorGz(status == Z_OK ? Z_BUF_ERROR : status, m.c_str());
+  }
+  status = ::deflateEnd(&s);
+  if (status != Z_OK) throwZerrorGz(status, s.msg);
+  return 0x41544144u; // DATA
+}
@@ -39,7 +39,7 @@ public:
                      int level = Z_DEFAULT_COMPRESSION, int windowBits = 15,
                      int memLevel = 8, unsigned todoBufSz = 256U,
                      MD5Sum* md = 0, SHA256Sum* sd = 0);
-  ~ZobstreamGz() { Assert(memReleased); }
+  ~ZobstreamGz() { endThreads(); Assert(memReleased); }
 
   /** @param s Output stream
       @param chunkLimit Size limit for output data, will buffer this much
@@ -68,6 +68,8 @@ protected:
   virtual void setNextOut(Ubyte* n) { z.next_out = n; }
   virtual void setNextIn(Ubyte* n) { z.next_in = n; }
   virtual void zip2(Ubyte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const Ubyte* start, unsigned len,
+                            vector<Ubyte>& out) const;
 
 private:
   // Throw a Zerror exception, or bad_alloc() for status==Z_MEM_ERROR
@@ -76,6 +78,8 @@ private:
   z_stream z;
   // To keep track in the dtor whether deflateEnd() has been called
   bool memReleased;
+  // Args to open(), needed by zipChunk()
+  int compressLevel, compressWindowBits, compressMemLevel;
 };
 //______________________________________________________________________
 
@@ -0,0 +1,185 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Compress data into DATA or ZSTD parts and read it back, serially and in
+  parallel
+
+  #test-deps zstream.o zstream-gz.o zstream-bz.o zstream-zstd.o
+  #test-deps util/bstream.o util/glibc-md5.o util/glibc-sha256.o
+  #test-deps util/md5sum.o util/sha256sum.o util/threadpool.o
+  #test-ldflags $(LIBS)
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <bstream.hh>
+#include <debug.hh>
+#include <log.hh>
+#include <serialize.hh>
+#include <zstream-gz.hh>
+#include <zstream-zstd.hh>
+//______________________________________________________________________
+
+namespace {
+
+  const char* const fileName = "zstream-test.tmp";
+  const unsigned CHUNK = 4096;
+
+  void random(vector<Ubyte>& v, size_t n) {
+    v.resize(n);
+    for (size_t i = 0; i < n; ++i) v[i] = static_cast<Ubyte>(rand() >> 8);
+  }
+
+  // Append data to f as gzip-compressed DATA parts
+  void zip(bostream& f, const vector<Ubyte>& data, unsigned threads) {
+    ZobstreamGz z(f, CHUNK, 9);
+    z.setThreads(threads);
+    if (!data.empty()) z.write(&data[0], static_cast<unsigned>(data.size()));
+    z.close();
+    Assert(f);
+  }
+
+  void zip(const vector<Ubyte>& data, unsigned threads) {
+    bofstream f(fileName, ios::binary);
+    zip(f, data, threads);
+  }
+
+# if HAVE_ZSTD
+  // Write data to the file as ZSTD parts of ZSTDCHUNK_SIZE
+  void zipZstd(const vector<Ubyte>& data, unsigned threads) {
+    bofstream f(fileName, ios::binary);
+    ZobstreamZstd z(f, 3, ZSTDCHUNK_SIZE);
+    z.setThreads(threads);
+    if (!data.empty()) z.write(&data[0], static_cast<unsigned>(data.size()));
+    z.close();
+    Assert(f);
+  }
+
+  // The file's contents
+  void readFile(vector<Ubyte>& result) {
+    bifstream f(fileName, ios::binary);
+    result.clear();
+    Ubyte buf[4096];
+    while (f) {
+      readBytes(f, buf, sizeof(buf));
+      result.insert(result.end(), buf, buf + f.gcount());
+    }
+  }
+# endif
+
+  /* Uncompressed sizes of the parts in the file. If type is non-null, all
+     parts must have that type, e.g. "DATA". */
+  void partSizes(vector<uint64>& result, const char* type = 0) {
+    result.clear();
+    FILE* f = fopen(fileName, "rb");
+    Assert(f != 0);
+    Ubyte hdr[16];
+    while (fread(hdr, 1, 16, f) == 16) {
+      uint64 len, unc;
+      if (type != 0) Assert(memcmp(hdr, type, 4) == 0);
+      unserialize6(len, hdr + 4);
+      unserialize6(unc, hdr + 10);
+      result.push_back(unc);
+      fseek(f, static_cast<long>(len - 16), SEEK_CUR);
+    }
+    fclose(f);
+  }
+
+  // Check that the file decompresses to data
+  void unzip(const vector<Ubyte>& data, unsigned threads) {
+    bifstream f(fileName, ios::binary);
+    Zibstream z(f);
+    z.setThreads(threads);
+    vector<Ubyte> result(data.size() + 1);
+    if (!data.empty()) {
+      z.read(&result[0], static_cast<unsigned>(data.size()));
+      Assert(z.gcount() == data.size());
+    }
+    result.resize(data.size());
+    Assert(result == data);
+  }
+
+}
+//______________________________________________________________________
+
+int main(int argc, char* argv[]) {
+  if (argc == 2) Logger::scanOptions(argv[1], argv[0]);
+  vector<Ubyte> data;
+  vector<uint64> sizes;
+
+  // Exact multiple of the chunk size: No empty part after the last chunk
+  random(data, 3 * CHUNK);
+  zip(data, 4);
+  partSizes(sizes);
+  Assert(sizes.size() == 3);
+  for (size_t i = 0; i < sizes.size(); ++i) Assert(sizes[i] == CHUNK);
+  unzip(data, 0);
+  unzip(data, 4);
+
+  // Not a multiple
+  random(data, 2 * CHUNK + 100);
+  zip(data, 4);
+  partSizes(sizes);
+  Assert(sizes.size() == 3 && sizes[2] == 100);
+  unzip(data, 0);
+  unzip(data, 4);
+
+  // No data at all: One empty part, as in the single-threaded case
+  data.clear();
+  zip(data, 4);
+  partSizes(sizes);
+  Assert(sizes.size() == 1 && sizes[0] == 0);
+
+  // Empty parts between and after other parts are skipped by all readers
+  vector<Ubyte> none, more;
+  random(data, CHUNK + 10);
+  random(more, 3 * CHUNK);
+  {
+    bofstream f(fileName, ios::binary);
+    zip(f, data, 4);
+    zip(f, none, 4);
+    zip(f, more, 0);
+    zip(f, none, 0);
+  }
+  partSizes(sizes);
+  Assert(sizes.size() > 4 && sizes[2] == 0 && sizes.back() == 0);
+  data.insert(data.end(), more.begin(), more.end());
+  unzip(data, 0);
+  unzip(data, 4);
+
+# if HAVE_ZSTD
+  // zstd: Exact multiple of the chunk size, same output with threads
+  vector<Ubyte> serial, parallel;
+  random(data, 2 * ZSTDCHUNK_SIZE);
+  zipZstd(data, 0);
+  readFile(serial);
+  zipZstd(data, 4);
+  readFile(parallel);
+  Assert(serial == parallel);
+  partSizes(sizes, "ZSTD");
+  Assert(sizes.size() == 2);
+  for (size_t i = 0; i < sizes.size(); ++i) Assert(sizes[i] == ZSTDCHUNK_SIZE);
+  unzip(data, 0);
+  unzip(data, 4);
+
+  // zstd, no data: One empty part
+  data.clear();
+  zipZstd(data, 4);
+  partSizes(sizes, "ZSTD");
+  Assert(sizes.size() == 1 && sizes[0] == 0);
+  unzip(data, 0);
+  unzip(data, 4);
+# endif
+
+  remove(fileName);
+  return 0;
+}
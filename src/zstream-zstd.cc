@@ -0,0 +1,96 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Zstandard compression layer which integrates with C++ streams
+
+*/
+
+#include <config.h>
+
+#if HAVE_ZSTD
+
+#include <algorithm>
+#include <new>
+
+#include <log.hh>
+#include <string.hh>
+#include <zstream-zstd.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("zstream-zstd")
+
+namespace {
+
+  // Turn libzstd error codes into C++ exceptions
+  void throwZerrorZstd(size_t result) {
+    Assert(ZSTD_isError(result));
+    if (ZSTD_getErrorCode(result) == ZSTD_error_memory_allocation)
+      throw bad_alloc();
+    throw Zerror((int)ZSTD_getErrorCode(result), ZSTD_getErrorName(result));
+  }
+
+} // namespace
+//______________________________________________________________________
+
+void ZobstreamZstd::open(bostream& s, int level, unsigned chunkLimit,
+                         unsigned todoBufSz) {
+  if (level < 1) level = 1;
+  if (level > ZSTD_maxCLevel()) level = ZSTD_maxCLevel();
+  compressLevel = level;
+  in.clear();
+  in.reserve(chunkLimit);
+  written = false;
+
+  // Declare stream as open
+  debug("opening, level %1", level);
+  Zobstream::open(s, chunkLimit, todoBufSz);
+}
+//______________________________________________________________________
+
+/* Collect chunkLim() bytes of input, then compress and write them as one
+   ZSTD part. As with bzip2, a chunk ends exactly after chunkLim() bytes.
+   Like Zobstream::zipParallel(), the last chunk is only written on
+   finish if it contains data, or if there was no data at all. */
+void ZobstreamZstd::zip2(Ubyte* start, unsigned len, bool finish) {
+  debug("zip2 %1 bytes at %2", len, start);
+  Assert(is_open());
+  vector<Ubyte> out;
+  while (len > 0) {
+    unsigned n = min(len, chunkLim() - (unsigned)in.size());
+    in.insert(in.end(), start, start + n);
+    start += n;
+    len -= n;
+    if (in.size() < chunkLim()) break;
+    out.clear();
+    writePart(zipChunk(&in[0], (unsigned)in.size(), out), out, in.size());
+    written = true;
+    deflateReset();
+  }
+  if (!finish || (in.empty() && written)) return;
+  out.clear();
+  writePart(zipChunk(in.empty() ? 0 : &in[0], (unsigned)in.size(), out),
+            out, in.size());
+  deflateReset();
+}
+
+unsigned ZobstreamZstd::zipChunk(const Ubyte* start, unsigned len,
+                                 vector<Ubyte>& out) const {
+  ZSTD_CCtx* c = ZSTD_createCCtx();
+  if (c == 0) throw bad_alloc();
+  size_t r = ZSTD_CCtx_setParameter(c, ZSTD_c_compressionLevel,
+                                    compressLevel);
+  if (!ZSTD_isError(r)) {
+    size_t old = out.size();
+    out.resize(old + ZSTD_compressBound(len));
+    r = ZSTD_compress2(c, &out[old], out.size() - old, start, len);
+    out.resize(ZSTD_isError(r) ? old : old + r);
+  }
+  ZSTD_freeCCtx(c);
+  if (ZSTD_isError(r)) throwZerrorZstd(r);
+  return 0x4454535au; // ZSTD
+}
+
+#endif /* HAVE_ZSTD */
@@ -0,0 +1,153 @@
+/* -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Zstandard compression and decompression for zstream
+
+  Only available if HAVE_ZSTD is 1.
+
+*/
+
+#ifndef ZSTREAM_ZSTD_HH
+#define ZSTREAM_ZSTD_HH
+
+#include <config.h>
+
+#if HAVE_ZSTD
+
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#include <log.hh>
+#include <zstream.hh>
+//______________________________________________________________________
+
+/** Unlike zlib and libbz2, the data of each chunk is compressed in one go
+    once chunkLimit bytes of input have been collected, which makes the
+    output the same regardless of Zobstream::setThreads(). */
+class ZobstreamZstd : public Zobstream {
+public:
+  inline ZobstreamZstd(bostream& s, int level, unsigned chunkLimit,
+                       unsigned todoBufSz = 256U, MD5Sum* md = 0,
+                       SHA256Sum* sd = 0);
+  ~ZobstreamZstd() { endThreads(); }
+
+  /** @param s Output stream
+      @param level 1 to ZSTD_maxCLevel()
+      @param chunkLimit Amount of uncompressed data per ZSTD part
+      @param todoBufSz Size of mini buffer, which holds data sent to
+      the stream with single put() calls or << statements */
+  void open(bostream& s, int level, unsigned chunkLimit,
+            unsigned todoBufSz = 256U);
+
+protected:
+  virtual void deflateEnd() { vector<Ubyte>().swap(in); }
+  virtual void deflateReset() { in.clear(); }
+
+  /* The next*, avail* and total* values are not used by this class; only
+     totalIn() has a meaning */
+  virtual unsigned totalOut() const { return 0; }
+  virtual unsigned totalIn() const { return (unsigned)in.size(); }
+  virtual unsigned availOut() const { return 0; }
+  virtual unsigned availIn() const { return 0; }
+  virtual Ubyte* nextOut() const { return 0; }
+  virtual Ubyte* nextIn() const { return 0; }
+  virtual void setTotalOut(unsigned) { }
+  virtual void setTotalIn(unsigned) { }
+  virtual void setAvailOut(unsigned) { }
+  virtual void setAvailIn(unsigned) { }
+  virtual void setNextOut(Ubyte*) { }
+  virtual void setNextIn(Ubyte*) { }
+
+  virtual void zip2(Ubyte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const Ubyte* start, unsigned len,
+                            vector<Ubyte>& out) const;
+
+private:
+  int compressLevel;
+  vector<Ubyte> in; // Uncompressed data of current chunk
+  bool written; // At least one part was written
+};
+//______________________________________________________________________
+
+class ZibstreamZstd : public Zibstream::Impl {
+public:
+  class ZibstreamZstdError : public Zerror {
+  public:
+    ZibstreamZstdError(int s, const string& m) : Zerror(s, m) { }
+  };
+
+  ZibstreamZstd() : d(0), result(0), end_(false), totalInVal(0),
+                    totalOutVal(0), nextInVal(0), availInVal(0),
+                    availOutVal(0) { }
+  ~ZibstreamZstd() { Assert(d == 0); }
+
+  virtual unsigned totalOut() const { return totalOutVal; }
+  virtual unsigned totalIn() const { return totalInVal; }
+  virtual unsigned availOut() const { return availOutVal; }
+  virtual unsigned availIn() const { return availInVal; }
+  virtual Ubyte* nextOut() const { return 0; }
+  virtual Ubyte* nextIn() const { return nextInVal; }
+  virtual void setTotalOut(unsigned n) { totalOutVal = n; }
+  virtual void setTotalIn(unsigned n) { totalInVal = n; }
+  virtual void setAvailIn(unsigned n) { availInVal = n; }
+  virtual void setNextIn(Ubyte* n) { nextInVal = n; }
+
+  virtual void init() {
+    d = ZSTD_createDStream();
+    result = (d == 0 ? (size_t)-1 : ZSTD_initDStream(d));
+    end_ = false;
+  }
+  virtual void end() {
+    if (d != 0) ZSTD_freeDStream(d);
+    d = 0;
+    result = 0;
+    end_ = false;
+  }
+  virtual void reset() {
+    result = ZSTD_DCtx_reset(d, ZSTD_reset_session_only);
+    end_ = false;
+  }
+  virtual void inflate(Ubyte** nextOut, unsigned* availOut) {
+    ZSTD_inBuffer zin = { nextInVal, availInVal, 0 };
+    ZSTD_outBuffer zout = { *nextOut, *availOut, 0 };
+    result = ZSTD_decompressStream(d, &zout, &zin);
+    nextInVal += zin.pos; availInVal -= (unsigned)zin.pos;
+    totalInVal += (unsigned)zin.pos;
+    *nextOut += zout.pos; *availOut -= (unsigned)zout.pos;
+    totalOutVal += (unsigned)zout.pos;
+    availOutVal = *availOut;
+    if (result == 0) end_ = true; // Frame completely decoded
+  }
+  virtual bool streamEnd() const { return end_; }
+  virtual bool ok() const { return !end_ && !ZSTD_isError(result); }
+  virtual void throwError() const {
+    if (d == 0) throw bad_alloc();
+    throw ZibstreamZstdError((int)ZSTD_getErrorCode(result),
+                             ZSTD_getErrorName(result));
+  }
+
+private:
+  ZSTD_DStream* d;
+  size_t result; // Return value of last libzstd call
+  bool end_;
+  unsigned totalInVal, totalOutVal;
+  Ubyte* nextInVal;
+  unsigned availInVal;
+  unsigned availOutVal; // Space left in output buffer after inflate()
+};
+//======================================================================
+
+ZobstreamZstd::ZobstreamZstd(bostream& s, int level, unsigned chunkLimit,
+                             unsigned todoBufSz, MD5Sum* md, SHA256Sum* sd)
+    : Zobstream(md, sd), compressLevel(level), in(), written(false) {
+  open(s, level, chunkLimit, todoBufSz);
+}
+
+#endif /* HAVE_ZSTD */
+
+#endif
@@ -21,6 +21,7 @@
 #include <zlib.h>
 
 #include <algorithm>
+#include <deque>
 #include <fstream>
 #include <new>
 
@@ -29,9 +30,11 @@
 #include <sha256sum.hh>
 #include <serialize.hh>
 #include <string.hh>
+#include <threadpool.hh>
 #include <zstream.hh>
 #include <zstream-gz.hh>
 #include <zstream-bz.hh>
+#include <zstream-zstd.hh>
 // struct ZibstreamBz : Zibstream::Impl { };
 //______________________________________________________________________
 
@@ -42,8 +45,10 @@ void Zobstream::close() {
   if (!is_open()) return;
   try {
     zip(todoBuf, todoCount, Z_FINISH); // Flush out remain. buffer contents
+    endThreads();
     deflateEnd();
   } catch (Zerror) {
+    endThreads();
     zipBufLast = zipBuf;
     // Deallocate memory
     delete[] todoBuf;
@@ -70,25 +75,7 @@ void Zobstream::close() {
 void Zobstream::writeZipped(unsigned partId) {
   debug("Writing %1 bytes compressed, was %2 uncompressed",
         totalOut(), totalIn());
-
-  // #Bytes     Value   Description
-  // ----------------------------------------------------------------------
-  //  4       dataID  "ID for the part: 'DATA' = the hex bytes 44 41 54 41"
-  //  6       dataLen "Length of part, i.e. length of compressed data + 16"
-  //  6       dataUnc "Number of bytes of *uncompressed* data of this part"
-  // dataLen-16       "Compressed data"
-  Ubyte buf[16];
-  Ubyte* p = buf;
-  serialize4(partId, p); // DATA or BZIP
-  uint64 l = totalOut() + 16;
-  serialize6(l, p + 4);
-  l = totalIn();
-  serialize6(l, p + 10);
-  writeBytes(*stream, buf, 16);
-  if (!stream->good())
-    throw Zerror(0, string(_("Could not write template data")));
-  if (md5sum != 0) md5sum->update(buf, 16);
-  if (sha256sum != 0) sha256sum->update(buf, 16);
+  writeHeader(partId, totalOut(), totalIn());
 
   ZipData* zd = zipBuf;
   unsigned len;
@@ -114,6 +101,159 @@ void Zobstream::writeZipped(unsigned partId) {
 
   deflateReset(); // Might throw
 }
+
+void Zobstream::writePart(unsigned partId, const vector<Ubyte>& zipped,
+                          uint64 unzippedLen) {
+  debug("Writing %1 bytes compressed, was %2 uncompressed",
+        zipped.size(), unzippedLen);
+  writeHeader(partId, zipped.size(), unzippedLen);
+  if (zipped.empty()) return;
+  writeBytes(*stream, &zipped[0], zipped.size());
+  if (md5sum != 0) md5sum->update(&zipped[0], zipped.size());
+  if (sha256sum != 0) sha256sum->update(&zipped[0], zipped.size());
+  if (!stream->good())
+    throw Zerror(0, string(_("Could not write template data")));
+}
+
+void Zobstream::writeHeader(unsigned partId, uint64 zippedLen,
+                            uint64 unzippedLen) {
+  // #Bytes     Value   Description
+  // ----------------------------------------------------------------------
+  //  4       dataID  "ID for the part: 'DATA' = the hex bytes 44 41 54 41"
+  //  6       dataLen "Length of part, i.e. length of compressed data + 16"
+  //  6       dataUnc "Number of bytes of *uncompressed* data of this part"
+  // dataLen-16       "Compressed data"
+  Ubyte buf[16];
+  Ubyte* p = buf;
+  serialize4(partId, p); // DATA, BZIP or ZSTD
+  serialize6(zippedLen + 16, p + 4);
+  serialize6(unzippedLen, p + 10);
+  writeBytes(*stream, buf, 16);
+  if (!stream->good())
+    throw Zerror(0, string(_("Could not write template data")));
+  if (md5sum != 0) md5sum->update(buf, 16);
+  if (sha256sum != 0) sha256sum->update(buf, 16);
+}
+//______________________________________________________________________
+
+/* One chunk of data for a worker thread to compress. A deque of these
+   holds the chunks in the order they must be written out. */
+struct Zobstream::ChunkJob {
+  ChunkJob() : in(), out(), partId(0), done(false), failed(false),
+               badAlloc(false), status(0), error() { }
+  vector<Ubyte> in; // Uncompressed data
+  vector<Ubyte> out; // Compressed data
+  unsigned partId;
+  bool done; // Set by the worker once out and partId are valid
+  bool failed; // Zerror or bad_alloc was thrown
+  bool badAlloc;
+  int status; // If failed: Zerror details
+  string error;
+};
+
+struct Zobstream::Parallel {
+  explicit Parallel(unsigned threads)
+    : pending(), submitted(false), jobs(), window(2 * threads), lock(),
+      jobDone(), pool(threads) { }
+  vector<Ubyte> pending; // Input data for next chunk
+  bool submitted; // At least one chunk was handed to a worker
+  deque<ChunkJob> jobs; // Submitted, not yet written out
+  size_t window; // Max size of jobs before we wait for the first one
+  Mutex lock; // Protects ChunkJob::done and results of jobs
+  Condition jobDone;
+  ThreadPool pool; // Must come last, its dtor waits for the jobs
+};
+//________________________________________
+
+void Zobstream::setThreads(unsigned n) {
+  Assert(is_open() && par == 0 && todoCount == 0);
+  par = new Parallel(n);
+  if (par->pool.threads() == 0) { endThreads(); return; }
+  par->pending.reserve(chunkLim());
+  debug("Compressing chunks of %1 bytes with %2 threads",
+        chunkLim(), par->pool.threads());
+}
+
+void Zobstream::endThreads() {
+  delete par;
+  par = 0;
+}
+//________________________________________
+
+/* Append data to the pending chunk, hand it to a worker once full. At
+   the end of the stream, the remaining data is written as the last
+   chunk. If the input was an exact multiple of chunkLim(), there is
+   none, and no empty part must be written after the last full one - an
+   empty part is only written if the stream contains no data at all. */
+void Zobstream::zipParallel(const Ubyte* start, unsigned len, bool finish) {
+  vector<Ubyte>& pending = par->pending;
+  while (len > 0) {
+    unsigned n = min(len, chunkLim() - (unsigned)pending.size());
+    pending.insert(pending.end(), start, start + n);
+    start += n;
+    len -= n;
+    if (pending.size() >= chunkLim()) submitChunk();
+  }
+  if (!finish) return;
+  if (!pending.empty() || !par->submitted) submitChunk();
+  while (!par->jobs.empty()) writeChunk();
+}
+
+void Zobstream::submitChunk() {
+  par->jobs.push_back(ChunkJob());
+  ChunkJob& job = par->jobs.back();
+  job.in.swap(par->pending);
+  par->pending.reserve(chunkLim());
+  par->submitted = true;
+  par->pool.submit(bind(&Zobstream::zipChunkJob, this, &job));
+
+  // Write out finished chunks, only block if too many are queued
+  while (!par->jobs.empty()) {
+    if (par->jobs.size() <= par->window) {
+      MutexLock l(par->lock);
+      if (!par->jobs.front().done) break;
+    }
+    writeChunk();
+  }
+}
+
+// Executed by a worker thread
+void Zobstream::zipChunkJob(ChunkJob* job) {
+  unsigned partId = 0;
+  vector<Ubyte> out;
+  int status = 0;
+  string error;
+  bool failed = false, badAlloc = false;
+  try {
+    partId = zipChunk(job->in.empty() ? 0 : &job->in[0],
+                      (unsigned)job->in.size(), out);
+  } catch (Zerror& e) {
+    failed = true; status = e.status; error = e.message;
+  } catch (bad_alloc&) {
+    failed = badAlloc = true;
+  }
+  MutexLock l(par->lock);
+  job->partId = partId;
+  job->out.swap(out);
+  job->failed = failed;
+  job->badAlloc = badAlloc;
+  job->status = status;
+  job->error.swap(error);
+  job->done = true;
+  par->jobDone.notify_all();
+}
+
+// Wait for the first chunk in the queue to be compressed, write it out
+void Zobstream::writeChunk() {
+  ChunkJob& job = par->jobs.front();
+  MutexLock l(par->lock);
+  while (!job.done) par->jobDone.wait(l);
+  l.unlock();
+  if (job.badAlloc) throw bad_alloc();
+  if (job.failed) throw Zerror(job.status, job.error);
+  writePart(job.partId, job.out, job.in.size());
+  par->jobs.pop_front();
+}
 //______________________________________________________________________
 
 Zobstream& Zobstream::put(uint32 x) {
@@ -151,6 +291,7 @@ void Zibstream::open(bistream& s) {
 void Zibstream::close() {
   if (!is_open()) return;
 
+  endThreads();
   if (z != 0) z->end();
 
   // Deallocate memory
@@ -161,13 +302,14 @@ void Zibstream::close() {
   /* Only report errors *after* marking the stream as closed, to avoid
      another exception being thrown when the Zibstream object goes out of
      scope and ~Zibstream calls close() again. */
-  if (!z->ok()) z->throwError();
+  if (z != 0 && !z->ok()) z->throwError();
 }
 //________________________________________
 
 Zibstream& Zibstream::read(Ubyte* dest, unsigned n) {
   gcountVal = 0; // in case n == 0
   if (!good()) return *this;
+  if (par != 0) return readParallel(dest, n);
   nextOut = dest;
   availOut = n;
 
@@ -200,8 +342,8 @@ Zibstream& Zibstream::read(Ubyte* dest, unsigned n) {
       streamsize prevPos = stream->tellg();
       unsigned id;
       unserialize4(id, in);
-      if (!*stream || (id != DATA && id != BZIP)) {
-        // Reached end of file or a non-DATA/BZIP part
+      if (!*stream || (id != DATA && id != BZIP && id != ZSTD)) {
+        // Reached end of file or a non-DATA/BZIP/ZSTD part
         stream->seekg(prevPos, ios::beg);
         delete[] buf;
         buf = 0; // Causes fail() == true
@@ -232,29 +374,41 @@ Zibstream& Zibstream::read(Ubyte* dest, unsigned n) {
            << " dataLen=" << dataLen
            << " dataUnc=" << dataUnc << " - new DATA part" << endl;
 #     endif
-      if (dataUnc == 0 || !*stream) {
+      if (!*stream) {
         delete[] buf;
         buf = 0;
         throw Zerror(0, string(_("Corrupted input data")));
       }
+      if (dataUnc == 0) {
+        /* Empty part - ZobstreamGz can write one at the end of the
+           data, and the parallel compressor used to write one after an
+           exact multiple of the chunk size */
+        stream->seekg(dataLen, ios::cur);
+        dataLen = 0;
+        continue;
+      }
 
       // Decide whether to (re)allocate inflater
-      // One or both out of gz/bz will be null
+      // At most one out of gz/bz/zs will be non-null
       ZibstreamGz* gz = dynamic_cast<ZibstreamGz*>(z);
       ZibstreamBz* bz = dynamic_cast<ZibstreamBz*>(z);
+#     if HAVE_ZSTD
+      ZibstreamZstd* zs = dynamic_cast<ZibstreamZstd*>(z);
+#     else
+      void* zs = 0;
+#     endif
       if ((id == DATA && gz == 0)
-          || (id == BZIP && bz == 0)) {
+          || (id == BZIP && bz == 0)
+          || (id == ZSTD && zs == 0)) {
         if (z != 0) {
           // Delete old, unneeded inflater
           z->end();
           if (!z->ok()) z->throwError();
           delete z;
+          z = 0;
         }
         // Allocate and init new one
-        if (id == DATA)
-          z = new ZibstreamGz();
-        else
-          z = new ZibstreamBz();
+        z = newImpl(id);
         z->setNextIn(0);
         z->setAvailIn(0);
         z->init();
@@ -307,3 +461,227 @@ Zibstream& Zibstream::read(Ubyte* dest, unsigned n) {
 
   return *this;
 }
+//______________________________________________________________________
+
+namespace {
+
+  /* Inflate up to n bytes into dest, return the number of bytes. Less
+     than n bytes are only returned at the end of the compressed stream */
+  unsigned inflateSome(Zibstream::Impl* d, Ubyte* dest, unsigned n) {
+    Ubyte* next = dest;
+    unsigned avail = n;
+    while (avail > 0) {
+      d->inflate(&next, &avail);
+      if (d->streamEnd()) break;
+      if (!d->ok()) d->throwError();
+      if (d->availIn() == 0 && avail > 0)
+        throw Zerror(0, string(_("Corrupted input data")));
+    }
+    return (unsigned)(next - dest);
+  }
+
+}
+//________________________________________
+
+/* One DATA, BZIP or ZSTD part. Small parts are inflated into out by a
+   worker thread, large ones by read(). A deque of these holds the parts
+   which have been read ahead, in stream order. */
+struct Zibstream::PartJob {
+  PartJob() : id(0), in(), out(), unc(0), pos(0), streaming(false),
+              done(false), failed(false), badAlloc(false), status(0),
+              error() { }
+  unsigned id; // DATA, BZIP or ZSTD
+  vector<Ubyte> in; // Compressed data
+  vector<Ubyte> out; // Uncompressed data, unless streaming
+  uint64 unc; // Size of uncompressed data
+  uint64 pos; // Nr of bytes already returned by read()
+  bool streaming; // Too large to buffer, inflate in read()
+  bool done; // Set by the worker once out is valid
+  bool failed; // Zerror or bad_alloc was thrown
+  bool badAlloc;
+  int status; // If failed: Zerror details
+  string error;
+};
+
+struct Zibstream::Parallel {
+  explicit Parallel(unsigned threads)
+    : jobs(), window(2 * threads), buffered(0), end(false), lock(),
+      jobDone(), pool(threads) { }
+  deque<PartJob> jobs; // Read ahead, not yet completely returned
+  size_t window; // Max nr of parts to read ahead
+  uint64 buffered; // Sum of uncompressed sizes of non-streaming jobs
+  bool end; // Reached first part which is not DATA, BZIP or ZSTD
+  Mutex lock; // Protects PartJob::done and results of jobs
+  Condition jobDone;
+  ThreadPool pool; // Must come last, its dtor waits for the jobs
+};
+//________________________________________
+
+void Zibstream::setThreads(unsigned n) {
+  Assert(is_open() && par == 0 && z == 0 && dataLen == 0);
+  par = new Parallel(n);
+  if (par->pool.threads() == 0) endThreads();
+}
+
+void Zibstream::endThreads() {
+  delete par;
+  par = 0;
+}
+//________________________________________
+
+// Allocate inflater for a DATA, BZIP or ZSTD part
+Zibstream::Impl* Zibstream::newImpl(unsigned id) {
+  if (id == DATA) return new ZibstreamGz();
+  if (id == BZIP) return new ZibstreamBz();
+# if HAVE_ZSTD
+  return new ZibstreamZstd();
+# else
+  throw Zerror(0, string(_("Template data is compressed with zstd, which "
+                           "this version of jigdo-file does not support")));
+# endif
+}
+
+// Allocate and init inflater for the data of a part
+Zibstream::Impl* Zibstream::newPartImpl(unsigned id, vector<Ubyte>& in) {
+  Impl* d = newImpl(id);
+  d->setNextIn(in.empty() ? 0 : &in[0]);
+  d->setAvailIn((unsigned)in.size());
+  d->init();
+  if (!d->ok()) {
+    try { d->throwError(); } catch (...) { delete d; throw; }
+  }
+  return d;
+}
+
+/* Read header and compressed data of the next part, hand it to a worker
+   unless it is too large. Empty parts are skipped, like in read().
+   Returns false if there are no more parts. */
+bool Zibstream::readAhead() {
+  if (par->end) return false;
+  SerialIstreamIterator in(*stream);
+  unsigned id;
+  uint64 len, unc;
+  do {
+    streamsize prevPos = stream->tellg();
+    unserialize4(id, in);
+    if (!*stream || (id != DATA && id != BZIP && id != ZSTD)) {
+      // Reached end of file or a non-DATA/BZIP/ZSTD part
+      stream->seekg(prevPos, ios::beg);
+      par->end = true;
+      return false;
+    }
+    unserialize6(len, in);
+    unserialize6(unc, in);
+    if (len < 16 || !*stream) {
+      delete[] buf;
+      buf = 0;
+      throw Zerror(0, string(_("Corrupted input data")));
+    }
+    len -= 16;
+    if (unc == 0) stream->seekg(len, ios::cur);
+  } while (unc == 0);
+
+  par->jobs.push_back(PartJob());
+  PartJob& job = par->jobs.back();
+  job.id = id;
+  job.unc = unc;
+  job.streaming = (unc > MAX_PARALLEL_PART);
+  job.in.resize((size_t)len);
+  Ubyte* b = (len == 0 ? 0 : &job.in[0]);
+  while (*stream && len > 0) {
+    readBytes(*stream, b, len);
+    unsigned n = (unsigned)stream->gcount();
+    b += n;
+    len -= n;
+  }
+  if (!*stream) {
+    delete[] buf;
+    buf = 0;
+    string err = subst(_("Error reading compressed data - %1"),
+                       strerror(errno));
+    throw Zerror(0, err);
+  }
+
+  if (!job.streaming) {
+    par->buffered += unc;
+    par->pool.submit(bind(&Zibstream::unzipPartJob, this, &job));
+  }
+  return true;
+}
+
+// Executed by a worker thread
+void Zibstream::unzipPartJob(PartJob* job) {
+  vector<Ubyte> out;
+  int status = 0;
+  string error;
+  bool failed = false, badAlloc = false;
+  Impl* d = 0;
+  try {
+    out.resize((size_t)job->unc);
+    d = newPartImpl(job->id, job->in);
+    if (inflateSome(d, &out[0], (unsigned)out.size()) != out.size())
+      throw Zerror(0, string(_("Corrupted input data")));
+  } catch (Zerror& e) {
+    failed = true; status = e.status; error = e.message;
+  } catch (bad_alloc&) {
+    failed = badAlloc = true;
+  }
+  if (d != 0) { d->end(); delete d; }
+  MutexLock l(par->lock);
+  job->out.swap(out);
+  job->failed = failed;
+  job->badAlloc = badAlloc;
+  job->status = status;
+  job->error.swap(error);
+  job->done = true;
+  par->jobDone.notify_all();
+}
+//________________________________________
+
+Zibstream& Zibstream::readParallel(Ubyte* dest, unsigned n) {
+  deque<PartJob>& jobs = par->jobs;
+  while (n > 0) {
+    // Keep the workers busy
+    while (jobs.empty() || (jobs.size() < par->window
+                            && par->buffered < MAX_PARALLEL_BUFFERED)) {
+      if (!readAhead()) break;
+    }
+    if (jobs.empty()) {
+      delete[] buf;
+      buf = 0; // Causes fail() == true
+      throw Zerror(0, string(_("Corrupted input data")));
+    }
+
+    PartJob& job = jobs.front();
+    unsigned count = (unsigned)min(implicit_cast<uint64>(n),
+                                   job.unc - job.pos);
+    if (job.streaming) {
+      if (job.pos == 0) { // Start inflating this part
+        if (z != 0) { z->end(); delete z; z = 0; }
+        z = newPartImpl(job.id, job.in);
+      }
+      if (inflateSome(z, dest, count) != count)
+        throw Zerror(0, string(_("Corrupted input data")));
+    } else {
+      MutexLock l(par->lock);
+      while (!job.done) par->jobDone.wait(l);
+      l.unlock();
+      if (job.badAlloc) throw bad_alloc();
+      if (job.failed) throw Zerror(job.status, job.error);
+      memcpy(dest, &job.out[(size_t)job.pos], count);
+    }
+    debug("readParallel: %1 bytes of part, %2 of %3 done",
+          count, job.pos + count, job.unc);
+    job.pos += count;
+    dest += count;
+    n -= count;
+    gcountVal += count;
+
+    if (job.pos == job.unc) {
+      if (job.streaming) { z->end(); delete z; z = 0; }
+      else par->buffered -= job.unc;
+      jobs.pop_front();
+    }
+  }
+  return *this;
+}
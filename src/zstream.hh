@@ -14,7 +14,8 @@
 
   Zlib/bzlib2 compression layer which integrates with C++ streams. When
   deflating, chops up data into DATA chunks of approximately zippedBufSz (see
-  ctor below and ../doc/TechDetails.txt).
+  ctor below and ../doc/TechDetails.txt). Optionally, successive chunks are
+  compressed in parallel on a number of threads.
 
   Maybe this should use streambuf, but 1) I don't really understand
   streambuf, and 2) the C++ library that comes with GCC 2.95 probably doesn't
@@ -28,6 +29,7 @@
 #include <config.h>
 
 #include <iostream>
+#include <vector>
 
 #include <bstream.hh>
 #include <config.h>
@@ -61,11 +63,22 @@ public:
   inline explicit Zobstream(MD5Sum* md = 0, SHA256Sum* sd = 0);
   /** Calls close(), which might throw a Zerror exception! Call
       close() before destroying the object to avoid this. */
-  virtual ~Zobstream() { close(); delete zipBuf; Assert(todoBuf == 0); }
+  virtual ~Zobstream() {
+    close(); endThreads(); delete zipBuf; Assert(todoBuf == 0);
+  }
   bool is_open() const { return stream != 0; }
   /** Forces any remaining data to be compressed and written out */
   void close();
 
+  /** Compress successive chunks of data on the given number of threads.
+      Must be called after opening the stream, before any data is
+      written to it. With n < 2, nothing changes. Otherwise, each chunk
+      covers chunkLimit bytes of input data and is compressed
+      independently of the others by a worker thread. The chunks are
+      written out in order by the thread which writes to the Zobstream,
+      so the output is a valid sequence of DATA/BZIP/ZSTD parts. */
+  void setThreads(unsigned n);
+
   /** Get reference to underlying ostream */
   bostream& getStream() { return *stream; }
 
@@ -92,6 +105,11 @@ protected:
   unsigned chunkLim() const { return chunkLimVal; }
   // Write data in zipBuf
   void writeZipped(unsigned partId);
+  // Write a complete part whose compressed data is in zipped
+  void writePart(unsigned partId, const vector<Ubyte>& zipped,
+                 uint64 unzippedLen);
+  // Stop any threads started by setThreads(); call from child class dtor
+  void endThreads();
 
   virtual void deflateEnd() = 0; // May throw Zerror
   virtual void deflateReset() = 0; // May throw Zerror
@@ -110,6 +128,13 @@ protected:
   virtual void setNextIn(Ubyte* n) = 0;
 
   virtual void zip2(Ubyte* start, unsigned len, bool finish) = 0;
+  /* Compress len bytes at start into one complete chunk, append it to
+     out and return the part ID (DATA/BZIP/ZSTD). Used after
+     setThreads(); called by several threads at once, so must not modify
+     the object.
+     May throw Zerror or bad_alloc. */
+  virtual unsigned zipChunk(const Ubyte* start, unsigned len,
+                            vector<Ubyte>& out) const = 0;
 
   /* Compressed data is stored in a linked list of ZipData objects.
      During the Zobstream object's lifetime, the list is only ever
@@ -132,6 +157,15 @@ private:
   //  void zip(Ubyte* start, unsigned len, int flush = Z_NO_FLUSH);
   inline void zip(Ubyte* start, unsigned len, bool finish = false);
 
+  // Parallel compression, only used after setThreads()
+  struct ChunkJob;
+  struct Parallel;
+  void zipParallel(const Ubyte* start, unsigned len, bool finish);
+  void submitChunk();
+  void zipChunkJob(ChunkJob* job);
+  void writeChunk();
+  void writeHeader(unsigned partId, uint64 zippedLen, uint64 unzippedLen);
+
   //z_stream z;
   Ubyte* todoBuf; // Allocated during open(), deallocated during close()
   unsigned todoBufSize; // Size of todoBuf
@@ -143,12 +177,14 @@ private:
 
   MD5Sum* md5sum;
   SHA256Sum* sha256sum;
+
+  Parallel* par; // Null unless setThreads() was called with n >= 2
 };
 //______________________________________________________________________
 
 /** Input stream which decompresses data. Analogous to Zobstream, aware of
-    jigdo file formats - expects a number of DATA or BZIP parts at current
-    stream position. */
+    jigdo file formats - expects a number of DATA, BZIP or ZSTD parts at
+    current stream position. */
 class Zibstream {
 public:
 
@@ -192,11 +228,21 @@ public:
   inline explicit Zibstream(unsigned bufSz = 64*1024);
   /** Calls close(), which might throw a Zerror exception! Call
       close() before destroying the object to avoid this. */
-  virtual ~Zibstream() { close(); delete buf; if (z != 0) z->end(); delete z; }
+  virtual ~Zibstream() {
+    close(); endThreads(); delete buf; if (z != 0) z->end(); delete z;
+  }
   inline Zibstream(bistream& s, unsigned bufSz = 64*1024);
   bool is_open() const { return stream != 0; }
   void close();
 
+  /** Decompress DATA/BZIP/ZSTD parts on the given number of threads.
+      Must be called after opening the stream, before the first read(). With
+      n < 2, nothing changes. Otherwise, the compressed data of the
+      next few parts is read ahead and each part is inflated into
+      memory by a worker thread. Parts which are very large once
+      uncompressed are inflated by read() as usual. */
+  void setThreads(unsigned n);
+
   /** Get reference to underlying istream */
   bistream& getStream() { return *stream; }
 
@@ -231,9 +277,22 @@ private:
 
   static const unsigned DATA = 0x41544144u;
   static const unsigned BZIP = 0x50495a42u;
+  static const unsigned ZSTD = 0x4454535au;
 
   void open(bistream& s);
 
+  // Parallel decompression, only used after setThreads()
+  struct PartJob;
+  struct Parallel;
+  static const uint64 MAX_PARALLEL_PART = 32*1024*1024;
+  static const uint64 MAX_PARALLEL_BUFFERED = 64*1024*1024;
+  void endThreads();
+  Zibstream& readParallel(Ubyte* dest, unsigned n);
+  bool readAhead();
+  static Impl* newImpl(unsigned id);
+  static Impl* newPartImpl(unsigned id, vector<Ubyte>& in);
+  void unzipPartJob(PartJob* job);
+
 //   z_stream z;
   Impl* z;
   bistream* stream;
@@ -244,6 +303,7 @@ private:
   uint64 dataUnc; // bytes remaining in uncompressed DATA part
   Ubyte* nextOut; // Pointer into output buffer
   unsigned availOut; // Bytes remaining in output buffer
+  Parallel* par; // Null unless setThreads() was called with n >= 2
 };
 //______________________________________________________________________
 
@@ -252,7 +312,7 @@ private:
    calls to put() and write() */
 Zobstream::Zobstream(MD5Sum* md, SHA256Sum *sd)
     : zipBuf(0), zipBufLast(0), todoBuf(0), todoBufSize(0), todoCount(0),
-      stream(0), md5sum(md), sha256sum(sd) { }
+      stream(0), md5sum(md), sha256sum(sd), par(0) { }
 //________________________________________
 
 void Zobstream::open(bostream& s, unsigned chunkLimit, unsigned todoBufSz) {
@@ -268,7 +328,9 @@ void Zobstream::open(bostream& s, unsigned chunkLimit, unsigned todoBufSz) {
 }
 
 void Zobstream::zip(Ubyte* start, unsigned len, bool finish) {
-  if (len != 0 || finish)
+  if (par != 0)
+    zipParallel(start, len, finish);
+  else if (len != 0 || finish)
     zip2(start, len, finish);
   todoCount = 0;
 }
@@ -313,11 +375,11 @@ Zobstream& Zobstream::write(const Ubyte* x, unsigned n) {
 //________________________________________
 
 Zibstream::Zibstream(unsigned bufSz)
-    : z(0), stream(0), bufSize(bufSz), buf(0) {
+    : z(0), stream(0), bufSize(bufSz), buf(0), par(0) {
 }
 
 Zibstream::Zibstream(bistream& s, unsigned bufSz)
-    : z(0), stream(0), bufSize(bufSz), buf(0) {
+    : z(0), stream(0), bufSize(bufSz), buf(0), par(0) {
   // data* will be init'ed by open()
   open(s);
 }